@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libkcaldav.h"
+
+/*
+ * Benchmark ical_datetime_parse() against the sscanf(3) parse it
+ * replaced, over dates and date-times from 1906 to 2271.
+ * Reports the sum of the parsed times, which must agree, and the
+ * values parsed per second.
+ */
+
+#define	VALS	 4096
+
+static char	 vals[VALS][17];
+
+/*
+ * The former parse: sscanf(3) into fields, then days-from-civil.
+ */
+static int
+parse_sscanf(const char *cp, struct icaltm *tm)
+{
+	unsigned int	 yr, mon, day, hr = 0, min = 0, sec = 0;
+	int64_t		 y, m, era, yoe, doy, doe;
+	size_t		 sz = strlen(cp);
+	char		 t, z;
+
+	if (sz == 8) {
+		if (sscanf(cp, "%4u%2u%2u", &yr, &mon, &day) != 3)
+			return 0;
+		tm->type = ICAL_DT_DATE;
+	} else if (sz == 15) {
+		if (sscanf(cp, "%4u%2u%2u%c%2u%2u%2u",
+		    &yr, &mon, &day, &t, &hr, &min, &sec) != 7 ||
+		    t != 'T')
+			return 0;
+		tm->type = ICAL_DT_DATETIME;
+	} else if (sz == 16) {
+		if (sscanf(cp, "%4u%2u%2u%c%2u%2u%2u%c",
+		    &yr, &mon, &day, &t, &hr, &min, &sec, &z) != 8 ||
+		    t != 'T' || z != 'Z')
+			return 0;
+		tm->type = ICAL_DT_DATETIMEUTC;
+	} else
+		return 0;
+
+	y = mon < 3 ? yr - 1 : yr;
+	m = mon;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + day - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	tm->tm = (era * 146097 + doe - 719468) * 86400 +
+		hr * 3600 + min * 60 + sec;
+	return 1;
+}
+
+static double
+now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench(const char *name, int (*fp)(const char *, struct icaltm *),
+	size_t iters, int64_t *sum)
+{
+	struct icaltm	 tm;
+	size_t		 i, j;
+	double		 start, secs;
+
+	*sum = 0;
+	start = now();
+	for (i = 0; i < iters; i++)
+		for (j = 0; j < VALS; j++) {
+			if (!(*fp)(vals[j], &tm)) {
+				warnx("%s: %s: not parsed", name, vals[j]);
+				return 0;
+			}
+			*sum += tm.tm;
+		}
+	secs = now() - start;
+
+	printf("%-8s %20" PRId64 " %10.1f M/s\n", name, *sum,
+		secs > 0.0 ? (double)iters * VALS / secs / 1e6 : 0.0);
+	return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t		 i, iters = 1000;
+	int		 c, rc = 1;
+	int64_t		 expect, sum;
+	const char	*er;
+	time_t		 t;
+	struct tm	*tm;
+
+	while ((c = getopt(argc, argv, "n:")) != -1)
+		switch (c) {
+		case 'n':
+			iters = strtonum(optarg, 1, 1000000, &er);
+			if (er != NULL)
+				errx(1, "-n: %s", er);
+			break;
+		default:
+			goto usage;
+		}
+
+	argc -= optind;
+	if (argc != 0)
+		goto usage;
+
+	/* A third each of dates, date-times, and UTC date-times. */
+
+	for (i = 0; i < VALS; i++) {
+		t = (time_t)i * 2319437 + i * 7919 % 86400 - 2000000000LL;
+		if ((tm = gmtime(&t)) == NULL)
+			err(1, "gmtime");
+		strftime(vals[i], sizeof(vals[i]), i % 3 == 0 ?
+			"%Y%m%d" : i % 3 == 1 ? "%Y%m%dT%H%M%S" :
+			"%Y%m%dT%H%M%SZ", tm);
+	}
+
+	printf("%d values, %zu iterations\n", VALS, iters);
+	if (!bench("sscanf", parse_sscanf, iters, &expect))
+		rc = 0;
+	if (!bench("fixed", ical_datetime_parse, iters, &sum))
+		rc = 0;
+	else if (sum != expect) {
+		warnx("fixed: sum %" PRId64 ", expected %" PRId64,
+			sum, expect);
+		rc = 0;
+	}
+	return rc ? 0 : 1;
+usage:
+	fprintf(stderr, "usage: %s [-n iterations]\n", getprogname());
+	return 1;
+}
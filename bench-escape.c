@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/stat.h>
+
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgixml.h>
+
+#include "libkcaldav.h"
+#include "db.h"
+#include "server.h"
+
+/*
+ * Benchmark the XML-escaping kernels over the given files (e.g., the
+ * iCalendar regression files), each escaped whole as for calendar-data.
+ * Reports the special characters found, which must agree, and the
+ * throughput of each kernel.
+ */
+
+struct	buf {
+	char	*buf;
+	size_t	 sz;
+};
+
+static size_t
+run(size_t (*fp)(const char *, size_t), const struct buf *bufs,
+	size_t bufsz)
+{
+	size_t	 i, j, n, found = 0;
+
+	for (i = 0; i < bufsz; i++)
+		for (j = 0; j < bufs[i].sz; j += n + 1) {
+			n = (*fp)(bufs[i].buf + j, bufs[i].sz - j);
+			if (j + n < bufs[i].sz)
+				found++;
+		}
+	return found;
+}
+
+static double
+now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench(const char *name, size_t (*fp)(const char *, size_t),
+	const struct buf *bufs, size_t bufsz, size_t total, size_t iters,
+	size_t expect)
+{
+	size_t	 i, found;
+	double	 start, secs;
+
+	start = now();
+	for (found = i = 0; i < iters; i++)
+		found += run(fp, bufs, bufsz);
+	secs = now() - start;
+
+	printf("%-8s %10zu %10.1f MB/s\n", name, found / iters,
+		secs > 0.0 ? total * iters / secs / 1e6 : 0.0);
+	if (found / iters != expect) {
+		warnx("%s: found %zu, expected %zu",
+			name, found / iters, expect);
+		return 0;
+	}
+	return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct buf	*bufs;
+	struct stat	 st;
+	size_t		 i, total = 0, iters = 100, expect;
+	int		 c, fd, rc = 1;
+	const char	*er;
+	ssize_t		 ssz;
+
+	while ((c = getopt(argc, argv, "n:")) != -1)
+		switch (c) {
+		case 'n':
+			iters = strtonum(optarg, 1, 1000000, &er);
+			if (er != NULL)
+				errx(1, "-n: %s", er);
+			break;
+		default:
+			goto usage;
+		}
+
+	argc -= optind;
+	argv += optind;
+	if (argc == 0)
+		goto usage;
+
+	if ((bufs = calloc(argc, sizeof(struct buf))) == NULL)
+		err(1, NULL);
+
+	for (i = 0; i < (size_t)argc; i++) {
+		if ((fd = open(argv[i], O_RDONLY, 0)) == -1)
+			err(1, "%s", argv[i]);
+		if (fstat(fd, &st) == -1)
+			err(1, "%s", argv[i]);
+		bufs[i].sz = st.st_size;
+		if ((bufs[i].buf = malloc(bufs[i].sz + 1)) == NULL)
+			err(1, NULL);
+		ssz = read(fd, bufs[i].buf, bufs[i].sz);
+		if (ssz < 0)
+			err(1, "%s", argv[i]);
+		bufs[i].sz = ssz;
+		total += ssz;
+		close(fd);
+	}
+
+	expect = run(xml_escape_span_scalar, bufs, argc);
+	printf("%zu files, %zu bytes, %zu iterations\n",
+		(size_t)argc, total, iters);
+
+	if (!bench("scalar", xml_escape_span_scalar,
+	    bufs, argc, total, iters, expect))
+		rc = 0;
+#if XMLESC_X86
+	if (!bench("sse2", xml_escape_span_sse2,
+	    bufs, argc, total, iters, expect))
+		rc = 0;
+	if (xml_escape_avx2() && !bench("avx2", xml_escape_span_avx2,
+	    bufs, argc, total, iters, expect))
+		rc = 0;
+#endif
+
+	for (i = 0; i < (size_t)argc; i++)
+		free(bufs[i].buf);
+	free(bufs);
+	return rc ? 0 : 1;
+usage:
+	fprintf(stderr, "usage: %s [-n iterations] file...\n",
+		getprogname());
+	return 1;
+}
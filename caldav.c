@@ -22,6 +22,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <expat.h>
 
@@ -46,6 +47,8 @@ struct	parse {
 	XML_Parser	  xp;
 	struct buf	  buf;
 	char		**er;
+	struct calfilter *filter; /* current filter */
+	struct calcomp	 *comp; /* current calendar-data comp */
 };
 
 typedef	int (*propvalid)(const char *);
@@ -55,6 +58,9 @@ typedef	int (*propvalid)(const char *);
  * Of course, not all elements have associated properties!
  */
 const enum calproptype calprops[CALELEM__MAX] = {
+	CALPROP__MAX, /* CALELEM_ALLCOMP */
+	CALPROP__MAX, /* CALELEM_ALLPROP */
+	CALPROP__MAX, /* CALELEM_CALDAV_PROP */
 	CALPROP_CALENDAR_COLOR, /* CALELEM_CALENDAR_COLOR */
 	CALPROP_CALENDAR_DATA, /* CALELEM_CALENDAR_DATA */
 	CALPROP_CALENDAR_DESCRIPTION, /* CALELEM_CALENDAR_DESCRIPTION */
@@ -66,18 +72,28 @@ const enum calproptype calprops[CALELEM__MAX] = {
 	CALPROP__MAX, /* CALELEM_CALENDAR_QUERY */
 	CALPROP_CALENDAR_TIMEZONE, /* CALELEM_CALENDAR_TIMEZONE */
 	CALPROP_CALENDAR_USER_ADDRESS_SET, /* CALELEM_CALENDAR_USER_A... */
+	CALPROP__MAX, /* CALELEM_COMP */
+	CALPROP__MAX, /* CALELEM_COMP_FILTER */
 	CALPROP_CURRENT_USER_PRINCIPAL, /* CALELEM_CURRENT_USER_PRINC... */
 	CALPROP_CURRENT_USER_PRIVILEGE_SET, /* CALELEM_CURRENT_USER_P... */
 	CALPROP_DISPLAYNAME, /* CALELEM_DISPLAYNAME */
+	CALPROP__MAX, /* CALELEM_EXPAND */
+	CALPROP__MAX, /* CALELEM_FILTER */
+	CALPROP__MAX, /* CALELEM_FREE_BUSY_QUERY */
 	CALPROP_GETCONTENTTYPE, /* CALELEM_GETCONTENTTYPE */
 	CALPROP_GETCTAG, /* CALELEM_GETCTAG */
 	CALPROP_GETETAG, /* CALELEM_GETETAG */
 	CALPROP_GROUP_MEMBER_SET, /* CALELEM_GROUP_MEMBER_SET */
 	CALPROP_GROUP_MEMBERSHIP, /* CALELEM_GROUP_MEMBERSHIP */
 	CALPROP__MAX, /* CALELEM_HREF */
+	CALPROP__MAX, /* CALELEM_IS_NOT_DEFINED */
+	CALPROP__MAX, /* CALELEM_LIMIT_FREEBUSY_SET */
+	CALPROP__MAX, /* CALELEM_LIMIT_RECURRENCE_SET */
 	CALPROP_OWNER, /* CALELEM_OWNER */
+	CALPROP__MAX, /* CALELEM_PARAM_FILTER */
 	CALPROP_PRINCIPAL_URL, /* CALELEM_PRINCIPAL_URL */
 	CALPROP__MAX, /* CALELEM_PROP */
+	CALPROP__MAX, /* CALELEM_PROP_FILTER */
 	CALPROP__MAX, /* CALELEM_PROPERTYUPDATE */
 	CALPROP__MAX, /* CALELEM_PROPFIND */
 	CALPROP_QUOTA_AVAILABLE_BYTES, /* CALELEM_PROP_AVAILABLE_BYTES */
@@ -86,6 +102,12 @@ const enum calproptype calprops[CALELEM__MAX] = {
 	CALPROP_SCHEDULE_CALENDAR_TRANSP, /* CALELEM_SCHEDULE_CALENDA... */
 	CALPROP_SUPPORTED_CALENDAR_COMPONENT_SET, /* CALELEM_SUPPORTE... */
 	CALPROP_SUPPORTED_CALENDAR_DATA, /* CALELEM_SUPPORTED_CALENDA... */
+	CALPROP_SUPPORTED_REPORT_SET, /* CALELEM_SUPPORTED_REPORT_SET */
+	CALPROP__MAX, /* CALELEM_SYNC_COLLECTION */
+	CALPROP__MAX, /* CALELEM_SYNC_LEVEL */
+	CALPROP_SYNC_TOKEN, /* CALELEM_SYNC_TOKEN */
+	CALPROP__MAX, /* CALELEM_TEXT_MATCH */
+	CALPROP__MAX, /* CALELEM_TIME_RANGE */
 };
 
 const enum calelem calpropelems[CALPROP__MAX] = {
@@ -114,9 +136,14 @@ const enum calelem calpropelems[CALPROP__MAX] = {
 	CALELEM_SCHEDULE_CALENDAR_TRANSP,/* CALPROP_SCHEDULE_CALENDAR... */
 	CALELEM_SUPPORTED_CALENDAR_COMPONENT_SET,/* CALPROP_SUPPORTED... */
 	CALELEM_SUPPORTED_CALENDAR_DATA,/* CALPROP_SUPPORTED_CALENDAR... */
+	CALELEM_SUPPORTED_REPORT_SET, /* CALPROP_SUPPORTED_REPORT_SET */
+	CALELEM_SYNC_TOKEN, /* CALPROP_SYNC_TOKEN */
 };
 
 const char *const calelems[CALELEM__MAX] = {
+	CALDAVNS "allcomp", /* CALELEM_ALLCOMP */
+	CALDAVNS "allprop", /* CALELEM_ALLPROP */
+	CALDAVNS "prop", /* CALELEM_CALDAV_PROP */
 	APPLENS "calendar-color", /* CALELEM_CALENDAR_COLOR */
 	CALDAVNS "calendar-data", /* CALELEM_CALENDAR_DATA */
 	CALDAVNS "calendar-description", /* CALELEM_CALENDAR_DESCR... */
@@ -128,18 +155,28 @@ const char *const calelems[CALELEM__MAX] = {
 	CALDAVNS "calendar-query", /* CALELEM_CALENDAR_QUERY */
 	CALDAVNS "calendar-timezone", /* CALELEM_CALENDAR_TIMEZONE */
 	CALDAVNS "calendar-user-address-set", /* CALELEM_CALENDAR_... */
+	CALDAVNS "comp", /* CALELEM_COMP */
+	CALDAVNS "comp-filter", /* CALELEM_COMP_FILTER */
 	DAVNS "current-user-principal", /* CALELEM_CURRENT_USER_PR... */
 	DAVNS "current-user-privilege-set", /* CALELEM_CURRENT_USE... */
 	DAVNS "displayname", /* CALELEM_DISPLAYNAME */
+	CALDAVNS "expand", /* CALELEM_EXPAND */
+	CALDAVNS "filter", /* CALELEM_FILTER */
+	CALDAVNS "free-busy-query", /* CALELEM_FREE_BUSY_QUERY */
 	DAVNS "getcontenttype", /* CALELEM_GETCONTENTTYPE */
 	CALSERVNS "getctag", /* CALELEM_GETCTAG */
 	DAVNS "getetag", /* CALELEM_GETETAG */
 	DAVNS "group-member-set", /* CALELEM_GROUP_MEMBER_SET */
 	DAVNS "group-membership", /* CALELEM_GROUP_MEMBERSHIP */
 	DAVNS "href", /* CALELEM_HREF */
+	CALDAVNS "is-not-defined", /* CALELEM_IS_NOT_DEFINED */
+	CALDAVNS "limit-freebusy-set", /* CALELEM_LIMIT_FREEBUSY_SET */
+	CALDAVNS "limit-recurrence-set", /* CALELEM_LIMIT_RECURREN... */
 	DAVNS "owner", /* CALELEM_OWNER */
+	CALDAVNS "param-filter", /* CALELEM_PARAM_FILTER */
 	DAVNS "principal-URL", /* CALELEM_PRINCIPAL_URL */
 	DAVNS "prop", /* CALELEM_PROP */
+	CALDAVNS "prop-filter", /* CALELEM_PROP_FILTER */
 	DAVNS "propertyupdate", /* CALELEM_PROPERTYUPDATE */
 	DAVNS "propfind", /* CALELEM_PROPFIND */
 	DAVNS "quota-available-bytes", /* CALELEM_QUOTA_AVAILABLE_... */
@@ -148,6 +185,19 @@ const char *const calelems[CALELEM__MAX] = {
 	CALDAVNS "schedule-calendar-transp", /* CALELEM_SCHEDULE_C... */
 	CALDAVNS "supported-calendar-component-set", /* CALELEM_SU... */
 	CALDAVNS "supported-calendar-data", /* CALELEM_SUPPORTED_C... */
+	DAVNS "supported-report-set", /* CALELEM_SUPPORTED_REPOR... */
+	DAVNS "sync-collection", /* CALELEM_SYNC_COLLECTION */
+	DAVNS "sync-level", /* CALELEM_SYNC_LEVEL */
+	DAVNS "sync-token", /* CALELEM_SYNC_TOKEN */
+	CALDAVNS "text-match", /* CALELEM_TEXT_MATCH */
+	CALDAVNS "time-range", /* CALELEM_TIME_RANGE */
+};
+
+const char *const calfbtypes[CALFB__MAX] = {
+	"FREE", /* CALFB_FREE */
+	"BUSY", /* CALFB_BUSY */
+	"BUSY-UNAVAILABLE", /* CALFB_BUSY_UNAVAILABLE */
+	"BUSY-TENTATIVE", /* CALFB_BUSY_TENTATIVE */
 };
 
 static int	 propvalid_rgb(const char *);
@@ -177,8 +227,13 @@ static const propvalid propvalids[CALPROP__MAX] = {
 	NULL, /* CALPROP_SCHEDULE_CALENDAR_TRANSP */
 	NULL, /* CALPROP_SUPPORTED_CALENDAR_COMPONENT_SET */
 	NULL, /* PROP_SUPPORTED_CALENDAR_DATA */
+	NULL, /* CALPROP_SUPPORTED_REPORT_SET */
+	NULL, /* CALPROP_SYNC_TOKEN */
 };
 
+static void	dataclose(void *, const XML_Char *);
+static void	dataopen(void *, const XML_Char *, const XML_Char **);
+static void	parsebuffer(void *, const XML_Char *, int);
 static void	parseclose(void *, const XML_Char *);
 static void	propclose(void *, const XML_Char *);
 static void	propopen(void *, const XML_Char *, const XML_Char **);
@@ -380,6 +435,47 @@ caldav_alloc(struct parse *p, enum calreqtype type)
 	return(0);
 }
 
+static void
+filter_free(struct calfilter *f)
+{
+	struct calfilter	*next;
+
+	for ( ; f != NULL; f = next) {
+		next = f->next;
+		filter_free(f->kids);
+		free(f->name);
+		free(f->match.val);
+		free(f);
+	}
+}
+
+static void
+calcomp_free(struct calcomp *c)
+{
+	struct calcomp	*next;
+	size_t		 i;
+
+	for ( ; c != NULL; c = next) {
+		next = c->next;
+		calcomp_free(c->kids);
+		for (i = 0; i < c->propsz; i++)
+			free(c->props[i].name);
+		free(c->props);
+		free(c->name);
+		free(c);
+	}
+}
+
+static void
+caldata_free(struct caldata *d)
+{
+
+	if (d == NULL)
+		return;
+	calcomp_free(d->comp);
+	free(d);
+}
+
 void
 caldav_free(struct caldav *p)
 {
@@ -388,12 +484,15 @@ caldav_free(struct caldav *p)
 	if (NULL == p)
 		return;
 
+	caldata_free(p->data);
+	filter_free(p->filter);
 	for (i = 0; i < p->propsz; i++)
 		prop_free(&p->props[i]);
 	for (i = 0; i < p->hrefsz; i++)
 		free(p->hrefs[i]);
 	free(p->props);
 	free(p->hrefs);
+	free(p->synctoken);
 	free(p);
 }
 
@@ -412,6 +511,398 @@ parsehex(char ch)
 		ch - '0' : tolower((unsigned char)ch) - 'a' + 10;
 }
 
+/*
+ * Parse the UTC date-time "cp" (RFC 4791, 9.9) into "v".
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+caldav_datetime(const char *cp, int64_t *v)
+{
+	struct icaltm	 tm;
+
+	if (!ical_datetime_parse(cp, &tm) ||
+	    tm.type != ICAL_DT_DATETIMEUTC)
+		return 0;
+	*v = tm.tm;
+	return 1;
+}
+
+/*
+ * Open a comp-filter, prop-filter, or param-filter within a
+ * calendar-query filter, making it the current filter.
+ * Comp-filters may only be nested in comp-filters (the top-level one
+ * being in the filter itself), prop-filters in comp-filters, and
+ * param-filters in prop-filters.
+ */
+static void
+filteropen(struct parse *p, enum calfiltertype type,
+	const XML_Char **atts)
+{
+	struct calfilter	*f, **fp;
+	const char		*name = NULL;
+	size_t			 i;
+
+	if (p->p == NULL || p->p->type != CALREQTYPE_CALQUERY) {
+		caldav_err(p, "filter outside of query");
+		return;
+	}
+
+	for (i = 0; atts[i] != NULL; i += 2)
+		if (strcmp(atts[i], "name") == 0)
+			name = atts[i + 1];
+
+	if (name == NULL) {
+		caldav_err(p, "filter without name");
+		return;
+	}
+
+	if (p->filter == NULL) {
+		if (type != CALFILTER_COMP || p->p->filter != NULL) {
+			caldav_err(p, "unexpected filter");
+			return;
+		}
+		fp = &p->p->filter;
+	} else {
+		if ((type == CALFILTER_PARAM) !=
+		    (p->filter->type == CALFILTER_PROP) ||
+		    p->filter->type == CALFILTER_PARAM) {
+			caldav_err(p, "unexpected filter");
+			return;
+		}
+		for (fp = &p->filter->kids; *fp != NULL; )
+			fp = &(*fp)->next;
+	}
+
+	if ((f = calloc(1, sizeof(struct calfilter))) == NULL ||
+	    (f->name = strdup(name)) == NULL) {
+		free(f);
+		caldav_err(p, "memory exhausted");
+		return;
+	}
+
+	f->type = type;
+	f->start = INT64_MIN;
+	f->end = INT64_MAX;
+	f->parent = p->filter;
+	*fp = f;
+	p->filter = f;
+}
+
+/*
+ * Parse a time-range within a comp-filter or prop-filter, or that of a
+ * free-busy-query (RFC 4791, 7.10), which must have both ends.
+ * The first time-range on the calendar's components is also recorded
+ * on its own, as it's used to narrow the resources that must be
+ * examined.
+ */
+static void
+timerangeopen(struct parse *p, const XML_Char **atts)
+{
+	struct calfilter	*f = p->filter;
+	struct caltimerange	*r;
+	size_t			 i;
+	int64_t			 start = INT64_MIN, end = INT64_MAX;
+	int			 fb;
+
+	fb = f == NULL && p->p != NULL &&
+		p->p->type == CALREQTYPE_FREEBUSY;
+	if (fb && p->p->range.set) {
+		caldav_err(p, "unexpected time-range");
+		return;
+	} else if (!fb && (f == NULL || f->type == CALFILTER_PARAM)) {
+		caldav_err(p, "unexpected time-range");
+		return;
+	}
+
+	for (i = 0; atts[i] != NULL; i += 2)
+		if (strcmp(atts[i], "start") == 0) {
+			if (!caldav_datetime(atts[i + 1], &start)) {
+				caldav_err(p, "bad time-range start");
+				return;
+			}
+		} else if (strcmp(atts[i], "end") == 0) {
+			if (!caldav_datetime(atts[i + 1], &end)) {
+				caldav_err(p, "bad time-range end");
+				return;
+			}
+		}
+
+	if (start == INT64_MIN && end == INT64_MAX) {
+		caldav_err(p, "time-range without start or end");
+		return;
+	} else if (fb && (start == INT64_MIN || end == INT64_MAX)) {
+		caldav_err(p, "free-busy time-range without start or end");
+		return;
+	}
+
+	if (fb) {
+		r = &p->p->range;
+		r->set = 1;
+		r->comps = ICAL_VEVENT | ICAL_VFREEBUSY;
+		r->start = start;
+		r->end = end;
+		return;
+	}
+
+	f->ranged = 1;
+	f->start = start;
+	f->end = end;
+
+	/* Only components directly within the VCALENDAR. */
+
+	r = &p->p->range;
+	if (f->type != CALFILTER_COMP || f->parent == NULL ||
+	    f->parent->parent != NULL || r->set)
+		return;
+
+	for (i = 0; i < ICALTYPE__MAX; i++)
+		if (strcasecmp(icaltypes[i], f->name) == 0)
+			break;
+
+	r->set = 1;
+	r->comps = i < ICALTYPE__MAX ? 1U << i : 0;
+	r->start = start;
+	r->end = end;
+}
+
+/*
+ * Open a text-match within a prop-filter or param-filter.
+ * Its text is collected until the element closes.
+ */
+static void
+textmatchopen(struct parse *p, const XML_Char **atts)
+{
+	struct calfilter	*f = p->filter;
+	size_t			 i;
+
+	if (f == NULL || f->type == CALFILTER_COMP || f->match.set) {
+		caldav_err(p, "unexpected text-match");
+		return;
+	}
+
+	f->match.set = 1;
+	f->match.collation = CALCOLLATE_ASCII;
+
+	for (i = 0; atts[i] != NULL; i += 2)
+		if (strcmp(atts[i], "collation") == 0) {
+			if (strcmp(atts[i + 1], "i;octet") == 0)
+				f->match.collation = CALCOLLATE_OCTET;
+			else if (strcmp(atts[i + 1],
+			    "i;ascii-casemap")) {
+				caldav_err(p, "unsupported collation");
+				return;
+			}
+		} else if (strcmp(atts[i], "negate-condition") == 0)
+			f->match.negate = 
+				strcmp(atts[i + 1], "yes") == 0;
+
+	p->buf.sz = 0;
+	XML_SetDefaultHandler(p->xp, parsebuffer);
+}
+
+/*
+ * Open a comp within calendar-data, making it the current one.
+ * The top-level comp (which should be the VCALENDAR) is in the
+ * calendar-data itself.
+ */
+static void
+compopen(struct parse *p, const XML_Char **atts)
+{
+	struct calcomp	*c, **cp;
+	const char	*name = NULL;
+	size_t		 i;
+
+	for (i = 0; atts[i] != NULL; i += 2)
+		if (strcmp(atts[i], "name") == 0)
+			name = atts[i + 1];
+
+	if (name == NULL) {
+		caldav_err(p, "comp without name");
+		return;
+	}
+
+	if (p->comp == NULL) {
+		if (p->p->data->comp != NULL) {
+			caldav_err(p, "unexpected comp");
+			return;
+		}
+		cp = &p->p->data->comp;
+	} else {
+		if (p->comp->allcomp) {
+			caldav_err(p, "comp with allcomp");
+			return;
+		}
+		for (cp = &p->comp->kids; *cp != NULL; )
+			cp = &(*cp)->next;
+	}
+
+	if ((c = calloc(1, sizeof(struct calcomp))) == NULL ||
+	    (c->name = strdup(name)) == NULL) {
+		free(c);
+		caldav_err(p, "memory exhausted");
+		return;
+	}
+
+	c->parent = p->comp;
+	*cp = c;
+	p->comp = c;
+}
+
+/*
+ * Add a prop to the current calendar-data comp.
+ */
+static void
+compprop(struct parse *p, const XML_Char **atts)
+{
+	struct calcomp	*c = p->comp;
+	const char	*name = NULL;
+	void		*pp;
+	size_t		 i;
+	int		 novalue = 0;
+
+	if (c == NULL || c->allprop) {
+		caldav_err(p, "unexpected prop");
+		return;
+	}
+
+	for (i = 0; atts[i] != NULL; i += 2)
+		if (strcmp(atts[i], "name") == 0)
+			name = atts[i + 1];
+		else if (strcmp(atts[i], "novalue") == 0)
+			novalue = strcmp(atts[i + 1], "yes") == 0;
+
+	if (name == NULL) {
+		caldav_err(p, "prop without name");
+		return;
+	}
+
+	pp = reallocarray(c->props,
+		c->propsz + 1, sizeof(struct calcompprop));
+	if (pp == NULL) {
+		caldav_err(p, "memory exhausted");
+		return;
+	}
+	c->props = pp;
+	c->props[c->propsz].novalue = novalue;
+	if ((c->props[c->propsz].name = strdup(name)) == NULL) {
+		caldav_err(p, "memory exhausted");
+		return;
+	}
+	c->propsz++;
+}
+
+/*
+ * Parse the start and end of expand, limit-recurrence-set, or
+ * limit-freebusy-set, both of which are required.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+datarange(struct parse *p, const XML_Char **atts,
+	int64_t *start, int64_t *end)
+{
+	size_t	 i;
+	int	 has = 0;
+
+	for (i = 0; atts[i] != NULL; i += 2)
+		if (strcmp(atts[i], "start") == 0) {
+			if (!caldav_datetime(atts[i + 1], start)) {
+				caldav_err(p, "bad start");
+				return 0;
+			}
+			has |= 1;
+		} else if (strcmp(atts[i], "end") == 0) {
+			if (!caldav_datetime(atts[i + 1], end)) {
+				caldav_err(p, "bad end");
+				return 0;
+			}
+			has |= 2;
+		}
+
+	if (has != 3) {
+		caldav_err(p, "range without start and end");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Within calendar-data (RFC 4791, 9.6), which is not a simple
+ * property: it describes how the calendar data is to be returned.
+ */
+static void
+dataopen(void *dat, const XML_Char *s, const XML_Char **atts)
+{
+	struct parse	*p = dat;
+	struct caldata	*d = p->p->data;
+
+	switch (calelem_find(s)) {
+	case CALELEM_ALLCOMP:
+		if (p->comp == NULL || p->comp->kids != NULL)
+			caldav_err(p, "unexpected allcomp");
+		else
+			p->comp->allcomp = 1;
+		break;
+	case CALELEM_ALLPROP:
+		if (p->comp == NULL || p->comp->propsz > 0)
+			caldav_err(p, "unexpected allprop");
+		else
+			p->comp->allprop = 1;
+		break;
+	case CALELEM_CALDAV_PROP:
+		compprop(p, atts);
+		break;
+	case CALELEM_COMP:
+		compopen(p, atts);
+		break;
+	case CALELEM_EXPAND:
+		if (d->expand || d->limitrec)
+			caldav_err(p, "unexpected expand");
+		else if (datarange(p, atts, &d->recstart, &d->recend))
+			d->expand = 1;
+		break;
+	case CALELEM_LIMIT_FREEBUSY_SET:
+		if (d->limitfb)
+			caldav_err(p, "unexpected limit-freebusy-set");
+		else if (datarange(p, atts, &d->fbstart, &d->fbend))
+			d->limitfb = 1;
+		break;
+	case CALELEM_LIMIT_RECURRENCE_SET:
+		if (d->expand || d->limitrec)
+			caldav_err(p, "unexpected limit-recurrence-set");
+		else if (datarange(p, atts, &d->recstart, &d->recend))
+			d->limitrec = 1;
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+dataclose(void *dat, const XML_Char *s)
+{
+	struct parse	*p = dat;
+	struct caldata	*d = p->p->data;
+
+	switch (calelem_find(s)) {
+	case CALELEM_COMP:
+		if (p->comp != NULL)
+			p->comp = p->comp->parent;
+		break;
+	case CALELEM_CALENDAR_DATA:
+		/* An empty calendar-data is for all of it. */
+		if (d->comp == NULL && !d->expand &&
+		    !d->limitrec && !d->limitfb) {
+			caldata_free(d);
+			p->p->data = NULL;
+		}
+		propadd(p, s, CALPROP_CALENDAR_DATA, NULL);
+		XML_SetElementHandler(p->xp, propopen, propclose);
+		break;
+	default:
+		break;
+	}
+}
+
 static void
 parseclose(void *dat, const XML_Char *s)
 {
@@ -425,10 +916,37 @@ parseclose(void *dat, const XML_Char *s)
 	case CALELEM_CALENDAR_QUERY:
 	case CALELEM_PROPERTYUPDATE:
 	case CALELEM_PROPFIND:
+	case CALELEM_SYNC_COLLECTION:
 		/* Clear our parsing context. */
 		XML_SetDefaultHandler(p->xp, NULL);
 		XML_SetElementHandler(p->xp, NULL, NULL);
 		break;
+	case CALELEM_COMP_FILTER:
+	case CALELEM_PARAM_FILTER:
+	case CALELEM_PROP_FILTER:
+		if (p->filter != NULL)
+			p->filter = p->filter->parent;
+		break;
+	case CALELEM_SYNC_TOKEN:
+		if (p->p == NULL ||
+		    p->p->type != CALREQTYPE_SYNCCOLLECTION)
+			break;
+		XML_SetDefaultHandler(p->xp, NULL);
+		free(p->p->synctoken);
+		p->p->synctoken = strdup(p->buf.sz == 0 ? 
+			"" : p->buf.buf);
+		if (p->p->synctoken == NULL)
+			caldav_err(p, "memory exhausted");
+		break;
+	case CALELEM_TEXT_MATCH:
+		if (p->filter == NULL || p->filter->match.set == 0)
+			break;
+		XML_SetDefaultHandler(p->xp, NULL);
+		p->filter->match.val = strdup(p->buf.sz == 0 ? 
+			"" : p->buf.buf);
+		if (p->filter->match.val == NULL)
+			caldav_err(p, "memory exhausted");
+		break;
 	case CALELEM_HREF:
 		if (0 == p->buf.sz)
 			break;
@@ -525,6 +1043,24 @@ propopen(void *dat, const XML_Char *s, const XML_Char **atts)
 	case CALELEM__MAX:
 		propadd(p, s, CALPROP__MAX, NULL);
 		break;
+	case CALELEM_CALENDAR_DATA:
+		if (p->p == NULL ||
+		    p->p->type == CALREQTYPE_PROPERTYUPDATE) {
+			p->buf.sz = 0;
+			XML_SetDefaultHandler(p->xp, parsebuffer);
+			break;
+		} else if (p->p->data != NULL) {
+			caldav_err(p, "unexpected calendar-data");
+			break;
+		}
+		p->p->data = calloc(1, sizeof(struct caldata));
+		if (p->p->data == NULL) {
+			caldav_err(p, "memory exhausted");
+			break;
+		}
+		p->comp = NULL;
+		XML_SetElementHandler(p->xp, dataopen, dataclose);
+		break;
 	default:
 		if (CALPROP__MAX == calprops[elem]) {
 			propadd(p, s, CALPROP__MAX, NULL);
@@ -548,12 +1084,27 @@ parseopen(void *dat, const XML_Char *s, const XML_Char **atts)
 	case CALELEM_CALENDAR_MULTIGET:
 		caldav_alloc(p, CALREQTYPE_CALMULTIGET);
 		break;
+	case CALELEM_FREE_BUSY_QUERY:
+		caldav_alloc(p, CALREQTYPE_FREEBUSY);
+		break;
 	case CALELEM_PROPERTYUPDATE:
 		caldav_alloc(p, CALREQTYPE_PROPERTYUPDATE);
 		break;
 	case CALELEM_PROPFIND:
 		caldav_alloc(p, CALREQTYPE_PROPFIND);
 		break;
+	case CALELEM_SYNC_COLLECTION:
+		caldav_alloc(p, CALREQTYPE_SYNCCOLLECTION);
+		break;
+	case CALELEM_SYNC_TOKEN:
+		if (p->p == NULL ||
+		    p->p->type != CALREQTYPE_SYNCCOLLECTION) {
+			caldav_err(p, "sync-token outside of sync");
+			break;
+		}
+		p->buf.sz = 0;
+		XML_SetDefaultHandler(p->xp, parsebuffer);
+		break;
 	case CALELEM_HREF:
 		p->buf.sz = 0;
 		XML_SetDefaultHandler(p->xp, parsebuffer);
@@ -561,6 +1112,27 @@ parseopen(void *dat, const XML_Char *s, const XML_Char **atts)
 	case CALELEM_PROP:
 		XML_SetElementHandler(p->xp, propopen, propclose);
 		break;
+	case CALELEM_COMP_FILTER:
+		filteropen(p, CALFILTER_COMP, atts);
+		break;
+	case CALELEM_IS_NOT_DEFINED:
+		if (p->filter == NULL)
+			caldav_err(p, "unexpected is-not-defined");
+		else
+			p->filter->notdefined = 1;
+		break;
+	case CALELEM_PARAM_FILTER:
+		filteropen(p, CALFILTER_PARAM, atts);
+		break;
+	case CALELEM_PROP_FILTER:
+		filteropen(p, CALFILTER_PROP, atts);
+		break;
+	case CALELEM_TEXT_MATCH:
+		textmatchopen(p, atts);
+		break;
+	case CALELEM_TIME_RANGE:
+		timerangeopen(p, atts);
+		break;
 	default:
 		break;
 	}
@@ -595,6 +1167,11 @@ caldav_parse(const char *buf, size_t sz, char **er)
 			(XML_GetErrorCode(p.xp)));
 		caldav_free(p.p);
 		p.p = NULL;
+	} else if (p.p != NULL && p.p->type == CALREQTYPE_FREEBUSY &&
+	    !p.p->range.set) {
+		caldav_err(&p, "free-busy-query without time-range");
+		caldav_free(p.p);
+		p.p = NULL;
 	}
 
 	XML_ParserFree(p.xp);
@@ -70,10 +70,17 @@ conf_parse_keyval(char *buf, const char **key, const char **val)
 
 /*
  * Optionally read our configuration.  This is in a regular
- * configuration file format and has only two possible key-value pairs:
+ * configuration file format with the following key-value pairs:
  *
  *  logfile=/path/to/logfile
  *  verbose=[0--3]
+ *  workers=[0--128]
+ *  maxrequests=[0--...]
+ *  busytimeout=[0--60000]
+ *  quota=[0--...]
+ *  horizon=[0--36500]
+ *  rangecache=[0--...]
+ *  nonce=[database|hmac]
  *
  * If the configuration file does not exist, do not enact any processing
  * and accept this as not an error.
@@ -92,6 +99,9 @@ conf_read(const char *fn, struct conf *conf)
 	int		 rc = 0, rrc;
 
 	memset(conf, 0, sizeof(struct conf));
+	conf->busytimeout = 1000;
+	conf->horizon = 365;
+	conf->rangecache = 8388608;
 
 	/*
 	 * Deprecated compile-time constants.  Allow these to be overriden by
@@ -163,6 +173,42 @@ conf_read(const char *fn, struct conf *conf)
 			conf->verbose = strtonum(val, 0, 10, &er);
 			if (er != NULL)
 				break;
+		} else if (strcmp(key, "workers") == 0) {
+			conf->workers = strtonum(val, 0, 128, &er);
+			if (er != NULL)
+				break;
+		} else if (strcmp(key, "maxrequests") == 0) {
+			conf->maxrequests = strtonum
+				(val, 0, INT_MAX, &er);
+			if (er != NULL)
+				break;
+		} else if (strcmp(key, "busytimeout") == 0) {
+			conf->busytimeout = strtonum
+				(val, 0, 60000, &er);
+			if (er != NULL)
+				break;
+		} else if (strcmp(key, "quota") == 0) {
+			conf->quota = strtonum
+				(val, 0, LLONG_MAX, &er);
+			if (er != NULL)
+				break;
+		} else if (strcmp(key, "horizon") == 0) {
+			conf->horizon = strtonum
+				(val, 0, 36500, &er);
+			if (er != NULL)
+				break;
+		} else if (strcmp(key, "rangecache") == 0) {
+			conf->rangecache = strtonum
+				(val, 0, LLONG_MAX, &er);
+			if (er != NULL)
+				break;
+		} else if (strcmp(key, "nonce") == 0) {
+			if (strcmp(val, "hmac") == 0)
+				conf->hmacnonce = 1;
+			else if (strcmp(val, "database") == 0)
+				conf->hmacnonce = 0;
+			else
+				break;
 		} else
 			break;
 	}
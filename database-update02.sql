@@ -0,0 +1,162 @@
+ALTER TABLE principal ADD COLUMN generation INTEGER NOT NULL DEFAULT(0);
+ALTER TABLE principal ADD COLUMN quota_used INTEGER NOT NULL DEFAULT(0);
+CREATE TABLE database_new (
+	owneruid INTEGER NOT NULL,
+	secret TEXT NOT NULL DEFAULT(lower(hex(randomblob(32))))
+);
+INSERT INTO database_new (owneruid) SELECT owneruid FROM database;
+DROP TABLE database;
+ALTER TABLE database_new RENAME TO database;
+DROP TABLE nonce;
+ALTER TABLE resource ADD COLUMN uid TEXT;
+ALTER TABLE resource ADD COLUMN components INTEGER NOT NULL DEFAULT(0);
+ALTER TABLE resource ADD COLUMN dtstart INTEGER;
+ALTER TABLE resource ADD COLUMN dtend INTEGER;
+ALTER TABLE resource ADD COLUMN floating INTEGER NOT NULL DEFAULT(0);
+ALTER TABLE resource ADD COLUMN recurring INTEGER NOT NULL DEFAULT(0);
+ALTER TABLE resource ADD COLUMN lastmod INTEGER;
+ALTER TABLE resource ADD COLUMN size INTEGER NOT NULL DEFAULT(0);
+UPDATE resource SET size=length(CAST(data AS BLOB));
+ALTER TABLE resource ADD COLUMN occurs INTEGER NOT NULL DEFAULT(0);
+ALTER TABLE resource ADD COLUMN occuntil INTEGER;
+CREATE INDEX resource_dtstart ON resource(collection,occurs,dtstart);
+CREATE INDEX resource_occuntil ON resource(collection,occuntil);
+
+CREATE TABLE occurrence (
+	resource INTEGER NOT NULL,
+	collection INTEGER NOT NULL,
+	dtstart INTEGER NOT NULL,
+	dtend INTEGER NOT NULL,
+	recurid INTEGER,
+	fbtype INTEGER NOT NULL DEFAULT(0),
+	FOREIGN KEY (resource) REFERENCES resource(id) ON DELETE CASCADE
+);
+CREATE INDEX occurrence_dtend ON occurrence(collection,dtend);
+CREATE INDEX occurrence_resource ON occurrence(resource);
+
+CREATE TABLE timezone (
+	hash INTEGER NOT NULL,
+	data TEXT NOT NULL,
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL
+);
+CREATE INDEX timezone_hash ON timezone(hash);
+
+CREATE TABLE resourcetz (
+	resource INTEGER NOT NULL,
+	timezone INTEGER NOT NULL,
+	offs INTEGER NOT NULL,
+	FOREIGN KEY (resource) REFERENCES resource(id) ON DELETE CASCADE,
+	FOREIGN KEY (timezone) REFERENCES timezone(id)
+);
+CREATE INDEX resourcetz_resource ON resourcetz(resource,offs);
+CREATE INDEX resourcetz_timezone ON resourcetz(timezone);
+
+CREATE TRIGGER resourcetz_delete AFTER DELETE ON resourcetz
+BEGIN
+	DELETE FROM timezone WHERE id=OLD.timezone AND NOT EXISTS
+		(SELECT 1 FROM resourcetz WHERE timezone=OLD.timezone);
+END;
+
+CREATE TABLE changelog (
+	collection INTEGER NOT NULL,
+	url TEXT NOT NULL,
+	seq INTEGER NOT NULL,
+	deleted INTEGER NOT NULL DEFAULT(0),
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,
+	unique (collection,url),
+	FOREIGN KEY (collection) REFERENCES collection(id) ON DELETE CASCADE
+);
+CREATE INDEX changelog_seq ON changelog(collection,seq);
+CREATE INDEX changelog_deleted ON changelog(collection,deleted,seq);
+ALTER TABLE collection ADD COLUMN synclimit INTEGER NOT NULL DEFAULT(0);
+INSERT INTO changelog (collection,url,seq)
+	SELECT resource.collection,resource.url,collection.ctag
+	FROM resource INNER JOIN collection
+	ON resource.collection=collection.id;
+
+UPDATE principal SET quota_used=(SELECT
+	COALESCE(SUM(resource.size), 0)
+	FROM resource INNER JOIN collection
+	ON resource.collection=collection.id
+	WHERE collection.principal=principal.id);
+
+CREATE TRIGGER collection_insert AFTER INSERT ON collection
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id=NEW.principal;
+END;
+
+CREATE TRIGGER collection_update AFTER UPDATE ON collection
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id=NEW.principal;
+END;
+
+CREATE TRIGGER collection_delete AFTER DELETE ON collection
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id=OLD.principal;
+END;
+
+CREATE TRIGGER proxy_insert AFTER INSERT ON proxy
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id IN (NEW.principal, NEW.proxy);
+END;
+
+CREATE TRIGGER proxy_update AFTER UPDATE ON proxy
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id IN (NEW.principal, NEW.proxy);
+END;
+
+CREATE TRIGGER proxy_delete AFTER DELETE ON proxy
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id IN (OLD.principal, OLD.proxy);
+END;
+
+CREATE TRIGGER principal_update
+	AFTER UPDATE OF name, hash, email ON principal
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id=NEW.id OR
+		id IN (SELECT principal FROM proxy WHERE proxy=NEW.id) OR
+		id IN (SELECT proxy FROM proxy WHERE principal=NEW.id);
+END;
+
+-- Keep the per-principal byte count of resource data current.
+-- When a collection is removed, its resources are removed by cascade
+-- after the collection itself, so they're accounted for beforehand.
+
+CREATE TRIGGER resource_insert AFTER INSERT ON resource
+BEGIN
+	UPDATE principal SET generation=generation+1,
+		quota_used=quota_used+NEW.size
+		WHERE id=(SELECT principal FROM collection
+			WHERE id=NEW.collection);
+END;
+
+CREATE TRIGGER resource_update AFTER UPDATE OF data, size ON resource
+BEGIN
+	UPDATE principal SET generation=generation+1,
+		quota_used=quota_used+NEW.size-OLD.size
+		WHERE id=(SELECT principal FROM collection
+			WHERE id=NEW.collection);
+END;
+
+CREATE TRIGGER resource_delete AFTER DELETE ON resource
+BEGIN
+	UPDATE principal SET generation=generation+1,
+		quota_used=quota_used-OLD.size
+		WHERE id=(SELECT principal FROM collection
+			WHERE id=OLD.collection);
+END;
+
+CREATE TRIGGER collection_delete_resources BEFORE DELETE ON collection
+BEGIN
+	UPDATE principal SET quota_used=quota_used-(SELECT
+		COALESCE(SUM(size), 0)
+		FROM resource WHERE collection=OLD.id)
+		WHERE id=OLD.principal;
+END;
@@ -15,472 +15,1338 @@
  */
 #include "config.h"
 
-#include <sys/time.h>
-
-#include <assert.h>
-#include <math.h>
-#include <stdio.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "libkcaldav.h"
 
 /*
- * THIS FILE IS NOT BUILT.
+ * Expansion of recurrence sets (RFC 5545, 3.3.10 and 3.8.5).
+ * A rule is expanded one period (e.g., a month for FREQ=MONTHLY) at a
+ * time.  The candidate days of a period are those passing the BYxxx
+ * parts on days, and its instances the product of those days and the
+ * times of day (BYHOUR, BYMINUTE, BYSECOND).  The product is already
+ * in order, so it's never built: BYSETPOS and iteration index into it.
+ * This keeps the iterator's memory fixed whatever the rule.
+ * Times are wall-clock seconds since the epoch, which is the frame in
+ * which rules are defined, regardless of time zone.
+ */
+
+/*
+ * Last year that's expanded, so that rules which can't produce any
+ * instances (e.g., every 30 February) terminate.
+ */
+#define	RECUR_MAXYEAR	9999
+
+/*
+ * Range of times formatted by ical_utc2str(), whose years have four
+ * digits: 0000-01-01T00:00:00Z to 9999-12-31T23:59:59Z.
+ */
+#define	TIME_MIN	(-62167219200LL)
+#define	TIME_MAX	253402300799LL
+
+/*
+ * Most periods in a row without instances before giving up, so that
+ * rules which can't produce any instances for want of alignment
+ * (e.g., every fourth minute at minutes 21 and 39) also terminate.
+ * Skipping non-matching days and hours keeps legitimate rules well
+ * below this.
  */
+#define	RECUR_MAXEMPTY	(1024 * 1024)
+
+struct	icalrecur {
+	const struct icalrrule	*rrule; /* or NULL if no RRULE */
+	const struct icaltm	*rdates; /* RDATE, sorted */
+	size_t			 rdatesz;
+	const struct icaltm	*exdates; /* EXDATE, sorted */
+	size_t			 exdatesz;
+	int			 date; /* DTSTART is a DATE */
+	int64_t			 start; /* window start */
+	int64_t			 end; /* window end */
+	int64_t			 dtstart;
+	int64_t			 until; /* or INT64_MAX */
+	int64_t			 maxday; /* first day past last year */
+	unsigned long		 interval;
+	unsigned long		 count; /* rule instances so far */
+	int			 wkst; /* 0 (Sunday) to 6 */
+	int			 dtstarted; /* DTSTART produced */
+	int			 loaded; /* period loaded */
+	int			 done; /* rule exhausted */
+	size_t			 empty; /* periods without instances */
+	int			 pending; /* "next" is set */
+	int64_t			 next; /* pending rule instance */
+	size_t			 rdate; /* next RDATE */
+
+	/* Rule parts as sets, with defaults taken from DTSTART. */
 
-struct	icaltmcmp {
-	unsigned long	 year; /* x-1900, x>=1970 */
-	unsigned long	 mon; /* 1--12 */
-	unsigned long	 mday; /* 1--31 (depending) */
-	unsigned long	 hour; /* 0--23 */
-	unsigned long	 min; /* 0--59 */
-	unsigned long	 sec; /* 0--59 */
+	int			 bymon; /* month[] is set */
+	unsigned char		 month[13];
+	int			 bymday;
+	unsigned char		 mday[32]; /* 1--31 */
+	unsigned char		 mdayneg[32]; /* -1--31 */
+	int			 byyday;
+	unsigned char		 yday[367];
+	unsigned char		 ydayneg[367];
+	int			 bywkno;
+	unsigned char		 wkno[54];
+	unsigned char		 wknoneg[54];
+	int			 bywday;
+	unsigned char		 wday[7]; /* any in period */
+	size_t			 nwdaysz;
+	struct {
+		long	 n; /* non-zero */
+		int	 wday;
+	}			 nwday[64]; /* nth in period */
+	int			 nwdayyear; /* nth in year */
+	unsigned char		 hourset[24];
+	unsigned char		 minset[60];
+	unsigned char		 secset[60];
+
+	/* Current period. */
+
+	int64_t			 year; /* YEARLY, MONTHLY */
+	unsigned int		 mon; /* MONTHLY */
+	int64_t			 cur; /* WEEKLY, DAILY: day; else sec */
+	int64_t			 days[366];
+	size_t			 daysz;
+	unsigned int		 hours[24];
+	size_t			 hoursz;
+	unsigned int		 mins[60];
+	size_t			 minsz;
+	unsigned int		 secs[60];
+	size_t			 secsz;
+	uint32_t		 setpos[733]; /* BYSETPOS indices */
+	size_t			 setposz;
+	size_t			 pos; /* next index in period */
+	size_t			 possz; /* indices in period */
 };
 
+static int64_t
+fdiv(int64_t a, int64_t b)
+{
+
+	return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+/*
+ * Days since the epoch of the given date, with "m" being 1--12 and "d"
+ * 1--31, using the days-from-civil algorithm of Howard Hinnant.
+ */
+static int64_t
+days_from_civil(int64_t y, unsigned int m, unsigned int d)
+{
+	int64_t	 era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+/*
+ * The inverse of days_from_civil().
+ */
 static void
-ical_datetime2cmp(struct icaltmcmp *cmp, const struct icaltm *tm)
+civil_from_days(int64_t z, int64_t *y, unsigned int *m, unsigned int *d)
+{
+	int64_t	 era, doe, yoe, doy, mp;
+
+	z += 719468;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	*d = doy - (153 * mp + 2) / 5 + 1;
+	*m = mp < 10 ? mp + 3 : mp - 9;
+	*y = yoe + era * 400 + (*m <= 2);
+}
+
+static int
+leapyear(int64_t y)
+{
+
+	return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+}
+
+static unsigned int
+monthdays(int64_t y, unsigned int m)
+{
+	static const unsigned int mdays[12] = {
+		31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+	return m == 2 && leapyear(y) ? 29 : mdays[m - 1];
+}
+
+/*
+ * Day of the week of "day", with zero being Sunday.
+ * The epoch was a Thursday.
+ */
+static int
+weekday(int64_t day)
 {
 
-	cmp->year = tm->year;
-	cmp->mon = tm->mon;
-	cmp->mday = tm->mday;
-	cmp->hour = tm->hour;
-	cmp->min = tm->min;
-	cmp->sec = tm->sec;
+	return (int)(((day % 7) + 11) % 7);
 }
 
 /*
- * See ical_datetime() in ical.c for a description of the algorithm.
- * This set the date from a set of broken-down data components.
- * Note that "year" is -1900 (so 1970 is just 70).
- * If the components are invalid (e.g., 30 February), this returns zero;
- * else, it returns non-ezro.
+ * First day of week 1 of year "y" (RFC 5545, 3.3.10, BYWEEKNO): the
+ * first week, starting on "wkst", with at least four days in the year.
+ */
+static int64_t
+week1(const struct icalrecur *r, int64_t y)
+{
+	int64_t	 jan1;
+	int	 off;
+
+	jan1 = days_from_civil(y, 1, 1);
+	off = (weekday(jan1) - r->wkst + 7) % 7;
+	return off <= 3 ? jan1 - off : jan1 - off + 7;
+}
+
+/*
+ * Whether the week of "day" of year "y" is in BYWEEKNO.
+ * The week may be the last of the prior year or first of the next.
  */
 static int
-ical_datetimecmp(struct icaltm *tm, const struct icaltmcmp *cmp)
-{
-	size_t		 i;
-	unsigned long	 m, K, J;
-	unsigned	 mdaysa[12] = {  0,  31,  59,  90, 
-				       120, 151, 181, 212, 
-				       243, 273, 304, 334 };
-	unsigned	 mdayss[12] = { 31,  28,  31,  30, 
-				        31,  30,  31,  31,
-					30,  31,  30,  31 };
-
-	memset(tm, 0, sizeof(struct icaltm));
-
-	if (cmp->year < 70)
-		return(0);
-	tm->year = cmp->year;
-	tm->ly = ((tm->year & 3) == 0 && 
-		((tm->year % 25) != 0 || (tm->year & 15) == 0));
-
-	if (tm->ly) {
-		mdayss[1] = 29;
-		for (i = 2; i < 12; i++)
-			mdaysa[i]++;
+recur_wkno(const struct icalrecur *r, int64_t day, int64_t y)
+{
+	int64_t	 w1, w1next, wk, nwk;
+
+	w1 = week1(r, y);
+	w1next = week1(r, y + 1);
+	if (day < w1) {
+		w1next = w1;
+		w1 = week1(r, y - 1);
+	} else if (day >= w1next) {
+		w1 = w1next;
+		w1next = week1(r, y + 2);
 	}
 
-	if (0 == cmp->mon || cmp->mon > 12)
-		return(0);
-	tm->mon = cmp->mon;
-	if (0 == cmp->mday || cmp->mday > mdayss[tm->mon - 1])
-		return(0);
-	tm->mday = cmp->mday;
-	if (cmp->hour > 23)
-		return(0);
-	tm->hour = cmp->hour;
-	if (cmp->min > 59)
-		return(0);
-	tm->min = cmp->min;
-	if (cmp->sec > 59)
-		return(0);
-	tm->sec = cmp->sec;
-	tm->day = mdaysa[tm->mon - 1] + (tm->mday - 1);
-	tm->tm = tm->sec + tm->min * 60 + tm->hour * 3600 + 
-		tm->day * 86400 + (tm->year - 70) * 31536000 + 
-		((tm->year - 69) / 4) * 86400 -
-		((tm->year - 1) / 100) * 86400 + 
-		((tm->year + 299) / 400) * 86400;
-
-	m = tm->mon < 3 ? tm->mon + 12 : tm->mon;
-	K = (tm->year + 1900) % 100;
-	J = floor((tm->year + 1900) / 100.0);
-	tm->wday = 
-		(tm->mday + 
-		 (unsigned long)floor((13 * (m + 1)) / 5.0) +
-		 K + 
-		 (unsigned long)floor(K / 4.0) + 
-		 (unsigned long)floor(J / 4.0) + 
-		 5 * J) % 7;
-	return(1);
+	wk = (day - w1) / 7 + 1;
+	nwk = (w1next - w1) / 7;
+	return r->wkno[wk] || r->wknoneg[nwk - wk + 1];
 }
 
+/*
+ * Whether "day", the "md"th of its month of "mlen" days and the "yd"th
+ * (from zero) of year "y" of "ylen" days, passes the rule's parts on
+ * days.
+ */
+static int
+recur_day(const struct icalrecur *r, int64_t day, int64_t y,
+	unsigned int m, unsigned int md, unsigned int mlen,
+	unsigned int yd, unsigned int ylen)
+{
+	size_t	 i;
+	long	 n, nth, nthneg;
+	int	 wd;
+
+	if (r->bymon && !r->month[m])
+		return 0;
+	if (r->bywkno && !recur_wkno(r, day, y))
+		return 0;
+	if (r->byyday && !r->yday[yd + 1] && !r->ydayneg[ylen - yd])
+		return 0;
+	if (r->bymday && !r->mday[md] && !r->mdayneg[mlen - md + 1])
+		return 0;
+	if (!r->bywday)
+		return 1;
 
-static size_t
-ical_rrule_produce(const struct icaltm *cur,
-	const struct icalrrule *rrule)
-{
-	const char *const weeks[7] = {
-		"Sat",
-		"Sun",
-		"Mon",
-		"Tues",
-		"Wed",
-		"Thurs",
-		"Fri",
-	};
-
-	/* Check the UNTIL clause. */
-	/* 
-	 * FIXME: UNTIL is in UTC, so we need to convert the "cur->tm"
-	 * value into UTC in order for it to be consistent.
-	 */
-	if (0 != rrule->until.tm)
-		if (cur->tm > rrule->until.tm)
-			return(0);
+	wd = weekday(day);
+	if (r->wday[wd])
+		return 1;
+
+	if (r->nwdayyear) {
+		nth = yd / 7 + 1;
+		nthneg = (ylen - yd - 1) / 7 + 1;
+	} else {
+		nth = (md - 1) / 7 + 1;
+		nthneg = (mlen - md) / 7 + 1;
+	}
 
-	fprintf(stderr, "%04lu%02lu%02luT%02lu%02lu%02lu (%s)\n",
-		cur->year + 1900,
-		cur->mon,
-		cur->mday,
-		cur->hour,
-		cur->min,
-		cur->sec,
-		cur->wday < 7 ? weeks[cur->wday] : "none");
-	return(1);
+	for (i = 0; i < r->nwdaysz; i++) {
+		if (r->nwday[i].wday != wd)
+			continue;
+		n = r->nwday[i].n;
+		if (n > 0 ? n == nth : -n == nthneg)
+			return 1;
+	}
+	return 0;
 }
 
-static size_t
-ical_rrule_bysetpos(const struct icaltm *cur,
-	const struct icalrrule *rrule)
+/*
+ * Append the days of month "m" of year "y" passing the rule.
+ */
+static void
+recur_month(struct icalrecur *r, int64_t y, unsigned int m)
 {
+	int64_t		 day;
+	unsigned int	 md, mlen, yd, ylen;
+
+	if (r->bymon && !r->month[m])
+		return;
+
+	mlen = monthdays(y, m);
+	ylen = leapyear(y) ? 366 : 365;
+	day = days_from_civil(y, m, 1);
+	yd = day - days_from_civil(y, 1, 1);
 
-	return(ical_rrule_produce(cur, rrule));
+	for (md = 1; md <= mlen; md++, day++, yd++)
+		if (recur_day(r, day, y, m, md, mlen, yd, ylen))
+			r->days[r->daysz++] = day;
 }
 
+/*
+ * Append "day" if it passes the rule.
+ */
+static void
+recur_oneday(struct icalrecur *r, int64_t day)
+{
+	int64_t		 y;
+	unsigned int	 m, md, yd;
+
+	civil_from_days(day, &y, &m, &md);
+	yd = day - days_from_civil(y, 1, 1);
+	if (recur_day(r, day, y, m, md, monthdays(y, m),
+	    yd, leapyear(y) ? 366 : 365))
+		r->days[r->daysz++] = day;
+}
+
+/*
+ * Fill "list" with the members of "set" (all of them if "all") or, if
+ * "fixed" is not negative, with only it if it's in "set".
+ */
 static size_t
-ical_rrule_bysecond(const struct icaltm *cur,
-	const struct icalrrule *rrule)
-{
-	struct icaltmcmp cmp;
-	struct icaltm	 tm;
-	size_t		 i, found;
-	int		 have;
-
-	ical_datetime2cmp(&cmp, cur);
-	for (found = i = 0, have = 0; i < rrule->bminsz; i++) {
-		cmp.min = rrule->bmin[i];
-		if ( ! ical_datetimecmp(&tm, &cmp))
-			continue;
-		found += ical_rrule_bysetpos(&tm, rrule);
-		have = 1;
-	}
+recur_times(unsigned int *list, const unsigned char *set, size_t sz,
+	int fixed)
+{
+	size_t	 i, n = 0;
 
-	/* If no entries, route directly through */
-	return(have ? found : ical_rrule_bysetpos(cur, rrule));
+	if (fixed >= 0)
+		return set[fixed] ? (list[0] = fixed, 1) : 0;
+	for (i = 0; i < sz; i++)
+		if (set[i])
+			list[n++] = i;
+	return n;
 }
 
+/*
+ * Compute the days and times of the current period.
+ * Returns the number of instances, which may be zero.
+ */
 static size_t
-ical_rrule_byminute(const struct icaltm *cur,
-	const struct icalrrule *rrule)
-{
-	struct icaltmcmp cmp;
-	struct icaltm	 tm;
-	size_t		 i, found;
-	int		 have;
-
-	ical_datetime2cmp(&cmp, cur);
-	for (found = i = 0, have = 0; i < rrule->bminsz; i++) {
-		cmp.min = rrule->bmin[i];
-		if ( ! ical_datetimecmp(&tm, &cmp))
+recur_load(struct icalrecur *r)
+{
+	const struct icalrrule	*rr = r->rrule;
+	unsigned int		 m;
+	size_t			 i, j, total;
+	int64_t			 day, idx;
+	int			 h = -1, mi = -1, s = -1, sec;
+
+	r->daysz = r->setposz = r->pos = 0;
+
+	switch (rr->freq) {
+	case ICALFREQ_YEARLY:
+		for (m = 1; m <= 12; m++)
+			recur_month(r, r->year, m);
+		break;
+	case ICALFREQ_MONTHLY:
+		recur_month(r, r->year, r->mon);
+		break;
+	case ICALFREQ_WEEKLY:
+		for (day = r->cur; day < r->cur + 7; day++)
+			recur_oneday(r, day);
+		break;
+	case ICALFREQ_DAILY:
+		recur_oneday(r, r->cur);
+		break;
+	default:
+		recur_oneday(r, fdiv(r->cur, 86400));
+		sec = r->cur - fdiv(r->cur, 86400) * 86400;
+		h = sec / 3600;
+		if (rr->freq <= ICALFREQ_MINUTELY)
+			mi = sec / 60 % 60;
+		if (rr->freq == ICALFREQ_SECONDLY)
+			s = sec % 60;
+		break;
+	}
+
+	r->hoursz = recur_times(r->hours, r->hourset, 24, h);
+	r->minsz = recur_times(r->mins, r->minset, 60, mi);
+	r->secsz = recur_times(r->secs, r->secset, 60, s);
+
+	total = r->daysz * r->hoursz * r->minsz * r->secsz;
+	if (total == 0 || rr->bspsz == 0)
+		return r->possz = total;
+
+	/* Each BYSETPOS as an index, in order and unique. */
+
+	for (i = 0; i < rr->bspsz; i++) {
+		if (rr->bsp[i] == 0)
+			continue;
+		idx = rr->bsp[i] > 0 ?
+			rr->bsp[i] - 1 : (int64_t)total + rr->bsp[i];
+		if (idx < 0 || idx >= (int64_t)total)
+			continue;
+		for (j = r->setposz; j > 0 && r->setpos[j - 1] > idx; j--)
+			r->setpos[j] = r->setpos[j - 1];
+		if (j > 0 && r->setpos[j - 1] == idx) {
+			memmove(&r->setpos[j], &r->setpos[j + 1],
+				(r->setposz - j) * sizeof(uint32_t));
 			continue;
-		found += ical_rrule_bysecond(&tm, rrule);
-		have = 1;
+		}
+		r->setpos[j] = idx;
+		r->setposz++;
 	}
 
-	/* If no entries, route directly through */
-	return(have ? found : ical_rrule_bysecond(cur, rrule));
+	return r->possz = r->setposz;
 }
 
-static size_t
-ical_rrule_byhour(const struct icaltm *cur,
-	const struct icalrrule *rrule)
-{
-	struct icaltmcmp cmp;
-	struct icaltm	 tm;
-	size_t		 i, found;
-	int		 have;
-
-	ical_datetime2cmp(&cmp, cur);
-	for (found = i = 0, have = 0; i < rrule->bhrsz; i++) {
-		cmp.hour = rrule->bhr[i];
-		if ( ! ical_datetimecmp(&tm, &cmp))
-			continue;
-		found += ical_rrule_byminute(&tm, rrule);
-		have = 1;
+/*
+ * Wall-clock time of the current period's "idx"th instance.
+ */
+static int64_t
+recur_time(const struct icalrecur *r, size_t idx)
+{
+	size_t	 ntimes = r->hoursz * r->minsz * r->secsz, t;
+
+	t = idx % ntimes;
+	return r->days[idx / ntimes] * 86400 +
+		r->hours[t / (r->minsz * r->secsz)] * 3600 +
+		r->mins[t / r->secsz % r->minsz] * 60 +
+		r->secs[t % r->secsz];
+}
+
+/*
+ * First day of the current period, or for sub-daily periods, the day
+ * of the period.
+ */
+static int64_t
+recur_periodday(const struct icalrecur *r)
+{
+
+	switch (r->rrule->freq) {
+	case ICALFREQ_YEARLY:
+		return days_from_civil(r->year, 1, 1);
+	case ICALFREQ_MONTHLY:
+		return days_from_civil(r->year, r->mon, 1);
+	case ICALFREQ_WEEKLY:
+	case ICALFREQ_DAILY:
+		return r->cur;
+	default:
+		return fdiv(r->cur, 86400);
 	}
+}
 
-	/* If no entries, route directly through */
-	return(have ? found : ical_rrule_byminute(cur, rrule));
+/*
+ * Length in seconds of a sub-daily period.
+ */
+static int64_t
+recur_unit(const struct icalrecur *r)
+{
+
+	switch (r->rrule->freq) {
+	case ICALFREQ_HOURLY:
+		return 3600;
+	case ICALFREQ_MINUTELY:
+		return 60;
+	default:
+		return 1;
+	}
 }
 
 /*
- * Recursively daily (day-in-week) component.
+ * Advance to the next period.
+ * Without COUNT, periods wholly before the window are skipped, as are
+ * sub-daily periods on days (or hours and minutes) that can't match.
  */
-static size_t
-ical_rrule_byday(const struct icaltm *cur,
-	const struct icalrrule *rrule)
-{
-	struct icaltmcmp cmp;
-	struct icaltm	 tm;
-	size_t		 i, found;
-	unsigned long	 j, wday;
-	unsigned long	 wdays[7][5];
-	size_t		 wdaysz[7];
-	int		 rc, have;
-
-	memset(wdays, 0, sizeof(wdays));
-	memset(wdaysz, 0, sizeof(wdaysz));
-
-	/* Direct recursion: nothing to do here. */
-	if (0 == rrule->bwkdsz) 
-		return(ical_rrule_byhour(cur, rrule));
-
-	/* 
-	 * In the current month, compute the days that correspond to a
-	 * given weekday.
-	 * To do so, first compute the weekday given the date, then map
-	 * an array of that weekday's days back into the day of month.
-	 */
-	ical_datetime2cmp(&cmp, cur);
-	for (i = 0; i < 32; i++) {
-		cmp.mday = i;
-		if ( ! ical_datetimecmp(&tm, &cmp))
-			continue;
-		assert(wdaysz[tm.wday] < sizeof(wdays[tm.wday]));
-		wdays[tm.wday][wdaysz[tm.wday]++] = cmp.mday;
+static void
+recur_advance(struct icalrecur *r)
+{
+	const struct icalrrule	*rr = r->rrule;
+	int64_t			 n, mons, step, target, sec;
+	unsigned int		 m, d;
+
+	switch (rr->freq) {
+	case ICALFREQ_YEARLY:
+		n = 1;
+		if (rr->count == 0 && r->start > INT64_MIN) {
+			civil_from_days(fdiv(r->start, 86400),
+				&target, &m, &d);
+			if (target > r->year + 1)
+				n = (target - r->year) / r->interval;
+		}
+		r->year += (n > 1 ? n : 1) * r->interval;
+		break;
+	case ICALFREQ_MONTHLY:
+		n = 1;
+		if (rr->count == 0 && r->start > INT64_MIN) {
+			civil_from_days(fdiv(r->start, 86400),
+				&target, &m, &d);
+			mons = (target - r->year) * 12 +
+				((int64_t)m - r->mon);
+			if (mons > 1)
+				n = mons / r->interval;
+		}
+		mons = r->year * 12 + (r->mon - 1) +
+			(n > 1 ? n : 1) * r->interval;
+		r->year = fdiv(mons, 12);
+		r->mon = mons - r->year * 12 + 1;
+		break;
+	case ICALFREQ_WEEKLY:
+	case ICALFREQ_DAILY:
+		step = (rr->freq == ICALFREQ_WEEKLY ? 7 : 1) *
+			r->interval;
+		r->cur += step;
+		if (rr->count == 0 && r->start > INT64_MIN &&
+		    (target = fdiv(r->start, 86400) - 6) > r->cur)
+			r->cur += (target - r->cur) / step * step;
+		break;
+	default:
+		step = recur_unit(r) * r->interval;
+		r->cur += step;
+		target = r->cur;
+		if (rr->count == 0 && r->start > INT64_MIN &&
+		    fdiv(r->start, recur_unit(r)) * recur_unit(r) > target)
+			target = fdiv(r->start, recur_unit(r)) * recur_unit(r);
+
+		/* Skip days, hours, and minutes that can't match. */
+
+		sec = r->cur - fdiv(r->cur, 86400) * 86400;
+		r->daysz = 0;
+		recur_oneday(r, fdiv(r->cur, 86400));
+		if (r->daysz == 0)
+			target = (fdiv(r->cur, 86400) + 1) * 86400;
+		else if (!r->hourset[sec / 3600])
+			target = (fdiv(r->cur, 3600) + 1) * 3600;
+		else if (rr->freq == ICALFREQ_SECONDLY &&
+		    !r->minset[sec / 60 % 60])
+			target = (fdiv(r->cur, 60) + 1) * 60;
+		if (target > r->cur)
+			r->cur += (target - r->cur + step - 1) /
+				step * step;
+		break;
 	}
+}
 
-	for (found = i = 0, have = 0; i < rrule->bwkdsz; i++) {
-		assert(rrule->bwkd[i].wkday > ICALWKDAY_NONE);
-		assert(rrule->bwkd[i].wkday < ICALWKDAY__MAX);
-		wday = rrule->bwkd[i].wkday % 7;
-
-		/* All weekdays in month. */
-		if (0 == rrule->bwkd[i].wk) {
-			for (j = 0; j < wdaysz[wday]; j++) {
-				cmp.mday = wdays[wday][j];
-				rc = ical_datetimecmp(&tm, &cmp);
-				assert(rc);
-				found += ical_rrule_byhour(&tm, rrule);
-				have = 1;
+/*
+ * Get the next instance of the rule (with DTSTART as its first).
+ * Returns zero if there are no more.
+ */
+static int
+recur_rule(struct icalrecur *r, int64_t *v)
+{
+	const struct icalrrule	*rr = r->rrule;
+	size_t			 idx;
+
+	if (!r->dtstarted) {
+		r->dtstarted = 1;
+		r->count = 1;
+		*v = r->dtstart;
+		return 1;
+	} else if (rr == NULL || r->done)
+		return 0;
+
+	for (;;) {
+		while (r->loaded && r->pos < r->possz) {
+			idx = r->setposz ? r->setpos[r->pos] : r->pos;
+			r->pos++;
+			*v = recur_time(r, idx);
+			if (*v <= r->dtstart)
+				continue;
+			if (*v > r->until ||
+			    (rr->count && r->count >= rr->count)) {
+				r->done = 1;
+				return 0;
 			}
-			continue;
+			r->count++;
+			return 1;
 		}
 
-		/* 
-		 * Specific weekday in month. 
-		 * First, see if the weekday requested doesn't exist
-		 * (e.g., the ninth Sunday).
-		 * Second, see if we're counting from the end of the
-		 * month or from the beginning.
-		 */
-		if (labs(rrule->bwkd[i].wk) - 1 >= (long)wdaysz[wday])
-			continue;
-		cmp.mday = rrule->bwkd[i].wk > 0 ?
-			wdays[wday][rrule->bwkd[i].wk] :
-			wdays[wday][wdaysz[wday] + rrule->bwkd[i].wk];
-		if ( ! ical_datetimecmp(&tm, &cmp))
-			continue;
-		found += ical_rrule_byhour(&tm, rrule);
-		have = 1;
+		if (r->loaded)
+			recur_advance(r);
+		r->loaded = 1;
+
+		if (recur_periodday(r) >= r->maxday ||
+		    recur_periodday(r) * 86400 >= r->end ||
+		    recur_periodday(r) * 86400 > r->until) {
+			r->done = 1;
+			return 0;
+		}
+		if (recur_load(r) > 0)
+			r->empty = 0;
+		else if (++r->empty >= RECUR_MAXEMPTY) {
+			r->done = 1;
+			return 0;
+		}
 	}
+}
 
-	return(have ? found : ical_rrule_byhour(cur, rrule));
+static int
+recur_excluded(const struct icalrecur *r, int64_t v)
+{
+	size_t	 lo = 0, hi = r->exdatesz, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (r->exdates[mid].tm == v)
+			return 1;
+		if (r->exdates[mid].tm < v)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+static void
+recur_set(unsigned char *set, size_t sz, const unsigned long *v,
+	size_t vsz, int fallback)
+{
+	size_t	 i;
+
+	if (vsz == 0) {
+		set[fallback] = 1;
+		return;
+	}
+	for (i = 0; i < vsz; i++)
+		if (v[i] < sz)
+			set[v[i]] = 1;
+}
+
+static size_t
+recur_count(const unsigned char *set, size_t sz)
+{
+	size_t	 i, n = 0;
+
+	for (i = 0; i < sz; i++)
+		n += set[i] != 0;
+	return n;
+}
+
+static void
+recur_setneg(unsigned char *pos, unsigned char *neg, size_t sz,
+	const long *v, size_t vsz)
+{
+	size_t	 i;
+
+	for (i = 0; i < vsz; i++)
+		if (v[i] > 0 && (size_t)v[i] < sz)
+			pos[v[i]] = 1;
+		else if (v[i] < 0 && (size_t)-v[i] < sz)
+			neg[-v[i]] = 1;
 }
 
 /*
- * Recursive day (day-in-month) component.
+ * Prepare the rule "rr" of "r", filling in parts left out with those
+ * of DTSTART as described in RFC 5545, 3.3.10.
  */
-static size_t
-ical_rrule_bymonthday(const struct icaltm *cur,
-	const struct icalrrule *rrule)
-{
-	struct icaltmcmp cmp;
-	struct icaltm	 tm;
-	size_t		 i, found;
-	int		 have;
-	unsigned	 mdayss[12] = { 31,  28,  31,  30, 
-				        31,  30,  31,  31,
-					30,  31,  30,  31 };
-
-	/* Leap-year February. */
-	if (cur->ly) 
-		mdayss[1] = 29;
-	ical_datetime2cmp(&cmp, cur);
-	for (found = i = 0, have = 0; i < rrule->bmndsz; i++) {
-		assert(0 != rrule->bmnd[i]);
-		assert(cmp.mon > 0 && cmp.mon < 13);
-		/*
-		 * If we're going backwards, then make sure we don't
-		 * specify a day before the beginning of the month,
-		 * e.g., -31 for February.
-		 */
-		if (rrule->bmnd[i] < 0 && mdayss[cmp.mon - 1] < 
-			(unsigned long)labs(rrule->bmnd[i]))
-			continue;
+static void
+recur_init_rule(struct icalrecur *r, const struct icalrrule *rr)
+{
+	int64_t		 y, day;
+	unsigned int	 m, md;
+	int		 sec, wd, dayrule;
+	size_t		 i, maxsz;
+
+	day = fdiv(r->dtstart, 86400);
+	sec = r->dtstart - day * 86400;
+	civil_from_days(day, &y, &m, &md);
 
-		cmp.mday = rrule->bmnd[i] < 0 ?
-			(unsigned long)(mdayss[cmp.mon - 1] + (rrule->bmnd[i] + 1)) :
-			(unsigned long)rrule->bmnd[i];
-		if ( ! ical_datetimecmp(&tm, &cmp))
+	r->rrule = rr;
+	r->interval = rr->interval == 0 ? 1 : rr->interval;
+	r->wkst = rr->wkst == ICALWKDAY_NONE ? 1 : rr->wkst - 1;
+	r->until = rr->until.type == ICAL_DT_UNSET ?
+		INT64_MAX : rr->until.tm;
+	if (rr->until.type == ICAL_DT_DATE && !r->date)
+		r->until += 86399;
+
+	recur_set(r->month, 13, rr->bmon, rr->bmonsz, m);
+	r->bymon = rr->bmonsz > 0;
+	recur_setneg(r->mday, r->mdayneg, 32, rr->bmnd, rr->bmndsz);
+	r->bymday = rr->bmndsz > 0;
+	recur_setneg(r->yday, r->ydayneg, 367, rr->byrd, rr->byrdsz);
+	r->byyday = rr->byrdsz > 0;
+	recur_setneg(r->wkno, r->wknoneg, 54, rr->bwkn, rr->bwknsz);
+	r->bywkno = rr->bwknsz > 0 && rr->freq == ICALFREQ_YEARLY;
+
+	/*
+	 * An ordinal BYDAY is within the month for MONTHLY, and for
+	 * YEARLY with BYMONTH; within the year for YEARLY otherwise.
+	 * It's meaningless for other frequencies and with BYWEEKNO.
+	 */
+
+	r->nwdayyear = rr->freq == ICALFREQ_YEARLY && rr->bmonsz == 0;
+	for (i = 0; i < rr->bwkdsz; i++) {
+		if (rr->bwkd[i].wkday <= ICALWKDAY_NONE ||
+		    rr->bwkd[i].wkday >= ICALWKDAY__MAX)
 			continue;
-		found += ical_rrule_byday(&tm, rrule);
-		have = 1;
+		r->bywday = 1;
+		wd = rr->bwkd[i].wkday - 1;
+		if (rr->bwkd[i].wk == 0 || r->bywkno ||
+		    (rr->freq != ICALFREQ_YEARLY &&
+		     rr->freq != ICALFREQ_MONTHLY))
+			r->wday[wd] = 1;
+		else if (r->nwdaysz < 64) {
+			r->nwday[r->nwdaysz].n = rr->bwkd[i].wk;
+			r->nwday[r->nwdaysz].wday = wd;
+			r->nwdaysz++;
+		}
+	}
+
+	/* Days and months left out are those of DTSTART. */
+
+	dayrule = r->bymday || r->byyday || r->bywkno || r->bywday;
+	if (!dayrule && rr->freq == ICALFREQ_YEARLY) {
+		r->bymon = 1;
+		if (rr->bmonsz == 0)
+			r->month[m] = 1;
+		r->bymday = 1;
+		r->mday[md] = 1;
+	} else if (!dayrule && rr->freq == ICALFREQ_MONTHLY) {
+		r->bymday = 1;
+		r->mday[md] = 1;
+	} else if (!dayrule && rr->freq == ICALFREQ_WEEKLY) {
+		r->bywday = 1;
+		r->wday[weekday(day)] = 1;
+	}
+
+	/* Likewise times, but as limits for smaller frequencies. */
+
+	if (rr->bhrsz == 0 && rr->freq <= ICALFREQ_HOURLY)
+		memset(r->hourset, 1, sizeof(r->hourset));
+	else
+		recur_set(r->hourset, 24, rr->bhr, rr->bhrsz, sec / 3600);
+	if (rr->bminsz == 0 && rr->freq <= ICALFREQ_MINUTELY)
+		memset(r->minset, 1, sizeof(r->minset));
+	else
+		recur_set(r->minset, 60, rr->bmin, rr->bminsz,
+			sec / 60 % 60);
+	if (rr->bsecsz == 0 && rr->freq <= ICALFREQ_SECONDLY)
+		memset(r->secset, 1, sizeof(r->secset));
+	else
+		recur_set(r->secset, 60, rr->bsec, rr->bsecsz, sec % 60);
+
+	/*
+	 * If no BYSETPOS can index into the largest possible period,
+	 * the rule has no instances.
+	 */
+
+	if (rr->bspsz > 0) {
+		maxsz = rr->freq == ICALFREQ_YEARLY ? 366 :
+			rr->freq == ICALFREQ_MONTHLY ? 31 :
+			rr->freq == ICALFREQ_WEEKLY ? 7 : 1;
+		if (rr->freq > ICALFREQ_HOURLY)
+			maxsz *= recur_count(r->hourset, 24);
+		if (rr->freq > ICALFREQ_MINUTELY)
+			maxsz *= recur_count(r->minset, 60);
+		if (rr->freq > ICALFREQ_SECONDLY)
+			maxsz *= recur_count(r->secset, 60);
+		for (i = 0; i < rr->bspsz; i++)
+			if (rr->bsp[i] != 0 &&
+			    (size_t)labs(rr->bsp[i]) <= maxsz)
+				break;
+		if (i == rr->bspsz)
+			r->done = 1;
+	}
+
+	/* The first period is that of DTSTART. */
+
+	switch (rr->freq) {
+	case ICALFREQ_YEARLY:
+		r->year = y;
+		break;
+	case ICALFREQ_MONTHLY:
+		r->year = y;
+		r->mon = m;
+		break;
+	case ICALFREQ_WEEKLY:
+		r->cur = day - (weekday(day) - r->wkst + 7) % 7;
+		break;
+	case ICALFREQ_DAILY:
+		r->cur = day;
+		break;
+	default:
+		r->cur = r->dtstart - sec % recur_unit(r);
+		break;
+	}
+}
+
+/*
+ * Begin iterating over the recurrence set starting at "dtstart" with
+ * the rule "rr" (if set), "rdates", and "exdates" within [start, end).
+ * Returns NULL on memory failure.
+ */
+static struct icalrecur *
+recur_new(const struct icaltm *dtstart, const struct icalrrule *rr,
+	const struct icaltm *rdates, size_t rdatesz,
+	const struct icaltm *exdates, size_t exdatesz,
+	int64_t start, int64_t end)
+{
+	struct icalrecur	*r;
+	size_t			 lo, hi, mid;
+
+	if ((r = calloc(1, sizeof(struct icalrecur))) == NULL)
+		return NULL;
+
+	r->rdates = rdates;
+	r->rdatesz = rdatesz;
+	r->exdates = exdates;
+	r->exdatesz = exdatesz;
+	r->date = dtstart->type == ICAL_DT_DATE;
+	r->start = start;
+	r->end = end;
+	r->dtstart = dtstart->tm;
+	r->until = INT64_MAX;
+	r->maxday = days_from_civil(RECUR_MAXYEAR + 1, 1, 1);
+
+	if (dtstart->type == ICAL_DT_UNSET) {
+		r->dtstarted = r->done = 1;
+		return r;
 	}
+	if (rr->set &&
+	    rr->freq > ICALFREQ_NONE &&
+	    rr->freq < ICALFREQ__MAX)
+		recur_init_rule(r, rr);
+
+	/* Skip to the first RDATE in the window. */
 
-	/* If no entries, route directly through */
-	return(have ? found : ical_rrule_byday(cur, rrule));
+	for (lo = 0, hi = rdatesz; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (rdates[mid].tm < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	r->rdate = lo;
+	return r;
 }
 
 /*
- * Recrusive weekly (number in year) component.
+ * Begin iterating over the recurrence set of "c": DTSTART and the
+ * instances of its RRULE and RDATE, less those of EXDATE.
+ * Only instances starting within [start, end) are produced; either may
+ * be INT64_MIN or INT64_MAX for no bound.
+ * Returns NULL on memory failure.
  */
-static size_t
-ical_rrule_byweekno(const struct icaltm *cur,
-	const struct icalrrule *rrule)
+struct icalrecur *
+ical_recur_init(const struct icalcomp *c, int64_t start, int64_t end)
 {
+	struct icalrecur	*r;
+
+	r = recur_new(&c->dtstart.time, &c->rrule, c->rdates,
+		c->rdatesz, c->exdates, c->exdatesz, start, end);
+	if (r == NULL)
+		return NULL;
 
-	return(ical_rrule_bymonthday(cur, rrule));
+	/*
+	 * A UTC UNTIL with a zoned DTSTART (RFC 5545, 3.3.10) is
+	 * compared in the zone's wall-clock time, as instances are.
+	 */
+
+	if (r->rrule != NULL &&
+	    r->rrule->until.type == ICAL_DT_DATETIMEUTC &&
+	    c->dtstart.time.type == ICAL_DT_DATETIME)
+		r->until = ical_utc2tz(c->dtstart.tz, r->until);
+	return r;
 }
 
 /*
- * Recursive monthly component.
+ * Get the next instance of the recurrence set into "v".
+ * Returns zero if there are no more, non-zero otherwise.
  */
-static size_t
-ical_rrule_bymonth(const struct icaltm *cur,
-	const struct icalrrule *rrule)
-{
-	struct icaltmcmp cmp;
-	struct icaltm	 tm;
-	size_t		 i, found;
-	int		 have;
-
-	ical_datetime2cmp(&cmp, cur);
-	for (found = i = 0, have = 0; i < rrule->bmonsz; i++) {
-		cmp.mon = rrule->bmon[i];
-		if ( ! ical_datetimecmp(&tm, &cmp))
+int
+ical_recur_next(struct icalrecur *r, int64_t *v)
+{
+	int64_t	 rd;
+
+	for (;;) {
+		if (!r->pending && recur_rule(r, &r->next))
+			r->pending = 1;
+
+		rd = r->rdate < r->rdatesz ?
+			r->rdates[r->rdate].tm : INT64_MAX;
+		if (!r->pending && rd == INT64_MAX)
+			return 0;
+
+		if (r->pending && r->next <= rd) {
+			*v = r->next;
+			r->pending = 0;
+			if (rd == *v)
+				r->rdate++;
+		} else {
+			*v = rd;
+			r->rdate++;
+		}
+
+		if (*v >= r->end)
+			return 0;
+		if (*v < r->start || recur_excluded(r, *v))
 			continue;
-		found += ical_rrule_byweekno(&tm, rrule);
-		have = 1;
+		return 1;
 	}
+}
 
-	/* If no entries, route directly through */
-	return(have ? found : ical_rrule_byweekno(cur, rrule));
+void
+ical_recur_free(struct icalrecur *r)
+{
+
+	free(r);
 }
 
 /*
- * Taking the first instance of a RRULE in "first", enumerate all
- * possible instances following that.
+ * Compiled time zones (RFC 5545, 3.6.5).
+ * A VTIMEZONE is compiled into its transitions: the onsets of each of
+ * its STANDARD and DAYLIGHT observances (DTSTART, RRULE, and RDATE) as
+ * UTC instants, each with the offset in effect from then on, sorted.
+ * Converting between UTC and the zone's wall-clock time is then a
+ * binary search.
+ * Onsets are in the wall-clock time of the offset before them and
+ * aren't expanded past TZ_MAXYEAR: later times keep the last offset.
+ * Every resource using a zone carries its own copy, so compiled zones
+ * are shared by all with the same TZID and content, and the most
+ * recently used are kept in a cache.
  */
-void
-ical_rrule_generate(const struct icaltm *first, 
-	const struct icalrrule *rrule)
-{
-	unsigned long 	 ivl, i, count;
-	struct icaltm	 tm;
-	struct icaltmcmp cmp;
-
-	ivl = 0 == rrule->interval ? 1 : rrule->interval;
-	count = 0 == rrule->count ? 10 : rrule->count;
-	tm = *first;
-
-	/* Create our initial instance. */
-	ical_datetime2cmp(&cmp, first);
-
-	switch (rrule->freq) {
-	case (ICALFREQ_YEARLY):
-		for (i = 0; i < count; i++) {
-			/* Increment over each year. */
-			cmp.year += ivl;
-			if ( ! ical_datetimecmp(&tm, &cmp))
-				continue;
-			/* Continue til no valid occurrences. */
-			if (0 == ical_rrule_bymonth(&tm, rrule))
-				break;
+
+#define	TZ_MAXYEAR	2200
+#define	TZ_MAXTRANS	8192
+#define	TZCACHE_MAX	16
+
+struct	icaltrans {
+	int64_t		 utc; /* instant of transition */
+	int64_t		 local; /* wall-clock time of it, in "prev" */
+	int		 offs; /* offset from then on */
+	int		 prev; /* offset before */
+};
+
+/*
+ * The definitions of a zone's observances as a list of values, used to
+ * match zones exactly; the hash is only to find candidates quickly.
+ */
+struct	tzkey {
+	int64_t		*v;
+	size_t		 sz;
+	size_t		 max;
+	int		 err; /* memory failure */
+};
+
+struct	icaltzone {
+	char		*tzid;
+	struct tzkey	 key; /* of the observances */
+	uint64_t	 hash; /* of the key */
+	size_t		 refs; /* references, including the cache */
+	int		 offs; /* offset before any transition */
+	struct icaltrans *trans; /* sorted by instant */
+	size_t		 transsz;
+};
+
+static struct icaltzone	*tzcache[TZCACHE_MAX]; /* most recent first */
+static size_t		 tzcachesz;
+
+/*
+ * Append the value "v" to the key "k", growing it as needed.
+ * On memory failure, the key is freed and further values ignored.
+ */
+static void
+tz_key(struct tzkey *k, int64_t v)
+{
+	void	*pp;
+
+	if (k->err)
+		return;
+	if (k->sz == k->max) {
+		pp = reallocarray(k->v, k->max == 0 ? 64 : k->max * 2,
+			sizeof(int64_t));
+		if (pp == NULL) {
+			free(k->v);
+			k->v = NULL;
+			k->err = 1;
+			return;
 		}
-		break;
-	default:
-		break;
-		
+		k->v = pp;
+		k->max = k->max == 0 ? 64 : k->max * 2;
 	}
+	k->v[k->sz++] = v;
 }
 
-#if 0
-time_t
-ical_time2utc(const struct icaltime *time)
+/*
+ * The FNV-1a hash of key "k".
+ */
+static uint64_t
+tz_keyhash(const struct tzkey *k)
 {
+	uint64_t	 h = 0xcbf29ce484222325ULL;
+	size_t		 i, j;
+
+	for (j = 0; j < k->sz; j++)
+		for (i = 0; i < 8; i++) {
+			h ^= ((uint64_t)k->v[j] >> (i * 8)) & 0xff;
+			h *= 0x100000001b3ULL;
+		}
+	return h;
+}
+
+/*
+ * Append the definition of observance "o" to key "k".
+ */
+static void
+tz_keyobs(struct tzkey *k, const struct icaltz *o)
+{
+	const struct icalrrule	*rr = &o->rrule;
 	size_t			 i;
-	time_t			 minres, res, diff, mindiff;
-	const struct icaltz	*tz;
 
-	if (NULL == time->tz)
-		return(time->time.tm);
+	tz_key(k, o->type);
+	tz_key(k, o->tzfrom);
+	tz_key(k, o->tzto);
+	tz_key(k, o->dtstart.type);
+	tz_key(k, o->dtstart.tm);
+	tz_key(k, o->rdatesz);
+	for (i = 0; i < o->rdatesz; i++)
+		tz_key(k, o->rdates[i].tm);
+
+	tz_key(k, rr->set);
+	if (!rr->set)
+		return;
+	tz_key(k, rr->freq);
+	tz_key(k, rr->until.type);
+	tz_key(k, rr->until.tm);
+	tz_key(k, rr->count);
+	tz_key(k, rr->interval);
+	tz_key(k, rr->wkst);
+	tz_key(k, rr->bhrsz);
+	for (i = 0; i < rr->bhrsz; i++)
+		tz_key(k, rr->bhr[i]);
+	tz_key(k, rr->bminsz);
+	for (i = 0; i < rr->bminsz; i++)
+		tz_key(k, rr->bmin[i]);
+	tz_key(k, rr->bmndsz);
+	for (i = 0; i < rr->bmndsz; i++)
+		tz_key(k, rr->bmnd[i]);
+	tz_key(k, rr->bmonsz);
+	for (i = 0; i < rr->bmonsz; i++)
+		tz_key(k, rr->bmon[i]);
+	tz_key(k, rr->bsecsz);
+	for (i = 0; i < rr->bsecsz; i++)
+		tz_key(k, rr->bsec[i]);
+	tz_key(k, rr->bspsz);
+	for (i = 0; i < rr->bspsz; i++)
+		tz_key(k, rr->bsp[i]);
+	tz_key(k, rr->bwkdsz);
+	for (i = 0; i < rr->bwkdsz; i++) {
+		tz_key(k, rr->bwkd[i].wk);
+		tz_key(k, rr->bwkd[i].wkday);
+	}
+	tz_key(k, rr->bwknsz);
+	for (i = 0; i < rr->bwknsz; i++)
+		tz_key(k, rr->bwkn[i]);
+	tz_key(k, rr->byrdsz);
+	for (i = 0; i < rr->byrdsz; i++)
+		tz_key(k, rr->byrd[i]);
+}
+
+static int
+tz_transcmp(const void *a, const void *b)
+{
+	const struct icaltrans	*t1 = a, *t2 = b;
+
+	return t1->utc < t2->utc ? -1 : t1->utc > t2->utc;
+}
+
+/*
+ * Append the onsets of observance "o" before wall-clock time "max" to
+ * the transitions of "z", their "prev" being its TZOFFSETFROM.
+ * The array is grown by doubling whenever its size is a power of two.
+ * Returns zero on memory failure.
+ */
+static int
+tz_compile_obs(struct icaltzone *z, const struct icaltz *o, int64_t max)
+{
+	struct icalrecur	*r;
+	struct icaltrans	*t;
+	int64_t			 v;
+	size_t			 sz;
+	void			*pp;
+	int			 rc = 1;
+
+	if (o->dtstart.type == ICAL_DT_UNSET)
+		return 1;
+
+	r = recur_new(&o->dtstart, &o->rrule,
+		o->rdates, o->rdatesz, NULL, 0, INT64_MIN, max);
+	if (r == NULL)
+		return 0;
+
+	/* A UTC UNTIL is compared in the wall-clock time of onsets. */
+
+	if (r->rrule != NULL && r->until != INT64_MAX &&
+	    o->rrule.until.type == ICAL_DT_DATETIMEUTC)
+		r->until += o->tzfrom;
+
+	while (z->transsz < TZ_MAXTRANS && ical_recur_next(r, &v)) {
+		sz = z->transsz;
+		if ((sz & (sz - 1)) == 0) {
+			pp = reallocarray(z->trans,
+				sz == 0 ? 1 : sz * 2,
+				sizeof(struct icaltrans));
+			if (pp == NULL) {
+				rc = 0;
+				break;
+			}
+			z->trans = pp;
+		}
+		t = &z->trans[z->transsz++];
+		t->utc = v - o->tzfrom;
+		t->offs = o->tzto;
+		t->prev = o->tzfrom;
+	}
+
+	ical_recur_free(r);
+	return rc;
+}
+
+/*
+ * Compile the VTIMEZONE "c", whose observances have key "key" (taking
+ * ownership of it) with hash "hash".
+ * Returns NULL on memory failure, freeing the key.
+ */
+static struct icaltzone *
+tz_compile(const struct icalcomp *c, struct tzkey *key, uint64_t hash)
+{
+	struct icaltzone	*z;
+	int64_t			 max;
+	size_t			 i, j;
+	int			 prev;
+
+	if ((z = calloc(1, sizeof(struct icaltzone))) == NULL) {
+		free(key->v);
+		return NULL;
+	}
+	z->key = *key;
+	z->hash = hash;
+	z->refs = 1;
+	if ((z->tzid = strdup(c->tzid == NULL ? "" : c->tzid)) == NULL) {
+		free(z->key.v);
+		free(z);
+		return NULL;
+	}
+
+	max = days_from_civil(TZ_MAXYEAR + 1, 1, 1) * 86400;
+	for (i = 0; i < c->tzsz; i++)
+		if (!tz_compile_obs(z, &c->tzs[i], max)) {
+			ical_tzone_free(z);
+			return NULL;
+		}
+
+	if (z->transsz == 0)
+		return z;
 
 	/*
-	 * Initialise this to something because we're not guaranteed
-	 * that the timezone entry will be sane.
-	 * For example, each one of the RRULE components could have
-	 * expired, leaving us nothing to translate into.
+	 * Before the first onset, the zone is at the offset it's from.
+	 * Onsets that don't change the offset are dropped, and the
+	 * offset before each is made that of the one before it.
 	 */
-	mindiff = LONG_MAX;
-	minres = time->time.tm;
 
-	for (i = 0; i < time->tz->tzsz; i++) {
-		tz = &time->tz->tzs[i];
-		/* Check if we the rule applies to us. */
-		if (time->time.tm < tz->dtstart.tm)
+	qsort(z->trans, z->transsz, sizeof(struct icaltrans), tz_transcmp);
+	z->offs = z->trans[0].prev;
+
+	for (i = j = 0; i < z->transsz; i++) {
+		prev = j == 0 ? z->offs : z->trans[j - 1].offs;
+		if (z->trans[i].offs == prev)
 			continue;
-		/* 
-		 * If there's no RRULE, then we automatically choose
-		 * this subcomponent as the correct one.
-		 */
-		res = time->time.tm + tz->tzto;
-		if (0 == tz->rrule.set)
+		z->trans[j] = z->trans[i];
+		z->trans[j].prev = prev;
+		z->trans[j].local = z->trans[j].utc + prev;
+		j++;
+	}
+	z->transsz = j;
+	return z;
+}
+
+/*
+ * Get the compiled zone of the VTIMEZONE "c", which is shared with all
+ * others of the same TZID and content.
+ * It must be released with ical_tzone_free().
+ * Returns NULL on memory failure.
+ */
+struct icaltzone *
+ical_tzone_new(const struct icalcomp *c)
+{
+	struct icaltzone	*z;
+	struct tzkey		 key;
+	uint64_t		 hash;
+	size_t			 i;
+
+	memset(&key, 0, sizeof(struct tzkey));
+	for (i = 0; i < c->tzsz; i++)
+		tz_keyobs(&key, &c->tzs[i]);
+	if (key.err)
+		return NULL;
+	hash = tz_keyhash(&key);
+
+	/*
+	 * The hash is easily made to collide, and the cache is shared
+	 * between resources (and users, when persistent), so a match
+	 * must have the same observances as well.
+	 */
+
+	for (i = 0; i < tzcachesz; i++)
+		if (tzcache[i]->hash == hash &&
+		    tzcache[i]->key.sz == key.sz &&
+		    (key.sz == 0 || memcmp(tzcache[i]->key.v, key.v,
+		     key.sz * sizeof(int64_t)) == 0) &&
+		    strcmp(tzcache[i]->tzid,
+		     c->tzid == NULL ? "" : c->tzid) == 0)
 			break;
 
-		/* FIXME: check the RDATE. */
+	if (i < tzcachesz) {
+		free(key.v);
+		z = tzcache[i];
+		memmove(&tzcache[1], &tzcache[0],
+			i * sizeof(struct icaltzone *));
+	} else {
+		if ((z = tz_compile(c, &key, hash)) == NULL)
+			return NULL;
+		if (tzcachesz == TZCACHE_MAX)
+			ical_tzone_free(tzcache[--tzcachesz]);
+		memmove(&tzcache[1], &tzcache[0],
+			tzcachesz * sizeof(struct icaltzone *));
+		tzcachesz++;
+	}
 
-		/*
-		 * We compute the instance we'll be checking in the
-		 * RRULE as described in the spec: using the tzto.
-		 */
-		res = time->time.tm + tz->tzto;
+	tzcache[0] = z;
+	z->refs++;
+	return z;
+}
 
-		/* See if we fall after the RRULE end date. */
-		if (0 != tz->rrule.until.tm)
-			if (res >= tz->rrule.until.tm)
-				continue;
+/*
+ * Release a reference to "z" from ical_tzone_new(), freeing it with
+ * the last.
+ * Does nothing if passed NULL.
+ */
+void
+ical_tzone_free(struct icaltzone *z)
+{
 
-		/*
-		 * Compute the nearest date produced by the RRULE to the
-		 * current date.
-		 * Store the minimum difference, which will be the
-		 * correct timezone component to use.
-		 */
-		diff = /*ical_rrule_after(&time->time, &tz->rrule) - 
-			time->time.tm;*/ 0;
-
-		if (diff < mindiff) {
-			minres = res;
-			mindiff = diff;
-		}
+	if (z == NULL || --z->refs > 0)
+		return;
+	free(z->trans);
+	free(z->key.v);
+	free(z->tzid);
+	free(z);
+}
+
+/*
+ * Convert the wall-clock time "v" in VTIMEZONE "tz" into UTC.
+ * A time skipped by a transition (e.g., into daylight time) is taken
+ * in the offset before it, and a time repeated by one (e.g., back into
+ * standard time) as its first occurrence, as in RFC 5545, 3.3.5.
+ * If "tz" is NULL, the time is floating and is returned as-is.
+ */
+int64_t
+ical_tz2utc(const struct icalcomp *tz, int64_t v)
+{
+	const struct icaltzone	*z;
+	const struct icaltrans	*t;
+	size_t			 lo, hi, mid;
+
+	if (tz == NULL || (z = tz->zone) == NULL)
+		return v;
+
+	for (lo = 0, hi = z->transsz; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (z->trans[mid].local <= v)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	return(minres);
+	if (lo == 0)
+		return v - z->offs;
+	t = &z->trans[lo - 1];
+	if (t->offs > t->prev && v < t->utc + t->offs)
+		return v - t->prev;
+	return v - t->offs;
+}
+
+/*
+ * Convert the UTC time "v" into wall-clock time in VTIMEZONE "tz".
+ * If "tz" is NULL, the time is returned as-is.
+ */
+int64_t
+ical_utc2tz(const struct icalcomp *tz, int64_t v)
+{
+	const struct icaltzone	*z;
+	size_t			 lo, hi, mid;
+
+	if (tz == NULL || (z = tz->zone) == NULL)
+		return v;
+
+	for (lo = 0, hi = z->transsz; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (z->trans[mid].utc <= v)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return v + (lo == 0 ? z->offs : z->trans[lo - 1].offs);
+}
+
+/*
+ * Convert "t" into UTC: by its time zone if a local date-time, else
+ * (UTC, floating, or a date) as-is.
+ */
+int64_t
+ical_time2utc(const struct icaltime *t)
+{
+
+	return t->time.type == ICAL_DT_DATETIME ?
+		ical_tz2utc(t->tz, t->time.tm) : t->time.tm;
+}
+
+/*
+ * Format the time "v" into "buf" of "sz" bytes as a value of "type":
+ * a UTC date-time, a floating date-time, or a date.
+ * Times outside of four-digit years are clamped to them.
+ */
+void
+ical_utc2str(char *buf, size_t sz, int64_t v, enum icaldatet type)
+{
+	struct tm	 tm;
+	time_t		 t;
+
+	if (v < TIME_MIN)
+		v = TIME_MIN;
+	else if (v > TIME_MAX)
+		v = TIME_MAX;
+	t = v;
+
+	if (gmtime_r(&t, &tm) == NULL)
+		memset(&tm, 0, sizeof(struct tm));
+
+	/*
+	 * The fields are in range, but the unsigned remainders let the
+	 * compiler see that they fit a small buffer.
+	 */
+
+	if (type == ICAL_DT_DATE)
+		snprintf(buf, sz, "%04u%02u%02u",
+			(unsigned int)(tm.tm_year + 1900) % 10000,
+			(unsigned int)tm.tm_mon % 12 + 1,
+			(unsigned int)tm.tm_mday % 32);
+	else
+		snprintf(buf, sz, "%04u%02u%02uT%02u%02u%02u%s",
+			(unsigned int)(tm.tm_year + 1900) % 10000,
+			(unsigned int)tm.tm_mon % 12 + 1,
+			(unsigned int)tm.tm_mday % 32,
+			(unsigned int)tm.tm_hour % 24,
+			(unsigned int)tm.tm_min % 60,
+			(unsigned int)tm.tm_sec % 61,
+			type == ICAL_DT_DATETIMEUTC ? "Z" : "");
 }
-#endif
@@ -15,9 +15,12 @@
  */
 #include "config.h"
 
-#include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
@@ -25,6 +28,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -34,18 +38,46 @@
 #include "db.h"
 
 /*
- * How many nonces do we allow in the database.
- * Too few nonces and a clever attacker can SYN-flood the nonce
- * database, and too many and it'll just be ponderous.
+ * How many nonces do we allow in the nonce table.
+ * Too few nonces and a clever attacker can flood the table, and too
+ * many and it'll just be large.
+ * This must be a power of two no larger than 65536.
  */
-#define NONCEMAX 1000
+#define NONCESLOTS 16384
 
 /*
- * Length of nonce string w/o NUL terminator.
+ * Length of nonce string w/o NUL terminator: four hexadecimal digits
+ * of slot index followed by ten of tag.
  */
-#define NONCESZ	 16
+#define NONCESZ	 14
+
+/*
+ * Each nonce slot is a word of the random tag, a reference bit used for
+ * clock eviction, and the next acceptable nonce count.
+ * A zero word is an empty slot.
+ */
+#define	NONCE_COUNTBITS	 24
+#define	NONCE_COUNTMAX	 ((UINT64_C(1) << NONCE_COUNTBITS) - 1)
+#define	NONCE_REF	 (UINT64_C(1) << NONCE_COUNTBITS)
+#define	NONCE_TAGSHIFT	 (NONCE_COUNTBITS + 1)
+
+/*
+ * The nonce table, mapped from a file alongside the database.
+ * Slots are only modified with compare-and-swap, so it may be shared
+ * between processes without locking.
+ */
+struct	noncemap {
+	uint64_t	 hand; /* clock hand */
+	uint64_t	 pad[7]; /* keep slots on their own line */
+	uint64_t	 slots[NONCESLOTS];
+};
 
 enum sqlstmt {
+	SQL_CHANGE_INSERT,
+	SQL_CHANGE_ITER,
+	SQL_CHANGE_ITER_META,
+	SQL_CHANGE_PRUNE,
+	SQL_CHANGE_PRUNE_GET,
 	SQL_COL_GET,
 	SQL_COL_GET_ID,
 	SQL_COL_INSERT,
@@ -53,16 +85,21 @@ enum sqlstmt {
 	SQL_COL_REMOVE,
 	SQL_COL_UPDATE,
 	SQL_COL_UPDATE_CTAG,
-	SQL_NONCE_COUNT,
-	SQL_NONCE_GET_COUNT,
-	SQL_NONCE_INSERT,
-	SQL_NONCE_REMOVE,
-	SQL_NONCE_REMOVE_MULTI,
-	SQL_NONCE_UPDATE,
+	SQL_COL_UPDATE_SYNCLIMIT,
+	SQL_HREF_CLEAR,
+	SQL_HREF_INSERT,
+	SQL_HREF_ITER,
+	SQL_OCCUR_COUNT,
+	SQL_OCCUR_INSERT,
+	SQL_OCCUR_ITER,
+	SQL_OCCUR_ITER_FREEBUSY,
+	SQL_OCCUR_REMOVE,
 	SQL_OWNER_GET,
 	SQL_OWNER_INSERT,
 	SQL_PRNCPL_GET,
+	SQL_PRNCPL_GET_GEN,
 	SQL_PRNCPL_GET_ID,
+	SQL_PRNCPL_GET_QUOTA,
 	SQL_PRNCPL_INSERT,
 	SQL_PRNCPL_UPDATE,
 	SQL_PROXY_INSERT,
@@ -72,25 +109,134 @@ enum sqlstmt {
 	SQL_PROXY_UPDATE,
 	SQL_RES_GET,
 	SQL_RES_GET_ETAG,
+	SQL_RES_GET_ID,
 	SQL_RES_INSERT,
 	SQL_RES_ITER,
+	SQL_RES_ITER_FREEBUSY,
+	SQL_RES_ITER_META,
+	SQL_RES_ITER_RANGE,
+	SQL_RES_ITER_UNLISTED,
 	SQL_RES_REMOVE,
 	SQL_RES_REMOVE_ETAG,
 	SQL_RES_UPDATE,
+	SQL_RESTZ_INSERT,
+	SQL_RESTZ_REMOVE,
+	SQL_SECRET_GET,
+	SQL_SECRET_SET,
+	SQL_TZ_GET,
+	SQL_TZ_GET_ID,
+	SQL_TZ_INSERT,
 	SQL__MAX
 };
 
+/*
+ * Resource metadata columns in the order read by db_resource_meta_get()
+ * and bound by db_resource_meta_bind(), and how many there are.
+ */
+#define	RESMETA_COLS \
+	"uid,components,dtstart,dtend,floating,recurring,lastmod,size," \
+	"occurs,occuntil"
+#define	RESMETA_NCOLS	 10
+
+/*
+ * The time zones of a resource taken out of its data, as the offset,
+ * timezone identifier, and row of each, separated by spaces, or NULL
+ * if it has none.
+ * This follows RESMETA_COLS in rows read by db_resource_row().
+ */
+#define	RESTZ_COL \
+	"(SELECT group_concat(offs||' '||timezone||' '||rowid,' ') " \
+		"FROM resourcetz WHERE resourcetz.resource=resource.id)"
+
+/*
+ * Resources in collection ?1 with components ?2 that may overlap the
+ * time range from ?5 to ?4 (?3 being ?4 widened by slop ?6) but whose
+ * occurrences in it aren't listed: those without a start time or
+ * without listed occurrences, by start time, and those with more
+ * instances than listed.
+ */
+#define	RES_ITER_UNLISTED \
+	"SELECT data,etag,url,id,collection," RESMETA_COLS "," \
+		RESTZ_COL " " \
+		"FROM resource WHERE collection=?1 AND occurs=0 " \
+		"AND dtstart IS NULL " \
+		"AND (components=0 OR (components&?2)!=0) " \
+	"UNION ALL " \
+	"SELECT data,etag,url,id,collection," RESMETA_COLS "," \
+		RESTZ_COL " " \
+		"FROM resource WHERE collection=?1 AND occurs=0 " \
+		"AND dtstart<?3 AND (components&?2)!=0 " \
+		"AND dtstart-floating*?6<?4 " \
+		"AND (recurring OR dtend+floating*?6>=?5) " \
+	"UNION ALL " \
+	"SELECT data,etag,url,id,collection," RESMETA_COLS "," \
+		RESTZ_COL " " \
+		"FROM resource WHERE collection=?1 AND occuntil<?4 " \
+		"AND (components&?2)!=0 "
+
+/*
+ * Seconds by which to widen floating times, whose stored values may be
+ * off from UTC by up to the largest zone offset.
+ */
+#define	RESMETA_SLOP	 50400
+
+/*
+ * Most removed resources kept as tombstones in each collection's change
+ * log for synchronisation.
+ */
+#define	CHANGE_TOMBSTONES 1024
+
+/*
+ * Most instances of a recurring component listed as occurrences.
+ * This is a bit more than ten years of daily instances.
+ */
+#define	OCCUR_MAX	 4096
+
+/*
+ * A time-zone component taken from the calendar data of a resource by
+ * db_resource_tzsplit(), to be stored once in the timezone table.
+ */
+struct	restz {
+	const char	*data; /* BEGIN through END, not NUL-terminated */
+	size_t		 sz; /* length of data */
+	size_t		 offs; /* offset in the remaining data */
+	int64_t		 hash; /* FNV-1a of data */
+};
+
 static const char *sqls[SQL__MAX] = {
+	/* SQL_CHANGE_INSERT */
+	"INSERT OR REPLACE INTO changelog (collection,url,seq,deleted) "
+		"SELECT id,?,ctag,? FROM collection WHERE id=?",
+	/* SQL_CHANGE_ITER */
+	"SELECT data,etag,resource.url,resource.id,resource.collection,"
+		RESMETA_COLS "," RESTZ_COL ",changelog.url FROM changelog "
+		"LEFT JOIN resource ON "
+		"resource.collection=changelog.collection AND "
+		"resource.url=changelog.url "
+		"WHERE changelog.collection=? AND seq>? ORDER BY seq",
+	/* SQL_CHANGE_ITER_META */
+	"SELECT NULL,etag,resource.url,resource.id,resource.collection,"
+		RESMETA_COLS ",NULL,changelog.url FROM changelog "
+		"LEFT JOIN resource ON "
+		"resource.collection=changelog.collection AND "
+		"resource.url=changelog.url "
+		"WHERE changelog.collection=? AND seq>? ORDER BY seq",
+	/* SQL_CHANGE_PRUNE */
+	"DELETE FROM changelog WHERE collection=? AND deleted=1 "
+		"AND seq<=?",
+	/* SQL_CHANGE_PRUNE_GET */
+	"SELECT seq FROM changelog WHERE collection=? AND deleted=1 "
+		"ORDER BY seq DESC LIMIT 1 OFFSET ?",
 	/* SQL_COL_GET */
-	"SELECT url,displayname,colour,description,ctag,id "
+	"SELECT url,displayname,colour,description,ctag,id,synclimit "
 		"FROM collection WHERE principal=? AND url=?",
 	/* SQL_COL_GET_ID */
-	"SELECT url,displayname,colour,description,ctag,id "
+	"SELECT url,displayname,colour,description,ctag,id,synclimit "
 		"FROM collection WHERE principal=? AND id=?",
 	/* SQL_COL_INSERT */
 	"INSERT INTO collection (principal, url) VALUES (?,?)",
 	/* SQL_COL_ITER */
-	"SELECT url,displayname,colour,description,ctag,id "
+	"SELECT url,displayname,colour,description,ctag,id,synclimit "
 		"FROM collection WHERE principal=?",
 	/* SQL_COL_REMOVE */
 	"DELETE FROM collection WHERE id=?",
@@ -99,26 +245,53 @@ static const char *sqls[SQL__MAX] = {
 		"WHERE id=?",
 	/* SQL_COL_UPDATE_CTAG */
 	"UPDATE collection SET ctag=ctag+1 WHERE id=?",
-	/* SQL_NONCE_COUNT */
-	"SELECT count(*) FROM nonce",
-	/* SQL_NONCE_GET_COUNT */
-	"SELECT count FROM nonce WHERE nonce=?",
-	/* SQL_NONCE_INSERT */
-	"INSERT INTO nonce (nonce) VALUES (?)",
-	/* SQL_NONCE_REMOVE */
-	"DELETE FROM nonce WHERE nonce=?",
-	/* SQL_NONCE_REMOVE_MULTI */
-	"DELETE FROM nonce WHERE id IN (SELECT id FROM nonce LIMIT 20)",
-	/* SQL_NONCE_UDPATE */
-	"UPDATE nonce SET count=? WHERE nonce=?",
+	/* SQL_COL_UPDATE_SYNCLIMIT */
+	"UPDATE collection SET synclimit=? WHERE id=?",
+	/* SQL_HREF_CLEAR */
+	"DELETE FROM temp.href",
+	/* SQL_HREF_INSERT */
+	"INSERT INTO temp.href (ord,collection,url) VALUES (?,?,?)",
+	/* SQL_HREF_ITER */
+	"SELECT data,etag,resource.url,resource.id,resource.collection,"
+		RESMETA_COLS "," RESTZ_COL ",href.ord FROM temp.href "
+		"LEFT JOIN resource ON "
+		"resource.collection=href.collection AND "
+		"resource.url=href.url ORDER BY href.ord",
+	/* SQL_OCCUR_COUNT */
+	"SELECT COUNT(*) FROM occurrence WHERE collection=?",
+	/* SQL_OCCUR_INSERT */
+	"INSERT INTO occurrence (resource,collection,dtstart,dtend,"
+		"recurid,fbtype) VALUES (?,?,?,?,?,?)",
+	/* SQL_OCCUR_ITER */
+	"SELECT occurrence.dtstart,occurrence.dtend,occurrence.fbtype,"
+		"resource.id,resource.components,resource.occuntil "
+		"FROM occurrence INNER JOIN resource "
+		"ON resource.id=occurrence.resource "
+		"WHERE occurrence.collection=?",
+	/* SQL_OCCUR_ITER_FREEBUSY */
+	"SELECT occurrence.dtstart,occurrence.dtend,occurrence.fbtype "
+		"FROM occurrence INNER JOIN resource "
+		"ON resource.id=occurrence.resource "
+		"WHERE occurrence.collection=?1 "
+		"AND occurrence.dtend>?2 AND occurrence.dtstart<?3 "
+		"AND occurrence.fbtype!=?4 "
+		"AND (occuntil IS NULL OR occuntil>=?3)",
+	/* SQL_OCCUR_REMOVE */
+	"DELETE FROM occurrence WHERE resource=?",
 	/* SQL_OWNER_GET */
 	"SELECT owneruid FROM database",
 	/* SQL_OWNER_INSERT */
 	"INSERT INTO database (owneruid) VALUES (?)",
 	/* SQL_PRNCPL_GET */
-	"SELECT hash,id,email FROM principal WHERE name=?",
+	"SELECT hash,id,email,generation,quota_used FROM principal "
+		"WHERE name=?",
+	/* SQL_PRNCPL_GET_GEN */
+	"SELECT generation FROM principal WHERE name=?",
 	/* SQL_PRNCPL_GET_ID */
 	"SELECT id FROM principal WHERE email=?",
+	/* SQL_PRNCPL_GET_QUOTA */
+	"SELECT quota_used FROM principal WHERE id="
+		"(SELECT principal FROM collection WHERE id=?)",
 	/* SQL_PRNCPL_INSERT */
 	"INSERT INTO principal (name,hash,email) VALUES (?,?,?)",
 	/* SQL_PRNCPL_UPDATE */
@@ -138,26 +311,88 @@ static const char *sqls[SQL__MAX] = {
 	/* SQL_PROXY_UPDATE */
 	"UPDATE proxy SET bits=? WHERE principal=? AND proxy=?",
 	/* SQL_RES_GET */
-	"SELECT data,etag,url,id,collection FROM resource "
-		"WHERE collection=? AND url=?",
+	"SELECT data,etag,url,id,collection," RESMETA_COLS ","
+		RESTZ_COL " "
+		"FROM resource WHERE collection=? AND url=?",
 	/* SQL_RES_GET_ETAG */
 	"SELECT id FROM resource WHERE url=? AND collection=? "
 		"AND etag=?",
+	/* SQL_RES_GET_ID */
+	"SELECT data,etag,url,id,collection," RESMETA_COLS ","
+		RESTZ_COL " "
+		"FROM resource WHERE id=?",
 	/* SQL_RES_INSERT */
-	"INSERT INTO resource (data,url,collection,etag) "
-		"VALUES (?,?,?,?)",
+	"INSERT INTO resource (data,url,collection,etag," RESMETA_COLS ") "
+		"VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?)",
 	/* SQL_RES_ITER */
-	"SELECT data,etag,url,id,collection FROM resource "
-		"WHERE collection=?",
+	"SELECT data,etag,url,id,collection," RESMETA_COLS ","
+		RESTZ_COL " "
+		"FROM resource WHERE collection=?",
+	/* SQL_RES_ITER_FREEBUSY */
+	"SELECT data,etag,url,id,collection," RESMETA_COLS ","
+		RESTZ_COL " "
+		"FROM resource WHERE collection=?1 AND occurs=0 "
+		"AND (components=0 OR (components&?4)!=0) "
+		"AND (dtstart IS NULL OR (dtstart<?5 AND "
+		"dtstart-floating*?6<?3 AND "
+		"(recurring OR dtend+floating*?6>?2))) "
+	"UNION ALL "
+	"SELECT data,etag,url,id,collection," RESMETA_COLS ","
+		RESTZ_COL " "
+		"FROM resource WHERE collection=?1 AND occuntil<?3 "
+		"AND (components&?4)!=0",
+	/* SQL_RES_ITER_META */
+	"SELECT NULL,etag,url,id,collection," RESMETA_COLS ",NULL "
+		"FROM resource WHERE collection=?",
+	/* SQL_RES_ITER_RANGE */
+	RES_ITER_UNLISTED
+	"UNION ALL "
+	"SELECT data,etag,url,id,collection," RESMETA_COLS ","
+		RESTZ_COL " "
+		"FROM resource WHERE id IN (SELECT resource "
+		"FROM occurrence WHERE collection=?1 "
+		"AND dtend>=?7 AND dtstart<=?3) "
+		"AND (components&?2)!=0 "
+		"AND (occuntil IS NULL OR occuntil>=?4)",
+	/* SQL_RES_ITER_UNLISTED */
+	RES_ITER_UNLISTED,
 	/* SQL_RES_REMOVE */
 	"DELETE FROM resource WHERE url=? AND collection=?",
 	/* SQL_RES_REMOVE_ETAG */
 	"DELETE FROM resource WHERE url=? AND collection=? "
 		"AND etag=?",
 	/* SQL_RES_UPDATE */
-	"UPDATE resource SET data=?,etag=? WHERE id=?",
+	"UPDATE resource SET data=?,etag=?,uid=?,components=?,"
+		"dtstart=?,dtend=?,floating=?,recurring=?,lastmod=?,"
+		"size=?,occurs=?,occuntil=? WHERE id=?",
+	/* SQL_RESTZ_INSERT */
+	"INSERT INTO resourcetz (resource,timezone,offs) VALUES (?,?,?)",
+	/* SQL_RESTZ_REMOVE */
+	"DELETE FROM resourcetz WHERE resource=?",
+	/* SQL_SECRET_GET */
+	"SELECT secret FROM database",
+	/* SQL_SECRET_SET */
+	"UPDATE database SET secret=lower(hex(randomblob(32))) "
+		"WHERE secret IS NULL",
+	/* SQL_TZ_GET */
+	"SELECT id FROM timezone WHERE hash=? AND data=?",
+	/* SQL_TZ_GET_ID */
+	"SELECT data FROM timezone WHERE id=?",
+	/* SQL_TZ_INSERT */
+	"INSERT INTO timezone (hash,data) VALUES (?,?)",
 };
 
+/*
+ * Per-connection setup.
+ * The "href" table holds the resources asked for by a multiget, so
+ * they may be looked up in one query; it's never on disk.
+ */
+static const char *db_sql_conn =
+	"PRAGMA foreign_keys = ON;"
+	"PRAGMA temp_store = MEMORY;"
+	"CREATE TEMP TABLE IF NOT EXISTS href ("
+	"ord INTEGER PRIMARY KEY, collection INTEGER, url TEXT);";
+
 /* Wrappers for debugging functions. */
 
 static void	 	 kdbg(const char *, ...)
@@ -174,6 +409,132 @@ static void	 	 kerrx(const char *, ...)
 static sqlite3		*db;
 static char		 dbname[PATH_MAX];
 
+/* The nonce table (or NULL) and its location. */
+
+static struct noncemap	*noncemap;
+static char		 noncename[PATH_MAX];
+
+/*
+ * Cache of prepared statements, one per "enum sqlstmt", kept for the
+ * lifetime of the database connection.
+ * A statement is marked as in use while it's handed out; if it's asked
+ * for again in the meantime, a fresh (uncached) one is prepared.
+ */
+
+static sqlite3_stmt	*stmts[SQL__MAX];
+static int		 stmtsused[SQL__MAX];
+static struct dbstats	 stats;
+
+/* Milliseconds sqlite3 waits on a locked database. */
+
+static int		 busytimeout = 1000;
+
+/* Per-principal byte limit or zero for none. */
+
+static uint64_t		 quota;
+
+/* Seconds past storage to which recurrences are listed. */
+
+static int64_t		 horizon = 365 * 86400;
+
+/*
+ * Principals (with collections and proxies) cached between requests.
+ * Each is validated against the principal's generation, which the
+ * database bumps whenever the principal or anything it carries
+ * changes (see kcaldav.sql).
+ * When full, the least recently used entry is evicted.
+ */
+
+#define	PCACHE_MAX	 16
+
+struct	pcache {
+	struct prncpl	*p; /* cached principal or NULL */
+	int64_t		 gen; /* generation when cached */
+	uint64_t	 used; /* last use (for eviction) */
+};
+
+static struct pcache	 pcache[PCACHE_MAX];
+static uint64_t		 pcacheuse;
+
+/*
+ * Listed occurrences of collections cached between requests, so that
+ * time ranges are answered without reading them from the database.
+ * Each is sorted by start into an implicit interval tree (see
+ * occache_index()) and validated against the collection's ctag.
+ * When the cache would pass "occachemax" bytes, the least recently
+ * used are evicted; if zero, nothing is cached.
+ */
+
+#define	OCCACHE_MAX	 64
+
+struct	occent {
+	int64_t		 start; /* UTC epoch */
+	int64_t		 end; /* UTC epoch */
+	int64_t		 max; /* latest end in subtree */
+	int64_t		 occuntil; /* resource's or INT64_MAX */
+	int64_t		 resource;
+	unsigned int	 comps; /* resource's ICAL_xxx */
+	int		 fbtype; /* CALFB_xxx */
+};
+
+struct	occache {
+	int		 set; /* whether in use */
+	int64_t		 colid;
+	int64_t		 ctag; /* ctag when cached */
+	struct occent	*ents; /* sorted by start */
+	size_t		 entsz;
+	int		 level; /* of the tree's root */
+	uint64_t	 used; /* last use (for eviction) */
+};
+
+/* Resources found by occache_range(). */
+
+struct	occids {
+	int64_t		*ids;
+	size_t		 sz;
+	size_t		 max;
+	unsigned int	 comps; /* range's components */
+	int64_t		 end; /* range's end */
+};
+
+/* Busy time collected by occache_freebusy(). */
+
+struct	occbusy {
+	const struct caltimerange *range;
+	struct calbusy	**busy;
+	size_t		 *busysz;
+};
+
+static struct occache	 occache[OCCACHE_MAX];
+static uint64_t		 occacheuse;
+static size_t		 occachesz; /* bytes cached */
+static size_t		 occachemax; /* byte limit or zero */
+
+static void		 occache_drop(struct occache *);
+
+/*
+ * Time-zone components cached by identifier for putting back into
+ * resources read from the database.
+ * Time zones are never changed and their identifiers are not reused
+ * (see kcaldav.sql) except after a rolled-back insertion, so this is
+ * cleared with each rollback.
+ * When full, the least recently used entry is evicted.
+ */
+
+#define	TZCACHE_MAX	 32
+
+struct	tzcache {
+	int64_t		 id;
+	char		*data; /* NUL-terminated or NULL if unused */
+	size_t		 sz; /* length of data */
+	uint64_t	 used; /* last use (for eviction) */
+};
+
+static struct tzcache	 tzcache[TZCACHE_MAX];
+static uint64_t		 tzcacheuse;
+
+static void		 tzcache_clear(void);
+
 /* Identifier and private data to provide to db_msg functions. */
 
 static const char	*msg_ident;
@@ -231,6 +592,40 @@ db_set_msg_info(db_msg msg)
 	msg_info = msg;
 }
 
+void
+db_set_quota(uint64_t bytes)
+{
+
+	quota = bytes;
+}
+
+void
+db_set_horizon(int64_t secs)
+{
+
+	horizon = secs < 0 ? 0 : secs;
+}
+
+void
+db_set_range_cache(size_t bytes)
+{
+	size_t	 i;
+
+	occachemax = bytes;
+	for (i = 0; i < OCCACHE_MAX; i++)
+		if (occachesz > occachemax)
+			occache_drop(&occache[i]);
+}
+
+void
+db_set_busy_timeout(int ms)
+{
+
+	busytimeout = ms;
+	if (db != NULL)
+		sqlite3_busy_timeout(db, busytimeout);
+}
+
 /*
  * Log information.
  * This means an operation that changed the database.
@@ -307,6 +702,27 @@ kerrx(const char *fmt, ...)
 static void
 db_close(void)
 {
+	size_t	 i;
+
+	for (i = 0; i < SQL__MAX; i++) {
+		sqlite3_finalize(stmts[i]);
+		stmts[i] = NULL;
+		stmtsused[i] = 0;
+	}
+
+	for (i = 0; i < PCACHE_MAX; i++) {
+		db_prncpl_free(pcache[i].p);
+		pcache[i].p = NULL;
+	}
+
+	for (i = 0; i < OCCACHE_MAX; i++)
+		occache_drop(&occache[i]);
+
+	tzcache_clear();
+
+	if (noncemap != NULL)
+		munmap(noncemap, sizeof(struct noncemap));
+	noncemap = NULL;
 
 	if (sqlite3_close(db) != SQLITE_OK)
 		kerrx("%s", sqlite3_errmsg(db));
@@ -319,14 +735,28 @@ db_close(void)
  * Finalise and nullify a statement.
  * Use this instead of sqlite3_finalize() so we catch any re-uses of the
  * statement object.
+ * If the statement is from our cache, it's reset and its bindings
+ * cleared instead of being destroyed.
  */
 static void
 db_finalise(sqlite3_stmt **stmt)
 {
+	size_t	 i;
 
 	if (*stmt == NULL)
 		return;
-	sqlite3_finalize(*stmt);
+
+	for (i = 0; i < SQL__MAX; i++)
+		if (stmts[i] == *stmt)
+			break;
+
+	if (i < SQL__MAX) {
+		sqlite3_reset(*stmt);
+		sqlite3_clear_bindings(*stmt);
+		stmtsused[i] = 0;
+	} else
+		sqlite3_finalize(*stmt);
+
 	*stmt = NULL;
 }
 
@@ -385,6 +815,7 @@ again:
 	assert(stmt != NULL);
 	assert(db != NULL);
 
+	stats.steps++;
 	rc = sqlite3_step(stmt);
 	switch (rc) {
 	case SQLITE_BUSY:
@@ -456,6 +887,21 @@ db_bindint(sqlite3_stmt *stmt, size_t pos, int64_t v)
 	return 0;
 }
 
+/*
+ * Bind a NULL to the statement.
+ * Return zero on failure, non-zero on success.
+ */
+static int
+db_bindnull(sqlite3_stmt *stmt, size_t pos)
+{
+
+	assert(pos > 0);
+	if (sqlite3_bind_null(stmt, pos) == SQLITE_OK)
+		return 1;
+	kerrx("sqlite3_bind_null: %s", sqlite3_errmsg(db));
+	return 0;
+}
+
 /*
  * Bind a NUL-terminated string "name" to the statement.
  * Return zero on failure, non-zero on success.
@@ -472,6 +918,23 @@ db_bindtext(sqlite3_stmt *stmt, size_t pos, const char *name)
 	return 0;
 }
 
+/*
+ * Bind the string "text" of "sz" bytes to the statement.
+ * Return zero on failure, non-zero on success.
+ */
+static int
+db_bindtextsz(sqlite3_stmt *stmt, size_t pos, const char *text,
+	size_t sz)
+{
+
+	assert(pos > 0);
+	if (sqlite3_bind_text(stmt,
+	    pos, text, sz, SQLITE_STATIC) == SQLITE_OK)
+		return 1;
+	kerrx("sqlite3_bind_text: %s", sqlite3_errmsg(db));
+	return 0;
+}
+
 /*
  * Execute a non-parameterised SQL statement.
  * Returns the sqlite3 error code, reporting the error if it doesn't
@@ -521,6 +984,7 @@ static int
 db_trans_rollback(void)
 {
 
+	tzcache_clear();
 	return(SQLITE_OK == db_exec("ROLLBACK TRANSACTION"));
 }
 
@@ -532,20 +996,28 @@ db_trans_commit(void)
 }
 
 /*
- * Prepare an SQL statement.
+ * Prepare an SQL statement, or re-use it from the statement cache if
+ * it's already been prepared on this connection.
+ * The statement must be released with db_finalise().
  * If errors occur, any fledgling statement is destroyed, so this always
  * returns non-NULL on success.
  */
 static sqlite3_stmt *
-db_prepare(const char *sql)
+db_prepare(enum sqlstmt type)
 {
 	sqlite3_stmt	*stmt;
 	size_t		 attempt = 0;
 	int		 rc;
-again:
+
 	assert(NULL != db);
 
-	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	if (stmts[type] != NULL && !stmtsused[type]) {
+		stmtsused[type] = 1;
+		stats.reuses++;
+		return stmts[type];
+	}
+again:
+	rc = sqlite3_prepare_v2(db, sqls[type], -1, &stmt, NULL);
 	switch (rc) {
 	case SQLITE_BUSY:
 		db_sleep(attempt++);
@@ -561,6 +1033,11 @@ again:
 		db_sleep(attempt++);
 		goto again;
 	case SQLITE_OK:
+		stats.prepares++;
+		if (stmts[type] == NULL) {
+			stmts[type] = stmt;
+			stmtsused[type] = 1;
+		}
 		return stmt;
 	default:
 		break;
@@ -575,22 +1052,32 @@ again:
  * Initialise the database, creating it if "create" is specified.
  * Note that "dir" refers to the director of creation, not the database
  * file itself.
+ * This may be called multiple times (e.g., once per FastCGI request):
+ * if the database is already open, this does nothing.
  * Returns zero on failure, non-zero on success.
  */
 int
 db_init(const char *dir, int create)
 {
-	size_t	 attempt = 0, sz;
-	int	 rc;
+	size_t		 attempt = 0, sz;
+	int		 rc;
+	static int	 registered;
+
+	if (db != NULL)
+		return 1;
 
 	/* 
 	 * Register exit hook for the destruction of the database. 
 	 * This allows us to ignore closing the database properly.
+	 * Only do so once, as we may be re-opened after failure.
 	 */
 
-	if (atexit(db_close) == -1) {
-		kerr("atexit");
-		return 0;
+	if (!registered) {
+		if (atexit(db_close) == -1) {
+			kerr("atexit");
+			return 0;
+		}
+		registered = 1;
 	}
 
 	/* Format the name of the database. */
@@ -602,6 +1089,13 @@ db_init(const char *dir, int create)
 	} else if ('/' == dbname[sz - 1])
 		dbname[sz - 1] = '\0';
 
+	strlcpy(noncename, dbname, sizeof(noncename));
+	sz = strlcat(noncename, "/kcaldav.nonce", sizeof(noncename));
+	if (sz >= sizeof(noncename)) {
+		kerrx("%s: too long", dir);
+		return 0;
+	}
+
 	sz = strlcat(dbname, "/kcaldav.db", sizeof(dbname));
 	if (sz >= sizeof(dbname)) {
 		kerrx("%s: too long", dir);
@@ -628,17 +1122,56 @@ again:
 		db_sleep(attempt++);
 		goto again;
 	case SQLITE_OK:
-		sqlite3_busy_timeout(db, 1000);
-		return SQLITE_OK == 
-		       db_exec("PRAGMA foreign_keys = ON;");
+		sqlite3_busy_timeout(db, busytimeout);
+		if (SQLITE_OK == db_exec(db_sql_conn))
+			return 1;
+		goto err;
 	default:
 		break;
 	} 
 
 	kerrx("sqlite3_open_v2: %s", sqlite3_errmsg(db));
+err:
+	/* 
+	 * Don't keep a half-open handle around: we'd otherwise think
+	 * that we're already initialised on the next invocation.
+	 */
+	sqlite3_close(db);
+	db = NULL;
 	return 0;
 }
 
+/*
+ * Prepare all statements ahead of time, e.g., when starting a
+ * long-lived worker, so that requests don't pay for compiling them.
+ * Return zero on failure, non-zero on success.
+ */
+int
+db_prepare_all(void)
+{
+	sqlite3_stmt	*stmt;
+	size_t		 i;
+
+	for (i = 0; i < SQL__MAX; i++) {
+		if ((stmt = db_prepare(i)) == NULL)
+			return 0;
+		db_finalise(&stmt);
+	}
+
+	return 1;
+}
+
+/*
+ * Fill in the statement statistics accumulated since the process
+ * started.
+ */
+void
+db_stats(struct dbstats *p)
+{
+
+	*p = stats;
+}
+
 /*
  * Update the tag ("ctag") for the collection.
  * Return zero on failure, non-zero on success.
@@ -648,7 +1181,7 @@ db_collection_update_ctag(int64_t id)
 {
 	sqlite3_stmt	*stmt;
 
-	if ((stmt = db_prepare(sqls[SQL_COL_UPDATE_CTAG])) == NULL)
+	if ((stmt = db_prepare(SQL_COL_UPDATE_CTAG)) == NULL)
 		goto err;
 	else if (!db_bindint(stmt, 1, id))
 		goto err;
@@ -664,23 +1197,55 @@ err:
 }
 
 /*
- * Delete the nonce row.
+ * Prune all but the newest CHANGE_TOMBSTONES tombstones from the change
+ * log of collection "id", invalidating sync-tokens from before those
+ * pruned.
+ * This should be run within the transaction making the change.
  * Return zero on failure, non-zero on success.
  */
-int
-db_nonce_delete(const char *nonce, const struct prncpl *p)
+static int
+db_collection_prune(int64_t id)
 {
 	sqlite3_stmt	*stmt;
+	int64_t		 seq;
+	int		 rc;
+
+	if ((stmt = db_prepare(SQL_CHANGE_PRUNE_GET)) == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, id))
+		goto err;
+	else if (!db_bindint(stmt, 2, CHANGE_TOMBSTONES))
+		goto err;
+	else if ((rc = db_step(stmt)) == SQLITE_DONE) {
+		db_finalise(&stmt);
+		return 1;
+	} else if (rc != SQLITE_ROW)
+		goto err;
+	seq = sqlite3_column_int64(stmt, 0);
+	db_finalise(&stmt);
+
+	if ((stmt = db_prepare(SQL_CHANGE_PRUNE)) == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, id))
+		goto err;
+	else if (!db_bindint(stmt, 2, seq))
+		goto err;
+	else if (db_step(stmt) != SQLITE_DONE)
+		goto err;
+	db_finalise(&stmt);
 
-	if ((stmt = db_prepare(sqls[SQL_NONCE_REMOVE])) == NULL)
+	if ((stmt = db_prepare(SQL_COL_UPDATE_SYNCLIMIT)) == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, seq))
 		goto err;
-	else if (!db_bindtext(stmt, 1, nonce))
+	else if (!db_bindint(stmt, 2, id))
 		goto err;
 	else if (db_step(stmt) != SQLITE_DONE)
 		goto err;
 
+	kdbg("pruned change log: collection-%" PRId64 
+		", ctag %" PRId64, id, seq);
 	db_finalise(&stmt);
-	kdbg("deleted nonce: %s", nonce);
 	return 1;
 err:
 	db_finalise(&stmt);
@@ -688,158 +1253,263 @@ err:
 }
 
 /*
- * See if the nonce count is valid.
- * Return the corresponding error code.
+ * Update the collection's ctag and record that the resource "url" has
+ * been created, modified, or "deleted" as of the new ctag.
+ * Removals may prune the oldest tombstones.
+ * This should be run within the transaction making the change.
+ * Return zero on failure, non-zero on success.
  */
-enum nonceerr
-db_nonce_validate(const char *nonce, int64_t count)
+static int
+db_collection_change(int64_t id, const char *url, int deleted)
 {
 	sqlite3_stmt	*stmt;
-	int64_t		 cmp;
 
-	if ((stmt = db_prepare(sqls[SQL_NONCE_GET_COUNT])) == NULL)
+	if (!db_collection_update_ctag(id))
+		return 0;
+
+	if ((stmt = db_prepare(SQL_CHANGE_INSERT)) == NULL)
+		goto err;
+	else if (!db_bindtext(stmt, 1, url))
 		goto err;
-	else if (!db_bindtext(stmt, 1, nonce))
+	else if (!db_bindint(stmt, 2, deleted))
 		goto err;
+	else if (!db_bindint(stmt, 3, id))
+		goto err;
+	else if (db_step(stmt) != SQLITE_DONE)
+		goto err;
+	db_finalise(&stmt);
 
-	switch (db_step(stmt)) {
-	case SQLITE_ROW:
-		cmp = sqlite3_column_int64(stmt, 0);
-		db_finalise(&stmt);
-		if (count < cmp) {
-			kerrx("nonce replay attack: %s, "
-				"%" PRId64 " < %" PRId64, 
-				nonce, count, cmp);
-			return NONCE_REPLAY;
-		}
-		return NONCE_OK;
-	case SQLITE_DONE:
-		db_finalise(&stmt);
-		return NONCE_NOTFOUND;
-	default:
-		break;
-	}
+	return !deleted || db_collection_prune(id);
 err:
 	db_finalise(&stmt);
-	return NONCE_ERR;
+	return 0;
 }
 
 /*
- * Validate then update nonce to be one greater than the given count.
- * Returns the corresponding error code.
+ * Map the nonce table, creating it if necessary.
+ * This is shared between all processes using the database and
+ * persists between them.
+ * Return zero on failure, non-zero on success.
  */
-enum nonceerr
-db_nonce_update(const char *nonce, int64_t count)
+static int
+db_nonce_map(void)
 {
-	enum nonceerr	 er;
-	sqlite3_stmt	*stmt;
+	int		 fd;
+	struct stat	 st;
+	void		*p;
 
-	if (!db_trans_open())
-		return NONCE_ERR;
+	if (noncemap != NULL)
+		return 1;
 
-	if ((er = db_nonce_validate(nonce, count)) != NONCE_OK) {
-		db_trans_rollback();
-		return er;
+	if ((fd = open(noncename, O_RDWR | O_CREAT, 0600)) == -1) {
+		kerr("%s", noncename);
+		return 0;
+	} else if (fstat(fd, &st) == -1) {
+		kerr("%s", noncename);
+		goto err;
 	}
 
-	/* FIXME: check for (unlikely) integer overflow. */
+	/*
+	 * New files (or those of the wrong size, such as from an older
+	 * layout) are zeroed: truncating first discards old contents,
+	 * which would otherwise be read as live slots.
+	 */
 
-	if ((stmt = db_prepare(sqls[SQL_NONCE_UPDATE])) == NULL)
-		goto err;
-	else if (!db_bindint(stmt, 1, count + 1))
+	if (st.st_size != sizeof(struct noncemap) &&
+	    (ftruncate(fd, 0) == -1 ||
+	     ftruncate(fd, sizeof(struct noncemap)) == -1)) {
+		kerr("%s", noncename);
 		goto err;
-	else if (!db_bindtext(stmt, 2, nonce))
-		goto err;
-	else if (db_step(stmt) != SQLITE_DONE)
+	}
+
+	p = mmap(NULL, sizeof(struct noncemap),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		kerr("%s", noncename);
 		goto err;
+	}
 
-	db_finalise(&stmt);
-	db_trans_commit();
-	kdbg("nonce updated: %s, count "
-		"%" PRId64, nonce, count + 1);
-	return NONCE_OK;
+	close(fd);
+	noncemap = p;
+	return 1;
 err:
-	db_finalise(&stmt);
-	db_trans_rollback();
-	return NONCE_ERR;
+	close(fd);
+	return 0;
 }
 
 /*
- * Create a new nonce and on success set its value in "np".
- * This is in static storage and is overwritten with every call.
+ * Parse the slot index and tag from a nonce string.
+ * Return zero if the nonce is malformed, non-zero on success.
+ */
+static int
+db_nonce_parse(const char *nonce, size_t *idx, uint64_t *tag)
+{
+	size_t		 i;
+	uint64_t	 v = 0;
+
+	if (strlen(nonce) != NONCESZ)
+		return 0;
+
+	for (i = 0; i < NONCESZ; i++) {
+		if (i == 4) {
+			*idx = v;
+			v = 0;
+		}
+		v <<= 4;
+		if (nonce[i] >= '0' && nonce[i] <= '9')
+			v |= nonce[i] - '0';
+		else if (nonce[i] >= 'a' && nonce[i] <= 'f')
+			v |= nonce[i] - 'a' + 10;
+		else
+			return 0;
+	}
+
+	*tag = v;
+	return *idx < NONCESLOTS && *tag != 0 &&
+		*tag <= (UINT64_MAX >> NONCE_TAGSHIFT);
+}
+
+/*
+ * Delete the nonce.
  * Return zero on failure, non-zero on success.
  */
 int
-db_nonce_new(char **np)
+db_nonce_delete(const char *nonce, const struct prncpl *p)
 {
-	static char	 nonce[NONCESZ + 1];
-	int64_t		 count;
-	sqlite3_stmt	*stmt;
-	int		 rc;
-	size_t		 i;
+	size_t		 idx;
+	uint64_t	 tag, v;
 
-	if (!db_trans_open())
+	if (!db_nonce_map())
 		return 0;
+	if (!db_nonce_parse(nonce, &idx, &tag))
+		return 1;
 
-	/* 
-	 * If we have more than NONCEMAX nonces in the database, then
-	 * cull the first 20 to make room for more.
-	 */
+	v = __atomic_load_n(&noncemap->slots[idx], __ATOMIC_ACQUIRE);
+	while ((v >> NONCE_TAGSHIFT) == tag)
+		if (__atomic_compare_exchange_n(&noncemap->slots[idx],
+		    &v, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			kdbg("deleted nonce: %s", nonce);
+			break;
+		}
 
-	if ((stmt = db_prepare(sqls[SQL_NONCE_COUNT])) == NULL)
-		goto err;
-	else if ((rc = db_step(stmt)) == SQLITE_ROW)
-		count = sqlite3_column_int64(stmt, 0);
-	else if (rc == SQLITE_DONE)
-		count = 0;
-	else
-		goto err;
+	return 1;
+}
 
-	db_finalise(&stmt);
+/*
+ * See if the nonce count is valid.
+ * Return the corresponding error code.
+ */
+enum nonceerr
+db_nonce_validate(const char *nonce, int64_t count)
+{
+	size_t		 idx;
+	uint64_t	 tag, v;
+	int64_t		 cmp;
 
-	if (count >= NONCEMAX) {
-		kdbg("culling from nonce database");
-		stmt = db_prepare(sqls[SQL_NONCE_REMOVE_MULTI]);
-		if (stmt == NULL)
-			goto err;
-		else if (db_step(stmt) != SQLITE_DONE)
-			goto err;
-		db_finalise(&stmt);
+	if (!db_nonce_map())
+		return NONCE_ERR;
+	if (!db_nonce_parse(nonce, &idx, &tag))
+		return NONCE_NOTFOUND;
+
+	v = __atomic_load_n(&noncemap->slots[idx], __ATOMIC_ACQUIRE);
+	if ((v >> NONCE_TAGSHIFT) != tag)
+		return NONCE_NOTFOUND;
+
+	cmp = v & NONCE_COUNTMAX;
+	if (count < cmp) {
+		kerrx("nonce replay attack: %s, "
+			"%" PRId64 " < %" PRId64, 
+			nonce, count, cmp);
+		return NONCE_REPLAY;
 	}
+	return NONCE_OK;
+}
 
-	/* 
-	 * Generate a random nonce and insert it into the database.
-	 * Let the uniqueness constraint guarantee that the nonce is
-	 * actually unique within the system.
-	 */
+/*
+ * Validate then update nonce to be one greater than the given count.
+ * If the count would overflow, the nonce is treated as not found so
+ * that the client is issued another.
+ * Returns the corresponding error code.
+ */
+enum nonceerr
+db_nonce_update(const char *nonce, int64_t count)
+{
+	size_t		 idx;
+	uint64_t	 tag, v, nv;
+	int64_t		 cmp;
 
-	if ((stmt = db_prepare(sqls[SQL_NONCE_INSERT])) == NULL)
-		goto err;
+	if (!db_nonce_map())
+		return NONCE_ERR;
+	if (!db_nonce_parse(nonce, &idx, &tag))
+		return NONCE_NOTFOUND;
+	if (count < 0 || count >= (int64_t)NONCE_COUNTMAX)
+		return NONCE_NOTFOUND;
+
+	nv = tag << NONCE_TAGSHIFT | NONCE_REF | (count + 1);
+	v = __atomic_load_n(&noncemap->slots[idx], __ATOMIC_ACQUIRE);
+
+	do {
+		if ((v >> NONCE_TAGSHIFT) != tag)
+			return NONCE_NOTFOUND;
+		cmp = v & NONCE_COUNTMAX;
+		if (count < cmp) {
+			kerrx("nonce replay attack: %s, "
+				"%" PRId64 " < %" PRId64, 
+				nonce, count, cmp);
+			return NONCE_REPLAY;
+		}
+	} while (!__atomic_compare_exchange_n(&noncemap->slots[idx],
+	    &v, nv, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	kdbg("nonce updated: %s, count "
+		"%" PRId64, nonce, count + 1);
+	return NONCE_OK;
+}
+
+/*
+ * Create a new nonce and on success set its value in "np".
+ * The slot is chosen by the clock algorithm: recently-used slots have
+ * their reference bit cleared and are passed over.
+ * This is in static storage and is overwritten with every call.
+ * Return zero on failure, non-zero on success.
+ */
+int
+db_nonce_new(char **np)
+{
+	static char	 nonce[NONCESZ + 1];
+	uint64_t	 hand, tag, v, *sp;
+	size_t		 idx;
+
+	if (!db_nonce_map())
+		return 0;
+
+	tag = ((uint64_t)get_random() << 32 | get_random()) &
+		(UINT64_MAX >> NONCE_TAGSHIFT);
+	if (tag == 0)
+		tag = 1;
 
 	for (;;) {
-		for (i = 0; i < sizeof(nonce) - 1; i++)
-			snprintf(nonce + i, 2, "%X", 
-				get_random_uniform(16));
-		if (!db_bindtext(stmt, 1, nonce))
-			goto err;
-		rc = db_step_constrained(stmt);
-		if (rc == SQLITE_CONSTRAINT) {
-			sqlite3_reset(stmt);
+		hand = __atomic_fetch_add
+			(&noncemap->hand, 1, __ATOMIC_RELAXED);
+		idx = hand % NONCESLOTS;
+		sp = &noncemap->slots[idx];
+		v = __atomic_load_n(sp, __ATOMIC_ACQUIRE);
+		if (v & NONCE_REF) {
+			__atomic_compare_exchange_n(sp, &v,
+				v & ~NONCE_REF, 0, __ATOMIC_ACQ_REL,
+				__ATOMIC_ACQUIRE);
 			continue;
-		} else if (rc != SQLITE_DONE)
-			goto err;
-		break;
+		}
+		if (__atomic_compare_exchange_n(sp, &v,
+		    tag << NONCE_TAGSHIFT | NONCE_REF, 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break;
 	}
 
-	db_finalise(&stmt);
-	db_trans_commit();
+	snprintf(nonce, sizeof(nonce), "%04zx%010" PRIx64, idx, tag);
 	*np = nonce;
 	kdbg("nonce created: %s", *np);
 	return 1;
-err:
-	db_finalise(&stmt);
-	db_trans_rollback();
-	return 0;
 }
 
 /*
@@ -852,7 +1522,7 @@ db_collection_new_byid(const char *url, int64_t id)
 	sqlite3_stmt	*stmt;
 	int		 rc;
 
-	if ((stmt = db_prepare(sqls[SQL_COL_INSERT])) == NULL)
+	if ((stmt = db_prepare(SQL_COL_INSERT)) == NULL)
 		goto err;
 	else if (!db_bindint(stmt, 1, id))
 		goto err;
@@ -900,7 +1570,7 @@ db_prncpl_new(const char *name, const char *hash,
 	if (!db_trans_open()) 
 		return (-1);
 
-	if ((stmt = db_prepare(sqls[SQL_PRNCPL_INSERT])) == NULL)
+	if ((stmt = db_prepare(SQL_PRNCPL_INSERT)) == NULL)
 		goto err;
 	else if (!db_bindtext(stmt, 1, name))
 		goto err;
@@ -948,7 +1618,7 @@ db_prncpl_update(const struct prncpl *p)
 	sqlite3_stmt	*stmt;
 	int		 rc;
 
-	if ((stmt = db_prepare(sqls[SQL_PRNCPL_UPDATE])) == NULL)
+	if ((stmt = db_prepare(SQL_PRNCPL_UPDATE)) == NULL)
 		goto err;
 	else if (!db_bindtext(stmt, 1, p->hash))
 		goto err;
@@ -994,6 +1664,7 @@ db_collection_get(struct coln **pp, sqlite3_stmt *stmt)
 		((char *)sqlite3_column_text(stmt, 3));
 	(*pp)->ctag = sqlite3_column_int64(stmt, 4);
 	(*pp)->id = sqlite3_column_int64(stmt, 5);
+	(*pp)->synclimit = sqlite3_column_int64(stmt, 6);
 
 	if (NULL != (*pp)->url &&
 	    NULL != (*pp)->displayname &&
@@ -1015,7 +1686,7 @@ db_proxy_remove(const struct prncpl *p, int64_t id)
 {
 	sqlite3_stmt	*stmt;
 
-	if ((stmt = db_prepare(sqls[SQL_PROXY_REMOVE])) == NULL)
+	if ((stmt = db_prepare(SQL_PROXY_REMOVE)) == NULL)
 		goto err;
 	else if (!db_bindint(stmt, 1, p->id))
 		goto err;
@@ -1053,7 +1724,7 @@ db_proxy(const struct prncpl *p, int64_t id, int64_t bits)
 
 	/* First try to create a new one. */
 
-	if ((stmt = db_prepare(sqls[SQL_PROXY_INSERT])) == NULL)
+	if ((stmt = db_prepare(SQL_PROXY_INSERT)) == NULL)
 		goto err;
 	else if (!db_bindint(stmt, 1, p->id))
 		goto err;
@@ -1076,7 +1747,7 @@ db_proxy(const struct prncpl *p, int64_t id, int64_t bits)
 
 	/* Field (might?) exist. */
 
-	if ((stmt = db_prepare(sqls[SQL_PROXY_UPDATE])) == NULL)
+	if ((stmt = db_prepare(SQL_PROXY_UPDATE)) == NULL)
 		goto err;
 	else if (!db_bindint(stmt, 1, bits))
 		goto err;
@@ -1119,7 +1790,7 @@ db_collection_loadid(struct coln **pp, int64_t id, int64_t pid)
 	sqlite3_stmt	*stmt;
 	int	 	 rc = -1;
 
-	if ((stmt = db_prepare(sqls[SQL_COL_GET_ID])) == NULL)
+	if ((stmt = db_prepare(SQL_COL_GET_ID)) == NULL)
 		goto err;
 	else if (!db_bindint(stmt, 1, pid))
 		goto err;
@@ -1148,7 +1819,7 @@ db_collection_load(struct coln **pp, const char *url, int64_t id)
 
 	*pp = NULL;
 
-	if ((stmt = db_prepare(sqls[SQL_COL_GET])) == NULL)
+	if ((stmt = db_prepare(SQL_COL_GET)) == NULL)
 		goto err;
 	else if (!db_bindint(stmt, 1, id))
 		goto err;
@@ -1189,7 +1860,7 @@ db_prncpl_identify(const char *email)
 	int64_t		 id;
 	int		 rc;
 
-	if ((stmt = db_prepare(sqls[SQL_PRNCPL_GET_ID])) == NULL)
+	if ((stmt = db_prepare(SQL_PRNCPL_GET_ID)) == NULL)
 		goto err;
 	else if (!db_bindtext(stmt, 1, email))
 		goto err;
@@ -1208,8 +1879,189 @@ err:
 	return -1;
 }
 
+/*
+ * Deep copy of a principal.
+ * Returns NULL on memory failure.
+ */
+static struct prncpl *
+prncpl_dup(const struct prncpl *p)
+{
+	struct prncpl	*np;
+	size_t		 i;
+
+	if ((np = calloc(1, sizeof(struct prncpl))) == NULL)
+		goto err;
+
+	np->id = p->id;
+	np->quota_used = p->quota_used;
+	np->quota_avail = p->quota_avail;
+	if ((np->name = strdup(p->name)) == NULL ||
+	    (np->hash = strdup(p->hash)) == NULL ||
+	    (np->email = strdup(p->email)) == NULL)
+		goto err;
+
+	/* 
+	 * Arrays are zeroed before being filled in, so a partial copy
+	 * is safely freed.
+	 */
+
+	if (p->colsz > 0 && (np->cols = calloc
+	    (p->colsz, sizeof(struct coln))) == NULL)
+		goto err;
+	np->colsz = p->colsz;
+	for (i = 0; i < p->colsz; i++) {
+		np->cols[i].ctag = p->cols[i].ctag;
+		np->cols[i].id = p->cols[i].id;
+		np->cols[i].synclimit = p->cols[i].synclimit;
+		if ((np->cols[i].url = 
+		     strdup(p->cols[i].url)) == NULL ||
+		    (np->cols[i].displayname = 
+		     strdup(p->cols[i].displayname)) == NULL ||
+		    (np->cols[i].colour = 
+		     strdup(p->cols[i].colour)) == NULL ||
+		    (np->cols[i].description = 
+		     strdup(p->cols[i].description)) == NULL)
+			goto err;
+	}
+
+	if (p->proxiesz > 0 && (np->proxies = calloc
+	    (p->proxiesz, sizeof(struct proxy))) == NULL)
+		goto err;
+	np->proxiesz = p->proxiesz;
+	for (i = 0; i < p->proxiesz; i++) {
+		np->proxies[i].bits = p->proxies[i].bits;
+		np->proxies[i].proxy = p->proxies[i].proxy;
+		np->proxies[i].id = p->proxies[i].id;
+		if ((np->proxies[i].email = 
+		     strdup(p->proxies[i].email)) == NULL ||
+		    (np->proxies[i].name = 
+		     strdup(p->proxies[i].name)) == NULL)
+			goto err;
+	}
+
+	if (p->rproxiesz > 0 && (np->rproxies = calloc
+	    (p->rproxiesz, sizeof(struct proxy))) == NULL)
+		goto err;
+	np->rproxiesz = p->rproxiesz;
+	for (i = 0; i < p->rproxiesz; i++) {
+		np->rproxies[i].bits = p->rproxies[i].bits;
+		np->rproxies[i].proxy = p->rproxies[i].proxy;
+		np->rproxies[i].id = p->rproxies[i].id;
+		if ((np->rproxies[i].email = 
+		     strdup(p->rproxies[i].email)) == NULL ||
+		    (np->rproxies[i].name = 
+		     strdup(p->rproxies[i].name)) == NULL)
+			goto err;
+	}
+
+	return np;
+err:
+	kerr(NULL);
+	db_prncpl_free(np);
+	return NULL;
+}
+
+/*
+ * Look up a principal in the cache by name.
+ * Returns the slot or NULL if not found.
+ */
+static struct pcache *
+pcache_get(const char *name)
+{
+	size_t	 i;
+
+	for (i = 0; i < PCACHE_MAX; i++)
+		if (pcache[i].p != NULL &&
+		    strcmp(pcache[i].p->name, name) == 0)
+			return &pcache[i];
+
+	return NULL;
+}
+
+static void
+pcache_drop(struct pcache *c)
+{
+
+	db_prncpl_free(c->p);
+	memset(c, 0, sizeof(struct pcache));
+}
+
+/*
+ * Cache a copy of the principal with the given generation, replacing
+ * any existing entry or the least recently-used one.
+ * Failure to cache is not an error.
+ */
+static void
+pcache_put(const struct prncpl *p, int64_t gen)
+{
+	struct pcache	*c;
+	size_t		 i;
+
+	if ((c = pcache_get(p->name)) == NULL) {
+		c = &pcache[0];
+		for (i = 1; i < PCACHE_MAX; i++)
+			if (pcache[i].used < c->used)
+				c = &pcache[i];
+	}
+
+	pcache_drop(c);
+	if ((c->p = prncpl_dup(p)) == NULL)
+		return;
+	c->gen = gen;
+	c->used = ++pcacheuse;
+}
+
+/*
+ * See if the cached principal "c" is current.
+ * Returns <0 on failure, 0 if the principal no longer exists, 1 if the
+ * cache is stale, 2 if it's current.
+ */
+static int
+pcache_validate(const struct pcache *c)
+{
+	sqlite3_stmt	*stmt;
+	int		 rc;
+
+	if ((stmt = db_prepare(SQL_PRNCPL_GET_GEN)) == NULL)
+		return (-1);
+	else if (!db_bindtext(stmt, 1, c->p->name))
+		goto err;
+
+	if ((rc = db_step(stmt)) == SQLITE_DONE) {
+		db_finalise(&stmt);
+		return 0;
+	} else if (rc != SQLITE_ROW)
+		goto err;
+
+	rc = sqlite3_column_int64(stmt, 0) == c->gen ? 2 : 1;
+	db_finalise(&stmt);
+	return rc;
+err:
+	db_finalise(&stmt);
+	return (-1);
+}
+
+/*
+ * Fill in the bytes available to "p" from its bytes used.
+ * Without a configured limit, this is INT64_MAX (not UINT64_MAX, as
+ * the value is also passed around as a signed integer).
+ */
+static void
+prncpl_quota(struct prncpl *p)
+{
+
+	if (quota == 0)
+		p->quota_avail = INT64_MAX;
+	else if (p->quota_used < quota)
+		p->quota_avail = quota - p->quota_used;
+	else
+		p->quota_avail = 0;
+}
+
 /*
  * Load the principal "name" into "pp", allocating it.
+ * This first consults the principal cache, which is used only if the
+ * principal's generation is unchanged.
  * Returns 0 if the principal isn't found <0 on error, >0 on success.
  * Principal is only set if >0 return value.
  */
@@ -1217,11 +2069,29 @@ int
 db_prncpl_load(struct prncpl **pp, const char *name)
 {
 	struct prncpl	*p;
+	struct pcache	*pc;
 	size_t		 i;
-	sqlite3_stmt	*stmt;
+	sqlite3_stmt	*stmt = NULL;
 	int		 c, rc = -1;
+	int64_t		 gen, used;
 	void		*vp;
-	struct statvfs	 sfs;
+
+	*pp = NULL;
+
+	if ((pc = pcache_get(name)) != NULL) {
+		if ((c = pcache_validate(pc)) < 0)
+			return (-1);
+		if (c == 2) {
+			if ((p = prncpl_dup(pc->p)) == NULL)
+				return (-1);
+			pc->used = ++pcacheuse;
+			*pp = p;
+			return 1;
+		}
+		pcache_drop(pc);
+		if (c == 0)
+			return 0;
+	}
 
 	p = *pp = calloc(1, sizeof(struct prncpl));
 	if (p == NULL) {
@@ -1229,7 +2099,7 @@ db_prncpl_load(struct prncpl **pp, const char *name)
 		return (-1);
 	}
 
-	if ((stmt = db_prepare(sqls[SQL_PRNCPL_GET])) == NULL)
+	if ((stmt = db_prepare(SQL_PRNCPL_GET)) == NULL)
 		goto err;
 	else if (!db_bindtext(stmt, 1, name))
 		goto err;
@@ -1244,6 +2114,9 @@ db_prncpl_load(struct prncpl **pp, const char *name)
 	p->hash = strdup((char *)sqlite3_column_text(stmt, 0));
 	p->id = sqlite3_column_int(stmt, 1);
 	p->email = strdup((char *)sqlite3_column_text(stmt, 2));
+	gen = sqlite3_column_int64(stmt, 3);
+	used = sqlite3_column_int64(stmt, 4);
+	p->quota_used = used < 0 ? 0 : used;
 
 	db_finalise(&stmt);
 
@@ -1252,17 +2125,11 @@ db_prncpl_load(struct prncpl **pp, const char *name)
 		goto err;
 	}
 
-	if (statvfs(dbname, &sfs) == -1) {
-		kerr("statvfs: %s", dbname);
-		goto err;
-	}
-
-	p->quota_used = sfs.f_blocks * sfs.f_bsize;
-	p->quota_avail = sfs.f_bfree * sfs.f_bsize;
+	prncpl_quota(p);
 
 	/* Read in each collection owned by the given principal. */
 
-	if ((stmt = db_prepare(sqls[SQL_COL_ITER])) == NULL)
+	if ((stmt = db_prepare(SQL_COL_ITER)) == NULL)
 		goto err;
 	else if (!db_bindint(stmt, 1, p->id))
 		goto err;
@@ -1286,6 +2153,7 @@ db_prncpl_load(struct prncpl **pp, const char *name)
 			((char *)sqlite3_column_text(stmt, 3));
 		p->cols[i].ctag = sqlite3_column_int64(stmt, 4);
 		p->cols[i].id = sqlite3_column_int64(stmt, 5);
+		p->cols[i].synclimit = sqlite3_column_int64(stmt, 6);
 
 		if (NULL == p->cols[i].url ||
 		    NULL == p->cols[i].displayname ||
@@ -1302,7 +2170,7 @@ db_prncpl_load(struct prncpl **pp, const char *name)
 
 	/* Read all reverse proxies. */
 
-	if ((stmt = db_prepare(sqls[SQL_PROXY_ITER])) == NULL)
+	if ((stmt = db_prepare(SQL_PROXY_ITER)) == NULL)
 		goto err;
 	else if (!db_bindint(stmt, 1, p->id))
 		goto err;
@@ -1334,7 +2202,7 @@ db_prncpl_load(struct prncpl **pp, const char *name)
 		goto err;
 	db_finalise(&stmt);
 
-	if ((stmt = db_prepare(sqls[SQL_PROXY_ITER_PRNCPL])) == NULL)
+	if ((stmt = db_prepare(SQL_PROXY_ITER_PRNCPL)) == NULL)
 		goto err;
 	else if (!db_bindint(stmt, 1, p->id))
 		goto err;
@@ -1366,6 +2234,7 @@ db_prncpl_load(struct prncpl **pp, const char *name)
 	if (c != SQLITE_DONE)
 		goto err;
 	db_finalise(&stmt);
+	pcache_put(p, gen);
 	return 1;
 err:
 	*pp = NULL;
@@ -1384,7 +2253,7 @@ db_collection_update(const struct coln *c, const struct prncpl *p)
 {
 	sqlite3_stmt	*stmt;
 
-	if ((stmt = db_prepare(sqls[SQL_COL_UPDATE])) == NULL)
+	if ((stmt = db_prepare(SQL_COL_UPDATE)) == NULL)
 		goto err;
 	else if (!db_bindtext(stmt, 1, c->displayname))
 		goto err;
@@ -1408,82 +2277,1293 @@ err:
 }
 
 /*
- * List all resources in a collection.
- * Return zero on failure, non-zero on success.
- * This can return failure after the callback has been invoked.
+ * Whether "t" is floating: a date, or a date-time without a time zone.
  */
-int
-db_collection_resources(void (*fp)(const struct res *, void *), 
-	int64_t colid, void *arg)
+static int
+db_resource_floating(const struct icaltime *t)
 {
-	sqlite3_stmt	*stmt;
-	size_t		 rsz, sz;
-	int		 rc;
-	char		*er;
-	struct res	 p;
-
-	if ((stmt = db_prepare(sqls[SQL_RES_ITER])) == NULL)
-		goto err;
-	else if (!db_bindint(stmt, 1, colid))
-		goto err;
 
-	while ((rc = db_step(stmt)) == SQLITE_ROW) {
-		memset(&p, 0, sizeof(struct res));
-		p.data = (char *)sqlite3_column_text(stmt, 0);
-		p.etag = (char *)sqlite3_column_text(stmt, 1);
-		p.url = (char *)sqlite3_column_text(stmt, 2);
-		p.id = sqlite3_column_int64(stmt, 3);
-		p.collection = sqlite3_column_int64(stmt, 4);
-		sz = strlen(p.data);
-		rsz = 0;
-		p.ical = ical_parse(NULL, p.data, sz, &rsz, &er);
-		if (p.ical == NULL) {
-			kerrx("ical_parse: %s", er);
-			free(er);
-			goto err;
-		} else if (rsz != sz)
-			kdbg("ical_parse: trailing bytes (%zu < %zu)",
-				rsz, sz);
-		(*fp)(&p, arg);
-		ical_free(p.ical);
-	}
-	if (rc != SQLITE_DONE)
-		goto err;
-	db_finalise(&stmt);
-	return 1;
-err:
-	db_finalise(&stmt);
-	return 0;
+	return t->time.type == ICAL_DT_DATE ||
+		(t->time.type == ICAL_DT_DATETIME && t->tz == NULL);
 }
 
 /*
- * Delete collection from database without verifying that it exists.
- * Return zero on failure, non-zero on success.
+ * Get the time span of a single component into "start" and "end" in
+ * UTC, following the rules of RFC 4791, 9.9.
+ * Returns zero if the component is unbounded (e.g., a VTODO without a
+ * start), non-zero otherwise.
+ * Sets RESMETA_FLOATING in "flags" if the times are floating.
  */
-int
-db_collection_remove(int64_t id, const struct prncpl *p)
+static int
+db_resource_meta_span(const struct icalcomp *c,
+	int64_t *start, int64_t *end, unsigned int *flags)
 {
-	sqlite3_stmt	*stmt;
+	int64_t	 dur;
 
-	if ((stmt = db_prepare(sqls[SQL_COL_REMOVE])) == NULL)
-		goto err;
-	else if (!db_bindint(stmt, 1, id))
-		goto err;
-	else if (db_step(stmt) != SQLITE_DONE)
-		goto err;
+	if (c->dtstart.time.type == ICAL_DT_UNSET)
+		return 0;
+
+	*start = ical_time2utc(&c->dtstart);
+	if (db_resource_floating(&c->dtstart))
+		*flags |= RESMETA_FLOATING;
+
+	dur = (int64_t)c->duration.week * 604800 +
+		(int64_t)c->duration.day * 86400 +
+		(int64_t)c->duration.hour * 3600 +
+		(int64_t)c->duration.min * 60 +
+		(int64_t)c->duration.sec;
+	dur *= c->duration.sign;
+
+	if (c->type == ICALTYPE_VEVENT &&
+	    c->dtend.time.type != ICAL_DT_UNSET) {
+		*end = ical_time2utc(&c->dtend);
+		if (db_resource_floating(&c->dtend))
+			*flags |= RESMETA_FLOATING;
+	} else if (c->duration.sign != 0)
+		*end = *start + dur;
+	else if (c->type == ICALTYPE_VTODO)
+		return 0;
+	else if (c->dtstart.time.type == ICAL_DT_DATE)
+		*end = *start + 86400;
+	else
+		*end = *start;
 
-	db_finalise(&stmt);
-	kinfo("collection removed (maybe): %" PRId64, id);
 	return 1;
-err:
-	db_finalise(&stmt);
-	return 0;
 }
 
 /*
- * Delete a resource from the collection and update the ctag.
- * Only do this if the resource matches the given tag or if the resource
- * wasn't found (so it's kinda... already deleted?).
+ * Extract the metadata of iCalendar "ical", whose text is "data", into
+ * "m", and its occurrences into "occurs" of "occursz", which must be
+ * freed.
+ * The UID is a pointer into "ical".
+ */
+static void
+db_resource_meta(struct resmeta *m, const char *data,
+	const struct ical *ical, struct caloccur **occurs, size_t *occursz)
+{
+	const enum icaltype	 types[] = {
+		ICALTYPE_VEVENT,
+		ICALTYPE_VTODO,
+		ICALTYPE_VJOURNAL
+	};
+	const struct icalcomp	*c;
+	size_t			 i;
+	int64_t			 start, end, until;
+	int			 bounded = 1, any = 0;
+
+	memset(m, 0, sizeof(struct resmeta));
+	m->bits = ical->bits;
+	m->size = strlen(data);
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+		for (c = ical->comps[types[i]]; c != NULL; c = c->next) {
+			if (m->uid == NULL)
+				m->uid = (char *)c->uid;
+			if (c->rrule.set || c->rdatesz > 0)
+				m->flags |= RESMETA_RECUR;
+			if (c->lastmod.type != ICAL_DT_UNSET &&
+			    (!(m->flags & RESMETA_LASTMOD) ||
+			     c->lastmod.tm > m->lastmod)) {
+				m->lastmod = c->lastmod.tm;
+				m->flags |= RESMETA_LASTMOD;
+			}
+			if (!db_resource_meta_span(c,
+			    &start, &end, &m->flags)) {
+				bounded = 0;
+				continue;
+			}
+			if (!any || start < m->start)
+				m->start = start;
+			if (!any || end > m->end)
+				m->end = end;
+			any = 1;
+		}
+
+	if (bounded && any)
+		m->flags |= RESMETA_BOUNDED;
+
+	/*
+	 * List the occurrences of bounded resources up to the horizon.
+	 * Free-busy components aren't occurrences, so resources with
+	 * them are left to be parsed.
+	 */
+
+	*occurs = NULL;
+	*occursz = 0;
+	m->occuntil = INT64_MAX;
+
+	if (!(m->flags & RESMETA_BOUNDED) ||
+	    (ical->bits & ICAL_VFREEBUSY))
+		return;
+
+	until = time(NULL) > INT64_MAX - horizon ?
+		INT64_MAX : time(NULL) + horizon;
+	if (!caldav_occurrences(ical, until, OCCUR_MAX,
+	    occurs, occursz, &m->occuntil)) {
+		kerr(NULL);
+		free(*occurs);
+		*occurs = NULL;
+		*occursz = 0;
+		m->occuntil = INT64_MAX;
+	} else
+		m->flags |= RESMETA_OCCURS;
+}
+
+/*
+ * Bind the metadata "m" to the statement starting at "pos".
+ * Return zero on failure, non-zero on success.
+ */
+static int
+db_resource_meta_bind(sqlite3_stmt *stmt, size_t pos,
+	const struct resmeta *m)
+{
+
+	if (m->uid == NULL ? !db_bindnull(stmt, pos) :
+	    !db_bindtext(stmt, pos, m->uid))
+		return 0;
+	if (!db_bindint(stmt, pos + 1, m->bits))
+		return 0;
+	if (m->flags & RESMETA_BOUNDED) {
+		if (!db_bindint(stmt, pos + 2, m->start) ||
+		    !db_bindint(stmt, pos + 3, m->end))
+			return 0;
+	} else if (!db_bindnull(stmt, pos + 2) ||
+	    !db_bindnull(stmt, pos + 3))
+		return 0;
+	if (!db_bindint(stmt, pos + 4, 
+	    (m->flags & RESMETA_FLOATING) != 0))
+		return 0;
+	if (!db_bindint(stmt, pos + 5, (m->flags & RESMETA_RECUR) != 0))
+		return 0;
+	if (m->flags & RESMETA_LASTMOD) {
+		if (!db_bindint(stmt, pos + 6, m->lastmod))
+			return 0;
+	} else if (!db_bindnull(stmt, pos + 6))
+		return 0;
+	if (!db_bindint(stmt, pos + 7, m->size))
+		return 0;
+	if (!db_bindint(stmt, pos + 8, (m->flags & RESMETA_OCCURS) != 0))
+		return 0;
+	return (m->flags & RESMETA_OCCURS) && m->occuntil != INT64_MAX ?
+		db_bindint(stmt, pos + 9, m->occuntil) :
+		db_bindnull(stmt, pos + 9);
+}
+
+/*
+ * Read the metadata columns starting at column "pos" into "m".
+ * The UID, if not NULL, points into the statement's row.
+ */
+static void
+db_resource_meta_get(sqlite3_stmt *stmt, int pos, struct resmeta *m)
+{
+
+	memset(m, 0, sizeof(struct resmeta));
+	m->uid = (char *)sqlite3_column_text(stmt, pos);
+	m->bits = sqlite3_column_int(stmt, pos + 1);
+	if (sqlite3_column_type(stmt, pos + 2) != SQLITE_NULL &&
+	    sqlite3_column_type(stmt, pos + 3) != SQLITE_NULL) {
+		m->start = sqlite3_column_int64(stmt, pos + 2);
+		m->end = sqlite3_column_int64(stmt, pos + 3);
+		m->flags |= RESMETA_BOUNDED;
+	}
+	if (sqlite3_column_int(stmt, pos + 4))
+		m->flags |= RESMETA_FLOATING;
+	if (sqlite3_column_int(stmt, pos + 5))
+		m->flags |= RESMETA_RECUR;
+	if (sqlite3_column_type(stmt, pos + 6) != SQLITE_NULL) {
+		m->lastmod = sqlite3_column_int64(stmt, pos + 6);
+		m->flags |= RESMETA_LASTMOD;
+	}
+	m->size = sqlite3_column_int64(stmt, pos + 7);
+	if (sqlite3_column_int(stmt, pos + 8))
+		m->flags |= RESMETA_OCCURS;
+	m->occuntil = sqlite3_column_type(stmt, pos + 9) == SQLITE_NULL ?
+		INT64_MAX : sqlite3_column_int64(stmt, pos + 9);
+}
+
+/*
+ * See whether the line at "cp" is "line" (case-insensitive) and return
+ * the start of the next line if so, else NULL.
+ */
+static const char *
+db_tzline(const char *cp, const char *line)
+{
+	size_t	 sz = strlen(line);
+
+	if (strncasecmp(cp, line, sz) || strncmp(cp + sz, "\r\n", 2))
+		return NULL;
+	return cp + sz + 2;
+}
+
+/*
+ * Return the start of the line after that at "cp".
+ */
+static const char *
+db_tznext(const char *cp)
+{
+
+	cp += strcspn(cp, "\n");
+	return *cp == '\n' ? cp + 1 : cp;
+}
+
+/*
+ * Take the time-zone components out of the calendar data "data" as
+ * printed by ical_printbuf(), setting "rest" to what remains and "tzs"
+ * of "tzsz" to the components, which point into "data".
+ * Both must be freed.
+ * Return zero on memory failure, non-zero on success.
+ */
+static int
+db_resource_tzsplit(const char *data, char **rest,
+	struct restz **tzs, size_t *tzsz)
+{
+	const char	*cp, *end, *next;
+	struct restz	*tz;
+	size_t		 sz = 0;
+	uint64_t	 h;
+	void		*pp;
+
+	*tzs = NULL;
+	*tzsz = 0;
+	if ((*rest = malloc(strlen(data) + 1)) == NULL)
+		return 0;
+
+	for (cp = data; *cp != '\0'; cp = next) {
+		next = NULL;
+		if ((end = db_tzline(cp, "BEGIN:VTIMEZONE")) != NULL)
+			while (*end != '\0' &&
+			    (next = db_tzline(end, "END:VTIMEZONE")) == NULL)
+				end = db_tznext(end);
+
+		/* Copy anything but a whole component. */
+
+		if (next == NULL) {
+			next = db_tznext(cp);
+			memcpy(*rest + sz, cp, next - cp);
+			sz += next - cp;
+			continue;
+		}
+
+		pp = reallocarray(*tzs, *tzsz + 1, sizeof(struct restz));
+		if (pp == NULL) {
+			free(*rest);
+			free(*tzs);
+			*rest = NULL;
+			*tzs = NULL;
+			*tzsz = 0;
+			return 0;
+		}
+		*tzs = pp;
+		tz = &(*tzs)[(*tzsz)++];
+		tz->data = cp;
+		tz->sz = next - cp;
+		tz->offs = sz;
+		for (h = 0xcbf29ce484222325ULL; cp < next; cp++)
+			h = (h ^ (unsigned char)*cp) * 0x100000001b3ULL;
+		tz->hash = (int64_t)h;
+	}
+
+	(*rest)[sz] = '\0';
+	return 1;
+}
+
+/*
+ * Replace the time zones of resource "id" with "tzs" of "tzsz", each
+ * stored in the timezone table unless already there.
+ * Time zones no longer used are removed by the database.
+ * Return zero on failure, non-zero on success.
+ */
+static int
+db_resource_tz(int64_t id, const struct restz *tzs, size_t tzsz)
+{
+	sqlite3_stmt	*stmt;
+	size_t		 i;
+	int64_t		 tzid;
+	int		 rc;
+
+	if ((stmt = db_prepare(SQL_RESTZ_REMOVE)) == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, id))
+		goto err;
+	else if (db_step(stmt) != SQLITE_DONE)
+		goto err;
+	db_finalise(&stmt);
+
+	for (i = 0; i < tzsz; i++) {
+		if ((stmt = db_prepare(SQL_TZ_GET)) == NULL)
+			goto err;
+		else if (!db_bindint(stmt, 1, tzs[i].hash))
+			goto err;
+		else if (!db_bindtextsz(stmt, 2, tzs[i].data, tzs[i].sz))
+			goto err;
+		if ((rc = db_step(stmt)) == SQLITE_ROW)
+			tzid = sqlite3_column_int64(stmt, 0);
+		else if (rc != SQLITE_DONE)
+			goto err;
+		db_finalise(&stmt);
+
+		if (rc == SQLITE_DONE) {
+			if ((stmt = db_prepare(SQL_TZ_INSERT)) == NULL)
+				goto err;
+			else if (!db_bindint(stmt, 1, tzs[i].hash))
+				goto err;
+			else if (!db_bindtextsz(stmt, 2,
+			    tzs[i].data, tzs[i].sz))
+				goto err;
+			else if (db_step(stmt) != SQLITE_DONE)
+				goto err;
+			db_finalise(&stmt);
+			tzid = sqlite3_last_insert_rowid(db);
+		}
+
+		if ((stmt = db_prepare(SQL_RESTZ_INSERT)) == NULL)
+			goto err;
+		else if (!db_bindint(stmt, 1, id))
+			goto err;
+		else if (!db_bindint(stmt, 2, tzid))
+			goto err;
+		else if (!db_bindint(stmt, 3, tzs[i].offs))
+			goto err;
+		else if (db_step(stmt) != SQLITE_DONE)
+			goto err;
+		db_finalise(&stmt);
+	}
+	return 1;
+err:
+	db_finalise(&stmt);
+	return 0;
+}
+
+static void
+tzcache_clear(void)
+{
+	size_t	 i;
+
+	for (i = 0; i < TZCACHE_MAX; i++) {
+		free(tzcache[i].data);
+		memset(&tzcache[i], 0, sizeof(struct tzcache));
+	}
+}
+
+/*
+ * Get the time zone "id" from the cache, reading it into the least
+ * recently used entry if not found.
+ * The entry is only valid until the next call.
+ * Returns NULL on failure, including if the time zone doesn't exist.
+ */
+static const struct tzcache *
+tzcache_get(int64_t id)
+{
+	struct tzcache	*c;
+	sqlite3_stmt	*stmt;
+	size_t		 i;
+	int		 rc;
+
+	for (i = 0; i < TZCACHE_MAX; i++)
+		if (tzcache[i].data != NULL && tzcache[i].id == id) {
+			tzcache[i].used = ++tzcacheuse;
+			return &tzcache[i];
+		}
+
+	c = &tzcache[0];
+	for (i = 1; i < TZCACHE_MAX; i++)
+		if (tzcache[i].used < c->used)
+			c = &tzcache[i];
+
+	free(c->data);
+	memset(c, 0, sizeof(struct tzcache));
+
+	if ((stmt = db_prepare(SQL_TZ_GET_ID)) == NULL)
+		return NULL;
+	else if (!db_bindint(stmt, 1, id))
+		goto err;
+
+	if ((rc = db_step(stmt)) == SQLITE_DONE)
+		kerrx("time zone %" PRId64 ": not found", id);
+	if (rc != SQLITE_ROW)
+		goto err;
+
+	c->sz = sqlite3_column_bytes(stmt, 0);
+	if ((c->data = malloc(c->sz + 1)) == NULL) {
+		kerr(NULL);
+		goto err;
+	}
+	memcpy(c->data, sqlite3_column_text(stmt, 0), c->sz);
+	c->data[c->sz] = '\0';
+	c->id = id;
+	c->used = ++tzcacheuse;
+	db_finalise(&stmt);
+	return c;
+err:
+	db_finalise(&stmt);
+	return NULL;
+}
+
+/*
+ * A time zone of a resource as listed by RESTZ_COL.
+ */
+struct	restzent {
+	size_t		 offs;
+	int64_t		 tz;
+	int64_t		 row;
+};
+
+static int
+restzent_cmp(const void *a, const void *b)
+{
+	const struct restzent	*x = a, *y = b;
+
+	if (x->offs != y->offs)
+		return x->offs < y->offs ? -1 : 1;
+	if (x->row != y->row)
+		return x->row < y->row ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Put the time zones of resource "id", listed in "list" by RESTZ_COL
+ * (or NULL if none), back into its stored calendar data "data",
+ * setting "pp" to the whole, which must be freed, or NULL if it has
+ * none.
+ * Return zero on failure, non-zero on success.
+ */
+static int
+db_resource_tzjoin(int64_t id, const char *data, const char *list,
+	char **pp)
+{
+	struct restzent		*ents = NULL;
+	const struct tzcache	*tz;
+	const char		*cp;
+	char			*ep;
+	size_t			 i, n, sz, bufsz, last = 0;
+	long long		 v[3];
+
+	*pp = NULL;
+	if (list == NULL)
+		return 1;
+
+	/* Each entry is three numbers, so count the spaces. */
+
+	for (n = 1, cp = list; *cp != '\0'; cp++)
+		if (*cp == ' ')
+			n++;
+	if (n % 3 != 0)
+		goto bad;
+	n /= 3;
+
+	if ((ents = calloc(n, sizeof(struct restzent))) == NULL) {
+		kerr(NULL);
+		return 0;
+	}
+
+	for (i = 0, cp = list; i < 3 * n; i++) {
+		errno = 0;
+		v[i % 3] = strtoll(cp, &ep, 10);
+		if (ep == cp || errno != 0 ||
+		    (*ep != ' ' && *ep != '\0') || v[i % 3] < 0)
+			goto bad;
+		cp = *ep == ' ' ? ep + 1 : ep;
+		if (i % 3 != 2)
+			continue;
+		ents[i / 3].offs = v[0];
+		ents[i / 3].tz = v[1];
+		ents[i / 3].row = v[2];
+	}
+
+	qsort(ents, n, sizeof(struct restzent), restzent_cmp);
+
+	/* Size the whole, then splice in each time zone. */
+
+	sz = strlen(data);
+	for (bufsz = sz + 1, i = 0; i < n; i++) {
+		if (ents[i].offs > sz)
+			goto bad;
+		if ((tz = tzcache_get(ents[i].tz)) == NULL)
+			goto err;
+		bufsz += tz->sz;
+	}
+
+	if ((*pp = malloc(bufsz)) == NULL) {
+		kerr(NULL);
+		goto err;
+	}
+
+	for (bufsz = 0, i = 0; i < n; i++) {
+		if ((tz = tzcache_get(ents[i].tz)) == NULL)
+			goto err;
+		memcpy(*pp + bufsz, data + last, ents[i].offs - last);
+		bufsz += ents[i].offs - last;
+		memcpy(*pp + bufsz, tz->data, tz->sz);
+		bufsz += tz->sz;
+		last = ents[i].offs;
+	}
+	memcpy(*pp + bufsz, data + last, sz - last);
+	(*pp)[bufsz + sz - last] = '\0';
+	free(ents);
+	return 1;
+bad:
+	kerrx("resource %" PRId64 ": bad time zones: %s", id, list);
+err:
+	free(ents);
+	free(*pp);
+	*pp = NULL;
+	return 0;
+}
+
+/*
+ * Fill "p" from the current resource row of a statement, whose columns
+ * start with those of SQL_RES_ITER, and parse its iCalendar if
+ * RES_ICAL is in "flags".
+ * If the data column was not selected (the "_META" statements), the
+ * data and iCalendar are left NULL.
+ * The strings are owned by the statement, except for data with time
+ * zones put back, which is also set in "buf"; it and the iCalendar
+ * must be freed.
+ * Data stored before the parser was made stricter may no longer parse
+ * (e.g., impossible dates): this is logged and the row is to be
+ * skipped, not failing listings of the whole collection.
+ * Return <0 on failure, 0 if the iCalendar doesn't parse, >0 on
+ * success.
+ */
+static int
+db_resource_row(sqlite3_stmt *stmt, struct res *p, unsigned int flags,
+	char **buf)
+{
+	size_t		 rsz, sz;
+	char		*er;
+
+	*buf = NULL;
+	memset(p, 0, sizeof(struct res));
+	p->etag = (char *)sqlite3_column_text(stmt, 1);
+	p->url = (char *)sqlite3_column_text(stmt, 2);
+	p->id = sqlite3_column_int64(stmt, 3);
+	p->collection = sqlite3_column_int64(stmt, 4);
+	db_resource_meta_get(stmt, 5, &p->meta);
+	if (sqlite3_column_type(stmt, 0) == SQLITE_NULL)
+		return 1;
+	p->data = (char *)sqlite3_column_text(stmt, 0);
+	if (!db_resource_tzjoin(p->id, p->data, (char *)
+	    sqlite3_column_text(stmt, 5 + RESMETA_NCOLS), buf))
+		return (-1);
+	if (*buf != NULL)
+		p->data = *buf;
+	if (!(flags & RES_ICAL))
+		return 1;
+	sz = strlen(p->data);
+	rsz = 0;
+	p->ical = ical_parse(NULL, p->data, sz, &rsz, &er);
+	if (p->ical == NULL) {
+		kerrx("resource %" PRId64 ": skipped: ical_parse: %s",
+			p->id, er);
+		free(er);
+		return 0;
+	} else if (rsz != sz)
+		kdbg("ical_parse: trailing bytes (%zu < %zu)",
+			rsz, sz);
+	return 1;
+}
+
+/*
+ * Invoke "fp" for each resource row of a prepared SQL_RES_ITER or
+ * SQL_RES_ITER_RANGE statement.
+ * Return zero on failure, non-zero on success.
+ * This can return failure after the callback has been invoked.
+ */
+static int
+db_resource_iter(sqlite3_stmt *stmt, unsigned int flags,
+	void (*fp)(const struct res *, void *), void *arg)
+{
+	int		 rc, c;
+	struct res	 p;
+	char		*buf;
+
+	while ((rc = db_step(stmt)) == SQLITE_ROW) {
+		if ((c = db_resource_row(stmt, &p, flags, &buf)) <= 0) {
+			free(buf);
+			if (c < 0)
+				return 0;
+			continue;
+		}
+		(*fp)(&p, arg);
+		ical_free(p.ical);
+		free(buf);
+	}
+	return rc == SQLITE_DONE;
+}
+
+/*
+ * List all resources in a collection.
+ * Unless given in "flags", the resources' calendar data (RES_DATA) and
+ * its parse (RES_ICAL) are NULL, so only the metadata need be loaded.
+ * Return zero on failure, non-zero on success.
+ * This can return failure after the callback has been invoked.
+ */
+int
+db_collection_resources(void (*fp)(const struct res *, void *), 
+	int64_t colid, unsigned int flags, void *arg)
+{
+	sqlite3_stmt	*stmt;
+
+	stmt = db_prepare((flags & (RES_DATA | RES_ICAL)) ?
+		SQL_RES_ITER : SQL_RES_ITER_META);
+	if (stmt == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, colid))
+		goto err;
+	else if (!db_resource_iter(stmt, flags, fp, arg))
+		goto err;
+	db_finalise(&stmt);
+	return 1;
+err:
+	db_finalise(&stmt);
+	return 0;
+}
+
+/*
+ * Free the cached occurrences of "c" and mark it unused.
+ */
+static void
+occache_drop(struct occache *c)
+{
+
+	if (!c->set)
+		return;
+	free(c->ents);
+	occachesz -= c->entsz * sizeof(struct occent);
+	memset(c, 0, sizeof(struct occache));
+}
+
+static int
+occache_cmp(const void *a, const void *b)
+{
+	const struct occent	*x = a, *y = b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/*
+ * Make the occurrences "ents" of "entsz", sorted by start, into an
+ * implicit interval tree, returning the level of its root.
+ * The tree is the binary search tree on indices whose nodes at level
+ * k are those with k trailing one bits; each node's "max" is the
+ * latest end in its subtree (after Heng Li's cgranges).
+ */
+static int
+occache_index(struct occent *ents, size_t entsz)
+{
+	size_t	 i, x, lasti = 0;
+	int64_t	 last = INT64_MIN, e;
+	int	 k;
+
+	for (i = 0; i < entsz; i += 2) {
+		lasti = i;
+		last = ents[i].max = ents[i].end;
+	}
+	for (k = 1; (size_t)1 << k <= entsz; k++) {
+		x = (size_t)1 << (k - 1);
+		for (i = (x << 1) - 1; i < entsz; i += x << 2) {
+			e = ents[i].end;
+			if (ents[i - x].max > e)
+				e = ents[i - x].max;
+			if (i + x < entsz ? ents[i + x].max > e : last > e)
+				e = i + x < entsz ? ents[i + x].max : last;
+			ents[i].max = e;
+		}
+		lasti = (lasti >> k) & 1 ? lasti - x : lasti + x;
+		if (lasti < entsz && ents[lasti].max > last)
+			last = ents[lasti].max;
+	}
+	return k - 1;
+}
+
+/*
+ * Invoke "fp" with each occurrence of "c" overlapping the time from
+ * "start" to "end", that is, starting before "end" and ending after
+ * "start".
+ * Return zero if the callback fails, non-zero otherwise.
+ */
+static int
+occache_overlap(const struct occache *c, int64_t start, int64_t end,
+	int (*fp)(const struct occent *, void *), void *arg)
+{
+	struct {
+		size_t	 x; /* node */
+		int	 k; /* its level */
+		int	 w; /* whether its left has been seen */
+	}		 stack[128], z;
+	const struct occent *e = c->ents;
+	size_t		 i, i1, n = c->entsz;
+	int		 t = 0;
+
+	if (n == 0)
+		return 1;
+
+	stack[t].k = c->level;
+	stack[t].x = ((size_t)1 << c->level) - 1;
+	stack[t++].w = 0;
+
+	while (t > 0) {
+		z = stack[--t];
+		if (z.k <= 3) {
+			/* Small subtrees are scanned in order. */
+			i = z.x >> z.k << z.k;
+			i1 = i + ((size_t)1 << (z.k + 1)) - 1;
+			if (i1 > n)
+				i1 = n;
+			for ( ; i < i1 && e[i].start < end; i++)
+				if (e[i].end > start && !(*fp)(&e[i], arg))
+					return 0;
+		} else if (z.w == 0) {
+			/* Revisit this node after its left subtree. */
+			stack[t].k = z.k;
+			stack[t].x = z.x;
+			stack[t++].w = 1;
+			i = z.x - ((size_t)1 << (z.k - 1));
+			if (i >= n || e[i].max > start) {
+				stack[t].k = z.k - 1;
+				stack[t].x = i;
+				stack[t++].w = 0;
+			}
+		} else if (z.x < n && e[z.x].start < end) {
+			if (e[z.x].end > start && !(*fp)(&e[z.x], arg))
+				return 0;
+			stack[t].k = z.k - 1;
+			stack[t].x = z.x + ((size_t)1 << (z.k - 1));
+			stack[t++].w = 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Get the cached occurrences of collection "col", loading them if not
+ * cached or if its ctag has changed.
+ * Return NULL if they're not to be cached (the cache is disabled or
+ * they're larger than it) or on failure, in which case the caller
+ * should use the database instead.
+ */
+static struct occache *
+occache_get(const struct coln *col)
+{
+	sqlite3_stmt	*stmt = NULL;
+	struct occache	*c = NULL, *lru;
+	struct occent	*ents = NULL, *e;
+	size_t		 i, n, entsz = 0, sz;
+	void		*pp;
+	int		 rc;
+
+	if (occachemax == 0)
+		return NULL;
+
+	for (i = 0; i < OCCACHE_MAX; i++)
+		if (occache[i].set && occache[i].colid == col->id) {
+			if (occache[i].ctag == col->ctag) {
+				occache[i].used = ++occacheuse;
+				return &occache[i];
+			}
+			occache_drop(&occache[i]);
+			break;
+		}
+
+	/*
+	 * Check the size first to avoid loading collections too large
+	 * to be cached, then load (allowing for occurrences added in
+	 * the meantime).
+	 */
+
+	if ((stmt = db_prepare(SQL_OCCUR_COUNT)) == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, col->id))
+		goto err;
+	else if (db_step(stmt) != SQLITE_ROW)
+		goto err;
+	n = sqlite3_column_int64(stmt, 0);
+	db_finalise(&stmt);
+
+	if (n > occachemax / sizeof(struct occent))
+		return NULL;
+	if (n > 0 && (ents = calloc(n, sizeof(struct occent))) == NULL) {
+		kerr(NULL);
+		goto err;
+	}
+
+	if ((stmt = db_prepare(SQL_OCCUR_ITER)) == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, col->id))
+		goto err;
+	while ((rc = db_step(stmt)) == SQLITE_ROW) {
+		if (entsz == n) {
+			n = n == 0 ? 16 : n * 2;
+			pp = reallocarray(ents, n, sizeof(struct occent));
+			if (pp == NULL) {
+				kerr(NULL);
+				goto err;
+			}
+			ents = pp;
+		}
+		e = &ents[entsz++];
+		e->start = sqlite3_column_int64(stmt, 0);
+		e->end = sqlite3_column_int64(stmt, 1);
+		e->fbtype = sqlite3_column_int(stmt, 2);
+		e->resource = sqlite3_column_int64(stmt, 3);
+		e->comps = sqlite3_column_int(stmt, 4);
+		e->occuntil = sqlite3_column_type(stmt, 5) ==
+			SQLITE_NULL ? INT64_MAX :
+			sqlite3_column_int64(stmt, 5);
+	}
+	if (rc != SQLITE_DONE)
+		goto err;
+	db_finalise(&stmt);
+
+	sz = entsz * sizeof(struct occent);
+	if (sz > occachemax) {
+		free(ents);
+		return NULL;
+	}
+
+	/* Evict the least recently used to make room. */
+
+	for (;;) {
+		c = lru = NULL;
+		for (i = 0; i < OCCACHE_MAX; i++)
+			if (!occache[i].set) {
+				if (c == NULL)
+					c = &occache[i];
+			} else if (lru == NULL || occache[i].used < lru->used)
+				lru = &occache[i];
+		if (c != NULL && occachesz + sz <= occachemax)
+			break;
+		assert(lru != NULL);
+		occache_drop(lru);
+	}
+
+	if (entsz > 0)
+		qsort(ents, entsz, sizeof(struct occent), occache_cmp);
+	c->set = 1;
+	c->colid = col->id;
+	c->ctag = col->ctag;
+	c->ents = ents;
+	c->entsz = entsz;
+	c->level = occache_index(ents, entsz);
+	c->used = ++occacheuse;
+	occachesz += sz;
+	kdbg("cached %zu occurrences of collection %" PRId64,
+		entsz, col->id);
+	return c;
+err:
+	db_finalise(&stmt);
+	free(ents);
+	return NULL;
+}
+
+/*
+ * Append the resource of occurrence "e" to the array "arg" if it
+ * matches the range and its resource's instances are all listed.
+ */
+static int
+occache_range(const struct occent *e, void *arg)
+{
+	struct occids	*ids = arg;
+	void		*pp;
+
+	if ((e->comps & ids->comps) == 0 || e->occuntil < ids->end)
+		return 1;
+	if (ids->sz == ids->max) {
+		ids->max = ids->max == 0 ? 16 : ids->max * 2;
+		pp = reallocarray(ids->ids, ids->max, sizeof(int64_t));
+		if (pp == NULL) {
+			kerr(NULL);
+			return 0;
+		}
+		ids->ids = pp;
+	}
+	ids->ids[ids->sz++] = e->resource;
+	return 1;
+}
+
+static int
+occache_idcmp(const void *a, const void *b)
+{
+	int64_t	 x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Like db_collection_resources(), but only list resources that may
+ * have components "range->comps" (or any, if zero) overlapping the
+ * time range, using the metadata extracted when they were stored.
+ * Bounded resources are found by the index on their start time, which
+ * is why the query is split from the unbounded ones; those with listed
+ * occurrences, by the collection's cached occurrences (see
+ * occache_get()) or the index on the occurrences' end time.
+ * This is a superset: resources without metadata, with floating times,
+ * or with recurrence are included if they might overlap, so the
+ * callback must still check the iCalendar itself.
+ * Return zero on failure, non-zero on success.
+ * This can return failure after the callback has been invoked.
+ */
+int
+db_collection_resources_range(void (*fp)(const struct res *, void *), 
+	const struct coln *col, const struct caltimerange *range,
+	void *arg)
+{
+	sqlite3_stmt	*stmt;
+	struct occache	*c;
+	struct occids	 ids;
+	int64_t		 start, end;
+	unsigned int	 comps;
+	size_t		 i;
+
+	memset(&ids, 0, sizeof(struct occids));
+
+	comps = range->comps == 0 ? ~0U : range->comps;
+	start = range->start < INT64_MIN + RESMETA_SLOP ?
+		INT64_MIN : range->start - RESMETA_SLOP;
+	end = range->end > INT64_MAX - RESMETA_SLOP ? 
+		INT64_MAX : range->end + RESMETA_SLOP;
+
+	c = occache_get(col);
+
+	stmt = db_prepare(c == NULL ? 
+		SQL_RES_ITER_RANGE : SQL_RES_ITER_UNLISTED);
+	if (stmt == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, col->id))
+		goto err;
+	else if (!db_bindint(stmt, 2, comps))
+		goto err;
+	else if (!db_bindint(stmt, 3, end))
+		goto err;
+	else if (!db_bindint(stmt, 4, range->end))
+		goto err;
+	else if (!db_bindint(stmt, 5, range->start))
+		goto err;
+	else if (!db_bindint(stmt, 6, RESMETA_SLOP))
+		goto err;
+	else if (c == NULL && !db_bindint(stmt, 7, start))
+		goto err;
+	else if (!db_resource_iter(stmt, RES_ICAL, fp, arg))
+		goto err;
+	db_finalise(&stmt);
+
+	if (c == NULL)
+		return 1;
+
+	/*
+	 * The occurrences are inclusive of the widened range, so widen
+	 * it by one more for occache_overlap().
+	 * Then load each resource found once, in order of identifier.
+	 */
+
+	ids.comps = comps;
+	ids.end = range->end;
+	if (!occache_overlap(c, start == INT64_MIN ? start : start - 1,
+	    end == INT64_MAX ? end : end + 1, occache_range, &ids))
+		goto err;
+	if (ids.sz > 0)
+		qsort(ids.ids, ids.sz, sizeof(int64_t), occache_idcmp);
+
+	for (i = 0; i < ids.sz; i++) {
+		if (i > 0 && ids.ids[i] == ids.ids[i - 1])
+			continue;
+		if ((stmt = db_prepare(SQL_RES_GET_ID)) == NULL)
+			goto err;
+		else if (!db_bindint(stmt, 1, ids.ids[i]))
+			goto err;
+		else if (!db_resource_iter(stmt, RES_ICAL, fp, arg))
+			goto err;
+		db_finalise(&stmt);
+	}
+	free(ids.ids);
+	return 1;
+err:
+	db_finalise(&stmt);
+	free(ids.ids);
+	return 0;
+}
+
+/*
+ * Add the busy time of occurrence "e" to the free-busy "arg", clipped
+ * to its range, if the resource's instances in it are all listed.
+ */
+static int
+occache_freebusy(const struct occent *e, void *arg)
+{
+	struct occbusy	*fb = arg;
+	struct calbusy	 b;
+
+	if (e->fbtype <= CALFB_FREE || e->fbtype >= CALFB__MAX ||
+	    e->occuntil < fb->range->end)
+		return 1;
+	b.start = e->start < fb->range->start ? 
+		fb->range->start : e->start;
+	b.end = e->end > fb->range->end ? fb->range->end : e->end;
+	b.type = e->fbtype;
+	if (!caldav_freebusy_add(fb->busy, fb->busysz, &b)) {
+		kerr(NULL);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Collect the busy time of a collection in the time range "range" for
+ * a free-busy-query (RFC 4791, 7.10) into "busy" of "busysz", which
+ * the caller must free even on failure.
+ * Most resources have their occurrences listed when stored: these are
+ * found by the collection's cached occurrences or the index on their
+ * end time and aren't loaded or parsed.
+ * Only resources without them (unbounded, with free-busy components,
+ * or stored before they were listed), or with instances past those
+ * listed that might fall in the range, are parsed.
+ * Periods are clipped to the range but not merged.
+ * Return zero on failure, non-zero on success.
+ */
+int
+db_collection_freebusy(const struct coln *col,
+	const struct caltimerange *range, struct calbusy **busy,
+	size_t *busysz)
+{
+	sqlite3_stmt	*stmt;
+	struct occache	*oc;
+	struct occbusy	 fb;
+	struct res	 p;
+	struct calbusy	 b;
+	int		 rc, c;
+	int64_t		 end;
+	char		*buf;
+
+	end = range->end > INT64_MAX - RESMETA_SLOP ? 
+		INT64_MAX : range->end + RESMETA_SLOP;
+
+	if ((stmt = db_prepare(SQL_RES_ITER_FREEBUSY)) == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, col->id))
+		goto err;
+	else if (!db_bindint(stmt, 2, range->start))
+		goto err;
+	else if (!db_bindint(stmt, 3, range->end))
+		goto err;
+	else if (!db_bindint(stmt, 4, ICAL_VEVENT | ICAL_VFREEBUSY))
+		goto err;
+	else if (!db_bindint(stmt, 5, end))
+		goto err;
+	else if (!db_bindint(stmt, 6, RESMETA_SLOP))
+		goto err;
+
+	while ((rc = db_step(stmt)) == SQLITE_ROW) {
+		if ((c = db_resource_row(stmt, &p, RES_ICAL, &buf)) <= 0) {
+			free(buf);
+			if (c < 0)
+				goto err;
+			continue;
+		}
+		c = caldav_freebusy(p.ical, 
+			range->start, range->end, busy, busysz);
+		ical_free(p.ical);
+		free(buf);
+		if (!c) {
+			kerr(NULL);
+			goto err;
+		}
+	}
+	if (rc != SQLITE_DONE)
+		goto err;
+	db_finalise(&stmt);
+
+	if ((oc = occache_get(col)) != NULL) {
+		fb.range = range;
+		fb.busy = busy;
+		fb.busysz = busysz;
+		return occache_overlap(oc, range->start, range->end,
+			occache_freebusy, &fb);
+	}
+
+	if ((stmt = db_prepare(SQL_OCCUR_ITER_FREEBUSY)) == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, col->id))
+		goto err;
+	else if (!db_bindint(stmt, 2, range->start))
+		goto err;
+	else if (!db_bindint(stmt, 3, range->end))
+		goto err;
+	else if (!db_bindint(stmt, 4, CALFB_FREE))
+		goto err;
+
+	while ((rc = db_step(stmt)) == SQLITE_ROW) {
+		b.start = sqlite3_column_int64(stmt, 0);
+		b.end = sqlite3_column_int64(stmt, 1);
+		b.type = sqlite3_column_int(stmt, 2);
+		if (b.type <= CALFB_FREE || b.type >= CALFB__MAX)
+			continue;
+		if (b.start < range->start)
+			b.start = range->start;
+		if (b.end > range->end)
+			b.end = range->end;
+		if (!caldav_freebusy_add(busy, busysz, &b)) {
+			kerr(NULL);
+			goto err;
+		}
+	}
+	if (rc != SQLITE_DONE)
+		goto err;
+	db_finalise(&stmt);
+	return 1;
+err:
+	db_finalise(&stmt);
+	return 0;
+}
+
+/*
+ * List resources in a collection changed after its ctag was "since",
+ * in the order of change (RFC 6578).
+ * The callback is passed the resource URL and the resource or NULL if
+ * it has since been removed.
+ * Calendar data is loaded as given by "flags", as with
+ * db_collection_resources().
+ * Return zero on failure, non-zero on success.
+ * This can return failure after the callback has been invoked.
+ */
+int
+db_collection_sync(void (*fp)(const char *, const struct res *, void *),
+	int64_t colid, int64_t since, unsigned int flags, void *arg)
+{
+	sqlite3_stmt	*stmt;
+	struct res	 p;
+	int		 rc, c;
+	char		*buf;
+
+	stmt = db_prepare((flags & (RES_DATA | RES_ICAL)) ? 
+		SQL_CHANGE_ITER : SQL_CHANGE_ITER_META);
+	if (stmt == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, colid))
+		goto err;
+	else if (!db_bindint(stmt, 2, since))
+		goto err;
+
+	while ((rc = db_step(stmt)) == SQLITE_ROW) {
+		if (sqlite3_column_type(stmt, 3) == SQLITE_NULL) {
+			(*fp)((char *)sqlite3_column_text(stmt,
+				6 + RESMETA_NCOLS),
+				NULL, arg);
+			continue;
+		} else if ((c = db_resource_row(stmt, &p, flags, &buf)) <= 0) {
+			free(buf);
+			if (c < 0)
+				goto err;
+			continue;
+		}
+		(*fp)(p.url, &p, arg);
+		ical_free(p.ical);
+		free(buf);
+	}
+	if (rc != SQLITE_DONE)
+		goto err;
+	db_finalise(&stmt);
+	return 1;
+err:
+	db_finalise(&stmt);
+	return 0;
+}
+
+/*
+ * Look up resources by collection and name, invoking "fp" with each
+ * one's index in "names" and the resource, or NULL if not found.
+ * Names with a negative collection or NULL URL are never found.
+ * The callback is invoked in order of "names".
+ * The resource's calendar data is always loaded, but only parsed if
+ * RES_ICAL is in "flags".
+ * Return zero on failure, non-zero on success.
+ * This can return failure after the callback has been invoked.
+ */
+int
+db_resource_list(void (*fp)(size_t, const struct res *, void *),
+	const struct resname *names, size_t namesz, unsigned int flags,
+	void *arg)
+{
+	sqlite3_stmt	*stmt;
+	struct res	 p;
+	size_t		 i;
+	int		 rc = 0, c;
+	char		*buf;
+
+	if ((stmt = db_prepare(SQL_HREF_INSERT)) == NULL)
+		goto out;
+	for (i = 0; i < namesz; i++) {
+		if (!db_bindint(stmt, 1, i))
+			goto out;
+		else if (names[i].collection < 0 ?
+		    !db_bindnull(stmt, 2) :
+		    !db_bindint(stmt, 2, names[i].collection))
+			goto out;
+		else if (names[i].url == NULL ?
+		    !db_bindnull(stmt, 3) :
+		    !db_bindtext(stmt, 3, names[i].url))
+			goto out;
+		else if (db_step(stmt) != SQLITE_DONE)
+			goto out;
+		sqlite3_reset(stmt);
+	}
+	db_finalise(&stmt);
+
+	if ((stmt = db_prepare(SQL_HREF_ITER)) == NULL)
+		goto out;
+	while ((rc = db_step(stmt)) == SQLITE_ROW) {
+		i = sqlite3_column_int64(stmt, 6 + RESMETA_NCOLS);
+		if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+			(*fp)(i, NULL, arg);
+			continue;
+		} else if ((c = db_resource_row(stmt, &p, flags, &buf)) <= 0) {
+			free(buf);
+			if (c < 0)
+				break;
+			(*fp)(i, NULL, arg);
+			continue;
+		}
+		(*fp)(i, &p, arg);
+		ical_free(p.ical);
+		free(buf);
+	}
+	rc = rc == SQLITE_DONE;
+out:
+	db_finalise(&stmt);
+	if ((stmt = db_prepare(SQL_HREF_CLEAR)) == NULL ||
+	    db_step(stmt) != SQLITE_DONE)
+		rc = 0;
+	db_finalise(&stmt);
+	return rc;
+}
+
+/*
+ * Delete collection from database without verifying that it exists.
+ * Return zero on failure, non-zero on success.
+ */
+int
+db_collection_remove(int64_t id, const struct prncpl *p)
+{
+	sqlite3_stmt	*stmt;
+
+	if ((stmt = db_prepare(SQL_COL_REMOVE)) == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, id))
+		goto err;
+	else if (db_step(stmt) != SQLITE_DONE)
+		goto err;
+
+	db_finalise(&stmt);
+	kinfo("collection removed (maybe): %" PRId64, id);
+	return 1;
+err:
+	db_finalise(&stmt);
+	return 0;
+}
+
+/*
+ * Delete a resource from the collection and update the ctag.
+ * Only do this if the resource matches the given tag or if the resource
+ * wasn't found (so it's kinda... already deleted?).
  * Returns zero on failure, non-zero on success.
  */
 int
@@ -1497,7 +3577,7 @@ db_resource_delete(const char *url, const char *tag, int64_t colid)
 
 	/* Throw away the results of this query. */
 
-	if ((stmt = db_prepare(sqls[SQL_RES_GET_ETAG])) == NULL)
+	if ((stmt = db_prepare(SQL_RES_GET_ETAG)) == NULL)
 		goto err;
 	else if (!db_bindtext(stmt, 1, url))
 		goto err;
@@ -1515,7 +3595,7 @@ db_resource_delete(const char *url, const char *tag, int64_t colid)
 	} else if (rc != SQLITE_ROW)
 		goto err;
 
-	if ((stmt = db_prepare(sqls[SQL_RES_REMOVE_ETAG])) == NULL)
+	if ((stmt = db_prepare(SQL_RES_REMOVE_ETAG)) == NULL)
 		goto err;
 	else if (!db_bindtext(stmt, 1, url))
 		goto err;
@@ -1526,7 +3606,7 @@ db_resource_delete(const char *url, const char *tag, int64_t colid)
 	else if (db_step(stmt) != SQLITE_DONE)
 		goto err;
 
-	if (db_collection_update_ctag(colid)) {
+	if (db_collection_change(colid, url, 1)) {
 		db_finalise(&stmt);
 		db_trans_commit();
 		kinfo("resource removed: %s", url);
@@ -1549,7 +3629,10 @@ db_resource_remove(const char *url, int64_t colid)
 {
 	sqlite3_stmt	*stmt;
 
-	if ((stmt = db_prepare(sqls[SQL_RES_REMOVE])) == NULL)
+	if (!db_trans_open())
+		return 0;
+
+	if ((stmt = db_prepare(SQL_RES_REMOVE)) == NULL)
 		goto err;
 	else if (!db_bindtext(stmt, 1, url))
 		goto err;
@@ -1559,35 +3642,149 @@ db_resource_remove(const char *url, int64_t colid)
 		goto err;
 
 	db_finalise(&stmt);
-	kinfo("resource removed (unsafe): %s", url);
 
-	if (db_collection_update_ctag(colid))
+	if (db_collection_change(colid, url, 1)) {
+		db_trans_commit();
+		kinfo("resource removed (unsafe): %s", url);
 		return 1;
+	}
+err:
+	db_finalise(&stmt);
+	db_trans_rollback();
+	return 0;
+}
+
+/*
+ * Replace the occurrences of resource "id" in collection "colid" with
+ * "occurs" of "occursz".
+ * Return zero on failure, non-zero on success.
+ */
+static int
+db_resource_occur(int64_t id, int64_t colid,
+	const struct caloccur *occurs, size_t occursz)
+{
+	sqlite3_stmt	*stmt;
+	size_t		 i;
+
+	if ((stmt = db_prepare(SQL_OCCUR_REMOVE)) == NULL)
+		goto err;
+	else if (!db_bindint(stmt, 1, id))
+		goto err;
+	else if (db_step(stmt) != SQLITE_DONE)
+		goto err;
+	db_finalise(&stmt);
+
+	if ((stmt = db_prepare(SQL_OCCUR_INSERT)) == NULL)
+		goto err;
+	for (i = 0; i < occursz; i++) {
+		if (!db_bindint(stmt, 1, id))
+			goto err;
+		else if (!db_bindint(stmt, 2, colid))
+			goto err;
+		else if (!db_bindint(stmt, 3, occurs[i].start))
+			goto err;
+		else if (!db_bindint(stmt, 4, occurs[i].end))
+			goto err;
+		else if (occurs[i].recur ?
+		    !db_bindint(stmt, 5, occurs[i].recurid) :
+		    !db_bindnull(stmt, 5))
+			goto err;
+		else if (!db_bindint(stmt, 6, occurs[i].fbtype))
+			goto err;
+		else if (db_step(stmt) != SQLITE_DONE)
+			goto err;
+		sqlite3_reset(stmt);
+	}
+	db_finalise(&stmt);
+	return 1;
 err:
 	db_finalise(&stmt);
 	return 0;
 }
 
+/*
+ * Check that having stored "size" bytes of resource data in collection
+ * "colid", in place of "oldsize" bytes, keeps the collection's owner
+ * within the quota.
+ * Shrinking is always allowed.
+ * This must be called after storing, within the same transaction, so
+ * that the principal's count includes the data (see kcaldav.sql).
+ * Returns <0 on failure, 0 if over quota, >0 if within it.
+ */
+static int
+db_resource_quota(int64_t colid, size_t oldsize, size_t size)
+{
+	sqlite3_stmt	*stmt;
+	int64_t		 used;
+
+	if (quota == 0 || size <= oldsize)
+		return 1;
+
+	if ((stmt = db_prepare(SQL_PRNCPL_GET_QUOTA)) == NULL)
+		return (-1);
+	else if (!db_bindint(stmt, 1, colid))
+		goto err;
+	else if (db_step(stmt) != SQLITE_ROW)
+		goto err;
+
+	used = sqlite3_column_int64(stmt, 0);
+	db_finalise(&stmt);
+
+	return used < 0 || (uint64_t)used <= quota;
+err:
+	db_finalise(&stmt);
+	return (-1);
+}
+
 /*
  * Create a new resource at "url" in "colid".
  * It initialises the etag to a random number and updates the
  * collection etag as well.
- * This returns <0 if a system error occurs, 0 if a resource by that
- * name already exists, or >0 on success.
+ * This returns RES_CONFLICT if a resource by that name already exists,
+ * RES_QUOTA if the collection's owner has no room for it, RES_OK on
+ * success, or RES_ERR on failure.
  */
-int
-db_resource_new(const char *data, const char *url, int64_t colid)
+enum reserr
+db_resource_new(const struct ical *ical, const char *url, int64_t colid)
 {
-	sqlite3_stmt	*stmt;
+	sqlite3_stmt	*stmt = NULL;
+	struct resmeta	 meta;
+	struct caloccur	*occurs;
+	size_t		 occursz;
 	int		 rc;
+	int64_t		 id;
 	char		 etag[64];
+	char		*data, *rest;
+	struct restz	*tzs;
+	size_t		 tzsz;
+
+	if ((data = ical_printbuf(ical, NULL)) == NULL) {
+		kerr(NULL);
+		return RES_ERR;
+	}
+
+	if (!db_resource_tzsplit(data, &rest, &tzs, &tzsz)) {
+		kerr(NULL);
+		free(data);
+		return RES_ERR;
+	}
+
+	db_resource_meta(&meta, data, ical, &occurs, &occursz);
 
 	snprintf(etag, sizeof(etag), "%" PRIu32 "-%" PRIu32, 
 		get_random(), get_random());
 
-	if ((stmt = db_prepare(sqls[SQL_RES_INSERT])) == NULL)
+	if (!db_trans_open()) {
+		free(occurs);
+		free(rest);
+		free(tzs);
+		free(data);
+		return RES_ERR;
+	}
+
+	if ((stmt = db_prepare(SQL_RES_INSERT)) == NULL)
 		goto err;
-	else if (!db_bindtext(stmt, 1, data))
+	else if (!db_bindtext(stmt, 1, rest))
 		goto err;
 	else if (!db_bindtext(stmt, 2, url))
 		goto err;
@@ -1595,50 +3792,110 @@ db_resource_new(const char *data, const char *url, int64_t colid)
 		goto err;
 	else if (!db_bindtext(stmt, 4, etag))
 		goto err;
+	else if (!db_resource_meta_bind(stmt, 5, &meta))
+		goto err;
 
 	rc = db_step_constrained(stmt);
 	db_finalise(&stmt);
 
-	if (rc == SQLITE_CONSTRAINT)
-		return 0;
-	else if (rc != SQLITE_DONE)
+	if (rc == SQLITE_CONSTRAINT) {
+		db_trans_rollback();
+		free(occurs);
+		free(rest);
+		free(tzs);
+		free(data);
+		return RES_CONFLICT;
+	} else if (rc != SQLITE_DONE)
 		goto err;
 
-	kinfo("resource created: %s", url);
+	id = sqlite3_last_insert_rowid(db);
 
-	if (db_collection_update_ctag(colid))
-		return 1;
+	if ((rc = db_resource_quota(colid, 0, meta.size)) == 0) {
+		db_trans_rollback();
+		free(occurs);
+		free(rest);
+		free(tzs);
+		free(data);
+		return RES_QUOTA;
+	} else if (rc < 0)
+		goto err;
+	if (db_resource_occur(id, colid, occurs, occursz) &&
+	    db_resource_tz(id, tzs, tzsz) &&
+	    db_collection_change(colid, url, 0)) {
+		db_trans_commit();
+		kinfo("resource created: %s", url);
+		free(occurs);
+		free(rest);
+		free(tzs);
+		free(data);
+		return RES_OK;
+	}
 err:
 	db_finalise(&stmt);
-	return (-1);
+	db_trans_rollback();
+	free(occurs);
+	free(rest);
+	free(tzs);
+	free(data);
+	return RES_ERR;
 }
 
 /*
  * Update the resource at "url" in collection "colid" with new data,
  * updating its and the collection's etag to a random number.
+ * The stored data is the canonical form of "ical".
  * Make sure that the existing etag matches "digest".
- * Returns <0 on error, 0 if the resource couldn't be found, or >0 on
- * success.
+ * Returns RES_CONFLICT if the resource couldn't be found or its etag
+ * doesn't match, RES_QUOTA if the collection's owner has no room for
+ * the growth, RES_OK on success, or RES_ERR on failure.
  */
-int
-db_resource_update(const char *data, const char *url, 
-	const char *digest, int64_t colid)
+enum reserr
+db_resource_update(const struct ical *ical,
+	const char *url, const char *digest, int64_t colid)
 {
 	sqlite3_stmt	*stmt = NULL;
 	struct res	*res = NULL;
+	struct resmeta	 meta;
+	struct caloccur	*occurs;
+	size_t		 occursz;
 	int		 rc;
 	int64_t		 id;
 	char		 etag[64];
+	char		*data, *rest;
+	struct restz	*tzs;
+	size_t		 tzsz, oldsize;
+
+	if ((data = ical_printbuf(ical, NULL)) == NULL) {
+		kerr(NULL);
+		return RES_ERR;
+	}
+
+	if (!db_resource_tzsplit(data, &rest, &tzs, &tzsz)) {
+		kerr(NULL);
+		free(data);
+		return RES_ERR;
+	}
+
+	db_resource_meta(&meta, data, ical, &occurs, &occursz);
 
 	snprintf(etag, sizeof(etag), "%" PRIu32 "-%" PRIu32,
 		get_random(), get_random());
 
-	if (!db_trans_open()) 
-		return (-1);
+	if (!db_trans_open()) {
+		free(occurs);
+		free(rest);
+		free(tzs);
+		free(data);
+		return RES_ERR;
+	}
 
-	if ((rc = db_resource_load(&res, url, colid)) == 0) {
+	if ((rc = db_resource_load(&res, url, colid, 0)) == 0) {
 		db_trans_rollback();
-		return 0;
+		free(occurs);
+		free(rest);
+		free(tzs);
+		free(data);
+		return RES_CONFLICT;
 	} else if (rc < 0)
 		goto err;
 
@@ -1647,44 +3904,75 @@ db_resource_update(const char *data, const char *url,
 	if (strcmp(res->etag, digest)) {
 		db_trans_rollback();
 		db_resource_free(res);
-		return 0;
+		free(occurs);
+		free(rest);
+		free(tzs);
+		free(data);
+		return RES_CONFLICT;
 	}
 
 	id = res->id;
+	oldsize = res->meta.size;
 	db_resource_free(res);
 
-	if ((stmt = db_prepare(sqls[SQL_RES_UPDATE])) == NULL)
+	if ((stmt = db_prepare(SQL_RES_UPDATE)) == NULL)
 		goto err;
-	else if (!db_bindtext(stmt, 1, data))
+	else if (!db_bindtext(stmt, 1, rest))
 		goto err;
 	else if (!db_bindtext(stmt, 2, etag))
 		goto err;
-	else if (!db_bindint(stmt, 3, id))
+	else if (!db_resource_meta_bind(stmt, 3, &meta))
+		goto err;
+	else if (!db_bindint(stmt, 3 + RESMETA_NCOLS, id))
 		goto err;
 	else if (db_step(stmt) != SQLITE_DONE)
 		goto err;
 
 	db_finalise(&stmt);
 
-	if (db_collection_update_ctag(colid)) {
+	/* Charge only the growth over the stored data. */
+
+	if ((rc = db_resource_quota(colid, oldsize, meta.size)) == 0) {
+		db_trans_rollback();
+		free(occurs);
+		free(rest);
+		free(tzs);
+		free(data);
+		return RES_QUOTA;
+	} else if (rc < 0)
+		goto err;
+
+	if (db_resource_occur(id, colid, occurs, occursz) &&
+	    db_resource_tz(id, tzs, tzsz) &&
+	    db_collection_change(colid, url, 0)) {
 		db_trans_commit();
 		kinfo("resource updated: %s", url);
-		return 1;
+		free(occurs);
+		free(rest);
+		free(tzs);
+		free(data);
+		return RES_OK;
 	}
 err:
 	db_finalise(&stmt);
 	db_trans_rollback();
-	return (-1);
+	free(occurs);
+	free(rest);
+	free(tzs);
+	free(data);
+	return RES_ERR;
 }
 
 /*
  * Load the resource named "url" within collection "colid".
+ * Its calendar data and parse are loaded as given by "flags".
  * Returns zero if the resource was not found, <0 if the retrieval
  * failed in some way, or >0 if the retrieval was successful.
  * On success, "pp" is set to the resource.
  */
 int
-db_resource_load(struct res **pp, const char *url, int64_t colid)
+db_resource_load(struct res **pp, const char *url, int64_t colid,
+	unsigned int flags)
 {
 	sqlite3_stmt	*stmt;
 	int		 rc;
@@ -1692,7 +3980,7 @@ db_resource_load(struct res **pp, const char *url, int64_t colid)
 	size_t		 sz, rsz;
 
 	*pp = NULL;
-	if ((stmt = db_prepare(sqls[SQL_RES_GET])) == NULL)
+	if ((stmt = db_prepare(SQL_RES_GET)) == NULL)
 		goto err;
 	else if (!db_bindint(stmt, 1, colid))
 		goto err;
@@ -1704,20 +3992,41 @@ db_resource_load(struct res **pp, const char *url, int64_t colid)
 			kerr(NULL);
 			goto err;
 		}
-		(*pp)->data = strdup
-			((char *)sqlite3_column_text(stmt, 0));
 		(*pp)->etag = strdup
 			((char *)sqlite3_column_text(stmt, 1));
 		(*pp)->url = strdup
 			((char *)sqlite3_column_text(stmt, 2));
 		(*pp)->id = sqlite3_column_int64(stmt, 3);
 		(*pp)->collection = sqlite3_column_int64(stmt, 4);
-		if ((*pp)->data == NULL || 
-		    (*pp)->etag == NULL ||
-		    (*pp)->url == NULL) {
+		db_resource_meta_get(stmt, 5, &(*pp)->meta);
+		if ((*pp)->meta.uid != NULL &&
+		    ((*pp)->meta.uid = strdup((*pp)->meta.uid)) == NULL) {
+			kerr(NULL);
+			goto err;
+		}
+		if ((*pp)->etag == NULL || (*pp)->url == NULL) {
+			kerr(NULL);
+			goto err;
+		}
+
+		if (!(flags & (RES_DATA | RES_ICAL))) {
+			db_finalise(&stmt);
+			return 1;
+		}
+		if (!db_resource_tzjoin((*pp)->id,
+		    (char *)sqlite3_column_text(stmt, 0), (char *)
+		    sqlite3_column_text(stmt, 5 + RESMETA_NCOLS),
+		    &(*pp)->data))
+			goto err;
+		if ((*pp)->data == NULL && ((*pp)->data = strdup
+		    ((char *)sqlite3_column_text(stmt, 0))) == NULL) {
 			kerr(NULL);
 			goto err;
 		}
+		if (!(flags & RES_ICAL)) {
+			db_finalise(&stmt);
+			return 1;
+		}
 
 		/* Parse the full iCalendar. */
 
@@ -1744,6 +4053,7 @@ err:
 		free((*pp)->etag);
 		free((*pp)->data);
 		free((*pp)->url);
+		free((*pp)->meta.uid);
 		free(*pp);
 	}
 	db_finalise(&stmt);
@@ -1763,7 +4073,7 @@ db_owner_check_or_set(int64_t id)
 	sqlite3_stmt	*stmt;
 	int64_t		 oid;
 
-	if ((stmt = db_prepare(sqls[SQL_OWNER_GET])) != NULL) {
+	if ((stmt = db_prepare(SQL_OWNER_GET)) != NULL) {
 		if (db_step(stmt) != SQLITE_ROW) 
 			goto err;
 		oid = sqlite3_column_int64(stmt, 0);
@@ -1783,7 +4093,7 @@ db_owner_check_or_set(int64_t id)
 
 	/* Finally, insert our database record. */
 
-	if ((stmt = db_prepare(sqls[SQL_OWNER_INSERT])) == NULL)
+	if ((stmt = db_prepare(SQL_OWNER_INSERT)) == NULL)
 		goto err;
 	else if (!db_bindint(stmt, 1, id))
 		goto err;
@@ -1797,6 +4107,57 @@ err:
 	return (-1);
 }
 
+/*
+ * Get the server secret (used to sign nonces) into "sp", allocating it.
+ * This is created along with the database record, but may be missing
+ * from databases updated before the column was required, in which case
+ * it's created here.
+ * Returns <0 on failure, 0 if the database has no record yet, or >0 on
+ * success.
+ */
+int
+db_secret(char **sp)
+{
+	sqlite3_stmt	*stmt;
+	int		 rc, set = 0;
+
+	*sp = NULL;
+again:
+	if ((stmt = db_prepare(SQL_SECRET_GET)) == NULL)
+		return (-1);
+
+	if ((rc = db_step(stmt)) == SQLITE_DONE) {
+		db_finalise(&stmt);
+		return 0;
+	} else if (rc != SQLITE_ROW)
+		goto err;
+
+	if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+		db_finalise(&stmt);
+		if (set++)
+			return (-1);
+		if ((stmt = db_prepare(SQL_SECRET_SET)) == NULL)
+			return (-1);
+		if (db_step(stmt) != SQLITE_DONE)
+			goto err;
+		db_finalise(&stmt);
+		kinfo("created missing nonce secret");
+		goto again;
+	}
+
+	if ((*sp = strdup((char *)
+	    sqlite3_column_text(stmt, 0))) == NULL) {
+		kerr(NULL);
+		goto err;
+	}
+
+	db_finalise(&stmt);
+	return 1;
+err:
+	db_finalise(&stmt);
+	return (-1);
+}
+
 void
 db_prncpl_free(struct prncpl *p)
 {
@@ -1837,6 +4198,7 @@ db_resource_free(struct res *p)
 	free(p->etag);
 	free(p->url);
 	free(p->data);
+	free(p->meta.uid);
 	ical_free(p->ical);
 	free(p);
 }
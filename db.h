@@ -18,16 +18,55 @@
 
 #define	KREALM		"kcaldav"
 
+/*
+ * Metadata extracted from a resource's iCalendar when it's stored.
+ * If "bits" is zero, the metadata was never extracted (resources
+ * predating it) and the iCalendar must be consulted instead.
+ */
+struct	resmeta {
+	char		*uid; /* UID or NULL */
+	unsigned int	 bits; /* ICAL_xxx components or zero */
+	int64_t		 start; /* earliest start (UTC epoch) */
+	int64_t		 end; /* latest end (UTC epoch) */
+	unsigned int	 flags;
+#define	RESMETA_BOUNDED	 0x01 /* start and end are set */
+#define	RESMETA_FLOATING 0x02 /* start or end floating, not UTC */
+#define	RESMETA_RECUR	 0x04 /* has RRULE or RDATE */
+#define	RESMETA_LASTMOD	 0x08 /* lastmod is set */
+#define	RESMETA_OCCURS	 0x10 /* occurrences are listed */
+	int64_t		 lastmod; /* latest LAST-MODIFIED (UTC epoch) */
+	size_t		 size; /* bytes of iCalendar data */
+	int64_t		 occuntil; /* first not listed or INT64_MAX */
+};
+
+/*
+ * What to load with resources.
+ */
+#define	RES_DATA	0x01 /* calendar data */
+#define	RES_ICAL	0x02 /* calendar data and its parse */
+
 /*
  * Resource in a calendar collection.
+ * The data and its parse are only set when asked for with RES_DATA and
+ * RES_ICAL, respectively, when loading.
+ * The data is in canonical form (as printed by ical_print()).
  */
 struct	res {
-	char		*data;
-	struct ical	*ical;
+	char		*data; /* iCalendar text or NULL */
+	struct ical	*ical; /* parsed data or NULL */
 	char		*etag; /* RFC 2616 etag */
 	char		*url;
 	int64_t		 collection;
 	int64_t		 id;
+	struct resmeta	 meta;
+};
+
+/*
+ * A resource name for db_resource_list().
+ */
+struct	resname {
+	int64_t		 collection; /* collection or <0 if unknown */
+	const char	*url; /* resource name or NULL */
 };
 
 /*
@@ -40,6 +79,7 @@ struct	coln {
 	char		*description; /* free-form description */
 	int64_t		 ctag; /* collection tag */
 	int64_t		 id; /* unique identifier */
+	int64_t		 synclimit; /* earliest valid sync ctag */
 };
 
 /*
@@ -64,8 +104,8 @@ struct	proxy {
 struct	prncpl {
 	char		*name; /* username */
 	char		*hash; /* MD5 of name, realm, and password */
-	uint64_t	 quota_used; /* quota (VFS) */
-	uint64_t	 quota_avail; /* quota (VFS) */
+	uint64_t	 quota_used; /* bytes of resource data */
+	uint64_t	 quota_avail; /* bytes remaining */
 	char		*email; /* email address */
 	struct coln	*cols; /* owned collections */
 	size_t		 colsz; /* number of owned collections */
@@ -86,6 +126,25 @@ enum	nonceerr {
 	NONCE_OK /* nonce checks out */
 };
 
+/*
+ * Return codes for storing resources.
+ */
+enum	reserr {
+	RES_ERR, /* generic error */
+	RES_CONFLICT, /* exists (new) or not found or changed (update) */
+	RES_QUOTA, /* owner's quota would be exceeded */
+	RES_OK /* resource stored */
+};
+
+/*
+ * Statement statistics, used to measure the prepared statement cache.
+ */
+struct	dbstats {
+	uint64_t	 prepares; /* statements compiled */
+	uint64_t	 reuses; /* statements taken from cache */
+	uint64_t	 steps; /* statement steps */
+};
+
 typedef void (*db_msg)(void *, const char *, const char *, va_list);
 
 void		db_set_msg_arg(void *);
@@ -94,13 +153,20 @@ void		db_set_msg_dbg(db_msg);
 void		db_set_msg_info(db_msg);
 void		db_set_msg_err(db_msg);
 void		db_set_msg_errx(db_msg);
+void		db_set_busy_timeout(int);
+void		db_set_quota(uint64_t);
+void		db_set_horizon(int64_t);
+void		db_set_range_cache(size_t);
 
 void		db_collection_free(struct coln *);
+int		db_collection_freebusy(const struct coln *, const struct caltimerange *, struct calbusy **, size_t *);
 int		db_collection_load(struct coln **, const char *, int64_t);
 int		db_collection_loadid(struct coln **, int64_t, int64_t);
 int		db_collection_new(const char *, const struct prncpl *);
 int		db_collection_remove(int64_t, const struct prncpl *);
-int		db_collection_resources(void (*)(const struct res *, void *), int64_t, void *);
+int		db_collection_resources(void (*)(const struct res *, void *), int64_t, unsigned int, void *);
+int		db_collection_resources_range(void (*)(const struct res *, void *), const struct coln *, const struct caltimerange *, void *);
+int		db_collection_sync(void (*)(const char *, const struct res *, void *), int64_t, int64_t, unsigned int, void *);
 int		db_collection_update(const struct coln *, const struct prncpl *);
 int		db_init(const char *, int);
 int		db_nonce_delete(const char *, const struct prncpl *);
@@ -108,6 +174,7 @@ int		db_nonce_new(char **);
 enum nonceerr	db_nonce_update(const char *, int64_t);
 enum nonceerr	db_nonce_validate(const char *, int64_t);
 int		db_owner_check_or_set(int64_t);
+int		db_prepare_all(void);
 void		db_prncpl_free(struct prncpl *);
 int64_t		db_prncpl_identify(const char *);
 int		db_prncpl_load(struct prncpl **, const char *);
@@ -118,9 +185,12 @@ int		db_proxy_remove(const struct prncpl *, int64_t);
 int		db_resource_delete(const char *, const char *, int64_t);
 void		db_resource_free(struct res *);
 int		db_resource_remove(const char *, int64_t);
-int		db_resource_load(struct res **, const char *, int64_t);
-int		db_resource_new(const char *, const char *, int64_t);
-int		db_resource_update(const char *, const char *, const char *, int64_t);
+int		db_resource_list(void (*)(size_t, const struct res *, void *), const struct resname *, size_t, unsigned int, void *);
+int		db_resource_load(struct res **, const char *, int64_t, unsigned int);
+enum reserr	db_resource_new(const struct ical *, const char *, int64_t);
+enum reserr	db_resource_update(const struct ical *, const char *, const char *, int64_t);
+int		db_secret(char **);
+void		db_stats(struct dbstats *);
 
 extern const char *db_sql;
 
@@ -297,7 +297,7 @@ static void
 json_logout(struct kreq *r, struct state *st)
 {
 
-	db_nonce_delete(st->nonce, st->prncpl);
+	nonce_delete(st->nonce, st->prncpl);
 	send200(r);
 }
 
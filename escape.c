@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <kcgi.h>
+#include <kcgixml.h>
+
+#include "libkcaldav.h"
+#include "db.h"
+#include "server.h"
+
+#if XMLESC_X86
+# include <immintrin.h>
+#endif
+
+/*
+ * Finding the XML special characters (those escaped by kxml_putc())
+ * in calendar data, which is mostly long runs of plain text.
+ * The vector kernels use that '<' and '>' differ only in bit 1, and '&'
+ * and '\'' in bit 0, so five characters need only three comparisons.
+ */
+
+static const unsigned char xmlspecial[256] = {
+	['<'] = 1,
+	['>'] = 1,
+	['&'] = 1,
+	['"'] = 1,
+	['\''] = 1,
+};
+
+/*
+ * Return the length of the leading run of "buf" without characters
+ * needing XML escaping.
+ */
+size_t
+xml_escape_span_scalar(const char *buf, size_t sz)
+{
+	const unsigned char	*p = (const unsigned char *)buf;
+	size_t			 i;
+
+	for (i = 0; i < sz; i++)
+		if (xmlspecial[p[i]])
+			break;
+	return i;
+}
+
+#if XMLESC_X86
+
+size_t
+xml_escape_span_sse2(const char *buf, size_t sz)
+{
+	const __m128i	 ltgt = _mm_set1_epi8('>'),
+			 ampap = _mm_set1_epi8('\''),
+			 quot = _mm_set1_epi8('"'),
+			 b1 = _mm_set1_epi8(0x02),
+			 b0 = _mm_set1_epi8(0x01);
+	__m128i		 v, m;
+	unsigned int	 mask;
+	size_t		 i;
+
+	for (i = 0; i + 16 <= sz; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(buf + i));
+		m = _mm_or_si128
+			(_mm_cmpeq_epi8(_mm_or_si128(v, b1), ltgt),
+			 _mm_cmpeq_epi8(_mm_or_si128(v, b0), ampap));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quot));
+		if ((mask = _mm_movemask_epi8(m)) != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + xml_escape_span_scalar(buf + i, sz - i);
+}
+
+__attribute__((target("avx2")))
+size_t
+xml_escape_span_avx2(const char *buf, size_t sz)
+{
+	const __m256i	 ltgt = _mm256_set1_epi8('>'),
+			 ampap = _mm256_set1_epi8('\''),
+			 quot = _mm256_set1_epi8('"'),
+			 b1 = _mm256_set1_epi8(0x02),
+			 b0 = _mm256_set1_epi8(0x01);
+	__m256i		 v, m;
+	unsigned int	 mask;
+	size_t		 i;
+
+	for (i = 0; i + 32 <= sz; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		m = _mm256_or_si256
+			(_mm256_cmpeq_epi8(_mm256_or_si256(v, b1), ltgt),
+			 _mm256_cmpeq_epi8(_mm256_or_si256(v, b0), ampap));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, quot));
+		if ((mask = _mm256_movemask_epi8(m)) != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + xml_escape_span_sse2(buf + i, sz - i);
+}
+
+/*
+ * Whether the AVX2 kernel may be used on this processor.
+ */
+int
+xml_escape_avx2(void)
+{
+
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif /* XMLESC_X86 */
+
+static size_t	 xml_escape_span_init(const char *, size_t);
+
+static size_t	(*xml_escape_spanfp)(const char *, size_t) =
+			xml_escape_span_init;
+
+/*
+ * Pick the kernel on first use.
+ * SSE2 is in the x86-64 baseline, so it needs no check.
+ */
+static size_t
+xml_escape_span_init(const char *buf, size_t sz)
+{
+
+#if XMLESC_X86
+	xml_escape_spanfp = xml_escape_avx2() ?
+		xml_escape_span_avx2 : xml_escape_span_sse2;
+#else
+	xml_escape_spanfp = xml_escape_span_scalar;
+#endif
+	return (*xml_escape_spanfp)(buf, sz);
+}
+
+/*
+ * Like xml_escape_span_scalar(), but with the fastest kernel available.
+ */
+size_t
+xml_escape_span(const char *buf, size_t sz)
+{
+
+	return (*xml_escape_spanfp)(buf, sz);
+}
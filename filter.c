@@ -0,0 +1,1569 @@
+/*
+ * Copyright (c) Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libkcaldav.h"
+
+/*
+ * Evaluation of calendar-query filters (RFC 4791, 9.7) against a
+ * parsed iCalendar, the subset of it requested by calendar-data
+ * (RFC 4791, 9.6), and its busy time (RFC 4791, 7.10).
+ * Components are walked in the iCalendar's node list, which has every
+ * line (including BEGIN and END) in order, so nested components and
+ * the properties of each component can be told apart.
+ * Times of events, to-dos, and journals are taken from the parsed
+ * components, which are in the same order as the nodes, and those of
+ * recurring components from ical_recur_init(3).
+ * Times are compared in UTC: those with a TZID are converted by their
+ * VTIMEZONE, and floating times are taken as UTC.
+ */
+
+/*
+ * Seconds by which to widen the range over which recurrences, which
+ * are in wall-clock time, are expanded, so that all instances in the
+ * range in UTC are found whatever the zone's offset.
+ */
+#define	FILTER_TZSLOP	86400
+
+static int	filter_comp(const struct calfilter *,
+			const struct ical *, const struct icalnode *);
+
+/*
+ * Parse a DATE or DATE-TIME value "cp" into "v".
+ * Sets "date" if it's a DATE.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+filter_datetime(const char *cp, int64_t *v, int *date)
+{
+	struct icaltm	 tm;
+
+	if (!ical_datetime_parse(cp, &tm))
+		return 0;
+	*v = tm.tm;
+	*date = tm.type == ICAL_DT_DATE;
+	return 1;
+}
+
+/*
+ * Invoke "fp" on each node directly within the component starting at
+ * BEGIN node "begin": the properties and the BEGIN nodes of nested
+ * components.
+ * Stops when "fp" returns non-zero and returns that value, else zero.
+ */
+static int
+filter_walk(const struct icalnode *begin,
+	int (*fp)(const struct icalnode *, const void *), const void *arg)
+{
+	const struct icalnode	*np;
+	size_t			 depth = 0;
+	int			 rc;
+
+	for (np = begin->next; np != NULL; np = np->next) {
+		if (strcasecmp(np->name, "END") == 0) {
+			if (depth-- == 0)
+				break;
+			continue;
+		}
+		if (depth == 0 && (rc = fp(np, arg)) != 0)
+			return rc;
+		if (strcasecmp(np->name, "BEGIN") == 0)
+			depth++;
+	}
+	return 0;
+}
+
+/*
+ * Find the parsed component for the BEGIN node "begin", which is of
+ * "type", by counting the components of that type before it.
+ */
+static const struct icalcomp *
+filter_icalcomp(const struct ical *ical, enum icaltype type,
+	const struct icalnode *begin)
+{
+	const struct icalnode	*np;
+	const struct icalcomp	*c = ical->comps[type];
+
+	for (np = ical->first; np != NULL && np != begin; np = np->next)
+		if (strcasecmp(np->name, "BEGIN") == 0 &&
+		    strcasecmp(np->val, icaltypes[type]) == 0 &&
+		    c != NULL)
+			c = c->next;
+
+	return c;
+}
+
+/*
+ * Look up property "name" directly in the component starting at
+ * "begin", returning NULL if not found.
+ */
+static const struct icalnode *
+filter_prop(const struct icalnode *begin, const char *name)
+{
+	const struct icalnode	*np;
+	size_t			 depth = 0;
+
+	for (np = begin->next; np != NULL; np = np->next) {
+		if (strcasecmp(np->name, "END") == 0) {
+			if (depth-- == 0)
+				break;
+		} else if (strcasecmp(np->name, "BEGIN") == 0)
+			depth++;
+		else if (depth == 0 && strcasecmp(np->name, name) == 0)
+			return np;
+	}
+	return NULL;
+}
+
+/*
+ * Like filter_prop(), but returning the value.
+ */
+static const char *
+filter_propval(const struct icalnode *begin, const char *name)
+{
+	const struct icalnode	*np;
+
+	return (np = filter_prop(begin, name)) == NULL ? NULL : np->val;
+}
+
+/*
+ * Get the VTIMEZONE of "ical" named by the TZID in the parameters
+ * "param" of a property, or NULL if there is none.
+ */
+static const struct icalcomp *
+filter_tz(const struct ical *ical, const char *param)
+{
+	const struct icalcomp	*c;
+	const char		*start, *end, *val;
+	size_t			 sz;
+	int			 quote;
+
+	for (start = param; start != NULL && *start != '\0'; ) {
+		for (end = start, quote = 0; *end != '\0'; end++)
+			if (*end == '"')
+				quote = !quote;
+			else if (*end == ';' && !quote)
+				break;
+		if (strncasecmp(start, "TZID=", 5) == 0) {
+			val = start + 5;
+			sz = end - val;
+			if (sz >= 2 && val[0] == '"' && end[-1] == '"') {
+				val++;
+				sz -= 2;
+			}
+			for (c = ical->comps[ICALTYPE_VTIMEZONE];
+			     c != NULL; c = c->next)
+				if (c->tzid != NULL &&
+				    strlen(c->tzid) == sz &&
+				    strncasecmp(c->tzid, val, sz) == 0)
+					return c;
+			break;
+		}
+		start = *end == '\0' ? end : end + 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Parse the DATE or DATE-TIME value of property "np" into "v" in UTC,
+ * converting a local date-time by the VTIMEZONE of its TZID, if any.
+ * Sets "date" if it's a DATE.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+filter_utcval(const struct ical *ical, const struct icalnode *np,
+	int64_t *v, int *date)
+{
+
+	if (!filter_datetime(np->val, v, date))
+		return 0;
+	if (!*date && strchr(np->val, 'Z') == NULL)
+		*v = ical_tz2utc(filter_tz(ical, np->param), *v);
+	return 1;
+}
+
+/*
+ * Get the time of property "name" of the component at "begin" into
+ * "v" in UTC, as for filter_utcval(), returning zero if it's not set or
+ * not a date or date-time.
+ */
+static int
+filter_proputc(const struct ical *ical, const struct icalnode *begin,
+	const char *name, int64_t *v)
+{
+	const struct icalnode	*np;
+	int			 date;
+
+	if ((np = filter_prop(begin, name)) == NULL)
+		return 0;
+	return filter_utcval(ical, np, v, &date);
+}
+
+/*
+ * Convert "v", which is in the wall-clock time of the DTSTART of "c"
+ * (e.g., an instance of its recurrence set), into UTC.
+ */
+static int64_t
+filter_utc(const struct icalcomp *c, int64_t v)
+{
+
+	return c->dtstart.time.type == ICAL_DT_DATETIME ?
+		ical_tz2utc(c->dtstart.tz, v) : v;
+}
+
+/*
+ * The duration of "c", which may be zero if unset.
+ */
+static int64_t
+filter_duration(const struct icalcomp *c)
+{
+	int64_t	 v;
+
+	v = (int64_t)c->duration.week * 604800 +
+		(int64_t)c->duration.day * 86400 +
+		(int64_t)c->duration.hour * 3600 +
+		(int64_t)c->duration.min * 60 +
+		(int64_t)c->duration.sec;
+	return v * c->duration.sign;
+}
+
+/*
+ * The length of each instance of "c", of "type", starting at "begin",
+ * which is zero for instances taking no time.
+ */
+static int64_t
+filter_instdur(const struct ical *ical, const struct icalcomp *c,
+	enum icaltype type, const struct icalnode *begin)
+{
+	int64_t	 due;
+
+	if (c->duration.sign != 0)
+		return filter_duration(c);
+	if (type == ICALTYPE_VEVENT &&
+	    c->dtend.time.type != ICAL_DT_UNSET)
+		return ical_time2utc(&c->dtend) -
+			ical_time2utc(&c->dtstart);
+	if (type == ICALTYPE_VTODO &&
+	    filter_proputc(ical, begin, "DUE", &due))
+		return due - ical_time2utc(&c->dtstart);
+	if (type != ICALTYPE_VTODO &&
+	    c->dtstart.time.type == ICAL_DT_DATE)
+		return 86400;
+	return 0;
+}
+
+/*
+ * Whether the instance "v" of recurring "c" (see filter_utc()), lasting
+ * "dur", overlaps [start, end): those taking time must start before the
+ * end and end after the start; others must start within it.
+ */
+static int
+filter_recurin(const struct icalcomp *c, int64_t dur,
+	int64_t start, int64_t end, int64_t v)
+{
+
+	if ((v = filter_utc(c, v)) >= end)
+		return 0;
+	if (dur > 0)
+		return start <= INT64_MIN + dur || v > start - dur;
+	return v >= start;
+}
+
+/*
+ * Begin iterating over the instances of recurring "c", each lasting
+ * "dur", that may overlap [start, end).
+ * Instances in a time zone must still be checked with filter_recurin().
+ * Returns NULL on memory failure.
+ */
+static struct icalrecur *
+filter_recurinit(const struct icalcomp *c, int64_t dur,
+	int64_t start, int64_t end)
+{
+
+	if (dur > 0 && start > INT64_MIN + dur)
+		start = start - dur + 1;
+	else if (dur > 0)
+		start = INT64_MIN;
+
+	if (c->dtstart.time.type == ICAL_DT_DATETIME &&
+	    c->dtstart.tz != NULL) {
+		start = start > INT64_MIN + FILTER_TZSLOP ?
+			start - FILTER_TZSLOP : INT64_MIN;
+		end = end < INT64_MAX - FILTER_TZSLOP ?
+			end + FILTER_TZSLOP : INT64_MAX;
+	}
+	return ical_recur_init(c, start, end);
+}
+
+/*
+ * Get the RECURRENCE-ID times (in UTC) of the components overriding
+ * instances of the recurring "comp" at BEGIN node "begin": its siblings
+ * of the same type and UID.
+ * The array "ovr" of "ovrsz" must be freed.
+ * Returns zero on memory failure.
+ */
+static int
+filter_overrides(const struct ical *ical, const struct icalnode *begin,
+	const struct icalcomp *comp, int64_t **ovr, size_t *ovrsz)
+{
+	const struct icalnode	*np;
+	const char		*uid;
+	int64_t			 v;
+	size_t			 depth = 0;
+	void			*pp;
+
+	*ovr = NULL;
+	*ovrsz = 0;
+
+	for (np = ical->first->next; np != NULL; np = np->next) {
+		if (strcasecmp(np->name, "END") == 0) {
+			if (depth-- == 0)
+				break;
+			continue;
+		} else if (strcasecmp(np->name, "BEGIN") != 0)
+			continue;
+		if (depth++ > 0 || np == begin || comp->uid == NULL ||
+		    strcasecmp(np->val, begin->val) != 0 ||
+		    (uid = filter_propval(np, "UID")) == NULL ||
+		    strcmp(uid, comp->uid) != 0 ||
+		    !filter_proputc(ical, np, "RECURRENCE-ID", &v))
+			continue;
+		pp = reallocarray(*ovr, *ovrsz + 1, sizeof(int64_t));
+		if (pp == NULL) {
+			free(*ovr);
+			*ovr = NULL;
+			*ovrsz = 0;
+			return 0;
+		}
+		*ovr = pp;
+		(*ovr)[(*ovrsz)++] = v;
+	}
+
+	return 1;
+}
+
+/*
+ * Whether the instance "v" of "c" (see filter_utc()) is one of the
+ * "ovrsz" overridden instances "ovr".
+ */
+static int
+filter_overridden(const struct icalcomp *c,
+	const int64_t *ovr, size_t ovrsz, int64_t v)
+{
+	size_t	 i;
+
+	v = filter_utc(c, v);
+	for (i = 0; i < ovrsz; i++)
+		if (ovr[i] == v)
+			return 1;
+	return 0;
+}
+
+/*
+ * See if the recurring component "c" at BEGIN node "begin", each
+ * instance lasting "dur", has an instance in the range [start, end)
+ * that's not overridden by another component.
+ * On memory failure, assume that it does.
+ */
+static int
+filter_recur(const struct ical *ical, const struct icalnode *begin,
+	const struct icalcomp *c, int64_t dur, int64_t start, int64_t end)
+{
+	struct icalrecur	*r;
+	int64_t			*ovr, v;
+	size_t			 ovrsz;
+	int			 rc;
+
+	if (!filter_overrides(ical, begin, c, &ovr, &ovrsz))
+		return 1;
+	if ((r = filter_recurinit(c, dur, start, end)) == NULL) {
+		free(ovr);
+		return 1;
+	}
+	while ((rc = ical_recur_next(r, &v)))
+		if (filter_recurin(c, dur, start, end, v) &&
+		    !filter_overridden(c, ovr, ovrsz, v))
+			break;
+	ical_recur_free(r);
+	free(ovr);
+	return rc;
+}
+
+/*
+ * Evaluate the time-range [start, end) against the VEVENT, VTODO, or
+ * VJOURNAL at "begin" according to RFC 4791, 9.9.
+ * Other components (e.g., VALARM) are always matched.
+ */
+static int
+filter_comprange(const struct ical *ical, const struct icalnode *begin,
+	int64_t start, int64_t end)
+{
+	const struct icalcomp	*c;
+	enum icaltype		 type;
+	int64_t			 ds, de, due, dur, comp, cre;
+	int			 hasdue, hascomp, hascre;
+
+	for (type = 0; type < ICALTYPE__MAX; type++)
+		if (strcasecmp(icaltypes[type], begin->val) == 0)
+			break;
+
+	if (type != ICALTYPE_VEVENT &&
+	    type != ICALTYPE_VTODO &&
+	    type != ICALTYPE_VJOURNAL)
+		return 1;
+	if ((c = filter_icalcomp(ical, type, begin)) == NULL)
+		return 1;
+
+	ds = ical_time2utc(&c->dtstart);
+	dur = filter_duration(c);
+
+	if (c->dtstart.time.type != ICAL_DT_UNSET &&
+	    (c->rrule.set || c->rdatesz > 0))
+		return filter_recur(ical, begin, c,
+			filter_instdur(ical, c, type, begin), start, end);
+
+	switch (type) {
+	case ICALTYPE_VEVENT:
+		if (c->dtend.time.type != ICAL_DT_UNSET)
+			de = ical_time2utc(&c->dtend);
+		else if (c->duration.sign != 0)
+			de = ds + dur;
+		else if (c->dtstart.time.type == ICAL_DT_DATE)
+			de = ds + 86400;
+		else
+			return start <= ds && end > ds;
+		if (de == ds)
+			return start <= ds && end > ds;
+		return start < de && end > ds;
+	case ICALTYPE_VTODO:
+		hasdue = filter_proputc(ical, begin, "DUE", &due);
+		hascomp = filter_proputc(ical, begin, "COMPLETED", &comp);
+		hascre = c->created.type != ICAL_DT_UNSET;
+		cre = c->created.tm;
+		if (c->dtstart.time.type != ICAL_DT_UNSET) {
+			if (c->duration.sign != 0)
+				return start <= ds + dur &&
+					(end > ds || end >= ds + dur);
+			if (hasdue)
+				return (start < due || start <= ds) &&
+					(end > ds || end >= due);
+			return start <= ds && end > ds;
+		}
+		if (hasdue)
+			return start < due && end >= due;
+		if (hascomp && hascre)
+			return (start <= cre || start <= comp) &&
+				(end >= cre || end >= comp);
+		if (hascomp)
+			return start <= comp && end >= comp;
+		if (hascre)
+			return end > cre;
+		return 1;
+	default:
+		if (c->dtstart.time.type == ICAL_DT_UNSET)
+			return 0;
+		if (c->dtstart.time.type == ICAL_DT_DATE)
+			return start < ds + 86400 && end > ds;
+		return start <= ds && end > ds;
+	}
+}
+
+/*
+ * Evaluate the text-match "m" against the value "val", which is
+ * "sz" bytes long (and not necessarily NUL-terminated).
+ * This is a substring match, case-insensitive for ASCII unless the
+ * collation is octet-wise.
+ */
+static int
+filter_textmatch(const struct caltextmatch *m, const char *val, size_t sz)
+{
+	size_t	 i, j, len;
+	int	 rc = 0;
+
+	if (!m->set)
+		return 1;
+
+	len = strlen(m->val);
+	for (i = 0; !rc && i + len <= sz; i++) {
+		for (j = 0; j < len; j++)
+			if (m->collation == CALCOLLATE_OCTET ?
+			    val[i + j] != m->val[j] :
+			    tolower((unsigned char)val[i + j]) !=
+			    tolower((unsigned char)m->val[j]))
+				break;
+		rc = j == len;
+	}
+
+	return m->negate ? !rc : rc;
+}
+
+/*
+ * Evaluate param-filter "f" against the parameters "param" (e.g.,
+ * "TZID=foo;VALUE=DATE-TIME") of a property.
+ */
+static int
+filter_param(const struct calfilter *f, const char *param)
+{
+	const char	*start, *end, *val;
+	size_t		 sz = strlen(f->name);
+	int		 quote;
+
+	for (start = param; start != NULL && *start != '\0'; ) {
+		/* Find the end, skipping quoted semicolons. */
+
+		for (end = start, quote = 0; *end != '\0'; end++)
+			if (*end == '"')
+				quote = !quote;
+			else if (*end == ';' && !quote)
+				break;
+
+		if ((size_t)(end - start) > sz &&
+		    start[sz] == '=' &&
+		    strncasecmp(start, f->name, sz) == 0) {
+			if (f->notdefined)
+				return 0;
+			val = start + sz + 1;
+			if (end - val >= 2 &&
+			    val[0] == '"' && end[-1] == '"')
+				return filter_textmatch(&f->match,
+					val + 1, end - val - 2);
+			return filter_textmatch(&f->match,
+				val, end - val);
+		}
+		start = *end == '\0' ? end : end + 1;
+	}
+
+	return f->notdefined;
+}
+
+/*
+ * Evaluate prop-filter "f" against the property at "np".
+ */
+static int
+filter_propmatch(const struct calfilter *f, const struct ical *ical,
+	const struct icalnode *np)
+{
+	const struct calfilter	*kid;
+	int64_t			 v;
+	int			 date;
+
+	if (f->ranged) {
+		if (!filter_utcval(ical, np, &v, &date))
+			return 0;
+		if (date ? !(f->start < v + 86400 && f->end > v) :
+		    !(f->start <= v && f->end > v))
+			return 0;
+	}
+	if (!filter_textmatch(&f->match, np->val, strlen(np->val)))
+		return 0;
+	for (kid = f->kids; kid != NULL; kid = kid->next)
+		if (!filter_param(kid, np->param))
+			return 0;
+	return 1;
+}
+
+struct	filterarg {
+	const struct calfilter	*f;
+	const struct ical	*ical;
+};
+
+static int
+filter_prop_cb(const struct icalnode *np, const void *arg)
+{
+	const struct filterarg	*fa = arg;
+
+	if (strcasecmp(np->name, "BEGIN") == 0 ||
+	    strcasecmp(np->name, fa->f->name) != 0)
+		return 0;
+	return fa->f->notdefined ? 1 :
+		filter_propmatch(fa->f, fa->ical, np) ? 2 : 0;
+}
+
+static int
+filter_comp_cb(const struct icalnode *np, const void *arg)
+{
+	const struct filterarg	*fa = arg;
+
+	if (strcasecmp(np->name, "BEGIN") != 0 ||
+	    strcasecmp(np->val, fa->f->name) != 0)
+		return 0;
+	return fa->f->notdefined ? 1 :
+		filter_comp(fa->f, fa->ical, np) ? 2 : 0;
+}
+
+/*
+ * Evaluate comp-filter "f" against the component at BEGIN node "begin"
+ * whose name has already been matched.
+ */
+static int
+filter_comp(const struct calfilter *f, const struct ical *ical,
+	const struct icalnode *begin)
+{
+	const struct calfilter	*kid;
+	struct filterarg	 fa;
+	int			 rc;
+
+	if (f->ranged &&
+	    !filter_comprange(ical, begin, f->start, f->end))
+		return 0;
+
+	fa.ical = ical;
+	for (kid = f->kids; kid != NULL; kid = kid->next) {
+		fa.f = kid;
+		rc = filter_walk(begin, kid->type == CALFILTER_COMP ?
+			filter_comp_cb : filter_prop_cb, &fa);
+		if (kid->notdefined ? rc != 0 : rc == 0)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Evaluate the calendar-query filter "f" against "ical".
+ * A NULL filter matches everything.
+ * Returns non-zero if it matches, zero otherwise.
+ */
+int
+caldav_filter(const struct calfilter *f, const struct ical *ical)
+{
+
+	if (f == NULL)
+		return 1;
+	assert(f->type == CALFILTER_COMP);
+	assert(ical->first != NULL);
+
+	if (strcasecmp(ical->first->val, f->name) != 0)
+		return f->notdefined;
+	if (f->notdefined)
+		return 0;
+	return filter_comp(f, ical, ical->first);
+}
+
+struct	dataout {
+	struct icalnode	 *first;
+	struct icalnode	**last;
+	int		  er; /* memory failure */
+};
+
+/*
+ * Append "np" to the output.
+ * Its strings are shared with "np" unless "val" is given, in which
+ * case its "sz" bytes are copied as the value.
+ */
+static void
+data_add(struct dataout *o, const struct icalnode *np,
+	const char *val, size_t sz)
+{
+	struct icalnode	*n;
+
+	if (o->er)
+		return;
+	if ((n = malloc(sizeof(struct icalnode) + 
+	    (val == NULL ? 0 : sz + 1))) == NULL) {
+		o->er = 1;
+		return;
+	}
+
+	n->name = np->name;
+	n->param = np->param;
+	n->val = np->val;
+	n->next = NULL;
+	if (val != NULL) {
+		n->val = (char *)(n + 1);
+		memcpy(n->val, val, sz);
+		n->val[sz] = '\0';
+	}
+	*o->last = n;
+	o->last = &n->next;
+}
+
+/*
+ * Parse the duration "cp" (RFC 5545, 3.3.6) into seconds.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+data_duration(const char *cp, int64_t *v)
+{
+	int64_t	 n, sign = 1;
+	int	 time = 0;
+
+	if (*cp == '+' || *cp == '-')
+		sign = *cp++ == '-' ? -1 : 1;
+	if (*cp++ != 'P')
+		return 0;
+
+	for (*v = 0; *cp != '\0'; cp++) {
+		if (*cp == 'T') {
+			time = 1;
+			continue;
+		} else if (!isdigit((unsigned char)*cp))
+			return 0;
+		for (n = 0; isdigit((unsigned char)*cp); cp++)
+			if ((n = n * 10 + (*cp - '0')) > 100000000)
+				return 0;
+		if (*cp == 'W' && !time)
+			n *= 604800;
+		else if (*cp == 'D' && !time)
+			n *= 86400;
+		else if (*cp == 'H' && time)
+			n *= 3600;
+		else if (*cp == 'M' && time)
+			n *= 60;
+		else if (*cp != 'S' || !time)
+			return 0;
+		*v += n;
+	}
+
+	*v *= sign;
+	return 1;
+}
+
+/*
+ * Parse the period of "sz" bytes at "cp" (RFC 5545, 3.3.9) into its
+ * start "ps" and end "pe".
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+data_span(const char *cp, size_t sz, int64_t *ps, int64_t *pe)
+{
+	char	 buf[64], *sep;
+	int64_t	 dur;
+	int	 date;
+
+	if (sz >= sizeof(buf))
+		return 0;
+	memcpy(buf, cp, sz);
+	buf[sz] = '\0';
+
+	if ((sep = strchr(buf, '/')) == NULL)
+		return 0;
+	*sep++ = '\0';
+	if (!filter_datetime(buf, ps, &date))
+		return 0;
+
+	if (*sep == 'P' || *sep == '+' || *sep == '-') {
+		if (!data_duration(sep, &dur))
+			return 0;
+		*pe = *ps + dur;
+	} else if (!filter_datetime(sep, pe, &date))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * See if the period of "sz" bytes at "cp" overlaps [start, end).
+ * Periods that can't be parsed are assumed to.
+ */
+static int
+data_period(const char *cp, size_t sz, int64_t start, int64_t end)
+{
+	int64_t	 ps, pe;
+
+	if (!data_span(cp, sz, &ps, &pe))
+		return 1;
+	return start < pe && end > ps;
+}
+
+/*
+ * Append the FREEBUSY property "np" with only the periods overlapping
+ * the limit-freebusy-set (RFC 4791, 9.6.7), if any.
+ */
+static void
+data_freebusy(struct dataout *o, const struct caldata *d,
+	const struct icalnode *np)
+{
+	const char	*cp, *end;
+	char		*buf;
+	size_t		 sz = 0;
+
+	if ((buf = malloc(strlen(np->val) + 1)) == NULL) {
+		o->er = 1;
+		return;
+	}
+
+	for (cp = np->val; *cp != '\0'; cp = *end == '\0' ? end : end + 1) {
+		if ((end = strchr(cp, ',')) == NULL)
+			end = cp + strlen(cp);
+		if (!data_period(cp, end - cp, d->fbstart, d->fbend))
+			continue;
+		if (sz > 0)
+			buf[sz++] = ',';
+		memcpy(buf + sz, cp, end - cp);
+		sz += end - cp;
+	}
+
+	if (sz > 0)
+		data_add(o, np, buf, sz);
+	free(buf);
+}
+
+/*
+ * An instance of a recurring component being expanded.
+ */
+struct	datainst {
+	const struct icalnode	*dtstart; /* of the component */
+	int64_t			 start; /* of the instance */
+	int64_t			 delta; /* from the component's DTSTART */
+};
+
+/*
+ * Format "v" into "buf" like a DATE or DATE-TIME value of "len" bytes.
+ */
+static void
+data_time(char *buf, size_t sz, int64_t v, size_t len)
+{
+
+	ical_utc2str(buf, sz, v, len == 8 ? ICAL_DT_DATE :
+		len == 16 ? ICAL_DT_DATETIMEUTC : ICAL_DT_DATETIME);
+}
+
+/*
+ * Append the property "np" of an instance being expanded, with its
+ * DTSTART set to that of the instance and DTEND or DUE moved with it,
+ * or with an empty value if "novalue".
+ * Properties defining the recurrence set are left out.
+ */
+static void
+data_instprop(struct dataout *o, const struct datainst *inst,
+	const struct icalnode *np, int novalue)
+{
+	char	 buf[32];
+	int64_t	 v;
+	int	 date;
+
+	if (strcasecmp(np->name, "RRULE") == 0 ||
+	    strcasecmp(np->name, "RDATE") == 0 ||
+	    strcasecmp(np->name, "EXDATE") == 0)
+		return;
+
+	if (novalue)
+		data_add(o, np, "", 0);
+	else if (strcasecmp(np->name, "DTSTART") == 0) {
+		data_time(buf, sizeof(buf), inst->start, strlen(np->val));
+		data_add(o, np, buf, strlen(buf));
+	} else if ((strcasecmp(np->name, "DTEND") == 0 ||
+	    strcasecmp(np->name, "DUE") == 0) &&
+	    filter_datetime(np->val, &v, &date)) {
+		data_time(buf, sizeof(buf),
+			v + inst->delta, strlen(np->val));
+		data_add(o, np, buf, strlen(buf));
+	} else
+		data_add(o, np, NULL, 0);
+}
+
+/*
+ * Whether the property "name" is selected by "c" (all are if NULL),
+ * setting "novalue" if only its name and parameters are.
+ */
+static int
+data_prop(const struct calcomp *c, const char *name, int *novalue)
+{
+	size_t	 i;
+
+	*novalue = 0;
+	if (c == NULL || c->allprop)
+		return 1;
+	for (i = 0; i < c->propsz; i++)
+		if (strcasecmp(c->props[i].name, name) == 0) {
+			*novalue = c->props[i].novalue;
+			return 1;
+		}
+	return 0;
+}
+
+/*
+ * Get the node after the component at BEGIN node "begin", or NULL if
+ * at the end.
+ */
+static const struct icalnode *
+data_skip(const struct icalnode *begin)
+{
+	const struct icalnode	*np;
+	size_t			 nest = 0;
+
+	for (np = begin->next; np != NULL; np = np->next)
+		if (strcasecmp(np->name, "BEGIN") == 0)
+			nest++;
+		else if (strcasecmp(np->name, "END") == 0 && nest-- == 0)
+			return np->next;
+	return NULL;
+}
+
+static const struct icalnode *data_comp(struct dataout *,
+	const struct caldata *, const struct calcomp *,
+	const struct ical *, const struct icalnode *, size_t,
+	const struct datainst *);
+
+/*
+ * Append each instance of the recurring component "comp", of "type"
+ * and at BEGIN node "begin", overlapping the expand range (RFC 4791,
+ * 9.6.5), less those overridden by other components (with a
+ * RECURRENCE-ID) with its UID.
+ * Each instance is the component with its own DTSTART and DTEND or DUE
+ * and a RECURRENCE-ID, and without the recurrence set.
+ * Returns the node after the component or NULL if at the end.
+ */
+static const struct icalnode *
+data_expand(struct dataout *o, const struct caldata *d,
+	const struct calcomp *c, const struct ical *ical,
+	const struct icalnode *begin, const struct icalcomp *comp,
+	enum icaltype type)
+{
+	struct icalrecur	*r;
+	struct datainst		 inst;
+	int64_t			*ovr, dur;
+	size_t			 ovrsz;
+
+	if (!filter_overrides(ical, begin, comp, &ovr, &ovrsz)) {
+		o->er = 1;
+		return data_skip(begin);
+	}
+
+	dur = filter_instdur(ical, comp, type, begin);
+	r = filter_recurinit(comp, dur, d->recstart, d->recend);
+	if (r == NULL) {
+		o->er = 1;
+		free(ovr);
+		return data_skip(begin);
+	}
+
+	memset(&inst, 0, sizeof(struct datainst));
+	inst.dtstart = filter_prop(begin, "DTSTART");
+	assert(inst.dtstart != NULL);
+
+	while (!o->er && ical_recur_next(r, &inst.start)) {
+		if (!filter_recurin(comp, dur,
+		    d->recstart, d->recend, inst.start) ||
+		    filter_overridden(comp, ovr, ovrsz, inst.start))
+			continue;
+		inst.delta = inst.start - comp->dtstart.time.tm;
+		data_comp(o, d, c, ical, begin, 1, &inst);
+	}
+
+	ical_recur_free(r);
+	free(ovr);
+	return data_skip(begin);
+}
+
+/*
+ * If the component at BEGIN node "begin" is a recurring VEVENT, VTODO,
+ * or VJOURNAL, get it and its type.
+ * Returns zero if it is not.
+ */
+static int
+data_recurring(const struct ical *ical, const struct icalnode *begin,
+	const struct icalcomp **comp, enum icaltype *type)
+{
+
+	for (*type = 0; *type < ICALTYPE__MAX; (*type)++)
+		if (strcasecmp(icaltypes[*type], begin->val) == 0)
+			break;
+	if (*type != ICALTYPE_VEVENT &&
+	    *type != ICALTYPE_VTODO &&
+	    *type != ICALTYPE_VJOURNAL)
+		return 0;
+	if ((*comp = filter_icalcomp(ical, *type, begin)) == NULL)
+		return 0;
+	return (*comp)->dtstart.time.type != ICAL_DT_UNSET &&
+		((*comp)->rrule.set || (*comp)->rdatesz > 0);
+}
+
+/*
+ * Append the component at BEGIN node "begin" to the output as selected
+ * by "c", or all of it if NULL, and nested "depth" components into the
+ * VCALENDAR.
+ * If "inst" is not NULL, the component is that instance of itself.
+ * Components directly within the VCALENDAR are limited by any expand
+ * or limit-recurrence-set: the former to those that overlap it, with
+ * recurring components expanded; the latter to overriding instances
+ * (with a RECURRENCE-ID) that do.
+ * Returns the node after the component or NULL if at the end.
+ */
+static const struct icalnode *
+data_comp(struct dataout *o, const struct caldata *d,
+	const struct calcomp *c, const struct ical *ical,
+	const struct icalnode *begin, size_t depth,
+	const struct datainst *inst)
+{
+	static char		 recurid[] = "RECURRENCE-ID";
+	const struct icalnode	*np;
+	const struct calcomp	*kid;
+	const struct icalcomp	*comp;
+	struct icalnode		 rid;
+	enum icaltype		 type;
+	char			 buf[32];
+	int			 keep, novalue;
+
+	data_add(o, begin, NULL, 0);
+
+	if (inst != NULL && data_prop(c, recurid, &novalue)) {
+		memset(&rid, 0, sizeof(struct icalnode));
+		rid.name = recurid;
+		rid.param = inst->dtstart->param;
+		data_time(buf, sizeof(buf), inst->start,
+			strlen(inst->dtstart->val));
+		data_add(o, &rid, buf, novalue ? 0 : strlen(buf));
+	}
+
+	for (np = begin->next; np != NULL; ) {
+		if (strcasecmp(np->name, "END") == 0) {
+			data_add(o, np, NULL, 0);
+			return np->next;
+		}
+
+		if (strcasecmp(np->name, "BEGIN") == 0) {
+			kid = NULL;
+			keep = 1;
+			if (c != NULL && !c->allcomp) {
+				for (kid = c->kids; kid != NULL; 
+				     kid = kid->next)
+					if (strcasecmp(kid->name, 
+					    np->val) == 0)
+						break;
+				keep = kid != NULL;
+			}
+			if (keep && depth == 0 && d->expand &&
+			    data_recurring(ical, np, &comp, &type)) {
+				np = data_expand(o, d, kid, ical, np,
+					comp, type);
+				continue;
+			} else if (keep && depth == 0 && d->expand)
+				keep = filter_comprange(ical, np,
+					d->recstart, d->recend);
+			else if (keep && depth == 0 && d->limitrec &&
+			    filter_propval(np, "RECURRENCE-ID") != NULL)
+				keep = filter_comprange(ical, np,
+					d->recstart, d->recend);
+			if (keep)
+				np = data_comp(o, d, kid, ical, np,
+					depth + 1, NULL);
+			else
+				np = data_skip(np);
+			continue;
+		}
+
+		if (!data_prop(c, np->name, &novalue))
+			; /* Not selected. */
+		else if (inst != NULL)
+			data_instprop(o, inst, np, novalue);
+		else if (novalue)
+			data_add(o, np, "", 0);
+		else if (d->limitfb && 
+		    strcasecmp(np->name, "FREEBUSY") == 0)
+			data_freebusy(o, d, np);
+		else
+			data_add(o, np, NULL, 0);
+		np = np->next;
+	}
+
+	return NULL;
+}
+
+/*
+ * Print the parts of "ical" requested by "d" (RFC 4791, 9.6) into a
+ * NUL-terminated buffer, setting "sz" (if not NULL) to its length.
+ * Returns the buffer, which must be freed, or NULL on memory failure.
+ */
+char *
+caldav_data(const struct caldata *d, const struct ical *ical, size_t *sz)
+{
+	struct dataout	 o;
+	struct ical	 out;
+	struct icalnode	*np, *next;
+	char		*buf = NULL;
+
+	assert(ical->first != NULL);
+
+	memset(&o, 0, sizeof(struct dataout));
+	o.last = &o.first;
+
+	if (d->comp == NULL ||
+	    strcasecmp(d->comp->name, ical->first->val) == 0)
+		data_comp(&o, d, d->comp, ical, ical->first, 0, NULL);
+
+	if (!o.er) {
+		memset(&out, 0, sizeof(struct ical));
+		out.first = o.first;
+		buf = ical_printbuf(&out, sz);
+	}
+
+	for (np = o.first; np != NULL; np = next) {
+		next = np->next;
+		free(np);
+	}
+	return buf;
+}
+
+/*
+ * Busy periods being collected by caldav_freebusy().
+ */
+struct	busyout {
+	struct calbusy	**busy;
+	size_t		 *busysz;
+	int64_t		  start; /* of the free-busy range */
+	int64_t		  end;
+};
+
+/*
+ * Append the period [start, end) of "type" clipped to the range.
+ * Returns zero on memory failure.
+ */
+static int
+busy_add(struct busyout *o, enum calfbtype type,
+	int64_t start, int64_t end)
+{
+	struct calbusy	 b;
+
+	b.type = type;
+	b.start = start < o->start ? o->start : start;
+	b.end = end > o->end ? o->end : end;
+	return caldav_freebusy_add(o->busy, o->busysz, &b);
+}
+
+/*
+ * The free-busy type of the time of the VEVENT at BEGIN node "begin"
+ * (RFC 4791, 7.10): none if it's transparent or cancelled.
+ */
+static enum calfbtype
+busy_type(const struct icalnode *begin)
+{
+	const char	*cp;
+
+	if ((cp = filter_propval(begin, "TRANSP")) != NULL &&
+	    strcasecmp(cp, "TRANSPARENT") == 0)
+		return CALFB_FREE;
+	if ((cp = filter_propval(begin, "STATUS")) != NULL) {
+		if (strcasecmp(cp, "CANCELLED") == 0)
+			return CALFB_FREE;
+		if (strcasecmp(cp, "TENTATIVE") == 0)
+			return CALFB_BUSY_TENTATIVE;
+	}
+	return CALFB_BUSY;
+}
+
+/*
+ * Add the busy time of the VEVENT "c" at BEGIN node "begin": each
+ * instance that takes time, unless the event is free.
+ * Instances overridden by other components are skipped, as those are
+ * added on their own.
+ * Returns zero on memory failure.
+ */
+static int
+busy_event(struct busyout *o, const struct ical *ical,
+	const struct icalnode *begin, const struct icalcomp *c)
+{
+	struct icalrecur	*r;
+	enum calfbtype		 type;
+	int64_t			*ovr, dur, v;
+	size_t			 ovrsz;
+	int			 rc = 1;
+
+	if ((type = busy_type(begin)) == CALFB_FREE)
+		return 1;
+
+	if (c->dtstart.time.type == ICAL_DT_UNSET ||
+	    (dur = filter_instdur(ical, c, ICALTYPE_VEVENT, begin)) <= 0)
+		return 1;
+
+	if (!c->rrule.set && c->rdatesz == 0) {
+		v = ical_time2utc(&c->dtstart);
+		return busy_add(o, type, v, v + dur);
+	}
+
+	if (!filter_overrides(ical, begin, c, &ovr, &ovrsz))
+		return 0;
+	if ((r = filter_recurinit(c, dur, o->start, o->end)) == NULL) {
+		free(ovr);
+		return 0;
+	}
+
+	while (rc && ical_recur_next(r, &v))
+		if (filter_recurin(c, dur, o->start, o->end, v) &&
+		    !filter_overridden(c, ovr, ovrsz, v)) {
+			v = filter_utc(c, v);
+			rc = busy_add(o, type, v, v + dur);
+		}
+
+	ical_recur_free(r);
+	free(ovr);
+	return rc;
+}
+
+/*
+ * Get the FBTYPE of the parameters "param" of a FREEBUSY property,
+ * which is BUSY if unset or unknown (RFC 5545, 3.2.9).
+ */
+static enum calfbtype
+busy_fbtype(const char *param)
+{
+	const char	*start, *end, *val;
+	enum calfbtype	 type;
+	size_t		 sz;
+	int		 quote;
+
+	for (start = param; start != NULL && *start != '\0'; ) {
+		for (end = start, quote = 0; *end != '\0'; end++)
+			if (*end == '"')
+				quote = !quote;
+			else if (*end == ';' && !quote)
+				break;
+		if (strncasecmp(start, "FBTYPE=", 7) == 0) {
+			val = start + 7;
+			sz = end - val;
+			for (type = 0; type < CALFB__MAX; type++)
+				if (strlen(calfbtypes[type]) == sz &&
+				    strncasecmp(calfbtypes[type],
+				    val, sz) == 0)
+					return type;
+			break;
+		}
+		start = *end == '\0' ? end : end + 1;
+	}
+
+	return CALFB_BUSY;
+}
+
+/*
+ * Add the periods of each FREEBUSY property of the VFREEBUSY at BEGIN
+ * node "begin" that aren't free.
+ * Periods that can't be parsed are skipped.
+ * Returns zero on memory failure.
+ */
+static int
+busy_freebusy(struct busyout *o, const struct icalnode *begin)
+{
+	const struct icalnode	*np;
+	const char		*cp, *end;
+	enum calfbtype		 type;
+	int64_t			 ps, pe;
+	size_t			 depth = 0;
+
+	for (np = begin->next; np != NULL; np = np->next) {
+		if (strcasecmp(np->name, "END") == 0) {
+			if (depth-- == 0)
+				break;
+			continue;
+		} else if (strcasecmp(np->name, "BEGIN") == 0) {
+			depth++;
+			continue;
+		} else if (depth > 0 ||
+		    strcasecmp(np->name, "FREEBUSY") != 0)
+			continue;
+		if ((type = busy_fbtype(np->param)) == CALFB_FREE)
+			continue;
+		for (cp = np->val; *cp != '\0';
+		     cp = *end == '\0' ? end : end + 1) {
+			if ((end = strchr(cp, ',')) == NULL)
+				end = cp + strlen(cp);
+			if (data_span(cp, end - cp, &ps, &pe) &&
+			    !busy_add(o, type, ps, pe))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Append the busy periods of "ical" within [start, end) to "busy" of
+ * "busysz", which must be NULL and zero or as left by a prior call
+ * (or by caldav_freebusy_add()), and which must be freed.
+ * Busy time is from the VEVENT and VFREEBUSY components as given by
+ * RFC 4791, 7.10, clipped to the range and neither sorted nor merged.
+ * Returns zero on memory failure, non-zero on success.
+ */
+int
+caldav_freebusy(const struct ical *ical, int64_t start, int64_t end,
+	struct calbusy **busy, size_t *busysz)
+{
+	const struct icalnode	*np;
+	const struct icalcomp	*c;
+	struct busyout		 o;
+	size_t			 depth = 0;
+
+	assert(ical->first != NULL);
+
+	o.busy = busy;
+	o.busysz = busysz;
+	o.start = start;
+	o.end = end;
+
+	/* 
+	 * Parsed events are in node order, so follow along with those
+	 * directly within the VCALENDAR.
+	 */
+
+	c = ical->comps[ICALTYPE_VEVENT];
+	for (np = ical->first->next; np != NULL; np = np->next) {
+		if (strcasecmp(np->name, "END") == 0) {
+			if (depth-- == 0)
+				break;
+			continue;
+		} else if (strcasecmp(np->name, "BEGIN") != 0)
+			continue;
+		if (depth++ > 0) {
+			if (strcasecmp(np->val, "VEVENT") == 0 &&
+			    c != NULL)
+				c = c->next;
+			continue;
+		}
+		if (strcasecmp(np->val, "VEVENT") == 0 && c != NULL) {
+			if (!busy_event(&o, ical, np, c))
+				return 0;
+			c = c->next;
+		} else if (strcasecmp(np->val, "VFREEBUSY") == 0 &&
+		    !busy_freebusy(&o, np))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Append a copy of "b" to "busy" of "busysz", as for caldav_freebusy(),
+ * unless it's empty.
+ * The array is grown by doubling whenever its size is a power of two.
+ * Returns zero on memory failure, non-zero on success.
+ */
+int
+caldav_freebusy_add(struct calbusy **busy, size_t *busysz,
+	const struct calbusy *b)
+{
+	size_t	 sz = *busysz;
+	void	*pp;
+
+	if (b->start >= b->end)
+		return 1;
+
+	if ((sz & (sz - 1)) == 0) {
+		pp = reallocarray(*busy,
+			sz == 0 ? 1 : sz * 2, sizeof(struct calbusy));
+		if (pp == NULL)
+			return 0;
+		*busy = pp;
+	}
+
+	(*busy)[(*busysz)++] = *b;
+	return 1;
+}
+
+static int
+busy_cmp(const void *a, const void *b)
+{
+	const struct calbusy	*p1 = a, *p2 = b;
+
+	if (p1->type != p2->type)
+		return p1->type < p2->type ? -1 : 1;
+	if (p1->start != p2->start)
+		return p1->start < p2->start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sort "busy" of "busysz" by type and start, then merge the periods of
+ * each type that overlap or abut, updating "busysz".
+ */
+void
+caldav_freebusy_merge(struct calbusy *busy, size_t *busysz)
+{
+	size_t	 i, j;
+
+	if (*busysz == 0)
+		return;
+
+	qsort(busy, *busysz, sizeof(struct calbusy), busy_cmp);
+
+	for (i = 0, j = 1; j < *busysz; j++)
+		if (busy[j].type == busy[i].type &&
+		    busy[j].start <= busy[i].end) {
+			if (busy[j].end > busy[i].end)
+				busy[i].end = busy[j].end;
+		} else
+			busy[++i] = busy[j];
+
+	*busysz = i + 1;
+}
+
+/*
+ * Occurrences being collected by caldav_occurrences().
+ */
+struct	occurout {
+	struct caloccur	**occurs;
+	size_t		 *occursz;
+	size_t		  max; /* of each component */
+	int64_t		  until; /* horizon */
+	int64_t		  more; /* earliest instance not listed */
+};
+
+/*
+ * Append an occurrence starting at "start" and lasting "dur", which
+ * may be negative, with the RECURRENCE-ID "recurid" if "recur".
+ * The array is grown by doubling whenever its size is a power of two.
+ * Returns zero on memory failure.
+ */
+static int
+occur_add(struct occurout *o, enum calfbtype type, int64_t start,
+	int64_t dur, int recur, int64_t recurid)
+{
+	struct caloccur	*oc;
+	size_t		 sz = *o->occursz;
+	void		*pp;
+
+	if ((sz & (sz - 1)) == 0) {
+		pp = reallocarray(*o->occurs,
+			sz == 0 ? 1 : sz * 2, sizeof(struct caloccur));
+		if (pp == NULL)
+			return 0;
+		*o->occurs = pp;
+	}
+
+	oc = &(*o->occurs)[(*o->occursz)++];
+	oc->start = dur < 0 ? start + dur : start;
+	oc->end = dur < 0 ? start : start + dur;
+	oc->fbtype = dur > 0 ? type : CALFB_FREE;
+	oc->recur = recur;
+	oc->recurid = recurid;
+	return 1;
+}
+
+/*
+ * Add the occurrences of "c", of "type" and at BEGIN node "begin": the
+ * component itself or, if recurring, those of its instances that start
+ * before the horizon and aren't overridden, up to the maximum.
+ * Returns zero on memory failure.
+ */
+static int
+occur_comp(struct occurout *o, const struct ical *ical,
+	const struct icalnode *begin, const struct icalcomp *c,
+	enum icaltype type)
+{
+	struct icalrecur	*r;
+	enum calfbtype		 fbtype;
+	int64_t			*ovr, dur, v, u;
+	size_t			 ovrsz, n = 0;
+	int			 rc = 1, recur;
+
+	if (c->dtstart.time.type == ICAL_DT_UNSET)
+		return 1;
+
+	fbtype = type == ICALTYPE_VEVENT ? busy_type(begin) : CALFB_FREE;
+	dur = filter_instdur(ical, c, type, begin);
+
+	if (!c->rrule.set && c->rdatesz == 0) {
+		recur = filter_proputc(ical, begin, "RECURRENCE-ID", &v);
+		return occur_add(o, fbtype, ical_time2utc(&c->dtstart),
+			dur, recur, recur ? v : 0);
+	}
+
+	if (!filter_overrides(ical, begin, c, &ovr, &ovrsz))
+		return 0;
+	if ((r = ical_recur_init(c, INT64_MIN, INT64_MAX)) == NULL) {
+		free(ovr);
+		return 0;
+	}
+
+	/* 
+	 * The first instance past the horizon or the maximum, if any,
+	 * is the first not listed.
+	 */
+
+	while (rc && ical_recur_next(r, &v)) {
+		u = filter_utc(c, v);
+		if (u >= o->until || n++ == o->max) {
+			if (u < o->more)
+				o->more = u;
+			break;
+		}
+		if (!filter_overridden(c, ovr, ovrsz, v))
+			rc = occur_add(o, fbtype, u, dur, 1, u);
+	}
+
+	ical_recur_free(r);
+	free(ovr);
+	return rc;
+}
+
+/*
+ * List the occurrences of the VEVENT, VTODO, and VJOURNAL components
+ * directly within the VCALENDAR "ical" into "occurs" of "occursz",
+ * which must be NULL and zero and must be freed.
+ * Each component is an occurrence unless recurring, in which case each
+ * of its instances starting before "until" is, less those overridden
+ * by other components, up to "max" for each component.
+ * Components without a start have none.
+ * Sets "more" to the earliest start of any instance not listed, or
+ * INT64_MAX if all are (as for a finite recurrence within the horizon).
+ * Returns zero on memory failure, non-zero on success.
+ */
+int
+caldav_occurrences(const struct ical *ical, int64_t until, size_t max,
+	struct caloccur **occurs, size_t *occursz, int64_t *more)
+{
+	const struct icalnode	*np;
+	const struct icalcomp	*cs[ICALTYPE__MAX];
+	struct occurout		 o;
+	enum icaltype		 type;
+	size_t			 depth = 0;
+
+	assert(ical->first != NULL);
+
+	o.occurs = occurs;
+	o.occursz = occursz;
+	o.max = max;
+	o.until = until;
+	o.more = INT64_MAX;
+
+	/* Follow along with the parsed components in node order. */
+
+	for (type = 0; type < ICALTYPE__MAX; type++)
+		cs[type] = ical->comps[type];
+
+	for (np = ical->first->next; np != NULL; np = np->next) {
+		if (strcasecmp(np->name, "END") == 0) {
+			if (depth-- == 0)
+				break;
+			continue;
+		} else if (strcasecmp(np->name, "BEGIN") != 0)
+			continue;
+		for (type = 0; type < ICALTYPE__MAX; type++)
+			if (strcasecmp(icaltypes[type], np->val) == 0)
+				break;
+		if (type == ICALTYPE__MAX || cs[type] == NULL) {
+			depth++;
+			continue;
+		}
+		if (depth++ == 0 &&
+		    (type == ICALTYPE_VEVENT ||
+		     type == ICALTYPE_VTODO ||
+		     type == ICALTYPE_VJOURNAL) &&
+		    !occur_comp(&o, ical, np, cs[type], type))
+			return 0;
+		cs[type] = cs[type]->next;
+	}
+
+	*more = o.more;
+	return 1;
+}
@@ -55,7 +55,7 @@ method_get(struct kreq *r)
 		return;
 	}
 
-	rc = db_resource_load(&p, st->resource, st->cfg->id);
+	rc = db_resource_load(&p, st->resource, st->cfg->id, RES_DATA);
 
 	if (rc < 0) {
 		kutil_errx_noexit(r, st->prncpl->name,
@@ -106,7 +106,7 @@ method_get(struct kreq *r)
 			"%s", kmimetypes[KMIME_TEXT_CALENDAR]);
 		khttp_head(r, kresps[KRESP_ETAG], "%s", p->etag);
 		khttp_body(r);
-		ical_print(p->ical, http_ical_putc, r);
+		khttp_write(r, p->data, strlen(p->data));
 	}
 
 	db_resource_free(p);
@@ -204,11 +204,16 @@ ical_free(struct ical *p)
 		while ((c = p->comps[i]) != NULL) {
 			p->comps[i] = c->next;
 			icalrrule_free(&c->rrule);
-			for (j = 0; j < c->tzsz; j++)
+			for (j = 0; j < c->tzsz; j++) {
 				icalrrule_free(&c->tzs[j].rrule);
+				free(c->tzs[j].rdates);
+			}
+			ical_tzone_free(c->zone);
 			free(c->dtstart.tzstr);
 			free(c->dtend.tzstr);
 			free(c->tzs);
+			free(c->rdates);
+			free(c->exdates);
 			free(c);
 		}
 	}
@@ -217,113 +222,114 @@ ical_free(struct ical *p)
 	free(p);
 }
 
-static enum icaldatet
-ical_datetime_date(const struct icalparse *p, struct tm *tm,
-	const char *cp, enum icaldatet *res)
+/*
+ * Parse the "n" decimal digits at "cp" into "v".
+ * Unlike sscanf(3), this admits no sign or white-space.
+ * Return zero on failure, non-zero on success.
+ */
+static int
+ical_digits(const char *cp, size_t n, unsigned int *v)
 {
-	unsigned int	day, mon, yr;
-
-	if (sscanf(cp, "%4u%2u%2u", &yr, &mon, &day) != 3)
-		return 0;
 
-	tm->tm_year = yr - 1900;
-	tm->tm_mon = mon - 1;
-	tm->tm_mday = day;
-	*res = ICAL_DT_DATE;
+	for (*v = 0; n > 0; n--, cp++) {
+		if (*cp < '0' || *cp > '9')
+			return 0;
+		*v = *v * 10 + (*cp - '0');
+	}
 	return 1;
 }
 
-static enum icaldatet
-ical_datetime_datetime_utc(const struct icalparse *p, struct tm *tm,
-	const char *cp, enum icaldatet *res)
+/*
+ * Days from the epoch to the (proleptic Gregorian) date of year "y",
+ * month "m" (1--12), and day "d", using the days-from-civil algorithm
+ * of Howard Hinnant.
+ */
+static int64_t
+ical_days(int64_t y, int64_t m, int64_t d)
 {
-	unsigned int	 day, mon, yr, hr, min, sec;
-	char		 t, z;
+	int64_t	 era, yoe, doy, doe;
 
-	if (sscanf(cp, "%4u%2u%2u%c%2u%2u%2u%c",
-	    &yr, &mon, &day, &t, &hr, &min, &sec, &z) != 8)
-		return 0;
-	else if (t != 'T' || z != 'Z')
-		return 0;
+	/* Count the year from March so that leap days come last. */
 
-	tm->tm_year = yr - 1900;
-	tm->tm_mon = mon - 1;
-	tm->tm_mday = day;
-	tm->tm_hour = hr;
-	tm->tm_min = min;
-	tm->tm_sec = sec;
-	*res = ICAL_DT_DATETIMEUTC;
-	return 1;
+	if (m < 3)
+		y--;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
 }
 
-static enum icaldatet
-ical_datetime_datetime(const struct icalparse *p, struct tm *tm,
-	const char *cp, enum icaldatet *res)
+/*
+ * Parse the numeric date and time "cp" into "tm" as seconds since the
+ * epoch, taking it as UTC whether or not it's marked as such.
+ * The date and time must be in one of the following formats:
+ *  YYYYMMDD
+ *  YYYYMMDD 'T' HHMMSS
+ *  YYYYMMDD 'T' HHMMSS 'Z'
+ * Each field is range-checked, allowing for a leap second.
+ * Don't use strptime(3) here because some systems (e.g., some Solaris
+ * derivatives) don't properly handle dates prior to 1900, nor
+ * mktime(3), which would interpret the fields in the server's time
+ * zone.
+ * Return zero on failure, non-zero on success.
+ */
+int
+ical_datetime_parse(const char *cp, struct icaltm *tm)
 {
-	unsigned int	 day, mon, yr, hr, min, sec;
-	char		 t;
+	static const unsigned int mdays[12] = {
+		31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	unsigned int	 yr, mon, day, hr = 0, min = 0, sec = 0, leap;
+	size_t		 sz = strlen(cp);
+	enum icaldatet	 type;
+
+	if (sz == 8)
+		type = ICAL_DT_DATE;
+	else if (sz == 15 && cp[8] == 'T')
+		type = ICAL_DT_DATETIME;
+	else if (sz == 16 && cp[8] == 'T' && cp[15] == 'Z')
+		type = ICAL_DT_DATETIMEUTC;
+	else
+		return 0;
 
-	if (sscanf(cp, "%4u%2u%2u%c%2u%2u%2u",
-	    &yr, &mon, &day, &t, &hr, &min, &sec) != 7)
+	if (!ical_digits(cp, 4, &yr) ||
+	    !ical_digits(cp + 4, 2, &mon) ||
+	    !ical_digits(cp + 6, 2, &day))
+		return 0;
+	if (type != ICAL_DT_DATE &&
+	    (!ical_digits(cp + 9, 2, &hr) ||
+	     !ical_digits(cp + 11, 2, &min) ||
+	     !ical_digits(cp + 13, 2, &sec)))
 		return 0;
-	else if (t != 'T')
+
+	leap = mon == 2 &&
+		yr % 4 == 0 && (yr % 100 != 0 || yr % 400 == 0);
+	if (mon < 1 || mon > 12 || day < 1 ||
+	    day > mdays[mon - 1] + leap ||
+	    hr > 23 || min > 59 || sec > 60)
 		return 0;
 
-	tm->tm_year = yr - 1900;
-	tm->tm_mon = mon - 1;
-	tm->tm_mday = day;
-	tm->tm_hour = hr;
-	tm->tm_min = min;
-	tm->tm_sec = sec;
-	*res = ICAL_DT_DATETIME;
+	tm->type = type;
+	tm->tm = ical_days(yr, mon, day) * 86400 +
+		hr * 3600 + min * 60 + sec;
 	return 1;
 }
 
 /*
- * Try to parse the numeric date and time (assumed UTC) into the "tm"
- * value, seconds since epoch.
- * The date and time must be in one of the following formats:
- *  YYYYMMDD
- *  YYYYMMDD 'T' HHMMSS
- *  YYYYMMDD 'T' HHMMSS 'Z'
+ * Parse the date and time "cp" into "tm" as with
+ * ical_datetime_parse(), reporting failure in "er".
  * Return zero on failure, non-zero on success.
  */
 static int
 ical_datetime(const struct icalparse *p, struct icaltm *tm,
 	const char *cp, char **er)
 {
-	struct tm	 tmm;
-	size_t 		 cplen = strlen(cp);
-	enum icaldatet	 dt;
-	int		 rc;
 
 	memset(tm, 0, sizeof(struct icaltm));
-	memset(&tmm, 0, sizeof(struct tm));
-	tm->type = ICAL_DT_UNSET;
-
-	/*
-	 * Don't use strptime(3) here because some systems (e.g., some
-	 * Solaris derivatives) don't properly handle dates prior to
-	 * 1900.  Since many time zones started prior to that, manually
-	 * convert here to a "struct tm" and use mktime(3) to convert.
-	 */
-
-	if (cplen == 16)
-		rc = ical_datetime_datetime_utc(p, &tmm, cp, &dt);
-	else if (cplen == 15)
-		rc = ical_datetime_datetime(p, &tmm, cp, &dt);
-	else if (cplen == 8)
-		rc = ical_datetime_date(p, &tmm, cp, &dt);
-	else
-		rc = 0;
-
-	if (!rc) {
+	if (!ical_datetime_parse(cp, tm)) {
 		ical_err(er, p->file, p->line, "bad date/date-time");
 		return 0;
 	}
-
-	tm->type = dt;
-	tm->tm = mktime(&tmm);
 	return 1;
 }
 
@@ -480,6 +486,55 @@ ical_utcdatetime(const struct icalparse *p,
 	return v->type == ICAL_DT_DATETIMEUTC;
 }
 
+static int
+ical_tmcmp(const void *a, const void *b)
+{
+	const struct icaltm	*t1 = a, *t2 = b;
+
+	return t1->tm < t2->tm ? -1 : t1->tm > t2->tm;
+}
+
+/*
+ * Parse a comma-separated list of dates or date-times (RDATE or EXDATE)
+ * and append it to "v", which is kept sorted.
+ * Periods (RDATE only) contribute their start.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+ical_datelist(const struct icalparse *p, struct icaltm **v,
+	size_t *vsz, const char *cp, char **er)
+{
+	char		 buf[32];
+	size_t		 len;
+	void		*pp;
+
+	for (;;) {
+		len = strcspn(cp, ",/");
+		if (len >= sizeof(buf)) {
+			ical_err(er, p->file, p->line, "bad date/date-time");
+			return 0;
+		}
+		memcpy(buf, cp, len);
+		buf[len] = '\0';
+		pp = reallocarray(*v, *vsz + 1, sizeof(struct icaltm));
+		if (pp == NULL)
+			return 0;
+		*v = pp;
+		if (!ical_datetime(p, &(*v)[*vsz], buf, er))
+			return 0;
+		(*vsz)++;
+		cp += len;
+		if (*cp == '/')
+			cp += strcspn(cp, ",");
+		if (*cp == '\0')
+			break;
+		cp++;
+	}
+
+	qsort(*v, *vsz, sizeof(struct icaltm), ical_tmcmp);
+	return 1;
+}
+
 /*
  * Parse a single signed, bounded integer.
  * Returns zero on success, non-zero on failure.
@@ -718,7 +773,7 @@ ical_rrule_param(const struct icalparse *p, struct icalrrule *vp,
 		ical_err(er, p->file, p->line, 
 			"malformed \"BYMINUTE\"");
 	} else if (strcmp(key, "BYMONTHDAY") == 0) {
-		if (ical_llong(p, &vp->bmnd, &vp->bmndsz, v, 1, 31, er))
+		if (ical_llong(p, &vp->bmnd, &vp->bmndsz, v, -31, 31, er))
 			return 1;
 		ical_err(er, p->file, p->line, 
 			"malformed \"BYMONTHDAY\"");
@@ -728,7 +783,7 @@ ical_rrule_param(const struct icalparse *p, struct icalrrule *vp,
 		ical_err(er, p->file, p->line, 
 			"malformed \"BYMONTH\"");
 	} else if (strcmp(key, "BYSECOND") == 0) {
-		if (ical_lulong(p, &vp->bsec, &vp->bsecsz, v, 1, 59, er))
+		if (ical_lulong(p, &vp->bsec, &vp->bsecsz, v, 0, 60, er))
 			return 1;
 		ical_err(er, p->file, p->line, 
 			"malformed \"BYSECOND\"");
@@ -738,12 +793,12 @@ ical_rrule_param(const struct icalparse *p, struct icalrrule *vp,
 		ical_err(er, p->file, p->line, 
 			"malformed \"BYSETPOS\"");
 	} else if (strcmp(key, "BYWEEKNO") == 0) {
-		if (ical_llong(p, &vp->bwkn, &vp->bwknsz, v, 1, 53, er))
+		if (ical_llong(p, &vp->bwkn, &vp->bwknsz, v, -53, 53, er))
 			return 1;
 		ical_err(er, p->file, p->line, 
 			"malformed \"BYWEEKNO\"");
 	} else if (strcmp(key, "BYYEARDAY") == 0) {
-		if (ical_llong(p, &vp->byrd, &vp->byrdsz, v, 1, 366, er))
+		if (ical_llong(p, &vp->byrd, &vp->byrdsz, v, -366, 366, er))
 			return 1;
 		ical_err(er, p->file, p->line, 
 			"malformed \"BYYEARDAY\"");
@@ -810,8 +865,10 @@ static int
 ical_duration(const struct icalparse *p,
 	struct icaldur *v, char *cp, char **er)
 {
-	char	*start;
-	char	 type;
+	char		*start;
+	char		 type;
+	unsigned long	*up;
+	int		 rc;
 
 	memset(v, 0, sizeof(struct icaldur));
 
@@ -850,33 +907,41 @@ ical_duration(const struct icalparse *p,
 		if ('\0' == *cp)
 			break;
 
+		/*
+		 * Terminate the number in place to parse it, then put
+		 * back the designator: the value is printed as-is.
+		 */
+
 		type = *cp;
-		*cp++ = '\0';
 		switch (type) {
 		case ('D'):
-			if (ical_ulong(p, &v->day, start, 0, ULONG_MAX, er))
-				continue;
+			up = &v->day;
 			break;
 		case ('W'):
-			if (ical_ulong(p, &v->week, start, 0, ULONG_MAX, er))
-				continue;
+			up = &v->week;
 			break;
 		case ('H'):
-			if (ical_ulong(p, &v->hour, start, 0, ULONG_MAX, er))
-				continue;
+			up = &v->hour;
 			break;
 		case ('M'):
-			if (ical_ulong(p, &v->min, start, 0, ULONG_MAX, er))
-				continue;
+			up = &v->min;
 			break;
 		case ('S'):
-			if (ical_ulong(p, &v->sec, start, 0, ULONG_MAX, er))
-				continue;
+			up = &v->sec;
 			break;
 		default:
+			up = NULL;
 			break;
 		}
-		break;
+		if (up == NULL)
+			break;
+		*cp = '\0';
+		rc = ical_ulong(p, up, start, 0, ULONG_MAX, er);
+		*cp++ = type;
+		if (!rc) {
+			ical_err(er, p->file, p->line, "bad duration");
+			return 0;
+		}
 	}
 
 	if ('\0' == *cp)
@@ -1172,6 +1237,9 @@ ical_parsetz(struct icalparse *p, enum icaltztype type, char **er)
 			rc = ical_utc_offs(p, &c->tzto, np->val, er);
 		else if (strcasecmp(name, "rrule") == 0)
 			rc = ical_rrule(p, &c->rrule, np->val, 1, er);
+		else if (strcasecmp(name, "rdate") == 0)
+			rc = ical_datelist(p, &c->rdates,
+				&c->rdatesz, np->val, er);
 
 		if (!rc)
 			return 0;
@@ -1291,6 +1359,12 @@ ical_parsecomp(struct icalparse *p, enum icaltype type, char **er)
 			rc = ical_string(p, &c->tzid, np->val, er);
 		else if (strcasecmp(name, "rrule") == 0)
 			rc = ical_rrule(p, &c->rrule, np->val, 0, er);
+		else if (strcasecmp(name, "rdate") == 0)
+			rc = ical_datelist(p, &c->rdates,
+				&c->rdatesz, np->val, er);
+		else if (strcasecmp(name, "exdate") == 0)
+			rc = ical_datelist(p, &c->exdates,
+				&c->exdatesz, np->val, er);
 
 		if (!rc)
 			return 0;
@@ -1368,7 +1442,9 @@ ical_postparse_tz(struct icalparse *pp, struct icaltime *tm, char **er)
 /*
  * RFC 5545 does not impose ordering constraints.
  * Link them together here.
- * At this point this is just the timezones in DTSTART and DTEND.
+ * At this point this is just the timezones in DTSTART and DTEND, each
+ * of which is first compiled for converting times (or taken from those
+ * already compiled).
  * Returns zero on failure, non-zero on success.
  */
 static int
@@ -1377,6 +1453,11 @@ ical_postparse(struct icalparse *pp, char **er)
 	struct icalcomp	*c;
 	enum icaltype	 i;
 
+	for (c = pp->ical->comps[ICALTYPE_VTIMEZONE];
+	     c != NULL; c = c->next)
+		if ((c->zone = ical_tzone_new(c)) == NULL)
+			return 0;
+
 	for (i = 0; i < ICALTYPE__MAX; i++)
 		for (c = pp->ical->comps[i]; c != NULL; c = c->next) {
 			if (!ical_postparse_tz(pp, &c->dtstart, er))
@@ -1666,6 +1747,53 @@ ical_print(const struct ical *p, ical_putchar fp, void *arg)
 	return icalnode_print(p->first, fp, arg);
 }
 
+struct	icalbuf {
+	char	*buf;
+	size_t	 sz;
+	size_t	 max;
+};
+
+static int
+icalbuf_putc(int c, void *arg)
+{
+	struct icalbuf	*p = arg;
+	void		*pp;
+
+	if (p->sz + 1 >= p->max) {
+		pp = realloc(p->buf, p->max * 2);
+		if (pp == NULL)
+			return 0;
+		p->buf = pp;
+		p->max *= 2;
+	}
+	p->buf[p->sz++] = c;
+	return 1;
+}
+
+/*
+ * Print an iCalendar into a NUL-terminated buffer, setting "sz" (if not
+ * NULL) to its length.
+ * Returns the buffer, which must be freed, or NULL on memory failure.
+ */
+char *
+ical_printbuf(const struct ical *p, size_t *sz)
+{
+	struct icalbuf	 b;
+
+	b.sz = 0;
+	b.max = 1024;
+	if ((b.buf = malloc(b.max)) == NULL)
+		return NULL;
+	if (!icalnode_print(p->first, icalbuf_putc, &b)) {
+		free(b.buf);
+		return NULL;
+	}
+	b.buf[b.sz] = '\0';
+	if (sz != NULL)
+		*sz = b.sz;
+	return b.buf;
+}
+
 /*
  * Print an iCalendar directly to the given file descriptor.
  * Returns zero on failure, non-zero on success.
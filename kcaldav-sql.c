@@ -0,0 +1,215 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "libkcaldav.h"
+#include "db.h"
+const char *db_sql = "PRAGMA journal_mode=WAL;\n\
+PRAGMA foreign_keys=ON;\n\
+\n\
+\n\
+CREATE TABLE resource (\n\
+	collection INTEGER NOT NULL,\n\
+	url TEXT NOT NULL,\n\
+	etag TEXT NOT NULL DEFAULT('1'),\n\
+	data TEXT NOT NULL,\n\
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,\n\
+	flags INTEGER NOT NULL DEFAULT(0),\n\
+	uid TEXT,\n\
+	components INTEGER NOT NULL DEFAULT(0),\n\
+	dtstart INTEGER,\n\
+	dtend INTEGER,\n\
+	floating INTEGER NOT NULL DEFAULT(0),\n\
+	recurring INTEGER NOT NULL DEFAULT(0),\n\
+	lastmod INTEGER,\n\
+	size INTEGER NOT NULL DEFAULT(0),\n\
+	occurs INTEGER NOT NULL DEFAULT(0),\n\
+	occuntil INTEGER,\n\
+	unique (url,collection),\n\
+	FOREIGN KEY (collection) REFERENCES collection(id) ON DELETE CASCADE\n\
+);\n\
+\n\
+\n\
+CREATE INDEX resource_dtstart ON resource(collection,occurs,dtstart);\n\
+CREATE INDEX resource_occuntil ON resource(collection,occuntil);\n\
+\n\
+\n\
+CREATE TABLE occurrence (\n\
+	resource INTEGER NOT NULL,\n\
+	collection INTEGER NOT NULL,\n\
+	dtstart INTEGER NOT NULL,\n\
+	dtend INTEGER NOT NULL,\n\
+	recurid INTEGER,\n\
+	fbtype INTEGER NOT NULL DEFAULT(0),\n\
+	FOREIGN KEY (resource) REFERENCES resource(id) ON DELETE CASCADE\n\
+);\n\
+\n\
+CREATE INDEX occurrence_dtend ON occurrence(collection,dtend);\n\
+CREATE INDEX occurrence_resource ON occurrence(resource);\n\
+\n\
+\n\
+CREATE TABLE timezone (\n\
+	hash INTEGER NOT NULL,\n\
+	data TEXT NOT NULL,\n\
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL\n\
+);\n\
+\n\
+CREATE INDEX timezone_hash ON timezone(hash);\n\
+\n\
+\n\
+CREATE TABLE resourcetz (\n\
+	resource INTEGER NOT NULL,\n\
+	timezone INTEGER NOT NULL,\n\
+	offs INTEGER NOT NULL,\n\
+	FOREIGN KEY (resource) REFERENCES resource(id) ON DELETE CASCADE,\n\
+	FOREIGN KEY (timezone) REFERENCES timezone(id)\n\
+);\n\
+\n\
+CREATE INDEX resourcetz_resource ON resourcetz(resource,offs);\n\
+CREATE INDEX resourcetz_timezone ON resourcetz(timezone);\n\
+\n\
+CREATE TRIGGER resourcetz_delete AFTER DELETE ON resourcetz\n\
+BEGIN\n\
+	DELETE FROM timezone WHERE id=OLD.timezone AND NOT EXISTS\n\
+		(SELECT 1 FROM resourcetz WHERE timezone=OLD.timezone);\n\
+END;\n\
+\n\
+\n\
+CREATE TABLE collection (\n\
+	principal INTEGER NOT NULL,\n\
+	url TEXT NOT NULL,\n\
+	displayname TEXT NOT NULL DEFAULT('Calendar'),\n\
+	colour TEXT NOT NULL DEFAULT('#B90E28FF'),\n\
+	description TEXT NOT NULL DEFAULT(''),\n\
+	ctag INT NOT NULL DEFAULT(1),\n\
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,\n\
+	flags INTEGER NOT NULL DEFAULT(0),\n\
+	synclimit INTEGER NOT NULL DEFAULT(0),\n\
+	unique (url,principal),\n\
+	FOREIGN KEY (principal) REFERENCES principal(id) ON DELETE CASCADE\n\
+);\n\
+\n\
+\n\
+CREATE TABLE changelog (\n\
+	collection INTEGER NOT NULL,\n\
+	url TEXT NOT NULL,\n\
+	seq INTEGER NOT NULL,\n\
+	deleted INTEGER NOT NULL DEFAULT(0),\n\
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,\n\
+	unique (collection,url),\n\
+	FOREIGN KEY (collection) REFERENCES collection(id) ON DELETE CASCADE\n\
+);\n\
+\n\
+CREATE INDEX changelog_seq ON changelog(collection,seq);\n\
+CREATE INDEX changelog_deleted ON changelog(collection,deleted,seq);\n\
+\n\
+\n\
+CREATE TABLE proxy (\n\
+	principal INTEGER NOT NULL,\n\
+	proxy INTEGER NOT NULL,\n\
+	bits INTEGER NOT NULL DEFAULT(0),\n\
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,\n\
+	flags INTEGER NOT NULL DEFAULT(0),\n\
+	unique (principal,proxy),\n\
+	FOREIGN KEY (principal) REFERENCES principal(id) ON DELETE CASCADE,\n\
+	FOREIGN KEY (proxy) REFERENCES principal(id) ON DELETE CASCADE\n\
+);\n\
+\n\
+\n\
+CREATE TABLE principal (\n\
+	name TEXT NOT NULL,\n\
+	hash TEXT NOT NULL,\n\
+	email TEXT NOT NULL,\n\
+	flags INTEGER NOT NULL DEFAULT(0),\n\
+	generation INTEGER NOT NULL DEFAULT(0),\n\
+	quota_used INTEGER NOT NULL DEFAULT(0),\n\
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,\n\
+	unique (email),\n\
+	unique (name)\n\
+);\n\
+\n\
+\n\
+CREATE TRIGGER collection_insert AFTER INSERT ON collection\n\
+BEGIN\n\
+	UPDATE principal SET generation=generation+1\n\
+		WHERE id=NEW.principal;\n\
+END;\n\
+\n\
+CREATE TRIGGER collection_update AFTER UPDATE ON collection\n\
+BEGIN\n\
+	UPDATE principal SET generation=generation+1\n\
+		WHERE id=NEW.principal;\n\
+END;\n\
+\n\
+CREATE TRIGGER collection_delete AFTER DELETE ON collection\n\
+BEGIN\n\
+	UPDATE principal SET generation=generation+1\n\
+		WHERE id=OLD.principal;\n\
+END;\n\
+\n\
+CREATE TRIGGER proxy_insert AFTER INSERT ON proxy\n\
+BEGIN\n\
+	UPDATE principal SET generation=generation+1\n\
+		WHERE id IN (NEW.principal, NEW.proxy);\n\
+END;\n\
+\n\
+CREATE TRIGGER proxy_update AFTER UPDATE ON proxy\n\
+BEGIN\n\
+	UPDATE principal SET generation=generation+1\n\
+		WHERE id IN (NEW.principal, NEW.proxy);\n\
+END;\n\
+\n\
+CREATE TRIGGER proxy_delete AFTER DELETE ON proxy\n\
+BEGIN\n\
+	UPDATE principal SET generation=generation+1\n\
+		WHERE id IN (OLD.principal, OLD.proxy);\n\
+END;\n\
+\n\
+CREATE TRIGGER principal_update\n\
+	AFTER UPDATE OF name, hash, email ON principal\n\
+BEGIN\n\
+	UPDATE principal SET generation=generation+1\n\
+		WHERE id=NEW.id OR\n\
+		id IN (SELECT principal FROM proxy WHERE proxy=NEW.id) OR\n\
+		id IN (SELECT proxy FROM proxy WHERE principal=NEW.id);\n\
+END;\n\
+\n\
+\n\
+CREATE TRIGGER resource_insert AFTER INSERT ON resource\n\
+BEGIN\n\
+	UPDATE principal SET generation=generation+1,\n\
+		quota_used=quota_used+NEW.size\n\
+		WHERE id=(SELECT principal FROM collection\n\
+			WHERE id=NEW.collection);\n\
+END;\n\
+\n\
+CREATE TRIGGER resource_update AFTER UPDATE OF data, size ON resource\n\
+BEGIN\n\
+	UPDATE principal SET generation=generation+1,\n\
+		quota_used=quota_used+NEW.size-OLD.size\n\
+		WHERE id=(SELECT principal FROM collection\n\
+			WHERE id=NEW.collection);\n\
+END;\n\
+\n\
+CREATE TRIGGER resource_delete AFTER DELETE ON resource\n\
+BEGIN\n\
+	UPDATE principal SET generation=generation+1,\n\
+		quota_used=quota_used-OLD.size\n\
+		WHERE id=(SELECT principal FROM collection\n\
+			WHERE id=OLD.collection);\n\
+END;\n\
+\n\
+CREATE TRIGGER collection_delete_resources BEFORE DELETE ON collection\n\
+BEGIN\n\
+	UPDATE principal SET quota_used=quota_used-(SELECT\n\
+		COALESCE(SUM(size), 0)\n\
+		FROM resource WHERE collection=OLD.id)\n\
+		WHERE id=OLD.principal;\n\
+END;\n\
+\n\
+\n\
+CREATE TABLE database (\n\
+	owneruid INTEGER NOT NULL,\n\
+	secret TEXT NOT NULL DEFAULT(lower(hex(randomblob(32))))\n\
+);\n\
+";
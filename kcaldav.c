@@ -16,10 +16,12 @@
 #include "config.h"
 
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #if HAVE_MD5
 # include <md5.h>
@@ -27,6 +29,7 @@
 #if HAVE_SANDBOX_INIT
 # include <sandbox.h> /* sandbox_init(3) */
 #endif
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -34,9 +37,7 @@
 #if !HAVE_ARC4RANDOM
 # include <time.h> /* time(3) */
 #endif
-#if HAVE_PLEDGE
-# include <unistd.h> /* pledge(2), unveil(2) */
-#endif
+#include <unistd.h> /* fork(2), pledge(2), unveil(2) */
 
 #include <kcgi.h>
 #include <kcgixml.h>
@@ -48,6 +49,8 @@
 
 static int verbose;
 
+static volatile sig_atomic_t supervisor_stop;
+
 static const char *const pages[PAGE__MAX] = {
 	"delcoln", /* PAGE_DELCOLN */
 	"delproxy", /* PAGE_DELPROXY */
@@ -72,69 +75,6 @@ static const char *const valids[VALID__MAX] = {
 	"path", /* VALID_PATH */
 };
 
-/*
- * Run a series of checks for the nonce validity.
- * This requires us to first open the nonce database read-only and see
- * if we've seen the nonce or not.
- * If we have and it's a replay--bam.
- * Otherwise, re-open the database read-writable and check again.
- * If we find it and it's a replay--bam.
- * If we find it and it's not, update the nonce count.
- * If we don't find it, start over.
- * Return -2 on system failure, -1 on replay, 0 on stale, 1 on ok.
- */
-static int
-nonce_validate(const struct khttpdigest *auth, char **np)
-{
-	/*
-	 * See whether our nonce lookup fails.
-	 * This is still occuring over a read-only database, as an
-	 * adversary could be playing us by submitting replay attacks
-	 * (or random nonce values) over and over again in the hopes of
-	 * filling up our nonce database.
-	 */
-
-	switch (db_nonce_validate(auth->nonce, auth->count)) {
-	case NONCE_ERR:
-		return (-2);
-	case NONCE_REPLAY:
-		return (-1);
-	case NONCE_NOTFOUND:
-		/*
-		 * We don't have the nonce.
-		 * This means that the client has either used one of our
-		 * bogus initial nonces or is using one from a much
-		 * earlier session.
-		 * Tell them to retry with a new nonce.
-		 */
-		if (!db_nonce_new(np))
-			return (-2);
-		return 0;
-	default:
-		break;
-	} 
-
-	/*
-	 * Now we actually update our nonce file.
-	 * We only get here if the nonce value exists and is fresh.
-	 */
-
-	switch (db_nonce_update(auth->nonce, auth->count)) {
-	case NONCE_ERR:
-		return (-2);
-	case NONCE_REPLAY:
-		return (-1);
-	case NONCE_NOTFOUND:
-		if (!db_nonce_new(np))
-			return (-2);
-		return 0;
-	default:
-		break;
-	} 
-
-	return 1;
-}
-
 /*
  * The name of a calendar.
  * Less than... 1K?
@@ -408,103 +348,119 @@ state_load(struct kreq *r, struct state *st,
 	return 1;
 }
 
-int
-main(void)
+static void
+supervisor_sig(int sig)
 {
-	struct kreq	 r;
-	struct kvalid	 valid[VALID__MAX] = {
-		{ kvalid_proxy_bits, valids[VALID_BITS] },
-		{ kvalid_body, valids[VALID_BODY] },
-		{ kvalid_colour, valids[VALID_COLOUR] },
-		{ kvalid_description, valids[VALID_DESCRIPTION] },
-		{ kvalid_email, valids[VALID_EMAIL] },
-		{ kvalid_int, valids[VALID_ID] },
-		{ kvalid_name, valids[VALID_NAME] },
-		{ kvalid_hash, valids[VALID_PASS] },
-		{ kvalid_path, valids[VALID_PATH] } }; 
-	struct state	*st = NULL;
-	char		*np;
-	struct conf	 conf;
-	const char	*cfgfile = NULL;
-	size_t		 i, sz;
-	enum kcgi_err	 er;
-	int		 rc;
-
-	/*
-	 * Hard-coded configuration file path.  If unset or set to an
-	 * empty string, no configuration file is used.
-	 */
-#ifdef CFGFILE
-	cfgfile = CFGFILE;
-#endif
-
-	/* Needed for non-OpenBSD systems for a weak PRNG. */
-
-#if !HAVE_ARC4RANDOM
-	srandom(time(NULL));
-#endif
 
-	/* Pledge allowing some file-system access. */
+	supervisor_stop = 1;
+}
 
-#if HAVE_PLEDGE
-	if (pledge("proc stdio rpath cpath wpath flock fattr unveil", NULL) == -1)
-		kutil_err(NULL, NULL, "pledge");
-#endif
+/*
+ * Pre-fork "workers" FastCGI worker processes, all of which accept
+ * connections from the FastCGI socket we've inherited, then sit in a
+ * loop and respawn any worker that exits (crashes, hits its maximum
+ * number of requests, etc.).
+ * This only returns in the worker process: the supervisor process
+ * terminates all workers and exits when signalled.
+ */
+static void
+supervise(size_t workers)
+{
+	pid_t		*pids, pid;
+	size_t		 i;
+	int		 status;
+	struct sigaction sa;
+
+	pids = kcalloc(workers, sizeof(pid_t));
+
+	memset(&sa, 0, sizeof(struct sigaction));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = supervisor_sig;
+	if (sigaction(SIGTERM, &sa, NULL) == -1 ||
+	    sigaction(SIGINT, &sa, NULL) == -1 ||
+	    sigaction(SIGHUP, &sa, NULL) == -1)
+		kutil_err(NULL, NULL, "sigaction");
+
+	while (!supervisor_stop) {
+		for (i = 0; i < workers; i++) {
+			if (pids[i] != 0)
+				continue;
+			if ((pid = fork()) == -1) {
+				kutil_warn(NULL, NULL, "fork");
+				break;
+			} else if (pid == 0) {
+				/* Worker: back to default handlers. */
+				sa.sa_handler = SIG_DFL;
+				sigaction(SIGTERM, &sa, NULL);
+				sigaction(SIGINT, &sa, NULL);
+				sigaction(SIGHUP, &sa, NULL);
+				free(pids);
+				return;
+			}
+			pids[i] = pid;
+		}
 
-	/* Read run-time configuration.  Act upon it then free. */
+		/* Don't spin if we couldn't start all workers. */
 
-	if ((rc = conf_read(cfgfile, &conf)) == -1)
-		kutil_err(NULL, NULL, "%s", cfgfile);
-	else if (rc == 0)
-		kutil_errx(NULL, NULL, "%s: malformed", cfgfile);
+		if (i < workers) {
+			sleep(1);
+			continue;
+		}
 
-	verbose = conf.verbose;
-	if (conf.logfile != NULL && *conf.logfile != '\0')
-		if (!kutil_openlog(conf.logfile))
-			kutil_err(NULL, NULL, "%s", conf.logfile);
+		if ((pid = waitpid(WAIT_ANY, &status, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			kutil_err(NULL, NULL, "waitpid");
+		}
 
-	free(conf.logfile);
-	memset(&conf, 0, sizeof(struct conf));
-	
-	/* Parse the main body. */
+		for (i = 0; i < workers; i++)
+			if (pids[i] == pid) {
+				pids[i] = 0;
+				break;
+			}
 
-	er = khttp_parsex
-		(&r, ksuffixmap, kmimetypes, KMIME__MAX, valid, 
-		 VALID__MAX, pages, PAGE__MAX, KMIME_TEXT_HTML,
-		 PAGE_INDEX, NULL, NULL, verbose >= 3 ? 
-		 (KREQ_DEBUG_WRITE | KREQ_DEBUG_READ_BODY) : 0, 
-		 NULL);
+		/* 
+		 * Abnormal exits are logged and throttled so that a
+		 * worker failing on start-up doesn't fork-bomb us.
+		 */
 
-	if (er != KCGI_OK)
-		kutil_errx(NULL, NULL, 
-			"khttp_parse: %s", kcgi_strerror(er));
+		if (WIFSIGNALED(status)) {
+			kutil_warnx(NULL, NULL, "worker %ld: signal %d",
+				(long)pid, WTERMSIG(status));
+			sleep(1);
+		} else if (WIFEXITED(status) &&
+		    WEXITSTATUS(status) != EXIT_SUCCESS) {
+			kutil_warnx(NULL, NULL, "worker %ld: exit %d",
+				(long)pid, WEXITSTATUS(status));
+			sleep(1);
+		}
+	}
 
-	/*
-	 * Tighten the sandbox: drop proc and only allow for the calendar
-	 * directory to be accessed.
-	 */
+	for (i = 0; i < workers; i++)
+		if (pids[i] != 0)
+			kill(pids[i], SIGTERM);
+	for (i = 0; i < workers; i++)
+		if (pids[i] != 0)
+			waitpid(pids[i], NULL, 0);
 
-#if HAVE_SANDBOX_INIT
-	rc = sandbox_init(kSBXProfileNoInternet, SANDBOX_NAMED, &np);
-	if (rc == -1)
-		kutil_errx(NULL, NULL, "sandbox_init: %s", np);
-#endif
+	free(pids);
+	exit(EXIT_SUCCESS);
+}
 
-#if HAVE_PLEDGE
-	/*
-	 * Directories required by sqlite3.
-	 */
-	if (unveil(CALDIR, "rwxc") == -1 && errno != ENOENT)
-		kutil_err(NULL, NULL, "unveil " CALDIR);
-	if (unveil("/tmp", "rwxc") == -1 && errno != ENOENT)
-		kutil_err(NULL, NULL, "unveil /tmp");
-	if (unveil("/var/tmp", "rwxc") == -1 && errno != ENOENT)
-		kutil_err(NULL, NULL, "unveil /var/tmp");
-	if (unveil("/dev", "rwx") == -1 && errno != ENOENT)
-		kutil_err(NULL, NULL, "unveil /dev");
-	if (pledge("stdio rpath cpath wpath flock fattr", NULL) == -1)
-		kutil_err(NULL, NULL, "pledge");
-#endif
+/*
+ * Process a single parsed request.
+ * This is shared between the CGI and FastCGI modes: it's given a fully
+ * parsed request and returns when the response has been written.
+ * It does not free the request itself.
+ */
+static void
+process(struct kreq *r)
+{
+	struct state	*st = NULL;
+	struct dbstats	 stats;
+	char		*np;
+	size_t		 i, sz;
+	int		 rc;
 
 	/* 
 	 * Begin by disallowing bogus HTTP methods and processing the
@@ -514,11 +470,11 @@ main(void)
 	 * so let this happen now.
 	 */
 
-	if (r.method == KMETHOD__MAX) {
-		http_error(&r, KHTTP_405);
+	if (r->method == KMETHOD__MAX) {
+		http_error(r, KHTTP_405);
 		goto out;
-	} else if (r.method == KMETHOD_OPTIONS) {
-		method_options(&r);
+	} else if (r->method == KMETHOD_OPTIONS) {
+		method_options(r);
 		goto out;
 	}
 
@@ -529,12 +485,12 @@ main(void)
 	 * credentials and we can do more high-level authentication.
 	 */
 
-	if (r.rawauth.type != KAUTH_DIGEST) {
-		http_error(&r, KHTTP_401);
+	if (r->rawauth.type != KAUTH_DIGEST) {
+		http_error(r, KHTTP_401);
 		goto out;
-	} else if (r.rawauth.authorised == 0) {
-		kutil_warnx(&r, NULL, "bad HTTP authorisation");
-		http_error(&r, KHTTP_401);
+	} else if (r->rawauth.authorised == 0) {
+		kutil_warnx(r, NULL, "bad HTTP authorisation");
+		http_error(r, KHTTP_401);
 		goto out;
 	} 
 
@@ -544,19 +500,19 @@ main(void)
 	 * hashed password), so allocate our state.
 	 */
 
-	r.arg = st = kcalloc(1, sizeof(struct state));
+	r->arg = st = kcalloc(1, sizeof(struct state));
 
-	if (r.fullpath[0] == '\0') {
-		np = khttp_urlabs(r.scheme, r.host, r.port, r.pname,
+	if (r->fullpath[0] == '\0') {
+		np = khttp_urlabs(r->scheme, r->host, r->port, r->pname,
 			(char *)NULL);
-		khttp_head(&r, kresps[KRESP_STATUS], 
+		khttp_head(r, kresps[KRESP_STATUS], 
 			"%s", khttps[KHTTP_307]);
-	        khttp_head(&r, kresps[KRESP_CONTENT_TYPE], 
-			"%s", kmimetypes[r.mime]);
-		khttp_head(&r, kresps[KRESP_LOCATION], 
+	        khttp_head(r, kresps[KRESP_CONTENT_TYPE], 
+			"%s", kmimetypes[r->mime]);
+		khttp_head(r, kresps[KRESP_LOCATION], 
 			"%s/", np);
-		khttp_body(&r);
-		khttp_puts(&r, "Redirecting...");
+		khttp_body(r);
+		khttp_puts(r, "Redirecting...");
 		free(np);
 		goto out;
 	}
@@ -566,7 +522,7 @@ main(void)
 	 * This is just a matter of copying them over.
 	 */
 
-	if (!http_paths(r.fullpath,
+	if (!http_paths(r->fullpath,
 	     &st->principal, &st->collection, &st->resource))
 		goto out;
 
@@ -575,8 +531,8 @@ main(void)
 	sz = strlcpy(st->caldir, CALDIR, sizeof(st->caldir));
 
 	if (sz >= sizeof(st->caldir)) {
-		kutil_errx_noexit(&r, NULL, "caldir too long");
-		http_error(&r, KHTTP_505);
+		kutil_errx_noexit(r, NULL, "caldir too long");
+		http_error(r, KHTTP_505);
 		goto out;
 	} else if (st->caldir[sz - 1] == '/')
 		st->caldir[sz - 1] = '\0';
@@ -587,64 +543,64 @@ main(void)
 	 * We'll do all the authentication afterward: this just loads.
 	 */
 
-	rc = state_load(&r, st, 
-		r.rawauth.d.digest.nonce, 
-		r.rawauth.d.digest.user);
+	rc = state_load(r, st, 
+		r->rawauth.d.digest.nonce, 
+		r->rawauth.d.digest.user);
 
 	if (rc < 0) {
-		http_error(&r, KHTTP_505);
+		http_error(r, KHTTP_505);
 		goto out;
 	} else if (rc == 0) {
-		http_error(&r, KHTTP_401);
+		http_error(r, KHTTP_401);
 		goto out;
 	} 
 
-	rc = khttpdigest_validatehash(&r, st->prncpl->hash);
+	rc = khttpdigest_validatehash(r, st->prncpl->hash);
 	if (rc < 0) {
-		kutil_warnx(&r, NULL, "bad authorisation sequence");
-		http_error(&r, KHTTP_401);
+		kutil_warnx(r, NULL, "bad authorisation sequence");
+		http_error(r, KHTTP_401);
 		goto out;
 	} else if (rc == 0) {
-		kutil_warnx(&r, NULL, "failed authorisation sequence");
-		http_error(&r, KHTTP_401);
+		kutil_warnx(r, NULL, "failed authorisation sequence");
+		http_error(r, KHTTP_401);
 		goto out;
 	} 
 	
 #if 0
-	if (strcmp(r.rawauth.d.digest.uri, st->rpath)) {
-		kerrx("%s: bad authorisation URI", r.fullpath);
-		http_error(&r, KHTTP_401);
+	if (strcmp(r->rawauth.d.digest.uri, st->rpath)) {
+		kerrx("%s: bad authorisation URI", r->fullpath);
+		http_error(r, KHTTP_401);
 		goto out;
 	}
 #endif
 
 	/*
-	 * Perform the steps required to check the nonce database
-	 * without allowing an attacker to overwrite the database.
+	 * Perform the steps required to check the nonce table
+	 * without allowing an attacker to flush the table.
 	 * If this clears, that means that the principal is real and not
 	 * replaying prior HTTP authentications.
 	 */
 
-	if ((rc = nonce_validate(&r.rawauth.d.digest, &np)) < -1) {
-		kutil_errx_noexit(&r, st->prncpl->name, 
+	if ((rc = nonce_validate(&r->rawauth.d.digest, &np)) < -1) {
+		kutil_errx_noexit(r, st->prncpl->name, 
 			"cannot validate nonce");
-		http_error(&r, KHTTP_505);
+		http_error(r, KHTTP_505);
 		goto out;
 	} else if (rc < 0) {
-		kutil_warnx(&r, st->prncpl->name, 
+		kutil_warnx(r, st->prncpl->name, 
 			"nonce replay attack");
-		http_error(&r, KHTTP_403);
+		http_error(r, KHTTP_403);
 		goto out;
 	} else if (rc == 0) {
-		khttp_head(&r, kresps[KRESP_STATUS], 
+		khttp_head(r, kresps[KRESP_STATUS], 
 			"%s", khttps[KHTTP_401]);
-		khttp_head(&r, kresps[KRESP_WWW_AUTHENTICATE],
+		khttp_head(r, kresps[KRESP_WWW_AUTHENTICATE],
 			"Digest realm=\"%s\", "
 			"algorithm=\"MD5-sess\", "
 			"qop=\"auth,auth-int\", "
 			"nonce=\"%s\", "
 			"stale=true", KREALM, np);
-		khttp_body(&r);
+		khttp_body(r);
 		goto out;
 	}
 
@@ -656,9 +612,9 @@ main(void)
 	 * For HTML access (the browser), we don't care.
 	 */
 
-	if (r.mime == KMIME_APP_JSON &&
-	    (r.method == KMETHOD_GET || r.method == KMETHOD_POST)) {
-		method_json(&r);
+	if (r->mime == KMIME_APP_JSON &&
+	    (r->method == KMETHOD_GET || r->method == KMETHOD_POST)) {
+		method_json(r);
 		goto out;
 	} 
 
@@ -668,16 +624,16 @@ main(void)
 	 */
 
 	if (st->principal[0] == '\0') {
-		np = khttp_urlabs(r.scheme, r.host, r.port, r.pname,
+		np = khttp_urlabs(r->scheme, r->host, r->port, r->pname,
 			(char *)NULL);
-		khttp_head(&r, kresps[KRESP_STATUS], 
+		khttp_head(r, kresps[KRESP_STATUS], 
 			"%s", khttps[KHTTP_307]);
-	        khttp_head(&r, kresps[KRESP_CONTENT_TYPE], 
-			"%s", kmimetypes[r.mime]);
-		khttp_head(&r, kresps[KRESP_LOCATION], 
+	        khttp_head(r, kresps[KRESP_CONTENT_TYPE], 
+			"%s", kmimetypes[r->mime]);
+		khttp_head(r, kresps[KRESP_LOCATION], 
 			"%s/%s/", np, st->prncpl->name);
-		khttp_body(&r);
-		khttp_puts(&r, "Redirecting...");
+		khttp_body(r);
+		khttp_puts(r, "Redirecting...");
 		free(np);
 		goto out;
 	}
@@ -686,10 +642,10 @@ main(void)
 		rc = db_prncpl_load
 			(&st->rprncpl, st->principal);
 		if (rc < 0) {
-			http_error(&r, KHTTP_505);
+			http_error(r, KHTTP_505);
 			goto out;
 		} else if (rc == 0) {
-			http_error(&r, KHTTP_401);
+			http_error(r, KHTTP_401);
 			goto out;
 		}
 
@@ -704,37 +660,37 @@ main(void)
 			    st->rprncpl->proxies[i].proxy)
 				break;
 		if (i == st->rprncpl->proxiesz) {
-			kutil_warnx(&r, st->prncpl->name,
+			kutil_warnx(r, st->prncpl->name,
 				"disallowed reverse proxy "
 				"on principal: %s",
 				st->rprncpl->email);
-			http_error(&r, KHTTP_403);
+			http_error(r, KHTTP_403);
 			goto out;
 		}
 		st->proxy = st->rprncpl->proxies[i].bits;
 
-		switch (r.method) {
+		switch (r->method) {
 		case KMETHOD_PUT:
 		case KMETHOD_PROPPATCH:
 		case KMETHOD_DELETE:
 			/* Implies read. */
 			if (st->proxy == PROXY_WRITE)
 				break;
-			kutil_warnx(&r, st->prncpl->name,
+			kutil_warnx(r, st->prncpl->name,
 				"disallowed reverse proxy "
 				"write on principal: %s",
 				st->rprncpl->email);
-			http_error(&r, KHTTP_403);
+			http_error(r, KHTTP_403);
 			goto out;
 		default:
 			if (st->proxy == PROXY_READ || 
 			    st->proxy == PROXY_WRITE)
 				break;
-			kutil_warnx(&r, st->prncpl->name,
+			kutil_warnx(r, st->prncpl->name,
 				"disallowed reverse proxy "
 				"read on principal: %s",
 				st->rprncpl->email);
-			http_error(&r, KHTTP_403);
+			http_error(r, KHTTP_403);
 			goto out;
 		}
 	} else
@@ -755,22 +711,22 @@ main(void)
 		if (st->cfg == NULL &&
 		    strcmp(st->collection, "calendar-proxy-read") &&
   		    strcmp(st->collection, "calendar-proxy-write")) {
-			kutil_warnx(&r, st->prncpl->name,
+			kutil_warnx(r, st->prncpl->name,
 				"request unknown collection");
-			http_error(&r, KHTTP_404);
+			http_error(r, KHTTP_404);
 			goto out;
 		}
 	}
 
-	switch (r.method) {
+	switch (r->method) {
 	case KMETHOD_PUT:
-		method_put(&r);
+		method_put(r);
 		break;
 	case KMETHOD_PROPFIND:
-		method_propfind(&r);
+		method_propfind(r);
 		break;
 	case KMETHOD_PROPPATCH:
-		method_proppatch(&r);
+		method_proppatch(r);
 		break;
 	case KMETHOD_POST:
 		/*
@@ -781,13 +737,13 @@ main(void)
 		 */
 
 		if (st->resource[0] == '\0') {
-			kutil_warnx(&r, st->prncpl->name,
+			kutil_warnx(r, st->prncpl->name,
 				"ignore POST to collection");
-			http_error(&r, KHTTP_404);
+			http_error(r, KHTTP_404);
 		} else {
-			kutil_warnx(&r, st->prncpl->name,
+			kutil_warnx(r, st->prncpl->name,
 				"bad POST to resource");
-			http_error(&r, KHTTP_405);
+			http_error(r, KHTTP_405);
 		}
 		break;
 	case KMETHOD_GET:
@@ -799,30 +755,237 @@ main(void)
 		 */
 
 		if (st->resource[0] == '\0') {
-			kutil_warnx(&r, st->prncpl->name,
+			kutil_warnx(r, st->prncpl->name,
 				"ignore GET of collection");
-			http_error(&r, KHTTP_404);
+			http_error(r, KHTTP_404);
 		} else
-			method_get(&r);
+			method_get(r);
 		break;
 	case KMETHOD_REPORT:
-		method_report(&r);
+		method_report(r);
 		break;
 	case KMETHOD_DELETE:
-		method_delete(&r);
+		method_delete(r);
 		break;
 	default:
-		kutil_warnx(&r, st->prncpl->name,
+		kutil_warnx(r, st->prncpl->name,
 			"ignore unsupported HTTP method: %s",
-			kmethods[r.method]);
-		http_error(&r, KHTTP_405);
+			kmethods[r->method]);
+		http_error(r, KHTTP_405);
 		break;
 	}
 
 out:
-	khttp_free(&r);
+	if (verbose >= 2) {
+		db_stats(&stats);
+		kutil_logx(r, "DB-DEBUG", NULL, 
+			"statements: %" PRIu64 " prepared, %" 
+			PRIu64 " cached, %" PRIu64 " steps", 
+			stats.prepares, stats.reuses, stats.steps);
+	}
 	db_set_msg_ident(NULL);
 	db_set_msg_arg(NULL);
 	state_free(st);
+	r->arg = NULL;
+}
+
+int
+main(void)
+{
+	struct kreq	 r;
+	struct kvalid	 valid[VALID__MAX] = {
+		{ kvalid_proxy_bits, valids[VALID_BITS] },
+		{ kvalid_body, valids[VALID_BODY] },
+		{ kvalid_colour, valids[VALID_COLOUR] },
+		{ kvalid_description, valids[VALID_DESCRIPTION] },
+		{ kvalid_email, valids[VALID_EMAIL] },
+		{ kvalid_int, valids[VALID_ID] },
+		{ kvalid_name, valids[VALID_NAME] },
+		{ kvalid_hash, valids[VALID_PASS] },
+		{ kvalid_path, valids[VALID_PATH] } }; 
+	struct kfcgi	*fcgi = NULL;
+	struct conf	 conf;
+	const char	*cfgfile = NULL;
+	enum kcgi_err	 er;
+	unsigned int	 debug;
+	size_t		 workers, maxrequests, nreq = 0, rangecache;
+	int		 rc, hmacnonce, kfcgi;
+#if HAVE_SANDBOX_INIT
+	char		*np;
+#endif
+
+	/*
+	 * Hard-coded configuration file path.  If unset or set to an
+	 * empty string, no configuration file is used.
+	 */
+#ifdef CFGFILE
+	cfgfile = CFGFILE;
+#endif
+
+	/* Needed for non-OpenBSD systems for a weak PRNG. */
+
+#if !HAVE_ARC4RANDOM
+	srandom(time(NULL));
+#endif
+
+	/* Pledge allowing some file-system access. */
+
+#if HAVE_PLEDGE
+	if (pledge("proc stdio rpath cpath wpath flock fattr "
+	    "recvfd unveil", NULL) == -1)
+		kutil_err(NULL, NULL, "pledge");
+#endif
+
+	/* Read run-time configuration.  Act upon it then free. */
+
+	if ((rc = conf_read(cfgfile, &conf)) == -1)
+		kutil_err(NULL, NULL, "%s", cfgfile);
+	else if (rc == 0)
+		kutil_errx(NULL, NULL, "%s: malformed", cfgfile);
+
+	verbose = conf.verbose;
+	if (conf.logfile != NULL && *conf.logfile != '\0')
+		if (!kutil_openlog(conf.logfile))
+			kutil_err(NULL, NULL, "%s", conf.logfile);
+
+	workers = conf.workers;
+	maxrequests = conf.maxrequests;
+	db_set_busy_timeout(conf.busytimeout);
+	db_set_quota(conf.quota);
+	db_set_horizon((int64_t)conf.horizon * 86400);
+	hmacnonce = conf.hmacnonce;
+	rangecache = conf.rangecache > SIZE_MAX ?
+		SIZE_MAX : conf.rangecache;
+
+	free(conf.logfile);
+	memset(&conf, 0, sizeof(struct conf));
+
+	debug = verbose >= 3 ?
+		(KREQ_DEBUG_WRITE | KREQ_DEBUG_READ_BODY) : 0;
+
+	/*
+	 * If we're started as a FastCGI application, set up the
+	 * FastCGI context and defer parsing until we loop over
+	 * requests.
+	 * If configured with workers, first fork into a supervisor
+	 * and its workers, each of which shares the FastCGI socket.
+	 * (This doesn't apply to kfcgi(8), which has its own pool.)
+	 * Otherwise, parse the main body as a one-shot CGI.
+	 * Stateless nonces need a replay window that outlives the
+	 * request and is shared by workers, so they're only used with
+	 * FastCGI and not under kfcgi(8), whose workers wouldn't share
+	 * it; the occurrence cache is also only used with FastCGI.
+	 */
+
+	if (khttp_fcgi_test()) {
+		kfcgi = getenv("FCGI_LISTENSOCK_DESCRIPTORS") != NULL;
+		if (hmacnonce && kfcgi)
+			kutil_warnx(NULL, NULL, "ignoring stateless "
+				"nonces when run under kfcgi(8)");
+		else if (hmacnonce && !nonce_hmac_init())
+			kutil_err(NULL, NULL, "nonce_hmac_init");
+		db_set_range_cache(rangecache);
+		if (workers > 0 && kfcgi)
+			kutil_warnx(NULL, NULL, "ignoring workers "
+				"when run under kfcgi(8)");
+		else if (workers > 0)
+			supervise(workers);
+		er = khttp_fcgi_initx
+			(&fcgi, kmimetypes, KMIME__MAX, valid,
+			 VALID__MAX, ksuffixmap, pages, PAGE__MAX,
+			 KMIME_TEXT_HTML, PAGE_INDEX, NULL, NULL,
+			 debug, NULL);
+		if (er != KCGI_OK)
+			kutil_errx(NULL, NULL, 
+				"khttp_fcgi_init: %s", kcgi_strerror(er));
+	} else {
+		if (hmacnonce)
+			kutil_warnx(NULL, NULL, "ignoring stateless "
+				"nonces when run as CGI");
+		er = khttp_parsex
+			(&r, ksuffixmap, kmimetypes, KMIME__MAX, valid, 
+			 VALID__MAX, pages, PAGE__MAX, KMIME_TEXT_HTML,
+			 PAGE_INDEX, NULL, NULL, debug, NULL);
+		if (er != KCGI_OK)
+			kutil_errx(NULL, NULL, 
+				"khttp_parse: %s", kcgi_strerror(er));
+	}
+
+	/*
+	 * Tighten the sandbox: drop proc and only allow for the calendar
+	 * directory to be accessed.
+	 * In FastCGI mode, we still need to receive descriptors from the
+	 * kcgi(3) control process.
+	 */
+
+#if HAVE_SANDBOX_INIT
+	rc = sandbox_init(kSBXProfileNoInternet, SANDBOX_NAMED, &np);
+	if (rc == -1)
+		kutil_errx(NULL, NULL, "sandbox_init: %s", np);
+#endif
+
+#if HAVE_PLEDGE
+	/*
+	 * Directories required by sqlite3.
+	 */
+	if (unveil(CALDIR, "rwxc") == -1 && errno != ENOENT)
+		kutil_err(NULL, NULL, "unveil " CALDIR);
+	if (unveil("/tmp", "rwxc") == -1 && errno != ENOENT)
+		kutil_err(NULL, NULL, "unveil /tmp");
+	if (unveil("/var/tmp", "rwxc") == -1 && errno != ENOENT)
+		kutil_err(NULL, NULL, "unveil /var/tmp");
+	if (unveil("/dev", "rwx") == -1 && errno != ENOENT)
+		kutil_err(NULL, NULL, "unveil /dev");
+	if (pledge(fcgi != NULL ?
+	    "stdio rpath cpath wpath flock fattr recvfd" :
+	    "stdio rpath cpath wpath flock fattr", NULL) == -1)
+		kutil_err(NULL, NULL, "pledge");
+#endif
+
+	if (fcgi == NULL) {
+		process(&r);
+		khttp_free(&r);
+		return EXIT_SUCCESS;
+	}
+
+	/*
+	 * FastCGI: open the database and prepare its statements now,
+	 * so that requests don't need to.
+	 * If this fails, we'll try again (and report) per request.
+	 */
+
+	db_set_msg_dbg(db_msg_dbg);
+	db_set_msg_info(db_msg_info);
+	db_set_msg_err(db_msg_err);
+	db_set_msg_errx(db_msg_errx);
+	if (db_init(CALDIR, 0) && !db_prepare_all())
+		kutil_warnx(NULL, NULL, "cannot prepare statements");
+
+	/*
+	 * Process requests until the web server tells us to stop or,
+	 * when supervised, we've hit our maximum number of requests
+	 * and the supervisor will start a fresh worker.
+	 * The database and run-time configuration are kept open until
+	 * we exit.
+	 * Note that khttp_free(3) must be called even if parsing fails.
+	 */
+
+	while ((er = khttp_fcgi_parse(fcgi, &r)) == KCGI_OK) {
+		process(&r);
+		khttp_free(&r);
+		if (maxrequests > 0 && ++nreq >= maxrequests) {
+			kutil_dbg(NULL, NULL, "worker exiting after "
+				"%zu requests", nreq);
+			khttp_fcgi_free(fcgi);
+			return EXIT_SUCCESS;
+		}
+	}
+
+	if (er != KCGI_EXIT)
+		kutil_errx_noexit(NULL, NULL, 
+			"khttp_fcgi_parse: %s", kcgi_strerror(er));
+
+	khttp_free(&r);
+	khttp_fcgi_free(fcgi);
 	return EXIT_SUCCESS;
 }
@@ -36,9 +36,7 @@
 #if HAVE_READPASSPHRASE
 # include <readpassphrase.h>
 #endif
-#if !HAVE_ARC4RANDOM
-# include <time.h> /* time(3) */
-#endif
+#include <time.h>
 #include <unistd.h>
 
 #include "libkcaldav.h"
@@ -91,10 +89,11 @@ check_safe_string(const char *cp)
 
 /*
  * Read the file "name" into the returned buffer.
- * The file is guaranteed to be a proper iCalendar file.
+ * The file is guaranteed to be a proper iCalendar file, whose parse is
+ * set in "icalp".
  */
 static char *
-read_whole_file(const char *name)
+read_whole_file(const char *name, struct ical **icalp)
 {
 	int		 fd;
 	char		*p = NULL;
@@ -131,7 +130,7 @@ read_whole_file(const char *name)
 	if ((ical = ical_parse(name, p, sz, NULL, NULL)) == NULL) 
 		errx(1, "%s: not an iCalendar file", name);
 
-	ical_free(ical);
+	*icalp = ical;
 	return p;
 }
 
@@ -243,6 +242,7 @@ main(int argc, char *argv[])
 	gid_t		 egid = getegid();
 	struct prncpl	*p = NULL;
 	struct coln	*col;
+	struct ical	*ical;
 	char		*user = NULL, *emailp = NULL, *res;
 
 #if HAVE_PLEDGE
@@ -532,7 +532,7 @@ main(int argc, char *argv[])
 	 */
 
 	for (i = 0; i < (size_t)argc; i++) {
-		res = read_whole_file(argv[i]);
+		res = read_whole_file(argv[i], &ical);
 		assert(res != NULL);
 
 		/* Get file-name component. */
@@ -542,11 +542,12 @@ main(int argc, char *argv[])
 		else
 			uid++;
 
-		rc = db_resource_new(res, uid, col->id);
+		rc = db_resource_new(ical, uid, col->id);
+		ical_free(ical);
 		free(res);
-		if (rc == 0)
+		if (rc == RES_CONFLICT)
 			errx(1, "%s: resource exists", argv[i]);
-		else if (rc < 0)
+		else if (rc != RES_OK)
 			errx(1, "failed to create resource");
 
 		printf("resource added: %s\n", argv[i]);
@@ -11,15 +11,106 @@ CREATE TABLE resource (
 	url TEXT NOT NULL,
 	-- The file's current etag (in the HTTP sense).
 	etag TEXT NOT NULL DEFAULT('1'),
-	-- The iCal data as a nil-terminated string.
+	-- The iCal data as a nil-terminated string, less the time zones
+	-- listed in the resourcetz table.
 	data TEXT NOT NULL,
 	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,
 	-- Currently unused.
 	flags INTEGER NOT NULL DEFAULT(0),
+	-- The following are extracted from the iCal data when it's
+	-- stored, so that it needn't be parsed to list or filter.
+	-- The UID of the first event, to-do, or journal, or NULL.
+	uid TEXT,
+	-- Bit-wise OR of the ICAL_xxx component bits present or zero
+	-- if the metadata hasn't been extracted.
+	components INTEGER NOT NULL DEFAULT(0),
+	-- Earliest start and latest end in UTC epoch seconds of all
+	-- components, or NULL if unbounded.
+	dtstart INTEGER,
+	dtend INTEGER,
+	-- Whether any time is floating, in which case dtstart and
+	-- dtend may be off by up to the largest UTC offset.
+	floating INTEGER NOT NULL DEFAULT(0),
+	-- Whether any component has an RRULE or RDATE.
+	recurring INTEGER NOT NULL DEFAULT(0),
+	-- Latest LAST-MODIFIED in UTC epoch seconds or NULL.
+	lastmod INTEGER,
+	-- Length of the iCal data (with its time zones) in bytes.
+	size INTEGER NOT NULL DEFAULT(0),
+	-- Whether the occurrences of its components are listed in the
+	-- occurrence table.
+	occurs INTEGER NOT NULL DEFAULT(0),
+	-- If listed, instances starting from here (UTC epoch seconds)
+	-- are not, as with recurrences without end, or NULL if all are.
+	occuntil INTEGER,
 	unique (url,collection),
 	FOREIGN KEY (collection) REFERENCES collection(id) ON DELETE CASCADE
 );
 
+-- For time ranges of resources without occurrences, which are filtered
+-- by start time, and of those with more occurrences than listed.
+
+CREATE INDEX resource_dtstart ON resource(collection,occurs,dtstart);
+CREATE INDEX resource_occuntil ON resource(collection,occuntil);
+
+-- The occurrences in time of the events, to-dos, and journals of each
+-- resource with a bounded time span, so that time ranges needn't parse
+-- resources to see what falls within them.
+-- Each component is an occurrence, except those recurring, which have
+-- an occurrence for each instance up to a horizon.
+
+CREATE TABLE occurrence (
+	resource INTEGER NOT NULL,
+	-- The resource's collection, for the index.
+	collection INTEGER NOT NULL,
+	-- Start and end in UTC epoch seconds, the end not before start.
+	dtstart INTEGER NOT NULL,
+	dtend INTEGER NOT NULL,
+	-- The RECURRENCE-ID of an instance in UTC epoch seconds or NULL.
+	recurid INTEGER,
+	-- The CALFB_xxx free-busy type of the time.
+	fbtype INTEGER NOT NULL DEFAULT(0),
+	FOREIGN KEY (resource) REFERENCES resource(id) ON DELETE CASCADE
+);
+
+CREATE INDEX occurrence_dtend ON occurrence(collection,dtend);
+CREATE INDEX occurrence_resource ON occurrence(resource);
+
+-- Time-zone (VTIMEZONE) components of resources, each stored once no
+-- matter how many resources carry it.
+-- These are removed by the trigger below when no longer used.
+
+CREATE TABLE timezone (
+	-- Hash of the data, by which it's looked up.
+	hash INTEGER NOT NULL,
+	-- The component's iCal text from BEGIN to END.
+	data TEXT NOT NULL,
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL
+);
+
+CREATE INDEX timezone_hash ON timezone(hash);
+
+-- The time zones taken from the iCal data of each resource, to be put
+-- back in order when the data is read.
+
+CREATE TABLE resourcetz (
+	resource INTEGER NOT NULL,
+	timezone INTEGER NOT NULL,
+	-- Byte offset in the resource's data at which it's put back.
+	offs INTEGER NOT NULL,
+	FOREIGN KEY (resource) REFERENCES resource(id) ON DELETE CASCADE,
+	FOREIGN KEY (timezone) REFERENCES timezone(id)
+);
+
+CREATE INDEX resourcetz_resource ON resourcetz(resource,offs);
+CREATE INDEX resourcetz_timezone ON resourcetz(timezone);
+
+CREATE TRIGGER resourcetz_delete AFTER DELETE ON resourcetz
+BEGIN
+	DELETE FROM timezone WHERE id=OLD.timezone AND NOT EXISTS
+		(SELECT 1 FROM resourcetz WHERE timezone=OLD.timezone);
+END;
+
 -- A collection is a calendar directory.
 -- Collections, in kCalDAV, only contain resources: we do not allow
 -- nested collections.
@@ -42,10 +133,34 @@ CREATE TABLE collection (
 	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,
 	-- Currently unused.
 	flags INTEGER NOT NULL DEFAULT(0),
+	-- Sync-tokens before this ctag are invalid, as removals before
+	-- it have been pruned from the change log.
+	synclimit INTEGER NOT NULL DEFAULT(0),
 	unique (url,principal),
 	FOREIGN KEY (principal) REFERENCES principal(id) ON DELETE CASCADE
 );
 
+-- The last change to each resource in a collection for RFC 6578
+-- synchronisation.
+-- Removed resources are kept as tombstones, the oldest of which are
+-- pruned (raising @collection.synclimit).
+
+CREATE TABLE changelog (
+	collection INTEGER NOT NULL,
+	-- The URL of the resource.
+	url TEXT NOT NULL,
+	-- The collection's ctag after the change.
+	seq INTEGER NOT NULL,
+	-- Whether the resource was removed (else created or modified).
+	deleted INTEGER NOT NULL DEFAULT(0),
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,
+	unique (collection,url),
+	FOREIGN KEY (collection) REFERENCES collection(id) ON DELETE CASCADE
+);
+
+CREATE INDEX changelog_seq ON changelog(collection,seq);
+CREATE INDEX changelog_deleted ON changelog(collection,deleted,seq);
+
 -- Proxies function as a delegation mechanism: the @proxy.proxy user
 -- will have access to the collections and resources of
 -- @"proxy.principal".
@@ -65,19 +180,6 @@ CREATE TABLE proxy (
 	FOREIGN KEY (proxy) REFERENCES principal(id) ON DELETE CASCADE
 );
 
--- A nonce is used by the HTTP digest authentication.
--- We limit the size of this table in the software, since it's basically
--- touchable by the open Internet.
-
-CREATE TABLE nonce (
-	-- The value of the nonce.
-	nonce TEXT NOT NULL,
-	-- How many times the nonce has been used.
-	count INT NOT NULL DEFAULT(0),
-	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,
-	unique (nonce)
-);
-
 -- A principal is a user.
 
 CREATE TABLE principal (
@@ -89,11 +191,106 @@ CREATE TABLE principal (
 	email TEXT NOT NULL,
 	-- Currently unused.
 	flags INTEGER NOT NULL DEFAULT(0),
+	-- Bumped (by the triggers below) whenever the principal, its
+	-- collections, or its proxies change.
+	-- Used to validate cached principals.
+	generation INTEGER NOT NULL DEFAULT(0),
+	-- Bytes of resource data in the principal's collections.
+	-- Maintained by the triggers below.
+	quota_used INTEGER NOT NULL DEFAULT(0),
 	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,
 	unique (email),
 	unique (name)
 );
 
+-- Keep the principal generation current.
+-- Collection updates include the ctag, so this also catches changes to
+-- any resources within the collection.
+-- Changes to a principal's name or e-mail are visible in the proxy
+-- lists of related principals, so these are bumped as well.
+
+CREATE TRIGGER collection_insert AFTER INSERT ON collection
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id=NEW.principal;
+END;
+
+CREATE TRIGGER collection_update AFTER UPDATE ON collection
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id=NEW.principal;
+END;
+
+CREATE TRIGGER collection_delete AFTER DELETE ON collection
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id=OLD.principal;
+END;
+
+CREATE TRIGGER proxy_insert AFTER INSERT ON proxy
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id IN (NEW.principal, NEW.proxy);
+END;
+
+CREATE TRIGGER proxy_update AFTER UPDATE ON proxy
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id IN (NEW.principal, NEW.proxy);
+END;
+
+CREATE TRIGGER proxy_delete AFTER DELETE ON proxy
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id IN (OLD.principal, OLD.proxy);
+END;
+
+CREATE TRIGGER principal_update
+	AFTER UPDATE OF name, hash, email ON principal
+BEGIN
+	UPDATE principal SET generation=generation+1
+		WHERE id=NEW.id OR
+		id IN (SELECT principal FROM proxy WHERE proxy=NEW.id) OR
+		id IN (SELECT proxy FROM proxy WHERE principal=NEW.id);
+END;
+
+-- Keep the per-principal byte count of resource data current.
+-- This counts the whole data, including time zones stored apart.
+-- When a collection is removed, its resources are removed by cascade
+-- after the collection itself, so they're accounted for beforehand.
+
+CREATE TRIGGER resource_insert AFTER INSERT ON resource
+BEGIN
+	UPDATE principal SET generation=generation+1,
+		quota_used=quota_used+NEW.size
+		WHERE id=(SELECT principal FROM collection
+			WHERE id=NEW.collection);
+END;
+
+CREATE TRIGGER resource_update AFTER UPDATE OF data, size ON resource
+BEGIN
+	UPDATE principal SET generation=generation+1,
+		quota_used=quota_used+NEW.size-OLD.size
+		WHERE id=(SELECT principal FROM collection
+			WHERE id=NEW.collection);
+END;
+
+CREATE TRIGGER resource_delete AFTER DELETE ON resource
+BEGIN
+	UPDATE principal SET generation=generation+1,
+		quota_used=quota_used-OLD.size
+		WHERE id=(SELECT principal FROM collection
+			WHERE id=OLD.collection);
+END;
+
+CREATE TRIGGER collection_delete_resources BEFORE DELETE ON collection
+BEGIN
+	UPDATE principal SET quota_used=quota_used-(SELECT
+		COALESCE(SUM(size), 0)
+		FROM resource WHERE collection=OLD.id)
+		WHERE id=OLD.principal;
+END;
+
 -- We use this to determine first whether the database has been opened
 -- and created or not; second, to see whether the person accessing the
 -- database on the local system is allowed.
@@ -101,5 +298,7 @@ CREATE TABLE principal (
 
 CREATE TABLE database (
 	-- Owner uid.
-	owneruid INTEGER NOT NULL
+	owneruid INTEGER NOT NULL,
+	-- Random secret used to sign stateless nonces.
+	secret TEXT NOT NULL DEFAULT(lower(hex(randomblob(32))))
 );
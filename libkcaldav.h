@@ -34,11 +34,16 @@
 enum	calreqtype {
 	CALREQTYPE_CALMULTIGET,
 	CALREQTYPE_CALQUERY,
+	CALREQTYPE_FREEBUSY,
 	CALREQTYPE_PROPERTYUPDATE,
 	CALREQTYPE_PROPFIND,
+	CALREQTYPE_SYNCCOLLECTION,
 };
 
 enum	calelem {
+	CALELEM_ALLCOMP,
+	CALELEM_ALLPROP,
+	CALELEM_CALDAV_PROP,
 	CALELEM_CALENDAR_COLOR,
 	CALELEM_CALENDAR_DATA,
 	CALELEM_CALENDAR_DESCRIPTION,
@@ -50,18 +55,28 @@ enum	calelem {
 	CALELEM_CALENDAR_QUERY,
 	CALELEM_CALENDAR_TIMEZONE,
 	CALELEM_CALENDAR_USER_ADDRESS_SET,
+	CALELEM_COMP,
+	CALELEM_COMP_FILTER,
 	CALELEM_CURRENT_USER_PRINCIPAL,
 	CALELEM_CURRENT_USER_PRIVILEGE_SET,
 	CALELEM_DISPLAYNAME,
+	CALELEM_EXPAND,
+	CALELEM_FILTER,
+	CALELEM_FREE_BUSY_QUERY,
 	CALELEM_GETCONTENTTYPE,
 	CALELEM_GETCTAG,
 	CALELEM_GETETAG,
 	CALELEM_GROUP_MEMBER_SET,
 	CALELEM_GROUP_MEMBERSHIP,
 	CALELEM_HREF,
+	CALELEM_IS_NOT_DEFINED,
+	CALELEM_LIMIT_FREEBUSY_SET,
+	CALELEM_LIMIT_RECURRENCE_SET,
 	CALELEM_OWNER,
+	CALELEM_PARAM_FILTER,
 	CALELEM_PRINCIPAL_URL,
 	CALELEM_PROP,
+	CALELEM_PROP_FILTER,
 	CALELEM_PROPERTYUPDATE,
 	CALELEM_PROPFIND,
 	CALELEM_QUOTA_AVAILABLE_BYTES,
@@ -70,6 +85,12 @@ enum	calelem {
 	CALELEM_SCHEDULE_CALENDAR_TRANSP,
 	CALELEM_SUPPORTED_CALENDAR_COMPONENT_SET,
 	CALELEM_SUPPORTED_CALENDAR_DATA,
+	CALELEM_SUPPORTED_REPORT_SET,
+	CALELEM_SYNC_COLLECTION,
+	CALELEM_SYNC_LEVEL,
+	CALELEM_SYNC_TOKEN,
+	CALELEM_TEXT_MATCH,
+	CALELEM_TIME_RANGE,
 	CALELEM__MAX
 };
 
@@ -103,6 +124,8 @@ enum	calproptype {
 	CALPROP_SCHEDULE_CALENDAR_TRANSP,
 	CALPROP_SUPPORTED_CALENDAR_COMPONENT_SET,
 	CALPROP_SUPPORTED_CALENDAR_DATA,
+	CALPROP_SUPPORTED_REPORT_SET,
+	CALPROP_SYNC_TOKEN,
 	CALPROP__MAX
 };
 
@@ -241,8 +264,12 @@ struct	icaltz {
 	int		 tzto;
 	struct icaltm	 dtstart;
 	struct icalrrule rrule;
+	struct icaltm	*rdates; /* RDATE, sorted */
+	size_t		 rdatesz;
 };
 
+struct	icaltzone;
+
 struct	icaltime {
 	const struct icalcomp *tz;
 	struct icaltm	 time;
@@ -261,8 +288,13 @@ struct	icalcomp {
 	struct icaldur	 duration;
 	struct icaltz	*tzs;
 	size_t		 tzsz;
+	struct icaltm	*rdates; /* RDATE, sorted */
+	size_t		 rdatesz;
+	struct icaltm	*exdates; /* EXDATE, sorted */
+	size_t		 exdatesz;
 	const char	*uid;
 	const char	*tzid;
+	struct icaltzone *zone; /* VTIMEZONE: compiled */
 };
 
 struct	ical {
@@ -286,14 +318,149 @@ struct	calprop {
 	int			  valid;
 };
 
+/*
+ * The time range (RFC 4791, 9.9) of the calendar-query filter on the
+ * calendar's components, used to narrow the resources that need
+ * examining.
+ * Unbounded ends are INT64_MIN and INT64_MAX.
+ */
+struct	caltimerange {
+	int			  set; /* a time-range was given */
+	unsigned int		  comps; /* ICAL_xxx or zero for any */
+	int64_t			  start; /* UTC epoch */
+	int64_t			  end; /* UTC epoch */
+};
+
+enum	calfiltertype {
+	CALFILTER_COMP, /* comp-filter */
+	CALFILTER_PROP, /* prop-filter */
+	CALFILTER_PARAM, /* param-filter */
+};
+
+enum	calcollation {
+	CALCOLLATE_ASCII, /* i;ascii-casemap */
+	CALCOLLATE_OCTET, /* i;octet */
+};
+
+/*
+ * A text-match (RFC 4791, 9.7.5) as a substring match.
+ */
+struct	caltextmatch {
+	int			  set; /* a text-match was given */
+	enum calcollation	  collation;
+	int			  negate; /* negate-condition */
+	char			 *val;
+};
+
+/*
+ * A calendar-query filter (RFC 4791, 9.7) compiled into a tree.
+ * The top-level comp-filter is on the VCALENDAR; its children are
+ * nested comp-filters or prop-filters, and those of prop-filters are
+ * param-filters.
+ * All children must match for the filter to match.
+ */
+struct	calfilter {
+	enum calfiltertype	  type;
+	char			 *name; /* component, property, or param */
+	int			  notdefined; /* is-not-defined */
+	int			  ranged; /* has time-range */
+	int64_t			  start; /* time-range start or INT64_MIN */
+	int64_t			  end; /* time-range end or INT64_MAX */
+	struct caltextmatch	  match; /* not for CALFILTER_COMP */
+	struct calfilter	 *kids; /* first child */
+	struct calfilter	 *next; /* next sibling */
+	struct calfilter	 *parent; /* or NULL if top-level */
+};
+
+/*
+ * A property to return within a calendar-data component (RFC 4791,
+ * 9.6.4), optionally without its value.
+ */
+struct	calcompprop {
+	char			 *name;
+	int			  novalue; /* novalue="yes" */
+};
+
+/*
+ * A component to return within calendar-data (RFC 4791, 9.6.1) with
+ * the properties and nested components to return within it.
+ * Without allprop or any props, no properties are returned; likewise
+ * for allcomp and nested components.
+ */
+struct	calcomp {
+	char			 *name;
+	int			  allprop; /* allprop */
+	int			  allcomp; /* allcomp */
+	struct calcompprop	 *props;
+	size_t			  propsz;
+	struct calcomp		 *kids; /* first nested comp */
+	struct calcomp		 *next; /* next sibling */
+	struct calcomp		 *parent; /* or NULL if top-level */
+};
+
+/*
+ * How calendar data is to be returned in calendar-data (RFC 4791,
+ * 9.6): which components and properties, and what of recurrence and
+ * free-busy sets.
+ * Unbounded ends are INT64_MIN and INT64_MAX.
+ */
+struct	caldata {
+	struct calcomp		 *comp; /* or NULL for everything */
+	int			  expand; /* expand */
+	int			  limitrec; /* limit-recurrence-set */
+	int64_t			  recstart; /* of expand or limitrec */
+	int64_t			  recend;
+	int			  limitfb; /* limit-freebusy-set */
+	int64_t			  fbstart;
+	int64_t			  fbend;
+};
+
+/*
+ * Free-busy time types (RFC 5545, 3.2.9).
+ */
+enum	calfbtype {
+	CALFB_FREE,
+	CALFB_BUSY,
+	CALFB_BUSY_UNAVAILABLE,
+	CALFB_BUSY_TENTATIVE,
+	CALFB__MAX
+};
+
+/*
+ * A busy period of a free-busy-query (RFC 4791, 7.10).
+ */
+struct	calbusy {
+	enum calfbtype		  type;
+	int64_t			  start; /* UTC epoch */
+	int64_t			  end; /* UTC epoch */
+};
+
+/*
+ * An occurrence of a component (or of an instance of a recurring one)
+ * in time.
+ */
+struct	caloccur {
+	int64_t			  start; /* UTC epoch */
+	int64_t			  end; /* UTC epoch, not before start */
+	enum calfbtype		  fbtype; /* of the time, if any */
+	int			  recur; /* recurid is set */
+	int64_t			  recurid; /* RECURRENCE-ID (UTC epoch) */
+};
+
 struct	caldav {
 	enum calreqtype		  type;
 	struct calprop		 *props;
 	size_t			  propsz;
 	char			**hrefs;
 	size_t			  hrefsz;
+	struct caltimerange	  range; /* CALREQTYPE_CALQUERY, _FREEBUSY */
+	struct calfilter	 *filter; /* CALREQTYPE_CALQUERY or NULL */
+	char			 *synctoken; /* CALREQTYPE_SYNCCOLLECTION */
+	struct caldata		 *data; /* calendar-data request or NULL */
 };
 
+struct	icalrecur;
+
 typedef int (*ical_putchar)(int, void *);
 
 __BEGIN_DECLS
@@ -303,17 +470,37 @@ struct ical 	 *ical_parse(const char *, const char *, size_t,
 void		  ical_free(struct ical *);
 int		  ical_print(const struct ical *, ical_putchar, void *);
 int		  ical_printfile(int, const struct ical *);
-#if 0
-void		  ical_rrule_generate(const struct icaltm *, 
-			const struct icalrrule *);
-#endif
+char		 *ical_printbuf(const struct ical *, size_t *);
+int		  ical_datetime_parse(const char *, struct icaltm *);
+int64_t		  ical_time2utc(const struct icaltime *);
+int64_t		  ical_tz2utc(const struct icalcomp *, int64_t);
+int64_t		  ical_utc2tz(const struct icalcomp *, int64_t);
+void		  ical_utc2str(char *, size_t, int64_t, enum icaldatet);
+struct icaltzone *ical_tzone_new(const struct icalcomp *);
+void		  ical_tzone_free(struct icaltzone *);
+struct icalrecur *ical_recur_init(const struct icalcomp *,
+			int64_t, int64_t);
+int		  ical_recur_next(struct icalrecur *, int64_t *);
+void		  ical_recur_free(struct icalrecur *);
 
 struct caldav 	 *caldav_parse(const char *, size_t, char **);
 void		  caldav_free(struct caldav *);
+int		  caldav_filter(const struct calfilter *,
+			const struct ical *);
+int		  caldav_freebusy(const struct ical *, int64_t,
+			int64_t, struct calbusy **, size_t *);
+int		  caldav_freebusy_add(struct calbusy **, size_t *,
+			const struct calbusy *);
+void		  caldav_freebusy_merge(struct calbusy *, size_t *);
+int		  caldav_occurrences(const struct ical *, int64_t,
+			size_t, struct caloccur **, size_t *, int64_t *);
+char		 *caldav_data(const struct caldata *,
+			const struct ical *, size_t *);
 
 extern const enum calproptype calprops[CALELEM__MAX];
 extern const enum calelem calpropelems[CALPROP__MAX];
 extern const char *const calelems[CALELEM__MAX];
+extern const char *const calfbtypes[CALFB__MAX];
 extern const char *const icaltypes[ICALTYPE__MAX];
 extern const char *const icaltztypes[ICALTZ__MAX];
 extern const char *const icalfreqs[ICALFREQ__MAX];
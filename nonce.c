@@ -0,0 +1,497 @@
+/*
+ * Copyright (c) Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <inttypes.h>
+#include <limits.h>
+#if HAVE_MD5
+# include <md5.h>
+#endif
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <kcgi.h>
+#include <kcgixml.h>
+
+#include "libkcaldav.h"
+#include "db.h"
+#include "server.h"
+
+/*
+ * Stateless nonces are the hexadecimal issue time, a random salt, and
+ * the leading half of an HMAC-MD5 over both keyed with the database
+ * secret.
+ * Checking one needs no database access beyond reading the secret.
+ */
+#define	HNONCE_TIMESZ	 16
+#define	HNONCE_SALTSZ	 8
+#define	HNONCE_MACSZ	 16
+#define	HNONCE_SZ	 (HNONCE_TIMESZ + HNONCE_SALTSZ + HNONCE_MACSZ)
+
+/*
+ * Seconds a stateless nonce may be used after being issued.
+ * After this, clients are asked to retry with a fresh nonce.
+ */
+#define	HNONCE_LIFETIME	 300
+
+/*
+ * The replay window is an open-addressed table of words, each holding
+ * a tag (from the nonce's HMAC) in the high 24 bits, the low 24 bits
+ * of the nonce's issue time in the next, and the next acceptable nonce
+ * count in the low 16 bits.
+ * A zero count marks a revoked nonce; a zero word is an empty slot.
+ * Evicting a nonce before it expires raises the watermark to its issue
+ * time: nonces not in the window issued before then are stale, as
+ * they may have been evicted.
+ * It's mapped shared before workers are forked, and words are only
+ * modified by compare-and-swap, so needs no other locking.
+ * This is why stateless nonces need workers forked by supervise():
+ * processes started otherwise (e.g., by kfcgi(8)) would each have
+ * their own window.
+ */
+#define	HNONCE_SLOTS	 4096
+#define	HNONCE_PROBES	 8
+#define	HNONCE_COUNTMAX	 0xffff
+
+#define	HSLOT(_tag, _issued, _count) \
+	((uint64_t)(_tag) << 40 | \
+	 ((uint64_t)(_issued) & 0xffffff) << 16 | (uint64_t)(_count))
+#define	HSLOT_ID(_v)	 ((_v) & ~(uint64_t)HNONCE_COUNTMAX)
+#define	HSLOT_COUNT(_v)	 ((_v) & HNONCE_COUNTMAX)
+#define	HSLOT_BUCKET(_tag) \
+	(((_tag) >> 1) % HNONCE_SLOTS) /* skip the non-zero bit */
+
+struct	hwindow {
+	uint64_t	 mark; /* watermark issue time */
+	uint64_t	 slots[HNONCE_SLOTS];
+};
+
+static struct hwindow	*window; /* replay window or NULL if unused */
+static uint8_t		 key[MD5_BLOCK_LENGTH]; /* HMAC key */
+static int		 haskey; /* key has been read */
+
+/*
+ * Enable stateless nonces by mapping the replay window.
+ * This must be called before forking workers to share the window.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+nonce_hmac_init(void)
+{
+	void	*p;
+
+	if (window != NULL)
+		return 1;
+
+	p = mmap(NULL, sizeof(struct hwindow),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED)
+		return 0;
+
+	window = p;
+	return 1;
+}
+
+/*
+ * Read the HMAC key from the database secret, if not already read.
+ * Keys longer than a block are hashed, as per RFC 2104.
+ * Returns <0 on failure, 0 if there's no secret, >0 on success.
+ */
+static int
+hnonce_key(void)
+{
+	char	*secret;
+	size_t	 sz;
+	int	 rc;
+	MD5_CTX	 ctx;
+
+	if (haskey)
+		return 1;
+	if ((rc = db_secret(&secret)) <= 0)
+		return rc;
+
+	if ((sz = strlen(secret)) > sizeof(key)) {
+		MD5Init(&ctx);
+		MD5Update(&ctx, (uint8_t *)secret, sz);
+		MD5Final(key, &ctx);
+	} else
+		memcpy(key, secret, sz);
+
+	explicit_bzero(secret, sz);
+	free(secret);
+	haskey = 1;
+	return 1;
+}
+
+/*
+ * Compute the HMAC-MD5 of "msg" into "mac" (RFC 2104).
+ */
+static void
+hnonce_mac(const char *msg, size_t sz, uint8_t mac[MD5_DIGEST_LENGTH])
+{
+	MD5_CTX	 ctx;
+	uint8_t	 pad[MD5_BLOCK_LENGTH];
+	size_t	 i;
+
+	for (i = 0; i < sizeof(pad); i++)
+		pad[i] = key[i] ^ 0x36;
+	MD5Init(&ctx);
+	MD5Update(&ctx, pad, sizeof(pad));
+	MD5Update(&ctx, (const uint8_t *)msg, sz);
+	MD5Final(mac, &ctx);
+
+	for (i = 0; i < sizeof(pad); i++)
+		pad[i] = key[i] ^ 0x5c;
+	MD5Init(&ctx);
+	MD5Update(&ctx, pad, sizeof(pad));
+	MD5Update(&ctx, mac, MD5_DIGEST_LENGTH);
+	MD5Final(mac, &ctx);
+}
+
+/*
+ * Create a new stateless nonce.
+ * This is in static storage and is overwritten with every call.
+ */
+static char *
+hnonce_new(void)
+{
+	static char	 nonce[HNONCE_SZ + 1];
+	uint8_t		 mac[MD5_DIGEST_LENGTH];
+	uint32_t	 salt;
+	size_t		 i;
+
+#if HAVE_ARC4RANDOM
+	salt = arc4random();
+#else
+	salt = random();
+#endif
+	snprintf(nonce, sizeof(nonce), "%016" PRIx64 "%08" PRIx32,
+		(uint64_t)time(NULL), salt);
+	hnonce_mac(nonce, HNONCE_TIMESZ + HNONCE_SALTSZ, mac);
+	for (i = 0; i < HNONCE_MACSZ / 2; i++)
+		snprintf(nonce + HNONCE_TIMESZ + HNONCE_SALTSZ + i * 2,
+			3, "%02" PRIx8, mac[i]);
+	return nonce;
+}
+
+/*
+ * Check that "nonce" was issued by us and is still fresh.
+ * On success, fill in the window "tag" derived from its HMAC, its
+ * issue time, and the current time.
+ * Returns zero if the nonce is bad or stale, non-zero on success.
+ */
+static int
+hnonce_check(const char *nonce, uint32_t *tag, uint64_t *issued,
+	uint64_t *now)
+{
+	uint8_t		 mac[MD5_DIGEST_LENGTH];
+	char		 buf[HNONCE_MACSZ + 1];
+	const char	*cp;
+	unsigned char	 diff = 0;
+	time_t		 t;
+	size_t		 i;
+
+	if (strlen(nonce) != HNONCE_SZ)
+		return 0;
+
+	*issued = 0;
+	for (cp = nonce, i = 0; i < HNONCE_TIMESZ; i++, cp++) {
+		*issued <<= 4;
+		if (*cp >= '0' && *cp <= '9')
+			*issued |= *cp - '0';
+		else if (*cp >= 'a' && *cp <= 'f')
+			*issued |= *cp - 'a' + 10;
+		else
+			return 0;
+	}
+
+	/* Compare in constant time. */
+
+	hnonce_mac(nonce, HNONCE_TIMESZ + HNONCE_SALTSZ, mac);
+	for (i = 0; i < HNONCE_MACSZ / 2; i++)
+		snprintf(buf + i * 2, 3, "%02" PRIx8, mac[i]);
+	cp = nonce + HNONCE_TIMESZ + HNONCE_SALTSZ;
+	for (i = 0; i < HNONCE_MACSZ; i++)
+		diff |= buf[i] ^ cp[i];
+	if (diff != 0)
+		return 0;
+
+	if ((t = time(NULL)) < 0)
+		return 0;
+	*now = t;
+	if (*issued > *now || *now - *issued > HNONCE_LIFETIME)
+		return 0;
+
+	*tag = ((uint32_t)mac[8] << 16 | (uint32_t)mac[9] << 8 |
+		mac[10]) | 1;
+	return 1;
+}
+
+/*
+ * The issue time of the nonce in slot "v", given the current time.
+ */
+static uint64_t
+hslot_issued(uint64_t v, uint64_t now)
+{
+
+	return now - ((now - (v >> 16)) & 0xffffff);
+}
+
+/*
+ * Record "nv" in an empty slot of those probed from "h" or, failing
+ * that, in place of an expired nonce or the oldest of the others,
+ * preferring to keep revoked ones.
+ * Returns zero if we raced with another writer, non-zero on success.
+ */
+static int
+hnonce_insert(size_t h, uint64_t nv, uint64_t now)
+{
+	uint64_t	*sp, *vp = NULL, v, vv = 0, issued, vissued = 0;
+	uint64_t	 mark;
+	size_t		 i;
+
+	for (i = 0; i < HNONCE_PROBES; i++) {
+		sp = &window->slots[(h + i) % HNONCE_SLOTS];
+		v = __atomic_load_n(sp, __ATOMIC_ACQUIRE);
+		if (v == 0)
+			return __atomic_compare_exchange_n(sp, &v, nv,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		issued = hslot_issued(v, now);
+		if (now - issued > HNONCE_LIFETIME)
+			return __atomic_compare_exchange_n(sp, &v, nv,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		if (vp == NULL ||
+		    (HSLOT_COUNT(vv) == 0 && HSLOT_COUNT(v) != 0) ||
+		    ((HSLOT_COUNT(vv) == 0) == (HSLOT_COUNT(v) == 0) &&
+		     issued < vissued)) {
+			vp = sp;
+			vv = v;
+			vissued = issued;
+		}
+	}
+
+	if (!__atomic_compare_exchange_n(vp, &vv, nv, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return 0;
+
+	mark = __atomic_load_n(&window->mark, __ATOMIC_ACQUIRE);
+	while (mark < vissued && 
+	    !__atomic_compare_exchange_n(&window->mark, &mark, vissued,
+	    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		continue;
+	return 1;
+}
+
+/*
+ * Check the nonce count against the replay window, then record it.
+ * Nonces not in the window are only accepted at their first use (a
+ * count of one) and if issued after the watermark, as otherwise they
+ * may have been evicted.
+ */
+static enum nonceerr
+hnonce_update(const char *nonce, int64_t count)
+{
+	uint32_t	 tag;
+	uint64_t	*sp, v, id, nv, issued, now;
+	size_t		 i, h;
+
+	if (!hnonce_check(nonce, &tag, &issued, &now))
+		return NONCE_NOTFOUND;
+	if (count < 0)
+		return NONCE_REPLAY;
+	if (count >= HNONCE_COUNTMAX)
+		return NONCE_NOTFOUND;
+
+	id = HSLOT(tag, issued, 0);
+	nv = id | (uint64_t)(count + 1);
+	h = HSLOT_BUCKET(tag);
+again:
+	for (i = 0; i < HNONCE_PROBES; i++) {
+		sp = &window->slots[(h + i) % HNONCE_SLOTS];
+		v = __atomic_load_n(sp, __ATOMIC_ACQUIRE);
+		if (HSLOT_ID(v) != id)
+			continue;
+		if (HSLOT_COUNT(v) == 0)
+			return NONCE_NOTFOUND;
+		if (count < (int64_t)HSLOT_COUNT(v))
+			return NONCE_REPLAY;
+		if (!__atomic_compare_exchange_n(sp, &v, nv, 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			goto again;
+		return NONCE_OK;
+	}
+
+	if (count != 1 || 
+	    issued <= __atomic_load_n(&window->mark, __ATOMIC_ACQUIRE))
+		return NONCE_NOTFOUND;
+
+	/*
+	 * If we race with another writer, start over: it might be
+	 * recording this same nonce.
+	 */
+
+	if (!hnonce_insert(h, nv, now))
+		goto again;
+	return NONCE_OK;
+}
+
+/*
+ * Revoke a stateless nonce by zeroing its count in the window.
+ * The revoked nonce is kept in the window until it expires unless
+ * every slot it may take holds a revoked nonce, in which case the
+ * watermark makes it stale.
+ */
+static void
+hnonce_revoke(const char *nonce)
+{
+	uint32_t	 tag;
+	uint64_t	*sp, v, id, issued, now;
+	size_t		 i, h;
+
+	if (!hnonce_check(nonce, &tag, &issued, &now))
+		return;
+
+	id = HSLOT(tag, issued, 0);
+	h = HSLOT_BUCKET(tag);
+again:
+	for (i = 0; i < HNONCE_PROBES; i++) {
+		sp = &window->slots[(h + i) % HNONCE_SLOTS];
+		v = __atomic_load_n(sp, __ATOMIC_ACQUIRE);
+		if (HSLOT_ID(v) != id)
+			continue;
+		if (!__atomic_compare_exchange_n(sp, &v, id, 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			goto again;
+		return;
+	}
+
+	if (issued <= __atomic_load_n(&window->mark, __ATOMIC_ACQUIRE))
+		return;
+	if (!hnonce_insert(h, id, now))
+		goto again;
+}
+
+/*
+ * Run a series of checks for the nonce validity.
+ * With stateless nonces, check the signature and age then consult
+ * the replay window.
+ * Otherwise, we first look up the nonce in the nonce table and see if
+ * we've seen the nonce or not.
+ * If we have and it's a replay--bam.
+ * Otherwise, atomically check again while updating.
+ * If we find it and it's a replay--bam.
+ * If we find it and it's not, update the nonce count.
+ * If we don't find it, start over.
+ * Return -2 on system failure, -1 on replay, 0 on stale, 1 on ok.
+ */
+int
+nonce_validate(const struct khttpdigest *auth, char **np)
+{
+	int	 rc;
+
+	/*
+	 * Without a secret (the database has no owner record yet),
+	 * fall back to database nonces.
+	 */
+
+	if (window != NULL && (rc = hnonce_key()) != 0) {
+		if (rc < 0)
+			return (-2);
+		switch (hnonce_update(auth->nonce, auth->count)) {
+		case NONCE_ERR:
+			return (-2);
+		case NONCE_REPLAY:
+			return (-1);
+		case NONCE_NOTFOUND:
+			*np = hnonce_new();
+			return 0;
+		default:
+			break;
+		}
+		return 1;
+	}
+
+	/*
+	 * See whether our nonce lookup fails.
+	 * This doesn't modify the table, as an adversary could be
+	 * playing us by submitting replay attacks (or random nonce
+	 * values) over and over again in the hopes of flushing it.
+	 */
+
+	switch (db_nonce_validate(auth->nonce, auth->count)) {
+	case NONCE_ERR:
+		return (-2);
+	case NONCE_REPLAY:
+		return (-1);
+	case NONCE_NOTFOUND:
+		/*
+		 * We don't have the nonce.
+		 * This means that the client has either used one of our
+		 * bogus initial nonces or is using one from a much
+		 * earlier session.
+		 * Tell them to retry with a new nonce.
+		 */
+		if (!db_nonce_new(np))
+			return (-2);
+		return 0;
+	default:
+		break;
+	}
+
+	/*
+	 * Now we actually update our nonce table.
+	 * We only get here if the nonce value exists and is fresh.
+	 */
+
+	switch (db_nonce_update(auth->nonce, auth->count)) {
+	case NONCE_ERR:
+		return (-2);
+	case NONCE_REPLAY:
+		return (-1);
+	case NONCE_NOTFOUND:
+		if (!db_nonce_new(np))
+			return (-2);
+		return 0;
+	default:
+		break;
+	}
+
+	return 1;
+}
+
+/*
+ * Delete the nonce, effectively logging out the user.
+ * Return zero on failure, non-zero on success.
+ */
+int
+nonce_delete(const char *nonce, const struct prncpl *p)
+{
+
+	if (window != NULL && strlen(nonce) == HNONCE_SZ) {
+		if (hnonce_key() > 0)
+			hnonce_revoke(nonce);
+		return 1;
+	}
+
+	return db_nonce_delete(nonce, p);
+}
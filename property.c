@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <kcgi.h>
 #include <kcgixml.h>
@@ -534,6 +535,44 @@ collection_supported_calendar_data(struct kreq *req,
 		"version", "2.0", NULL);
 }
 
+/*
+ * RFC 3253, 3.1.5.
+ */
+static void
+collection_supported_report_set(struct kreq *req, 
+	struct kxmlreq *xml, const struct coln *c)
+{
+	const enum xml	 reports[] = {
+		XML_CALDAV_CALENDAR_MULTIGET,
+		XML_CALDAV_CALENDAR_QUERY,
+		XML_CALDAV_FREE_BUSY_QUERY,
+		XML_DAV_SYNC_COLLECTION
+	};
+	size_t		 i;
+
+	for (i = 0; i < sizeof(reports) / sizeof(reports[0]); i++) {
+		kxml_push(xml, XML_DAV_SUPPORTED_REPORT);
+		kxml_push(xml, XML_DAV_REPORT);
+		kxml_pushnull(xml, reports[i]);
+		kxml_pop(xml);
+		kxml_pop(xml);
+	}
+}
+
+/*
+ * RFC 6578, 4.
+ * The sync-token is the ctag, which is bumped with every change.
+ */
+static void
+collection_sync_token(struct kreq *req, 
+	struct kxmlreq *xml, const struct coln *c)
+{
+	char	 buf[64];
+
+	snprintf(buf, sizeof(buf), SYNCTOKEN "%" PRId64, c->ctag);
+	kxml_puts(xml, buf);
+}
+
 /*
  * RFC 4791, 5.2.2.
  */
@@ -575,13 +614,32 @@ collection_min_date_time(struct kreq *req,
 
 /*
  * RFC 4791, 9.6.
+ * If only some of the data was requested, it's printed from the parse;
+ * otherwise, it's the stored data as-is.
  */
 static void
 resource_calendar_data(struct kreq *req, struct kxmlreq *xml, 
 	const struct coln *c, const struct res *p)
 {
+	struct state	*st = req->arg;
+	struct outbuf	 ob;
+	char		*buf;
+	size_t		 sz;
+
+	outbuf_init(&ob, req);
+	if (st->caldata == NULL || p->ical == NULL) {
+		outbuf_put_xml(&ob, p->data, strlen(p->data));
+		outbuf_flush(&ob);
+		return;
+	}
 
-	ical_print(p->ical, xml_ical_putc, xml);
+	if ((buf = caldav_data(st->caldata, p->ical, &sz)) == NULL) {
+		kutil_err_noexit(req, st->prncpl->name, "caldav_data");
+		return;
+	}
+	outbuf_put_xml(&ob, buf, sz);
+	outbuf_flush(&ob);
+	free(buf);
 }
 
 /*
@@ -746,4 +804,14 @@ const struct property properties[CALPROP__MAX] = {
 	  collection_supported_calendar_data, 
 	  NULL,
 	  NULL }, 
+	{ /* CALPROP_SUPPORTED_REPORT_SET */
+	  0, 
+	  collection_supported_report_set, 
+	  NULL,
+	  NULL }, 
+	{ /* CALPROP_SYNC_TOKEN */
+	  0, 
+	  collection_sync_token, 
+	  NULL,
+	  NULL }, 
 };
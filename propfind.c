@@ -16,11 +16,15 @@
 #include "config.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <kcgi.h>
 #include <kcgixml.h>
@@ -34,8 +38,36 @@ struct	cbarg {
 	struct kreq		*req;
 	const struct caldav	*dav;
 	const struct coln	*c;
+	int			 initial; /* sync: skip removed */
+	size_t			 next; /* multiget: next href */
 };
 
+enum	propelem {
+	PROPELEM_OPEN,
+	PROPELEM_CLOSE,
+	PROPELEM_EMPTY
+};
+
+/*
+ * Buffer an element for the requested property "p".
+ * It's given its own namespace prefix, as the request may have used any.
+ */
+static void
+propfind_prop(struct outbuf *ob, const struct calprop *p, 
+	enum propelem type)
+{
+
+	outbuf_puts(ob, type == PROPELEM_CLOSE ? "</X:" : "<X:");
+	outbuf_puts(ob, p->name);
+	if (type == PROPELEM_CLOSE) {
+		outbuf_putc('>', ob);
+		return;
+	}
+	outbuf_puts(ob, " xmlns:X=\"");
+	outbuf_puts(ob, p->xmlns);
+	outbuf_puts(ob, type == PROPELEM_EMPTY ? "\" />" : "\">");
+}
+
 /*
  * This converts the request into a CalDav object.
  * We know that the request is a well-formed CalDav object because it
@@ -46,6 +78,7 @@ static struct caldav *
 req2caldav(struct kreq *r, enum kmime *mime)
 {
 	struct state	*st = r->arg;
+	struct caldav	*dav;
 
 	if (r->fieldmap[VALID_BODY] == NULL) {
 		kutil_warnx(r, st->prncpl->name,
@@ -66,9 +99,15 @@ req2caldav(struct kreq *r, enum kmime *mime)
 
 	/* This shouldn't fail now. */
 
-	return caldav_parse
+	dav = caldav_parse
 		(r->fieldmap[VALID_BODY]->val, 
 		 r->fieldmap[VALID_BODY]->valsz, NULL);
+
+	/* For resource_calendar_data(). */
+
+	if (dav != NULL)
+		st->caldata = dav->data;
+	return dav;
 }
 
 static void
@@ -76,10 +115,13 @@ propfind_coln(struct kreq *r, struct kxmlreq *xml,
 	const struct caldav *dav, const struct coln *coln)
 {
 	struct state		*st = r->arg;
+	struct outbuf		 ob;
 	size_t			 i;
 	int			 nf;
 	enum calproptype	 key;
 
+	outbuf_init(&ob, r);
+
 	kxml_push(xml, XML_DAV_RESPONSE);
 	kxml_push(xml, XML_DAV_HREF);
 	kxml_puts(xml, r->pname);
@@ -99,16 +141,12 @@ propfind_coln(struct kreq *r, struct kxmlreq *xml,
 			continue;
 		} else if (properties[key].cgetfp == NULL)
 			continue;
-		khttp_puts(r, "<X:");
-		khttp_puts(r, dav->props[i].name);
-		khttp_puts(r, " xmlns:X=\"");
-		khttp_puts(r, dav->props[i].xmlns);
-		khttp_puts(r, "\">");
+		propfind_prop(&ob, &dav->props[i], PROPELEM_OPEN);
+		outbuf_flush(&ob);
 		(*properties[key].cgetfp)(r, xml, coln);
-		khttp_puts(r, "</X:");
-		khttp_puts(r, dav->props[i].name);
-		khttp_putc(r, '>');
+		propfind_prop(&ob, &dav->props[i], PROPELEM_CLOSE);
 	}
+	outbuf_flush(&ob);
 	kxml_pop(xml);
 	kxml_push(xml, XML_DAV_STATUS);
 	kxml_puts(xml, "HTTP/1.1 ");
@@ -126,12 +164,9 @@ propfind_coln(struct kreq *r, struct kxmlreq *xml,
 		for (i = 0; i < dav->propsz; i++) {
 			if (dav->props[i].key != CALPROP__MAX)
 				continue;
-			khttp_puts(r, "<X:");
-			khttp_puts(r, dav->props[i].name);
-			khttp_puts(r, " xmlns:X=\"");
-			khttp_puts(r, dav->props[i].xmlns);
-			khttp_puts(r, "\" />");
+			propfind_prop(&ob, &dav->props[i], PROPELEM_EMPTY);
 		}
+		outbuf_flush(&ob);
 		kxml_pop(xml);
 		kxml_push(xml, XML_DAV_STATUS);
 		kxml_puts(xml, "HTTP/1.1 ");
@@ -149,10 +184,13 @@ propfind_resource(struct kreq *r,
 	const struct coln *c, const struct res *res)
 {
 	struct state		*st = r->arg;
+	struct outbuf		 ob;
 	size_t			 i;
 	int			 nf;
 	enum calproptype	 key;
 
+	outbuf_init(&ob, r);
+
 	kxml_push(xml, XML_DAV_RESPONSE);
 	kxml_push(xml, XML_DAV_HREF);
 	kxml_puts(xml, r->pname);
@@ -172,16 +210,12 @@ propfind_resource(struct kreq *r,
 			continue;
 		} else if (properties[key].rgetfp == NULL)
 			continue;
-		khttp_puts(r, "<X:");
-		khttp_puts(r, dav->props[i].name);
-		khttp_puts(r, " xmlns:X=\"");
-		khttp_puts(r, dav->props[i].xmlns);
-		khttp_puts(r, "\">");
+		propfind_prop(&ob, &dav->props[i], PROPELEM_OPEN);
+		outbuf_flush(&ob);
 		(*properties[key].rgetfp)(r, xml, c, res);
-		khttp_puts(r, "</X:");
-		khttp_puts(r, dav->props[i].name);
-		khttp_putc(r, '>');
+		propfind_prop(&ob, &dav->props[i], PROPELEM_CLOSE);
 	}
+	outbuf_flush(&ob);
 	kxml_pop(xml);
 	kxml_push(xml, XML_DAV_STATUS);
 	kxml_puts(xml, "HTTP/1.1 ");
@@ -199,12 +233,9 @@ propfind_resource(struct kreq *r,
 		for (i = 0; i < dav->propsz; i++) {
 			if (dav->props[i].key != CALPROP__MAX)
 				continue;
-			khttp_puts(r, "<X:");
-			khttp_puts(r, dav->props[i].name);
-			khttp_puts(r, " xmlns:X=\"");
-			khttp_puts(r, dav->props[i].xmlns);
-			khttp_puts(r, "\" />");
+			propfind_prop(&ob, &dav->props[i], PROPELEM_EMPTY);
 		}
+		outbuf_flush(&ob);
 		kxml_pop(xml);
 		kxml_push(xml, XML_DAV_STATUS);
 		kxml_puts(xml, "HTTP/1.1 ");
@@ -216,77 +247,98 @@ propfind_resource(struct kreq *r,
 	kxml_pop(xml);
 }
 
+/*
+ * What of each resource's calendar data responding to "dav" needs: the
+ * text to print it (RES_DATA) or its parse to filter on or print a part
+ * of (RES_ICAL).
+ * Without either, resources are listed from their metadata alone.
+ */
+static unsigned int
+propfind_data(const struct caldav *dav)
+{
+	size_t	 i;
+
+	if (dav->filter != NULL || dav->data != NULL)
+		return RES_ICAL;
+	for (i = 0; i < dav->propsz; i++)
+		if (dav->props[i].key == CALPROP_CALENDAR_DATA)
+			return RES_DATA;
+	return 0;
+}
+
 static void
 propfind_resource_cb(const struct res *r, void *arg)
 {
 	struct cbarg	*d = arg;
 
-	propfind_resource(d->req, d->xml, d->dav, d->c, r);
+	/* Only calendar-query has filters. */
+
+	if (caldav_filter(d->dav->filter, r->ical))
+		propfind_resource(d->req, d->xml, d->dav, d->c, r);
 }
 
 /*
- * Look up a resource within the given collection.
- * This is similar to when we look up our request from the HTTP method
- * (e.g., GET /principal/collection/resource).
- * Return <0 on fatal error, 0 on error, >0 on success.
+ * Resolve "cp", a request URI of the form
+ * /script/principal/collection/resource, into a name looked up within
+ * the requested principal's collections.
+ * The principal and collection are matched in place, so only the
+ * (percent-decoded) resource name is allocated.
+ * On failure, the name is left as one that won't be found.
  */
-static int
-propfind_resource_lookup(struct kreq *r, struct kxmlreq *xml, 
-	const char *cp, struct res **p)
+static void
+propfind_href(struct kreq *r, const char *cp, struct resname *name)
 {
 	struct state	*st = r->arg;
-	char		*prncp = NULL, *comp = NULL, *res = NULL;
-	int		 rc = 0;
+	const char	*coln, *res;
+	char		*url;
 	size_t		 i, sz;
 
-	*p = NULL;
+	name->collection = -1;
+	name->url = NULL;
 
 	sz = strlen(r->pname);
 	if (strncmp(r->pname, cp, sz)) {
 		kutil_warnx(r, st->prncpl->name,
 			"bad script name");
-		return 0;
+		return;
 	}
 
-	/* Parse out paths. */
+	/* Parse out paths, as in http_paths(). */
 
 	cp += sz;
+	sz = strlen(st->rprncpl->name);
 
-	if (!http_paths(cp, &prncp, &comp, &res)) {
+	if (cp[0] != '/' || (coln = strchr(cp + 1, '/')) == NULL ||
+	    (res = strrchr(coln + 1, '/')) == NULL) {
 		kutil_warnx(r, st->prncpl->name,
 			"bad request path");
-		goto err;
-	} else if (strcmp(st->rprncpl->name, prncp)) {
+		return;
+	} else if ((size_t)(coln - cp - 1) != sz ||
+	    strncmp(cp + 1, st->rprncpl->name, sz)) {
 		kutil_warnx(r, st->prncpl->name,
-			"bad request principal: %s", prncp);
-		goto err;
+			"bad request principal: %.*s", 
+			(int)(coln - cp - 1), cp + 1);
+		return;
 	}
 
 	/* Look up the collection. */
 
+	coln++;
+	sz = res - coln;
 	for (i = 0; i < st->rprncpl->colsz; i++)
-		if (strcmp(st->rprncpl->cols[i].url, comp) == 0)
+		if (strlen(st->rprncpl->cols[i].url) == sz &&
+		    strncmp(st->rprncpl->cols[i].url, coln, sz) == 0)
 			break;
 
 	if (i == st->rprncpl->colsz) {
 		kutil_warnx(r, st->prncpl->name,
-			"bad request collection: %s", comp);
-		goto err;
+			"bad request collection: %.*s", (int)sz, coln);
+		return;
 	}
 
-	rc = db_resource_load(p, res, st->rprncpl->cols[i].id);
-
-	if (rc == 0)
-		kutil_warnx(r, st->prncpl->name,
-			"resource not found: %s", res);
-	else if (rc < 0)
-		kutil_errx_noexit(r, st->prncpl->name,
-			"cannot load resource: %s", res);
-err:
-	free(prncp);
-	free(comp);
-	free(res);
-	return rc;
+	http_decode(res + 1, &url);
+	name->collection = st->rprncpl->cols[i].id;
+	name->url = url;
 }
 
 static void
@@ -294,10 +346,13 @@ propfind_prncpl(struct kreq *req, struct kxmlreq *xml,
 	const struct caldav *dav)
 {
 	struct state		*st = req->arg;
+	struct outbuf		 ob;
 	size_t			 i;
 	int			 nf;
 	enum calproptype	 key;
 
+	outbuf_init(&ob, req);
+
 	kxml_push(xml, XML_DAV_RESPONSE);
 	kxml_push(xml, XML_DAV_HREF);
 	kxml_puts(xml, req->pname);
@@ -314,16 +369,12 @@ propfind_prncpl(struct kreq *req, struct kxmlreq *xml,
 			continue;
 		} else if (NULL == properties[key].pgetfp)
 			continue;
-		khttp_puts(req, "<X:");
-		khttp_puts(req, dav->props[i].name);
-		khttp_puts(req, " xmlns:X=\"");
-		khttp_puts(req, dav->props[i].xmlns);
-		khttp_puts(req, "\">");
+		propfind_prop(&ob, &dav->props[i], PROPELEM_OPEN);
+		outbuf_flush(&ob);
 		(*properties[key].pgetfp)(req, xml);
-		khttp_puts(req, "</X:");
-		khttp_puts(req, dav->props[i].name);
-		khttp_putc(req, '>');
+		propfind_prop(&ob, &dav->props[i], PROPELEM_CLOSE);
 	}
+	outbuf_flush(&ob);
 	kxml_pop(xml);
 	kxml_push(xml, XML_DAV_STATUS);
 	kxml_puts(xml, "HTTP/1.1 ");
@@ -337,12 +388,9 @@ propfind_prncpl(struct kreq *req, struct kxmlreq *xml,
 		for (i = 0; i < dav->propsz; i++) {
 			if (CALPROP__MAX != dav->props[i].key)
 				continue;
-			khttp_puts(req, "<X:");
-			khttp_puts(req, dav->props[i].name);
-			khttp_puts(req, " xmlns:X=\"");
-			khttp_puts(req, dav->props[i].xmlns);
-			khttp_puts(req, "\" />");
+			propfind_prop(&ob, &dav->props[i], PROPELEM_EMPTY);
 		}
+		outbuf_flush(&ob);
 		kxml_pop(xml);
 		kxml_push(xml, XML_DAV_STATUS);
 		kxml_puts(xml, "HTTP/1.1 ");
@@ -364,10 +412,13 @@ propfind_proxy(struct kreq *req, struct kxmlreq *xml,
 	const struct caldav *dav, const char *proxy)
 {
 	struct state	*st = req->arg;
+	struct outbuf	 ob;
 	size_t	 	 i, j, nf;
 	int		 bits;
 	enum xml	 type;
 
+	outbuf_init(&ob, req);
+
 	/* Are we asking for writers or readers? */
 
 	type = 0 == strcmp(proxy, "calendar-proxy-write") ?
@@ -405,11 +456,8 @@ propfind_proxy(struct kreq *req, struct kxmlreq *xml,
 		 * RFC 3744, 4.3.
 		 * Specifically, caldav-proxy.txt, 5.2.
 		 */
-		khttp_puts(req, "<X:");
-		khttp_puts(req, dav->props[i].name);
-		khttp_puts(req, " xmlns:X=\"");
-		khttp_puts(req, dav->props[i].xmlns);
-		khttp_puts(req, "\">");
+		propfind_prop(&ob, &dav->props[i], PROPELEM_OPEN);
+		outbuf_flush(&ob);
 
 		/* All of the readers or writers. */
 		for (j = 0; j < st->rprncpl->proxiesz; j++) {
@@ -423,10 +471,9 @@ propfind_proxy(struct kreq *req, struct kxmlreq *xml,
 			kxml_pop(xml);
 		}
 
-		khttp_puts(req, "</X:");
-		khttp_puts(req, dav->props[i].name);
-		khttp_putc(req, '>');
+		propfind_prop(&ob, &dav->props[i], PROPELEM_CLOSE);
 	}
+	outbuf_flush(&ob);
 	kxml_pop(xml);
 	kxml_push(xml, XML_DAV_STATUS);
 	kxml_puts(xml, "HTTP/1.1 ");
@@ -442,12 +489,9 @@ propfind_proxy(struct kreq *req, struct kxmlreq *xml,
 			if (CALPROP_RESOURCETYPE == dav->props[i].key ||
 			    CALPROP_GROUP_MEMBER_SET == dav->props[i].key)
 				continue;
-			khttp_puts(req, "<X:");
-			khttp_puts(req, dav->props[i].name);
-			khttp_puts(req, " xmlns:X=\"");
-			khttp_puts(req, dav->props[i].xmlns);
-			khttp_puts(req, "\" />");
+			propfind_prop(&ob, &dav->props[i], PROPELEM_EMPTY);
 		}
+		outbuf_flush(&ob);
 		kxml_pop(xml);
 		kxml_push(xml, XML_DAV_STATUS);
 		kxml_puts(xml, "HTTP/1.1 ");
@@ -501,8 +545,8 @@ propfind_directory(struct kreq *req, struct kxmlreq *xml,
 		carg.c = c;
 		carg.dav = dav;
 		carg.req = req;
-		db_collection_resources
-			(propfind_resource_cb, c->id, &carg);
+		db_collection_resources(propfind_resource_cb, 
+			c->id, propfind_data(dav), &carg);
 		return;
 	} 
 
@@ -513,9 +557,307 @@ propfind_directory(struct kreq *req, struct kxmlreq *xml,
 			&st->rprncpl->cols[i]);
 }
 
+/*
+ * Satisfy a calendar-query (RFC 4791, 7.8) on collection "c".
+ * If the filter has a time-range, only resources that may overlap it
+ * are looked up; otherwise, all of them are.
+ * Either way, the filter is applied to each of them.
+ */
+static void
+propfind_query(struct kreq *req, struct kxmlreq *xml, 
+	const struct caldav *dav, const struct coln *c)
+{
+	struct state	*st = req->arg;
+	struct cbarg	 carg;
+	int		 rc;
+
+	carg.xml = xml;
+	carg.c = c;
+	carg.dav = dav;
+	carg.req = req;
+
+	if (dav->range.set)
+		rc = db_collection_resources_range
+			(propfind_resource_cb, c, &dav->range, &carg);
+	else
+		rc = db_collection_resources(propfind_resource_cb, 
+			c->id, propfind_data(dav), &carg);
+
+	if (!rc)
+		kutil_errx_noexit(req, st->prncpl->name,
+			"cannot query collection: %s", c->url);
+}
+
+static void
+propfind_sync_cb(const char *url, const struct res *r, void *arg)
+{
+	struct cbarg	*d = arg;
+	struct state	*st = d->req->arg;
+	char		*cp;
+
+	if (r != NULL) {
+		propfind_resource(d->req, d->xml, d->dav, d->c, r);
+		return;
+	} else if (d->initial)
+		return;
+
+	/* RFC 6578, 3.5.2: removed members have only a status. */
+
+	kxml_push(d->xml, XML_DAV_RESPONSE);
+	kxml_push(d->xml, XML_DAV_HREF);
+	kxml_puts(d->xml, d->req->pname);
+	kxml_putc(d->xml, '/');
+	kxml_puts(d->xml, st->rprncpl->name);
+	kxml_putc(d->xml, '/');
+	kxml_puts(d->xml, d->c->url);
+	kxml_putc(d->xml, '/');
+	cp = khttp_urlencode(url);
+	kxml_puts(d->xml, cp);
+	free(cp);
+	kxml_pop(d->xml);
+	kxml_push(d->xml, XML_DAV_STATUS);
+	kxml_puts(d->xml, "HTTP/1.1 ");
+	kxml_puts(d->xml, khttps[KHTTP_404]);
+	kxml_pop(d->xml);
+	kxml_pop(d->xml);
+}
+
+/*
+ * Buffer the UTC date-time "v" (RFC 5545, 3.3.5).
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+propfind_freebusy_time(struct outbuf *ob, int64_t v)
+{
+	char	 buf[32];
+
+	ical_utc2str(buf, sizeof(buf), v, ICAL_DT_DATETIMEUTC);
+	return outbuf_puts(ob, buf);
+}
+
+/*
+ * Buffer the VFREEBUSY of the merged busy periods "busy" of "busysz"
+ * over the range of "dav".
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+propfind_freebusy_write(struct outbuf *ob, const struct caldav *dav,
+	const struct calbusy *busy, size_t busysz)
+{
+	size_t	 i;
+
+	if (!outbuf_puts(ob, "BEGIN:VCALENDAR\r\n") ||
+	    !outbuf_puts(ob, "VERSION:2.0\r\n") ||
+	    !outbuf_puts(ob, "PRODID:-//BSD.lv Project/kcaldav "
+	     VERSION "//EN\r\n") ||
+	    !outbuf_puts(ob, "BEGIN:VFREEBUSY\r\n") ||
+	    !outbuf_puts(ob, "DTSTAMP:") ||
+	    !propfind_freebusy_time(ob, time(NULL)) ||
+	    !outbuf_puts(ob, "\r\nDTSTART:") ||
+	    !propfind_freebusy_time(ob, dav->range.start) ||
+	    !outbuf_puts(ob, "\r\nDTEND:") ||
+	    !propfind_freebusy_time(ob, dav->range.end) ||
+	    !outbuf_puts(ob, "\r\n"))
+		return 0;
+
+	for (i = 0; i < busysz; i++)
+		if (!outbuf_puts(ob, "FREEBUSY;FBTYPE=") ||
+		    !outbuf_puts(ob, calfbtypes[busy[i].type]) ||
+		    !outbuf_putc(':', ob) ||
+		    !propfind_freebusy_time(ob, busy[i].start) ||
+		    !outbuf_putc('/', ob) ||
+		    !propfind_freebusy_time(ob, busy[i].end) ||
+		    !outbuf_puts(ob, "\r\n"))
+			return 0;
+
+	return outbuf_puts(ob, "END:VFREEBUSY\r\n") &&
+	    outbuf_puts(ob, "END:VCALENDAR\r\n") &&
+	    outbuf_flush(ob);
+}
+
+/*
+ * Respond to a free-busy-query (RFC 4791, 7.10) on a collection with a
+ * VFREEBUSY of the merged busy periods of each type in the range, one
+ * per FREEBUSY property.
+ * Most resources are accounted for by the occurrences listed when
+ * they were stored: only those without, or with instances past the
+ * horizon in the range, are parsed.
+ */
+static void
+propfind_freebusy(struct kreq *r, const struct caldav *dav,
+	const struct coln *c)
+{
+	struct state	*st = r->arg;
+	struct outbuf	 ob;
+	struct calbusy	*busy = NULL;
+	size_t		 busysz = 0;
+
+	if (!db_collection_freebusy(c, &dav->range, &busy, &busysz)) {
+		kutil_errx_noexit(r, st->prncpl->name,
+			"cannot query collection: %s", c->url);
+		http_error(r, KHTTP_505);
+		free(busy);
+		return;
+	}
+
+	caldav_freebusy_merge(busy, &busysz);
+
+	khttp_head(r, kresps[KRESP_STATUS], 
+		"%s", khttps[KHTTP_200]);
+	khttp_head(r, kresps[KRESP_CONTENT_TYPE], 
+		"%s", kmimetypes[KMIME_TEXT_CALENDAR]);
+	khttp_body(r);
+
+	outbuf_init(&ob, r);
+	if (!propfind_freebusy_write(&ob, dav, busy, busysz))
+		kutil_warnx(r, st->prncpl->name,
+			"cannot write free-busy: %s", c->url);
+	free(busy);
+}
+
+/*
+ * Parse a sync-token (RFC 6578, 3.2) into the ctag of collection "c"
+ * it was issued at, which must not be after its current ctag nor
+ * before the oldest change it still records.
+ * An empty token (or none at all) is an initial synchronisation.
+ * Returns zero if the token is not one of ours or is too old, non-zero
+ * otherwise.
+ */
+static int
+propfind_sync_token(const char *tok, const struct coln *c, int64_t *since)
+{
+	const char	*er;
+	char		 buf[64];
+	size_t		 sz;
+
+	*since = 0;
+	if (tok == NULL)
+		return 1;
+
+	while (isspace((unsigned char)*tok))
+		tok++;
+	sz = strlen(tok);
+	while (sz > 0 && isspace((unsigned char)tok[sz - 1]))
+		sz--;
+	if (sz == 0)
+		return 1;
+
+	if (sz <= strlen(SYNCTOKEN) || sz >= sizeof(buf) ||
+	    strncmp(tok, SYNCTOKEN, strlen(SYNCTOKEN)))
+		return 0;
+
+	memcpy(buf, tok + strlen(SYNCTOKEN), sz - strlen(SYNCTOKEN));
+	buf[sz - strlen(SYNCTOKEN)] = '\0';
+	*since = strtonum(buf, 0, c->ctag, &er);
+	return er == NULL && (*since == 0 || *since >= c->synclimit);
+}
+
+/*
+ * Fail the DAV:valid-sync-token precondition (RFC 6578, 3.2), which
+ * makes the client synchronise from scratch.
+ */
+static void
+propfind_sync_invalid(struct kreq *r)
+{
+	struct kxmlreq	 xml;
+
+	khttp_head(r, kresps[KRESP_STATUS], 
+		"%s", khttps[KHTTP_403]);
+	khttp_head(r, kresps[KRESP_CONTENT_TYPE], 
+		"%s", kmimetypes[KMIME_TEXT_XML]);
+	khttp_body(r);
+	kxml_open(&xml, r, xmls, XML__MAX);
+	kxml_prologue(&xml);
+	kxml_pushattrs(&xml, XML_DAV_ERROR, "xmlns:D", "DAV:", NULL);
+	kxml_pushnull(&xml, XML_DAV_VALID_SYNC_TOKEN);
+	kxml_popall(&xml);
+	kxml_close(&xml);
+}
+
+/*
+ * Satisfy a sync-collection (RFC 6578, 3.2) on collection "c" from
+ * "since", the ctag of the client's last synchronisation (or zero).
+ * This lists each resource changed or removed since then from the
+ * change log, then the token for the current ctag.
+ */
+static void
+propfind_sync(struct kreq *req, struct kxmlreq *xml, 
+	const struct caldav *dav, const struct coln *c, int64_t since)
+{
+	struct state	*st = req->arg;
+	struct cbarg	 carg;
+	char		 buf[64];
+
+	carg.xml = xml;
+	carg.c = c;
+	carg.dav = dav;
+	carg.req = req;
+	carg.initial = since == 0;
+
+	if (!db_collection_sync(propfind_sync_cb, 
+	    c->id, since, propfind_data(dav), &carg))
+		kutil_errx_noexit(req, st->prncpl->name,
+			"cannot synchronise collection: %s", c->url);
+
+	snprintf(buf, sizeof(buf), SYNCTOKEN "%" PRId64, c->ctag);
+	kxml_push(xml, XML_DAV_SYNC_TOKEN);
+	kxml_puts(xml, buf);
+	kxml_pop(xml);
+}
+
+/*
+ * Respond to a multiget "href" that couldn't be looked up with a bare
+ * status code.
+ */
+static void
+propfind_href_status(struct kreq *req, struct kxmlreq *xml,
+	const char *href, enum khttp code)
+{
+	char		*cp;
+
+	kxml_push(xml, XML_DAV_RESPONSE);
+	kxml_push(xml, XML_DAV_HREF);
+	kxml_puts(xml, req->pname);
+	/* Remember to URL encode! */
+	cp = khttp_urlencode(href);
+	kxml_puts(xml, cp);
+	free(cp);
+	kxml_pop(xml);
+	kxml_push(xml, XML_DAV_STATUS);
+	kxml_puts(xml, "HTTP/1.1 ");
+	kxml_puts(xml, khttps[code]);
+	kxml_pop(xml);
+	kxml_pop(xml);
+}
+
+static void
+propfind_list_cb(size_t idx, const struct res *res, void *arg)
+{
+	struct cbarg	*d = arg;
+	struct state	*st = d->req->arg;
+	size_t		 i;
+
+	d->next = idx + 1;
+
+	if (res == NULL) {
+		propfind_href_status(d->req, d->xml, 
+			d->dav->hrefs[idx], KHTTP_403);
+		return;
+	}
+
+	for (i = 0; i < st->rprncpl->colsz; i++)
+		if (res->collection == st->rprncpl->cols[i].id)
+			break;
+	assert(i < st->rprncpl->colsz);
+	propfind_resource(d->req, d->xml, d->dav, 
+		&st->rprncpl->cols[i], res);
+}
+
 /*
  * Given a list of collections or resources in the "href" object of the
  * XML request, get their properties.
+ * The resources are looked up all at once, but responses are still
+ * in order of the request.
  * This occurs within a multi-response.
  */
 static void
@@ -523,46 +865,41 @@ propfind_list(struct kreq *req, struct kxmlreq *xml,
 	const struct caldav *dav)
 {
 	struct state	*st = req->arg;
-	size_t		 i, j;
-	struct res	*res;
-	char		*cp;
-	int		 rc;
+	struct resname	*names;
+	struct cbarg	 carg;
+	size_t		 i;
 
-	for (i = 0; i < dav->hrefsz; i++) {
-		rc = propfind_resource_lookup
-			(req, xml, dav->hrefs[i], &res);
-		if (rc > 0) {
-			assert(res != NULL);
-			for (j = 0; j < st->rprncpl->colsz; j++)
-				if (res->collection == 
-				    st->rprncpl->cols[j].id)
-					break;
-			assert(j < st->rprncpl->colsz);
-			propfind_resource(req, xml, dav, 
-				&st->rprncpl->cols[j], res);
-			db_resource_free(res);
-			continue;
-		} 
-
-		kxml_push(xml, XML_DAV_RESPONSE);
-		kxml_push(xml, XML_DAV_HREF);
-		kxml_puts(xml, req->pname);
-		/* Remember to URL encode! */
-		cp = khttp_urlencode(dav->hrefs[i]);
-		kxml_puts(xml, cp);
-		free(cp);
-		kxml_pop(xml);
-		kxml_push(xml, XML_DAV_STATUS);
-		kxml_puts(xml, "HTTP/1.1 ");
-		kxml_puts(xml, khttps[rc < 0 ? KHTTP_505 : KHTTP_403]);
-		kxml_pop(xml);
-		kxml_pop(xml);
+	if (dav->hrefsz == 0)
+		return;
+
+	names = kcalloc(dav->hrefsz, sizeof(struct resname));
+	for (i = 0; i < dav->hrefsz; i++)
+		propfind_href(req, dav->hrefs[i], &names[i]);
+
+	carg.xml = xml;
+	carg.c = NULL;
+	carg.dav = dav;
+	carg.req = req;
+	carg.next = 0;
+
+	if (!db_resource_list(propfind_list_cb, 
+	    names, dav->hrefsz, propfind_data(dav), &carg)) {
+		kutil_errx_noexit(req, st->prncpl->name,
+			"cannot load resources");
+		for (i = carg.next; i < dav->hrefsz; i++)
+			propfind_href_status(req, xml, 
+				dav->hrefs[i], KHTTP_505);
 	}
+
+	for (i = 0; i < dav->hrefsz; i++)
+		free((char *)names[i].url);
+	free(names);
 }
 
 /*
  * The REPORT method is for calendar collections and reosurces.
- * It's defined by RFC 4791, section 7.1.
+ * It's defined by RFC 4791, section 7.1, with the sync-collection
+ * report for collections in RFC 6578, section 3.2.
  */
 void
 method_report(struct kreq *r)
@@ -573,6 +910,7 @@ method_report(struct kreq *r)
 	struct res	*res = NULL;
 	enum kmime	 mime;
 	int		 rc;
+	int64_t		 since = 0;
 
 	if (st->cfg == NULL) {
 		kutil_warnx(r, st->prncpl->name, 
@@ -583,7 +921,9 @@ method_report(struct kreq *r)
 		return;
 
 	if (dav->type != CALREQTYPE_CALMULTIGET &&
-	    dav->type != CALREQTYPE_CALQUERY) {
+	    dav->type != CALREQTYPE_CALQUERY &&
+	    dav->type != CALREQTYPE_FREEBUSY &&
+	    dav->type != CALREQTYPE_SYNCCOLLECTION) {
 		kutil_warnx(r, st->prncpl->name, 
 			"unknown REPORT request type");
 		http_error(r, KHTTP_415);
@@ -591,19 +931,64 @@ method_report(struct kreq *r)
 		return;
 	}
 
+	/*
+	 * We only answer free-busy for collections, which is also all
+	 * that clients ask about (RFC 4791, 7.10).
+	 * It's not a multistatus, but the calendar itself.
+	 */
+
+	if (dav->type == CALREQTYPE_FREEBUSY) {
+		if (st->resource[0] != '\0') {
+			kutil_warnx(r, st->prncpl->name, 
+				"free-busy-query REPORT of resource");
+			http_error(r, KHTTP_403);
+		} else
+			propfind_freebusy(r, dav, st->cfg);
+		caldav_free(dav);
+		return;
+	}
+
+	/* 
+	 * Synchronisation is only for collections (RFC 6578, 3.2).
+	 * A token we don't know or whose changes have been pruned fails
+	 * the "valid-sync-token" precondition, which makes the client
+	 * start over.
+	 */
+
+	if (dav->type == CALREQTYPE_SYNCCOLLECTION) {
+		if (st->resource[0] != '\0') {
+			kutil_warnx(r, st->prncpl->name, 
+				"sync-collection REPORT of resource");
+			http_error(r, KHTTP_403);
+			caldav_free(dav);
+			return;
+		} else if (!propfind_sync_token(dav->synctoken, 
+		    st->cfg, &since)) {
+			kutil_warnx(r, st->prncpl->name, 
+				"invalid sync-token: %s", 
+				dav->synctoken);
+			propfind_sync_invalid(r);
+			caldav_free(dav);
+			return;
+		}
+	}
+
 	if (st->resource[0] != '\0') {
-		rc = db_resource_load(&res, st->resource, st->cfg->id);
+		rc = db_resource_load(&res, st->resource, 
+			st->cfg->id, propfind_data(dav));
 		if (rc < 0) {
 			kutil_errx_noexit(r, st->prncpl->name,
 				"cannot load resource: %s", 
 				st->resource);
 			http_error(r, KHTTP_505);
+			caldav_free(dav);
 			return;
 		} else if (0 == rc) {
 			kutil_errx_noexit(r, st->prncpl->name,
 				"REPORT for unknown resource: %s", 
 				st->resource);
 			http_error(r, KHTTP_404);
+			caldav_free(dav);
 			return;
 		}
 	} 
@@ -629,11 +1014,14 @@ method_report(struct kreq *r)
 		if (dav->type == CALREQTYPE_CALMULTIGET)
 			propfind_list(r, &xml, dav);
 		else if (dav->type == CALREQTYPE_CALQUERY)
-			propfind_directory(r, &xml, dav, st->cfg);
-	} else
+			propfind_query(r, &xml, dav, st->cfg);
+		else
+			propfind_sync(r, &xml, dav, st->cfg, since);
+	} else if (caldav_filter(dav->filter, res->ical))
 		propfind_resource(r, &xml, dav, st->cfg, res);
 
 	caldav_free(dav);
+	db_resource_free(res);
 	kxml_popall(&xml);
 	kxml_close(&xml);
 }
@@ -667,8 +1055,8 @@ method_propfind(struct kreq *r)
 	}
 	
 	if (st->cfg != NULL && st->resource[0] != '\0') {
-		rc = db_resource_load(&res,
-			st->resource, st->cfg->id);
+		rc = db_resource_load(&res, st->resource, 
+			st->cfg->id, propfind_data(dav));
 		if (rc < 0) {
 			kutil_errx_noexit(r, st->prncpl->name,
 				"cannot load resource: %s", 
@@ -63,7 +63,7 @@ method_put(struct kreq *r)
 	struct ical	*p;
 	struct state	*st = r->arg;
 	size_t		 sz;
-	int		 rc;
+	enum reserr	 rc;
 	char		*buf = NULL;
 	const char	*digest = NULL;
 
@@ -117,25 +117,31 @@ method_put(struct kreq *r)
 			digest = NULL;
 	}
 
+	/*
+	 * The collection owner's quota (RFC 4331, 6) is checked when
+	 * storing, against the canonical data less any it replaces.
+	 */
+
 	if (digest == NULL) 
-		rc = db_resource_new
-			(r->fieldmap[VALID_BODY]->val, 
-			 st->resource, st->cfg->id);
+		rc = db_resource_new(p, st->resource, st->cfg->id);
 	else
 		rc = db_resource_update
-			(r->fieldmap[VALID_BODY]->val, 
-			 st->resource, digest, st->cfg->id);
+			(p, st->resource, digest, st->cfg->id);
 
-	if (rc < 0) {
+	if (rc == RES_ERR) {
 		kutil_errx_noexit(r, st->prncpl->name,
 			"cannot %s resource: %s", 
 			digest == NULL ? "create" : "update",
 			r->fullpath);
 		http_error(r, KHTTP_505);
-	} else if (rc == 0) {
+	} else if (rc == RES_CONFLICT) {
 		kutil_warnx(r, st->prncpl->name,
 			"duplicate resource: %s", r->fullpath);
 		http_error(r, KHTTP_403);
+	} else if (rc == RES_QUOTA) {
+		kutil_warnx(r, st->prncpl->name,
+			"quota exceeded: %s", r->fullpath);
+		http_error(r, KHTTP_507);
 	} else {
 		kutil_dbg(r, st->prncpl->name,
 			"resource %s: %s",
@@ -16,10 +16,29 @@
 #ifndef KCALDAV_H
 #define KCALDAV_H
 
+/*
+ * Prefix of RFC 6578 sync-tokens, which are followed by the
+ * collection's ctag.
+ */
+#define	SYNCTOKEN	"urn:x-kcaldav:sync:"
+
+/*
+ * Whether the vector XML-escaping kernels are built: x86-64 (where SSE2
+ * is baseline) with a compiler that can target AVX2 per function.
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+# define XMLESC_X86	1
+#else
+# define XMLESC_X86	0
+#endif
+
 enum	xml {
 	XML_CALDAV_CALENDAR,
 	XML_CALDAV_CALENDAR_DATA,
+	XML_CALDAV_CALENDAR_MULTIGET,
+	XML_CALDAV_CALENDAR_QUERY,
 	XML_CALDAV_COMP,
+	XML_CALDAV_FREE_BUSY_QUERY,
 	XML_CALDAV_OPAQUE,
 	XML_CALDAVSERV_PROXY_READ,
 	XML_CALDAVSERV_PROXY_READ_FOR,
@@ -27,6 +46,7 @@ enum	xml {
 	XML_CALDAVSERV_PROXY_WRITE_FOR,
 	XML_DAV_BIND,
 	XML_DAV_COLLECTION,
+	XML_DAV_ERROR,
 	XML_DAV_HREF,
 	XML_DAV_MULTISTATUS,
 	XML_DAV_PRINCIPAL,
@@ -35,10 +55,15 @@ enum	xml {
 	XML_DAV_PROPSTAT,
 	XML_DAV_READ,
 	XML_DAV_READ_CURRENT_USER_PRIVILEGE_SET,
+	XML_DAV_REPORT,
 	XML_DAV_RESOURCETYPE,
 	XML_DAV_RESPONSE,
 	XML_DAV_STATUS,
+	XML_DAV_SUPPORTED_REPORT,
+	XML_DAV_SYNC_COLLECTION,
+	XML_DAV_SYNC_TOKEN,
 	XML_DAV_UNBIND,
+	XML_DAV_VALID_SYNC_TOKEN,
 	XML_DAV_WRITE,
 	XML__MAX
 };
@@ -75,6 +100,13 @@ enum	valid {
 struct	conf {
 	char		*logfile; /* logfile or NULL (ptr needs free) */
 	int		 verbose; /* assign to verbose */
+	size_t		 workers; /* FastCGI workers or zero for none */
+	size_t		 maxrequests; /* per-worker requests or zero */
+	int		 busytimeout; /* sqlite3 busy timeout (ms) */
+	uint64_t	 quota; /* per-principal bytes or zero */
+	int		 horizon; /* days of recurrence listed */
+	uint64_t	 rangecache; /* FastCGI occurrence cache bytes */
+	int		 hmacnonce; /* use stateless nonces */
 };
 
 /*
@@ -90,6 +122,19 @@ struct	state {
 	char		*collection; /* collection in request */
 	char		*resource; /* resource in request */
 	const char	*nonce; /* requested nonce */
+	const struct caldata *caldata; /* requested calendar-data */
+};
+
+/*
+ * Output buffer in front of kcgi, so that many small writes become a
+ * few large ones.
+ * Anything written directly to the request (e.g., with kxml_push())
+ * must be preceded by outbuf_flush() to keep the output in order.
+ */
+struct	outbuf {
+	struct kreq	*req;
+	size_t		 sz; /* bytes pending in buf */
+	char		 buf[8192];
 };
 
 typedef void (*principalfp)(struct kreq *, struct kxmlreq *);
@@ -111,9 +156,26 @@ struct	property {
 
 int		 conf_read(const char *, struct conf *);
 
-int		 xml_ical_putc(int, void *);
-int		 http_ical_putc(int, void *);
+int		 nonce_delete(const char *, const struct prncpl *);
+int		 nonce_hmac_init(void);
+int		 nonce_validate(const struct khttpdigest *, char **);
+
+size_t		 xml_escape_span(const char *, size_t);
+size_t		 xml_escape_span_scalar(const char *, size_t);
+#if XMLESC_X86
+int		 xml_escape_avx2(void);
+size_t		 xml_escape_span_avx2(const char *, size_t);
+size_t		 xml_escape_span_sse2(const char *, size_t);
+#endif
+
+void		 outbuf_init(struct outbuf *, struct kreq *);
+int		 outbuf_flush(struct outbuf *);
+int		 outbuf_put(struct outbuf *, const char *, size_t);
+int		 outbuf_puts(struct outbuf *, const char *);
+int		 outbuf_put_xml(struct outbuf *, const char *, size_t);
+int		 outbuf_putc(int, void *);
 
+void		 http_decode(const char *, char **);
 void		 http_error(struct kreq *, enum khttp);
 int		 http_paths(const char *, char **, char **, char **);
 int		 http_safe_string(const char *);
@@ -20,6 +20,7 @@
 #if HAVE_ERR
 # include <err.h>
 #endif
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -56,6 +57,21 @@ main(int argc, char *argv[])
 
 	printf("debug=%d\n", conf.verbose);
 
+	if (conf.workers > 0)
+		printf("workers=%zu\n", conf.workers);
+	if (conf.maxrequests > 0)
+		printf("maxrequests=%zu\n", conf.maxrequests);
+	if (conf.busytimeout != 1000)
+		printf("busytimeout=%d\n", conf.busytimeout);
+	if (conf.quota > 0)
+		printf("quota=%" PRIu64 "\n", conf.quota);
+	if (conf.horizon != 365)
+		printf("horizon=%d\n", conf.horizon);
+	if (conf.rangecache != 8388608)
+		printf("rangecache=%" PRIu64 "\n", conf.rangecache);
+	if (conf.hmacnonce)
+		puts("nonce=hmac");
+
 	free(conf.logfile);
 	return 0;
 }
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libkcaldav.h"
+
+/*
+ * Check ical_datetime_parse() on every date of years 0000--9999, every
+ * time of day (and those just out of range), known instants, and
+ * malformed values.
+ */
+
+/* Values that must not parse. */
+
+static const char *const bad[] = {
+	"",
+	"2025010",
+	"202501011",
+	"20250101T",
+	"20250101T00000",
+	"20250101T0000000",
+	"20250101T000000ZZ",
+	"20250101t000000",
+	"20250101T000000z",
+	"20250101X000000",
+	"20250101X000000Z",
+	"20250101T00000Z",
+	"+0250101",
+	" 2025010",
+	"2025 101",
+	"2025-101",
+	"2025O101",
+	"20250101T+00000",
+	"20250101T 00000",
+	"20250101T0000-0",
+	"20250100",
+	"20250132",
+	"20250229",
+	"19000229",
+	"21000229",
+	"20250431",
+	"20250631",
+	"20250931",
+	"20251131",
+	"20250001",
+	"20251301",
+	"20259901",
+	"20250101T240000",
+	"20250101T006000",
+	"20250101T000061",
+	"20250101T999999Z",
+	NULL
+};
+
+/* Values that must parse, with their type and time. */
+
+static const struct {
+	const char	*val;
+	enum icaldatet	 type;
+	int64_t		 tm;
+} good[] = {
+	{ "19700101", ICAL_DT_DATE, 0 },
+	{ "19700101T000000", ICAL_DT_DATETIME, 0 },
+	{ "19700101T000000Z", ICAL_DT_DATETIMEUTC, 0 },
+	{ "19691231T235959Z", ICAL_DT_DATETIMEUTC, -1 },
+	{ "20000229", ICAL_DT_DATE, 951782400 },
+	{ "20000301T000000Z", ICAL_DT_DATETIMEUTC, 951868800 },
+	{ "20240229T120000", ICAL_DT_DATETIME, 1709208000 },
+	{ "20380119T031408Z", ICAL_DT_DATETIMEUTC, 2147483648LL },
+	{ "20161231T235960Z", ICAL_DT_DATETIMEUTC, 1483228800 },
+	{ "16010101", ICAL_DT_DATE, -11644473600LL },
+	{ "00000101", ICAL_DT_DATE, -62167219200LL },
+	{ "99991231T235959Z", ICAL_DT_DATETIMEUTC, 253402300799LL },
+	{ NULL, ICAL_DT_UNSET, 0 }
+};
+
+static int
+check(const char *val, enum icaldatet type, int64_t v)
+{
+	struct icaltm	 tm;
+
+	if (!ical_datetime_parse(val, &tm)) {
+		warnx("%s: not parsed", val);
+		return 0;
+	} else if (tm.type != type || (int64_t)tm.tm != v) {
+		warnx("%s: parsed as %" PRId64 " (type %d), "
+			"expected %" PRId64 " (type %d)", val,
+			(int64_t)tm.tm, tm.type, v, type);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Times formatted by ical_utc2str(), including those clamped to
+ * four-digit years.
+ */
+static const struct {
+	int64_t		 tm;
+	enum icaldatet	 type;
+	const char	*val;
+} fmt[] = {
+	{ 0, ICAL_DT_DATE, "19700101" },
+	{ 1709208000, ICAL_DT_DATETIME, "20240229T120000" },
+	{ 1483228800, ICAL_DT_DATETIMEUTC, "20170101T000000Z" },
+	{ -62167219200LL, ICAL_DT_DATETIMEUTC, "00000101T000000Z" },
+	{ -62167219201LL, ICAL_DT_DATE, "00000101" },
+	{ INT64_MIN, ICAL_DT_DATETIMEUTC, "00000101T000000Z" },
+	{ 253402300800LL, ICAL_DT_DATETIMEUTC, "99991231T235959Z" },
+	{ INT64_MAX, ICAL_DT_DATE, "99991231" },
+	{ 0, ICAL_DT_UNSET, NULL }
+};
+
+static int
+checkbad(const char *val)
+{
+	struct icaltm	 tm;
+
+	if (ical_datetime_parse(val, &tm)) {
+		warnx("%s: parsed", val);
+		return 0;
+	}
+	return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const unsigned int mdays[12] = {
+		31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	unsigned int	 y, m, d, n, hr, min, sec;
+	int64_t		 days;
+	size_t		 i;
+	int		 rc = 1;
+	char		 buf[32];
+
+	if (getopt(argc, argv, "") != -1)
+		return 1;
+
+	for (i = 0; good[i].val != NULL; i++)
+		if (!check(good[i].val, good[i].type, good[i].tm))
+			rc = 0;
+	for (i = 0; bad[i] != NULL; i++)
+		if (!checkbad(bad[i]))
+			rc = 0;
+	for (i = 0; fmt[i].val != NULL; i++) {
+		ical_utc2str(buf, sizeof(buf), fmt[i].tm, fmt[i].type);
+		if (strcmp(buf, fmt[i].val)) {
+			warnx("%" PRId64 ": formatted as %s, expected %s",
+				fmt[i].tm, buf, fmt[i].val);
+			rc = 0;
+		}
+	}
+
+	/*
+	 * Walk each day in turn, counting days from 0000-01-01 (itself
+	 * 719528 days before the epoch), and the day after the last of
+	 * each month, which must not parse.
+	 */
+
+	days = -719528;
+	for (y = 0; y <= 9999; y++)
+		for (m = 1; m <= 12; m++) {
+			n = mdays[m - 1] + (m == 2 && y % 4 == 0 &&
+				(y % 100 != 0 || y % 400 == 0));
+			for (d = 1; d <= n; d++, days++) {
+				snprintf(buf, sizeof(buf),
+					"%04u%02u%02u", y, m, d);
+				if (!check(buf, ICAL_DT_DATE, days * 86400))
+					rc = 0;
+			}
+			snprintf(buf, sizeof(buf), "%04u%02u%02u", y, m, d);
+			if (!checkbad(buf))
+				rc = 0;
+		}
+
+	/* Each time of day, including a leap second, and past it. */
+
+	days = 20089;
+	for (hr = 0; hr <= 24; hr++)
+		for (min = 0; min <= 60; min++)
+			for (sec = 0; sec <= 61; sec++) {
+				snprintf(buf, sizeof(buf),
+					"20250101T%02u%02u%02uZ", hr, min, sec);
+				if (hr > 23 || min > 59 || sec > 60) {
+					if (!checkbad(buf))
+						rc = 0;
+				} else if (!check(buf, ICAL_DT_DATETIMEUTC,
+				    days * 86400 + hr * 3600 + min * 60 + sec))
+					rc = 0;
+			}
+
+	return rc ? 0 : 1;
+}
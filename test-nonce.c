@@ -15,6 +15,8 @@
  */
 #include "config.h"
 
+#include <sys/wait.h>
+
 #if HAVE_ERR
 # include <err.h>
 #endif
@@ -24,8 +26,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "libkcaldav.h"
 #include "db.h"
 
 int
@@ -35,6 +39,9 @@ main(int argc, char *argv[])
 	char		*np;
 	size_t		 i;
 	enum nonceerr	 er;
+	struct dbstats	 st;
+	pid_t		 pid;
+	int		 status;
 
 	if (getopt(argc, argv, "") != -1)
 		return 1;
@@ -69,5 +76,34 @@ main(int argc, char *argv[])
 			errx(1, "replay attack!?");
 	}
 
+	/* Nonces should be shared with other processes. */
+
+	if (!db_nonce_new(&np))
+		errx(1, "nonce database failure");
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0)
+		_exit(db_nonce_update(np, 1) == NONCE_OK ? 0 : 1);
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "nonce not shared");
+	if (db_nonce_update(np, 1) != NONCE_REPLAY)
+		errx(1, "replay attack in other process!?");
+	if (!db_nonce_delete(np, NULL))
+		errx(1, "nonce database failure");
+	if (db_nonce_validate(np, 2) != NONCE_NOTFOUND)
+		errx(1, "found deleted nonce!?");
+
+	/* Statements should be compiled once, then re-used. */
+
+	for (i = 0; i < 10; i++)
+		if (db_prncpl_identify("nobody@localhost") != 0)
+			errx(1, "found principal!?");
+
+	db_stats(&st);
+	if (st.reuses == 0 || st.prepares > st.reuses)
+		errx(1, "statement cache not used");
+
 	return 0;
 }
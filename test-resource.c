@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+#include "libkcaldav.h"
+#include "db.h"
+
+/*
+ * Resources stored before the iCalendar parser was made stricter may
+ * no longer parse, such as those with impossible dates.
+ * These must be skipped when listing a collection, not fail it.
+ */
+
+static const char ics[] =
+	"BEGIN:VCALENDAR\r\n"
+	"VERSION:2.0\r\n"
+	"PRODID:-//test//EN\r\n"
+	"BEGIN:VEVENT\r\n"
+	"UID:test@localhost\r\n"
+	"DTSTAMP:20250101T000000Z\r\n"
+	"DTSTART:20250201T100000Z\r\n"
+	"DTEND:20250201T110000Z\r\n"
+	"END:VEVENT\r\n"
+	"END:VCALENDAR\r\n";
+
+static void
+count(const struct res *p, void *arg)
+{
+
+	if (strcmp(p->url, "good.ics"))
+		errx(1, "%s: listed", p->url);
+	(*(size_t *)arg)++;
+}
+
+static void
+countsync(const char *url, const struct res *p, void *arg)
+{
+
+	count(p, arg);
+}
+
+static void
+countlist(size_t i, const struct res *p, void *arg)
+{
+
+	if ((i == 0) != (p != NULL))
+		errx(1, "%zu: %s", i, p == NULL ? "not found" : "found");
+	if (p != NULL)
+		count(p, arg);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct prncpl		*p;
+	struct coln		*c;
+	struct ical		*ical;
+	struct res		*r;
+	struct resname		 names[2];
+	struct caltimerange	 range;
+	struct calbusy		*busy = NULL;
+	size_t			 n, busysz = 0;
+	sqlite3			*db;
+	char			 path[PATH_MAX];
+
+	if (getopt(argc, argv, "") != -1)
+		return 1;
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		return 1;
+
+	if (!db_init(argv[0], 0))
+		errx(1, "db_init");
+	if (db_prncpl_new("test", "hash", "test@localhost", "calendar") <= 0)
+		errx(1, "db_prncpl_new");
+	if (db_prncpl_load(&p, "test") <= 0)
+		errx(1, "db_prncpl_load");
+	if (db_collection_load(&c, "calendar", p->id) <= 0)
+		errx(1, "db_collection_load");
+
+	if ((ical = ical_parse(NULL, ics, sizeof(ics) - 1,
+	    NULL, NULL)) == NULL)
+		errx(1, "ical_parse");
+	if (db_resource_new(ical, "good.ics", c->id) != RES_OK)
+		errx(1, "db_resource_new");
+	ical_free(ical);
+
+	/* Store a copy with an impossible start, as older versions did. */
+
+	snprintf(path, sizeof(path), "%s/kcaldav.db", argv[0]);
+	if (sqlite3_open(path, &db) != SQLITE_OK)
+		errx(1, "%s: %s", path, sqlite3_errmsg(db));
+	if (sqlite3_exec(db, "INSERT INTO resource "
+	    "(collection,url,data) SELECT collection,'bad.ics',"
+	    "replace(data,'DTSTART:20250201','DTSTART:20250230') "
+	    "FROM resource WHERE url='good.ics'",
+	    NULL, NULL, NULL) != SQLITE_OK)
+		errx(1, "%s: %s", path, sqlite3_errmsg(db));
+	sqlite3_close(db);
+
+	if (db_resource_load(&r, "bad.ics", c->id, RES_DATA) <= 0)
+		errx(1, "bad.ics: data not loaded");
+	db_resource_free(r);
+
+	n = 0;
+	if (!db_collection_resources(count, c->id, RES_ICAL, &n) || n != 1)
+		errx(1, "db_collection_resources");
+
+	n = 0;
+	if (!db_collection_sync(countsync, c->id, 0, RES_ICAL, &n) || n != 1)
+		errx(1, "db_collection_sync");
+
+	names[0].collection = names[1].collection = c->id;
+	names[0].url = "good.ics";
+	names[1].url = "bad.ics";
+	n = 0;
+	if (!db_resource_list(countlist, names, 2, RES_ICAL, &n) || n != 1)
+		errx(1, "db_resource_list");
+
+	memset(&range, 0, sizeof(struct caltimerange));
+	range.set = 1;
+	range.start = 1738368000; /* 2025-02-01 */
+	range.end = range.start + 86400 * 60;
+	if (!db_collection_freebusy(c, &range, &busy, &busysz) ||
+	    busysz != 1)
+		errx(1, "db_collection_freebusy");
+
+	free(busy);
+	db_collection_free(c);
+	db_prncpl_free(p);
+	return 0;
+}
@@ -18,10 +18,12 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
-#include <assert.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
 #include <fcntl.h>
 #include <getopt.h>
-#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,68 +32,128 @@
 
 #include "libkcaldav.h"
 
-static void
-ical_printcomp(const struct icalcomp *c)
+/*
+ * Print "v" as a date-time, with a UTC designator if "utc".
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+printtime(int64_t v, int utc)
 {
-	size_t	 i;
+	struct tm	 tm;
+	time_t		 t = v;
+
+	if (gmtime_r(&t, &tm) == NULL)
+		return 0;
+	printf("%04d%02d%02dT%02d%02d%02d%s",
+		tm.tm_year + 1900, tm.tm_mon + 1,
+		tm.tm_mday, tm.tm_hour, tm.tm_min,
+		tm.tm_sec, utc ? "Z" : "");
+	return 1;
+}
 
-	assert(NULL != c);
-	assert(ICALTYPE_VTIMEZONE == c->type);
-	assert(NULL != c->tzid);
+/*
+ * Print the first "max" instances of each recurring component's
+ * recurrence set, one per line, each set introduced by the UID.
+ * Instances of a DTSTART with a time zone are followed by their UTC
+ * time.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+printcomp(const struct icalcomp *c, size_t max)
+{
+	struct icalrecur	*r;
+	int64_t			 v;
+	size_t			 i;
+	int			 zoned, rc = 1;
 
-	printf("TZID = %s\n", c->tzid);
-	for (i = 0; i < c->tzsz; i++) {
-		if ( ! c->tzs[i].rrule.set) {
-			printf("(RRULE not defined.)\n");
+	for ( ; c != NULL; c = c->next) {
+		if (!c->rrule.set && c->rdatesz == 0)
 			continue;
+		r = ical_recur_init(c, INT64_MIN, INT64_MAX);
+		if (r == NULL)
+			return 0;
+		zoned = c->dtstart.time.type == ICAL_DT_DATETIME &&
+			c->dtstart.tz != NULL;
+		printf("%s:\n", c->uid == NULL ? "(no UID)" : c->uid);
+		for (i = 0; rc && i < max && ical_recur_next(r, &v); i++) {
+			rc = printtime(v, 0);
+			if (rc && zoned) {
+				putchar(' ');
+				rc = printtime(ical_tz2utc
+					(c->dtstart.tz, v), 1);
+			}
+			putchar('\n');
 		}
-		ical_rrule_generate(&c->tzs[i].dtstart, &c->tzs[i].rrule);
+		ical_recur_free(r);
+		if (!rc)
+			return 0;
 	}
 
-	if (NULL != c->next)
-		ical_printcomp(c->next);
+	return 1;
 }
 
 int
 main(int argc, char *argv[])
 {
-	int		 fd, c;
+	int		 fd, c, rc = 0;
 	struct stat	 st;
-	size_t		 sz;
-	char		*map;
-	struct ical	*p = NULL;
+	size_t		 sz, max = 100;
+	char		*map, *er = NULL;
+	const char	*errstr;
+	struct ical	*p;
 
-	if (-1 != (c = getopt(argc, argv, "")))
-		return(EXIT_FAILURE);
+#if HAVE_PLEDGE
+	if (pledge("stdio rpath", NULL) == -1)
+		err(EXIT_FAILURE, "pledge");
+#endif
+
+	while ((c = getopt(argc, argv, "n:")) != -1)
+		switch (c) {
+		case 'n':
+			max = strtonum(optarg, 1, 100000, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "-n: %s", errstr);
+			break;
+		default:
+			goto usage;
+		}
 
 	argc -= optind;
 	argv += optind;
 
-	if (0 == argc)
-		return(EXIT_FAILURE);
+	if (argc == 0)
+		goto usage;
+
+	if ((fd = open(argv[0], O_RDONLY, 0)) == -1)
+		err(EXIT_FAILURE, "%s", argv[0]);
 
-	if (-1 == (fd = open(argv[0], O_RDONLY, 0))) {
-		perror(argv[0]);
-		return(EXIT_FAILURE);
-	} else if (-1 == fstat(fd, &st)) {
-		perror(argv[0]);
-		close(fd);
-		return(EXIT_FAILURE);
-	} 
+#if HAVE_PLEDGE
+	if (pledge("stdio", NULL) == -1)
+		err(EXIT_FAILURE, "pledge");
+#endif
+
+	if (fstat(fd, &st) == -1)
+		err(EXIT_FAILURE, "%s", argv[0]);
 
 	sz = st.st_size;
 	map = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
 	close(fd);
 
-	if (MAP_FAILED == map) {
-		perror(argv[0]);
-		return(EXIT_FAILURE);
-	} else if (NULL != (p = ical_parse(argv[0], map, sz))) {
-		if (NULL != p->comps[ICALTYPE_VTIMEZONE])
-			ical_printcomp(p->comps[ICALTYPE_VTIMEZONE]);
-	}
+	if (map == MAP_FAILED)
+		err(EXIT_FAILURE, "%s", argv[0]);
+
+	if ((p = ical_parse(argv[0], map, sz, NULL, &er)) == NULL)
+		warnx("%s", er == NULL ? "memory failure" : er);
+	else if (!(rc = printcomp(p->comps[ICALTYPE_VEVENT], max) &&
+	    printcomp(p->comps[ICALTYPE_VTODO], max) &&
+	    printcomp(p->comps[ICALTYPE_VJOURNAL], max)))
+		warnx("memory failure");
 
 	munmap(map, sz);
 	ical_free(p);
-	return(NULL == p ? EXIT_FAILURE : EXIT_SUCCESS);
+	free(er);
+	return rc ? EXIT_SUCCESS : EXIT_FAILURE;
+usage:
+	fprintf(stderr, "usage: %s [-n max] file\n", getprogname());
+	return EXIT_FAILURE;
 }
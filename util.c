@@ -34,7 +34,10 @@
 const char *const xmls[XML__MAX] = {
 	"C:calendar", /* XML_CALDAV_CALENDAR */
 	"C:calendar-data", /* XML_CALDAV_CALENDAR_DATA */
+	"C:calendar-multiget", /* XML_CALDAV_CALENDAR_MULTIGET */
+	"C:calendar-query", /* XML_CALDAV_CALENDAR_QUERY */
 	"C:comp", /* XML_CALDAV_COMP */
+	"C:free-busy-query", /* XML_CALDAV_FREE_BUSY_QUERY */
 	"C:opaque", /* XML_CALDAV_OPAQUE */
 	"B:calendar-proxy-read", /* XML_CALDAVSERV_PROXY_READ */
 	"B:calendar-proxy-read-for", /* XML_CALDAVSERV_PROXY_READ_FOR */
@@ -42,6 +45,7 @@ const char *const xmls[XML__MAX] = {
 	"B:calendar-proxy-write-for", /* XML_CALDAVSERV_PROXY_WRIT... */
 	"D:bind", /* XML_DAV_BIND */
 	"D:collection", /* XML_DAV_COLLECTION */
+	"D:error", /* XML_DAV_ERROR */
 	"D:href", /* XML_DAV_HREF */
 	"D:multistatus", /* XML_DAV_MULTISTATUS */
 	"D:principal", /* XML_DAV_PRINCIPAL */
@@ -50,10 +54,15 @@ const char *const xmls[XML__MAX] = {
         "D:propstat", /* XML_DAV_PROPSTAT */
 	"D:read", /* XML_DAV_READ */
 	"D:read-current-user-privilege-set", /* XML_DAV_READ_CUR... */
+	"D:report", /* XML_DAV_REPORT */
 	"D:resourcetype", /* XML_DAV_RESOURCETYPE */
 	"D:response", /* XML_DAV_RESPONSE */
 	"D:status", /* XML_DAV_STATUS */
+	"D:supported-report", /* XML_DAV_SUPPORTED_REPORT */
+	"D:sync-collection", /* XML_DAV_SYNC_COLLECTION */
+	"D:sync-token", /* XML_DAV_SYNC_TOKEN */
 	"D:unbind", /* XML_DAV_UNBIND */
+	"D:valid-sync-token", /* XML_DAV_VALID_SYNC_TOKEN */
 	"D:write", /* XML_DAV_WRITE */
 };
 
@@ -71,12 +80,108 @@ get_random_uniform(size_t sz)
 #endif
 }
 
+void
+outbuf_init(struct outbuf *p, struct kreq *r)
+{
+
+	p->req = r;
+	p->sz = 0;
+}
+
+/*
+ * Write out and empty the buffer.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+outbuf_flush(struct outbuf *p)
+{
+	size_t	 sz = p->sz;
+
+	p->sz = 0;
+	return sz == 0 || khttp_write(p->req, p->buf, sz) == KCGI_OK;
+}
+
+/*
+ * Append "sz" bytes of "buf" without escaping.
+ * Anything larger than the buffer bypasses it after flushing.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+outbuf_put(struct outbuf *p, const char *buf, size_t sz)
+{
+
+	if (p->sz + sz > sizeof(p->buf) && !outbuf_flush(p))
+		return 0;
+	if (sz > sizeof(p->buf))
+		return khttp_write(p->req, buf, sz) == KCGI_OK;
+	memcpy(p->buf + p->sz, buf, sz);
+	p->sz += sz;
+	return 1;
+}
+
+int
+outbuf_puts(struct outbuf *p, const char *cp)
+{
+
+	return outbuf_put(p, cp, strlen(cp));
+}
+
+/*
+ * Like outbuf_put(), but escaping XML special characters, as with
+ * kxml_write().
+ * Runs of unescaped bytes are found with xml_escape_span() and copied
+ * at once.
+ */
 int
-xml_ical_putc(int c, void *arg)
+outbuf_put_xml(struct outbuf *p, const char *buf, size_t sz)
 {
-	struct kxmlreq	*r = arg;
+	size_t		 i;
+	const char	*ent;
+
+	while (sz > 0) {
+		i = xml_escape_span(buf, sz);
+		if (!outbuf_put(p, buf, i))
+			return 0;
+		if (i == sz)
+			break;
+		switch (buf[i]) {
+		case '<':
+			ent = "&lt;";
+			break;
+		case '>':
+			ent = "&gt;";
+			break;
+		case '&':
+			ent = "&amp;";
+			break;
+		case '"':
+			ent = "&quot;";
+			break;
+		default:
+			ent = "&#39;";
+			break;
+		}
+		if (!outbuf_puts(p, ent))
+			return 0;
+		buf += i + 1;
+		sz -= i + 1;
+	}
+	return 1;
+}
 
-	return kxml_putc(r, c) == KCGI_OK;
+/*
+ * Append a single byte.
+ * This is an ical_putchar callback with a "struct outbuf" argument.
+ */
+int
+outbuf_putc(int c, void *arg)
+{
+	struct outbuf	*p = arg;
+
+	if (p->sz == sizeof(p->buf) && !outbuf_flush(p))
+		return 0;
+	p->buf[p->sz++] = c;
+	return 1;
 }
 
 static char
@@ -87,7 +192,10 @@ parsehex(char ch)
 		tolower((unsigned char)ch) - 'a' + 10);
 }
 
-static void
+/*
+ * Decode the percent-encoded "in" into the allocated "rp".
+ */
+void
 http_decode(const char *in, char **rp)
 {
 	size_t	 i, j, sz;
@@ -207,14 +315,6 @@ http_safe_string(const char *cp)
 	return(1);
 }
 
-int
-http_ical_putc(int c, void *arg)
-{
-	struct kreq	*r = arg;
-
-	return khttp_putc(r, c) == KCGI_OK;
-}
-
 void
 http_error(struct kreq *r, enum khttp c)
 {